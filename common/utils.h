@@ -62,17 +62,67 @@ STATIC_ASSERT(sizeof(s64)  == 8,  "s64 must be 8 bytes");
 #define TODO_COLOR    CYAN
 
 #define COLOR_STR(str, COLOR) COLOR str RESET_COLOR
-#define WARNING_LOG(format, ...) printf(COLOR_STR("WARNING:" __FILE__ ":%u: ", BRIGHT_YELLOW) format, __LINE__, ##__VA_ARGS__)
-#define TODO(msg) printf(COLOR_STR("TODO: " __FILE__ ":%u: ", TODO_COLOR) msg "\n", __LINE__)
 
-#ifdef _DEBUG
-	#define DEBUG_LOG(format, ...) printf(COLOR_STR("DEBUG:" __FILE__ ":%u: ", DEBUG_COLOR) format, __LINE__, ##__VA_ARGS__)
-#else 
-    #define DEBUG_LOG(...)
-#endif //_DEBUG
+#include <stdio.h>
+#include <stdarg.h>
+
+/// NOTE: every message has a level, and those more verbose than QCOW_LOG_COMPILE_LEVEL are discarded at compile time, as the
+///       check is on constants, so that neither the call nor its arguments are left in the I/O paths. The compile level
+///       defaults to QCOW_LOG_DEBUG with _DEBUG and to QCOW_LOG_WARNING otherwise, hence the per-cluster and per-block
+///       TRACE_LOG statements are only built with -DQCOW_LOG_COMPILE_LEVEL=QCOW_LOG_TRACE. The messages left are filtered
+///       at runtime against qcow_log_level (QCOW_LOG_WARNING unless changed with qcow_set_log_level), and handed to the
+///       sink, which prints them to stdout unless replaced with qcow_set_log_sink.
+typedef enum QCowLogLevel { QCOW_LOG_ERROR, QCOW_LOG_WARNING, QCOW_LOG_INFO, QCOW_LOG_DEBUG, QCOW_LOG_TRACE } QCowLogLevel;
+typedef void (*qcow_log_sink_t)(QCowLogLevel level, const char* file, unsigned int line, const char* format, va_list args);
+
+#ifndef QCOW_LOG_COMPILE_LEVEL
+	#ifdef _DEBUG
+		#define QCOW_LOG_COMPILE_LEVEL QCOW_LOG_DEBUG
+	#else
+		#define QCOW_LOG_COMPILE_LEVEL QCOW_LOG_WARNING
+	#endif //_DEBUG
+#endif //QCOW_LOG_COMPILE_LEVEL
+
+static void qcow_default_log_sink(QCowLogLevel level, const char* file, unsigned int line, const char* format, va_list args) {
+	static const char* level_colors[] = { ERROR_COLOR, WARNING_COLOR, GREEN, DEBUG_COLOR, DEBUG_COLOR };
+	static const char* level_names[] = { "ERROR", "WARNING", "INFO", "DEBUG", "TRACE" };
+	printf("%s%s:%s:%u: " RESET_COLOR, level_colors[level], level_names[level], file, line);
+	vprintf(format, args);
+	return;
+}
+
+static QCowLogLevel qcow_log_level __attribute__((unused)) = QCOW_LOG_WARNING;
+static qcow_log_sink_t qcow_log_sink = qcow_default_log_sink;
+
+__attribute__((unused)) static void qcow_set_log_level(QCowLogLevel level) {
+	qcow_log_level = level;
+	return;
+}
+
+/// NOTE: a NULL sink restores the default one.
+__attribute__((unused)) static void qcow_set_log_sink(qcow_log_sink_t sink) {
+	qcow_log_sink = (sink == NULL) ? qcow_default_log_sink : sink;
+	return;
+}
+
+__attribute__((unused, format(printf, 4, 5))) static void qcow_log(QCowLogLevel level, const char* file, unsigned int line, const char* format, ...) {
+	va_list args;
+	va_start(args, format);
+	qcow_log_sink(level, file, line, format, args);
+	va_end(args);
+	return;
+}
+
+#define QCOW_LOG(level, format, ...) (((int) (level) <= (int) QCOW_LOG_COMPILE_LEVEL && (int) (level) <= (int) qcow_log_level) ? qcow_log(level, __FILE__, __LINE__, format, ##__VA_ARGS__) : (void) 0)
+#define ERROR_LOG(format, ...)   QCOW_LOG(QCOW_LOG_ERROR, format, ##__VA_ARGS__)
+#define WARNING_LOG(format, ...) QCOW_LOG(QCOW_LOG_WARNING, format, ##__VA_ARGS__)
+#define INFO_LOG(format, ...)    QCOW_LOG(QCOW_LOG_INFO, format, ##__VA_ARGS__)
+#define DEBUG_LOG(format, ...)   QCOW_LOG(QCOW_LOG_DEBUG, format, ##__VA_ARGS__)
+#define TRACE_LOG(format, ...)   QCOW_LOG(QCOW_LOG_TRACE, format, ##__VA_ARGS__)
+#define TODO(msg) WARNING_LOG(COLOR_STR("TODO: ", TODO_COLOR) msg "\n")
 
 #include "./str_error.h"
-#define PERROR_LOG(format, ...) printf(COLOR_STR("WARNING:" __FILE__ ":%u: ", BRIGHT_YELLOW) format ", because: " COLOR_STR("'%s'", BRIGHT_YELLOW) ".\n", __LINE__, ##__VA_ARGS__, str_error())
+#define PERROR_LOG(format, ...) WARNING_LOG(format ", because: " COLOR_STR("'%s'", BRIGHT_YELLOW) ".\n", ##__VA_ARGS__, str_error())
 
 #endif //_QCOW_PRINTING_UTILS_
 
@@ -144,7 +194,22 @@ do {                      															         \
     defined(__AARCH64EL__) || \
     defined(_MIPSEL) || defined(__MIPSEL) || defined(__MIPSEL__)
 
+	#define _QCOW_LITTLE_ENDIAN_
 	UNUSED_FUNCTION static void qcow_be_to_le(void* ptr_val, size_t size) {
+		if (size == sizeof(unsigned long long int)) {
+			unsigned long long int value = 0;
+			__builtin_memcpy(&value, ptr_val, sizeof(unsigned long long int));
+			value = __builtin_bswap64(value);
+			__builtin_memcpy(ptr_val, &value, sizeof(unsigned long long int));
+			return;
+		} else if (size == sizeof(unsigned int)) {
+			unsigned int value = 0;
+			__builtin_memcpy(&value, ptr_val, sizeof(unsigned int));
+			value = __builtin_bswap32(value);
+			__builtin_memcpy(ptr_val, &value, sizeof(unsigned int));
+			return;
+		}
+
         for (size_t i = 0; i < size / 2; ++i) {
             unsigned char temp = QCOW_CAST_PTR(ptr_val, unsigned char)[i];
             QCOW_CAST_PTR(ptr_val, unsigned char)[i] = QCOW_CAST_PTR(ptr_val, unsigned char)[size - 1 - i];
@@ -180,31 +245,285 @@ UNUSED_FUNCTION static int str_n_cmp(const char* str1, const char* str2, size_t
 
 /* -------------------------------------------------------------------------------------------------------- */
 #ifdef _QCOW_UTILS_IMPLEMENTATION_
+#if defined(__x86_64__) && !defined(_QCOW_NO_SIMD_)
+	#include <immintrin.h>
+	#define _QCOW_MEM_SIMD_
+#endif //__x86_64__
+
+/// NOTE: the memory kernels below work word-at-a-time: 8-byte words go through __builtin_memcpy, so that the accesses are
+///       unaligned-safe, while on x86-64 the bulk of the buffers longer than QCOW_MEM_SIMD_THRESHOLD bytes is moved with 32-byte
+///       AVX2 vectors, when the cpu supports them, or 16-byte SSE2 ones otherwise. The vector kernels first bring the destination
+///       to the vector alignment, so that only the loads are unaligned. Every chunk is loaded whole before it is stored, hence
+///       the forward copy stays correct also when the ranges overlap with dest below src, while dest above src needs the
+///       backward copy, both used by mem_move so that it needs no temporary buffer.
+#define QCOW_MEM_SIMD_THRESHOLD 64
+
+static inline void qcow_mem_cpy_words(unsigned char* dest, const unsigned char* src, size_t size) {
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8) {
+		unsigned long long int word = 0;
+		__builtin_memcpy(&word, src + i, sizeof(unsigned long long int));
+		__builtin_memcpy(dest + i, &word, sizeof(unsigned long long int));
+	}
+	for (; i < size; ++i) dest[i] = src[i];
+	return;
+}
+
+static inline void qcow_mem_cpy_words_backward(unsigned char* dest, const unsigned char* src, size_t size) {
+	size_t i = size;
+	for (; i >= 8; i -= 8) {
+		unsigned long long int word = 0;
+		__builtin_memcpy(&word, src + i - 8, sizeof(unsigned long long int));
+		__builtin_memcpy(dest + i - 8, &word, sizeof(unsigned long long int));
+	}
+	while (i--) dest[i] = src[i];
+	return;
+}
+
+/// NOTE: fills ptr[i] with the byte i % 8 of the pattern, as laid out in memory.
+static inline void qcow_mem_set_words(unsigned char* ptr, unsigned long long int pattern, size_t size) {
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8) __builtin_memcpy(ptr + i, &pattern, sizeof(unsigned long long int));
+	for (; i < size; ++i) ptr[i] = QCOW_CAST_PTR(&pattern, unsigned char)[i % 8];
+	return;
+}
+
+#ifdef _QCOW_MEM_SIMD_
+/// NOTE: returns the pattern as seen from shift bytes further in the buffer, used once the head has been aligned.
+static inline unsigned long long int qcow_mem_shift_pattern(unsigned long long int pattern, size_t shift) {
+	unsigned char shifted_bytes[8] = {0};
+	for (unsigned char i = 0; i < 8; ++i) shifted_bytes[i] = QCOW_CAST_PTR(&pattern, unsigned char)[(i + shift) % 8];
+	__builtin_memcpy(&pattern, shifted_bytes, sizeof(unsigned long long int));
+	return pattern;
+}
+
+static void qcow_mem_cpy_sse2(unsigned char* dest, const unsigned char* src, size_t size) {
+	size_t i = (0 - (size_t) dest) & 15;
+	qcow_mem_cpy_words(dest, src, i);
+	for (; i + 32 <= size; i += 32) {
+		const __m128i lo = _mm_loadu_si128((const __m128i*) (src + i));
+		const __m128i hi = _mm_loadu_si128((const __m128i*) (src + i + 16));
+		_mm_store_si128((__m128i*) (dest + i), lo);
+		_mm_store_si128((__m128i*) (dest + i + 16), hi);
+	}
+	qcow_mem_cpy_words(dest + i, src + i, size - i);
+	return;
+}
+
+static void qcow_mem_cpy_backward_sse2(unsigned char* dest, const unsigned char* src, size_t size) {
+	size_t i = size - (((size_t) dest + size) & 15);
+	qcow_mem_cpy_words_backward(dest + i, src + i, size - i);
+	for (; i >= 32; i -= 32) {
+		const __m128i lo = _mm_loadu_si128((const __m128i*) (src + i - 32));
+		const __m128i hi = _mm_loadu_si128((const __m128i*) (src + i - 16));
+		_mm_store_si128((__m128i*) (dest + i - 32), lo);
+		_mm_store_si128((__m128i*) (dest + i - 16), hi);
+	}
+	qcow_mem_cpy_words_backward(dest, src, i);
+	return;
+}
+
+static void qcow_mem_set_sse2(unsigned char* ptr, unsigned long long int pattern, size_t size) {
+	size_t i = (0 - (size_t) ptr) & 15;
+	qcow_mem_set_words(ptr, pattern, i);
+	pattern = qcow_mem_shift_pattern(pattern, i);
+	const __m128i vec_pattern = _mm_set1_epi64x((long long int) pattern);
+	for (; i + 32 <= size; i += 32) {
+		_mm_store_si128((__m128i*) (ptr + i), vec_pattern);
+		_mm_store_si128((__m128i*) (ptr + i + 16), vec_pattern);
+	}
+	qcow_mem_set_words(ptr + i, pattern, size - i);
+	return;
+}
+
+__attribute__((target("avx2"))) static void qcow_mem_cpy_avx2(unsigned char* dest, const unsigned char* src, size_t size) {
+	size_t i = (0 - (size_t) dest) & 31;
+	qcow_mem_cpy_words(dest, src, i);
+	for (; i + 64 <= size; i += 64) {
+		const __m256i lo = _mm256_loadu_si256((const __m256i*) (src + i));
+		const __m256i hi = _mm256_loadu_si256((const __m256i*) (src + i + 32));
+		_mm256_store_si256((__m256i*) (dest + i), lo);
+		_mm256_store_si256((__m256i*) (dest + i + 32), hi);
+	}
+	qcow_mem_cpy_words(dest + i, src + i, size - i);
+	return;
+}
+
+__attribute__((target("avx2"))) static void qcow_mem_cpy_backward_avx2(unsigned char* dest, const unsigned char* src, size_t size) {
+	size_t i = size - (((size_t) dest + size) & 31);
+	qcow_mem_cpy_words_backward(dest + i, src + i, size - i);
+	for (; i >= 64; i -= 64) {
+		const __m256i lo = _mm256_loadu_si256((const __m256i*) (src + i - 64));
+		const __m256i hi = _mm256_loadu_si256((const __m256i*) (src + i - 32));
+		_mm256_store_si256((__m256i*) (dest + i - 64), lo);
+		_mm256_store_si256((__m256i*) (dest + i - 32), hi);
+	}
+	qcow_mem_cpy_words_backward(dest, src, i);
+	return;
+}
+
+__attribute__((target("avx2"))) static void qcow_mem_set_avx2(unsigned char* ptr, unsigned long long int pattern, size_t size) {
+	size_t i = (0 - (size_t) ptr) & 31;
+	qcow_mem_set_words(ptr, pattern, i);
+	pattern = qcow_mem_shift_pattern(pattern, i);
+	const __m256i vec_pattern = _mm256_set1_epi64x((long long int) pattern);
+	for (; i + 64 <= size; i += 64) {
+		_mm256_store_si256((__m256i*) (ptr + i), vec_pattern);
+		_mm256_store_si256((__m256i*) (ptr + i + 32), vec_pattern);
+	}
+	qcow_mem_set_words(ptr + i, pattern, size - i);
+	return;
+}
+#endif //_QCOW_MEM_SIMD_
+
 static void mem_set_var(void* ptr, int value, size_t size, size_t val_size) {
-	if (ptr == NULL) return;
-	for (size_t i = 0; i < size; ++i) QCOW_CAST_PTR(ptr, unsigned char)[i] = QCOW_CAST_PTR(&value, unsigned char)[i % val_size]; 
+	if (ptr == NULL || val_size == 0 || val_size > sizeof(unsigned long long int)) return;
+	
+	// The bytes past the int, reached only by mem_set_64, hold its sign extension
+	unsigned char value_bytes[sizeof(unsigned long long int)] = {0};
+	for (unsigned char i = 0; i < sizeof(unsigned long long int); ++i) value_bytes[i] = (value < 0) ? 0xFF : 0x00;
+	__builtin_memcpy(value_bytes, &value, sizeof(int));
+	
+	if (8 % val_size) {
+		for (size_t i = 0; i < size; ++i) QCOW_CAST_PTR(ptr, unsigned char)[i] = value_bytes[i % val_size];
+		return;
+	}
+
+	unsigned char pattern_bytes[8] = {0};
+	for (unsigned char i = 0; i < 8; ++i) pattern_bytes[i] = value_bytes[i % val_size];
+	unsigned long long int pattern = 0;
+	__builtin_memcpy(&pattern, pattern_bytes, sizeof(unsigned long long int));
+
+#ifdef _QCOW_MEM_SIMD_
+	if (size >= QCOW_MEM_SIMD_THRESHOLD) {
+		if (__builtin_cpu_supports("avx2")) qcow_mem_set_avx2(ptr, pattern, size);
+		else qcow_mem_set_sse2(ptr, pattern, size);
+		return;
+	}
+#endif //_QCOW_MEM_SIMD_
+
+	qcow_mem_set_words(ptr, pattern, size);
+	
 	return;
 }
 
 static void* mem_cpy(void* dest, const void* src, size_t size) {
 	if (dest == NULL || src == NULL) return NULL;
-	for (size_t i = 0; i < size; ++i) QCOW_CAST_PTR(dest, unsigned char)[i] = QCOW_CAST_PTR(src, unsigned char)[i];
+
+#ifdef _QCOW_MEM_SIMD_
+	if (size >= QCOW_MEM_SIMD_THRESHOLD) {
+		if (__builtin_cpu_supports("avx2")) qcow_mem_cpy_avx2(dest, src, size);
+		else qcow_mem_cpy_sse2(dest, src, size);
+		return dest;
+	}
+#endif //_QCOW_MEM_SIMD_
+
+	qcow_mem_cpy_words(dest, src, size);
+	
 	return dest;
 }
 
 static void mem_move(void* dest, const void* src, size_t size) {
-    if (dest == NULL || src == NULL || size == 0) return;
-    
-	unsigned char* temp = (unsigned char*) qcow_calloc(size, sizeof(unsigned char));
+	if (dest == NULL || src == NULL || size == 0 || dest == src) return;
 	
-	for (size_t i = 0; i < size; ++i) *QCOW_CAST_PTR(temp + i, unsigned char) = *QCOW_CAST_PTR(QCOW_CAST_PTR(src, unsigned char) + i, unsigned char); 
-    for (size_t i = 0; i < size; ++i) *QCOW_CAST_PTR(QCOW_CAST_PTR(dest, unsigned char) + i, unsigned char) = *QCOW_CAST_PTR(temp + i, unsigned char);
-    
-	QCOW_SAFE_FREE(temp);
-    
-    return;
+	// Unless dest lies within (src, src + size), the forward copy never reads a byte it has already written
+	if ((size_t) dest - (size_t) src >= size) {
+		mem_cpy(dest, src, size);
+		return;
+	}
+
+#ifdef _QCOW_MEM_SIMD_
+	if (size >= QCOW_MEM_SIMD_THRESHOLD) {
+		if (__builtin_cpu_supports("avx2")) qcow_mem_cpy_backward_avx2(dest, src, size);
+		else qcow_mem_cpy_backward_sse2(dest, src, size);
+		return;
+	}
+#endif //_QCOW_MEM_SIMD_
+
+	qcow_mem_cpy_words_backward(dest, src, size);
+
+	return;
+}
+
+/// NOTE: the metadata tables are stored big-endian, so once loaded they are converted in place a whole table at a time,
+///       rather than entry by entry, and converting back for writing is the same swap. On x86-64 the bytes are reordered
+///       a vector at a time by pshufb, with AVX2 when the cpu supports it or SSSE3, while the remainder goes through bswap.
+#define cpu_to_be64_array(ptr, cnt) be64_to_cpu_array(ptr, cnt)
+#define cpu_to_be16_array(ptr, cnt) be16_to_cpu_array(ptr, cnt)
+#ifdef _QCOW_LITTLE_ENDIAN_
+#ifdef _QCOW_MEM_SIMD_
+__attribute__((target("ssse3"))) static size_t qcow_bswap_ssse3(unsigned char* ptr, size_t size, const unsigned char* shuffle_mask) {
+	const __m128i mask = _mm_loadu_si128((const __m128i*) shuffle_mask);
+	size_t i = 0;
+	for (; i + 16 <= size; i += 16) {
+		const __m128i values = _mm_loadu_si128((const __m128i*) (ptr + i));
+		_mm_storeu_si128((__m128i*) (ptr + i), _mm_shuffle_epi8(values, mask));
+	}
+	return i;
 }
 
+__attribute__((target("avx2"))) static size_t qcow_bswap_avx2(unsigned char* ptr, size_t size, const unsigned char* shuffle_mask) {
+	const __m256i mask = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*) shuffle_mask));
+	size_t i = 0;
+	for (; i + 64 <= size; i += 64) {
+		const __m256i lo = _mm256_loadu_si256((const __m256i*) (ptr + i));
+		const __m256i hi = _mm256_loadu_si256((const __m256i*) (ptr + i + 32));
+		_mm256_storeu_si256((__m256i*) (ptr + i), _mm256_shuffle_epi8(lo, mask));
+		_mm256_storeu_si256((__m256i*) (ptr + i + 32), _mm256_shuffle_epi8(hi, mask));
+	}
+	return i;
+}
+
+/// NOTE: returns the number of bytes swapped, always a multiple of 16, leaving the rest to the scalar loop.
+static inline size_t qcow_bswap_simd(unsigned char* ptr, size_t size, const unsigned char* shuffle_mask) {
+	if (__builtin_cpu_supports("avx2")) return qcow_bswap_avx2(ptr, size, shuffle_mask);
+	else if (__builtin_cpu_supports("ssse3")) return qcow_bswap_ssse3(ptr, size, shuffle_mask);
+	return 0;
+}
+#endif //_QCOW_MEM_SIMD_
+
+UNUSED_FUNCTION static void be64_to_cpu_array(void* ptr, size_t cnt) {
+	if (ptr == NULL) return;
+
+	size_t i = 0;
+#ifdef _QCOW_MEM_SIMD_
+	static const unsigned char be64_shuffle_mask[16] = { 7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8 };
+	i = qcow_bswap_simd(ptr, cnt * sizeof(unsigned long long int), be64_shuffle_mask) / sizeof(unsigned long long int);
+#endif //_QCOW_MEM_SIMD_
+
+	for (; i < cnt; ++i) {
+		unsigned long long int value = 0;
+		__builtin_memcpy(&value, QCOW_CAST_PTR(ptr, unsigned long long int) + i, sizeof(unsigned long long int));
+		value = __builtin_bswap64(value);
+		__builtin_memcpy(QCOW_CAST_PTR(ptr, unsigned long long int) + i, &value, sizeof(unsigned long long int));
+	}
+
+	return;
+}
+
+UNUSED_FUNCTION static void be16_to_cpu_array(void* ptr, size_t cnt) {
+	if (ptr == NULL) return;
+
+	size_t i = 0;
+#ifdef _QCOW_MEM_SIMD_
+	static const unsigned char be16_shuffle_mask[16] = { 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14 };
+	i = qcow_bswap_simd(ptr, cnt * sizeof(unsigned short int), be16_shuffle_mask) / sizeof(unsigned short int);
+#endif //_QCOW_MEM_SIMD_
+
+	for (; i < cnt; ++i) {
+		unsigned short int value = 0;
+		__builtin_memcpy(&value, QCOW_CAST_PTR(ptr, unsigned short int) + i, sizeof(unsigned short int));
+		value = __builtin_bswap16(value);
+		__builtin_memcpy(QCOW_CAST_PTR(ptr, unsigned short int) + i, &value, sizeof(unsigned short int));
+	}
+
+	return;
+}
+#else
+	#define be64_to_cpu_array(ptr, cnt)
+	#define be16_to_cpu_array(ptr, cnt)
+#endif //_QCOW_LITTLE_ENDIAN_
+
 UNUSED_FUNCTION static int mem_n_cmp(const void* ptr1, const void* ptr2, size_t n) {
     // Null Checks
     if (ptr1 == NULL && ptr2 == NULL) return 0;
@@ -347,6 +666,10 @@ typedef enum PACKED_STRUCT {
 	QCOW_GUID_MISMATCH,
 	QCOW_EMPTY_TREE,
 	QCOW_UNKNOWN_ITEM_TYPE,
+	QCOW_QUEUE_FULL,
+	QCOW_READ_ONLY_IMAGE,
+	QCOW_UNBORROWABLE_CLUSTER,
+	QCOW_BACKING_CHAIN_TOO_DEEP,
 	QCOW_TODO 
 } QCowErrors;
 
@@ -410,6 +733,10 @@ static const char* qcow_errors_str[] = {
 	"QCOW_GUID_MISMATCH",
 	"QCOW_EMPTY_TREE",
 	"QCOW_UNKNOWN_ITEM_TYPE",
+	"QCOW_QUEUE_FULL",
+	"QCOW_READ_ONLY_IMAGE",
+	"QCOW_UNBORROWABLE_CLUSTER",
+	"QCOW_BACKING_CHAIN_TOO_DEEP",
 	"QCOW_TODO" 
 };
 
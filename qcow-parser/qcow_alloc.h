@@ -0,0 +1,201 @@
+/*
+ * Copyright (C) 2025 TheProgxy <theprogxy@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _QCOW_ALLOC_H_
+#define _QCOW_ALLOC_H_
+
+#include "../common/utils.h"
+
+/* -------------------------------------------------------------------------------------------------------- */
+// ---------
+//  Structs
+// ---------
+
+/// NOTE: The free map tracks the host clusters of the image with one bit each (set if the cluster is in use),
+///       up to clusters_cnt, which is the end of the file in clusters. Allocations are served next-fit starting from
+///       the cursor, so that the holes left by released clusters are reused before growing the file, while the
+///       full words of the bitmap are skipped at once, making the allocation O(1) amortized.
+///       The released clusters stay in use until qcow_free_map_commit_released, as the tables dropping them may still be cached.
+///       The free map does not lock itself, as it is always accessed under the alloc_lock of the qcow_ctx.
+typedef struct qcow_free_map_t {
+	u64* bitmap;
+	u64 words_cnt;
+	u64 clusters_cnt;
+	u64 free_cnt;
+	u64 cursor;
+	u64* released;
+	u64 released_cnt;
+	u64 released_capacity;
+} qcow_free_map_t;
+
+/* -------------------------------------------------------------------------------------------------------- */
+// ------------------------
+//  Functions Declarations
+// ------------------------
+static int init_qcow_free_map(qcow_free_map_t** free_map, u64 clusters_cnt);
+static void deinit_qcow_free_map(qcow_free_map_t* free_map);
+static int qcow_free_map_grow(qcow_free_map_t* free_map, u64 clusters_cnt);
+static int qcow_free_map_mark(qcow_free_map_t* free_map, u64 cluster, u64 n, bool used);
+static bool qcow_free_map_find_run(const qcow_free_map_t* free_map, u64 from, u64 to, u64 n, u64* cluster);
+static int qcow_free_map_claim(qcow_free_map_t* free_map, u64 n, u64* cluster);
+static int qcow_free_map_release(qcow_free_map_t* free_map, u64 cluster);
+static int qcow_free_map_commit_released(qcow_free_map_t* free_map, u64 n);
+
+/* -------------------------------------------------------------------------------------------------------- */
+
+#define QCOW_FREE_MAP_TEST(free_map, cluster) (((free_map) -> bitmap[(cluster) / 64] >> ((cluster) % 64)) & 1)
+
+static int init_qcow_free_map(qcow_free_map_t** free_map, u64 clusters_cnt) {
+	qcow_free_map_t* map = (qcow_free_map_t*) qcow_calloc(1, sizeof(qcow_free_map_t));
+	if (map == NULL) {
+		WARNING_LOG("Failed to allocate the free map.\n");
+		return -QCOW_IO_ERROR;
+	}
+
+	if (qcow_free_map_grow(map, clusters_cnt) < 0) {
+		QCOW_SAFE_FREE(map);
+		WARNING_LOG("Failed to allocate the free map bitmap.\n");
+		return -QCOW_IO_ERROR;
+	}
+
+	*free_map = map;
+
+	return QCOW_NO_ERROR;
+}
+
+static void deinit_qcow_free_map(qcow_free_map_t* free_map) {
+	if (free_map == NULL) return;
+	QCOW_SAFE_FREE(free_map -> bitmap);
+	QCOW_SAFE_FREE(free_map -> released);
+	QCOW_SAFE_FREE(free_map);
+	return;
+}
+
+/// NOTE: the newly tracked clusters are free, and the bitmap capacity is doubled, so that appending clusters one at a time stays amortized O(1).
+static int qcow_free_map_grow(qcow_free_map_t* free_map, u64 clusters_cnt) {
+	if (clusters_cnt <= free_map -> clusters_cnt) return QCOW_NO_ERROR;
+
+	const u64 words_needed = (clusters_cnt + 63) / 64;
+	if (words_needed > free_map -> words_cnt) {
+		const u64 words_cnt = MAX(words_needed, free_map -> words_cnt * 2);
+		u64* bitmap = (u64*) qcow_realloc(free_map -> bitmap, words_cnt * sizeof(u64));
+		if (bitmap == NULL) {
+			WARNING_LOG("Failed to reallocate the free map bitmap.\n");
+			return -QCOW_IO_ERROR;
+		}
+		mem_set(bitmap + free_map -> words_cnt, 0, (words_cnt - free_map -> words_cnt) * sizeof(u64));
+		free_map -> bitmap = bitmap;
+		free_map -> words_cnt = words_cnt;
+	}
+
+	free_map -> free_cnt += clusters_cnt - free_map -> clusters_cnt;
+	free_map -> clusters_cnt = clusters_cnt;
+
+	return QCOW_NO_ERROR;
+}
+
+static int qcow_free_map_mark(qcow_free_map_t* free_map, u64 cluster, u64 n, bool used) {
+	int err = 0;
+	if ((err = qcow_free_map_grow(free_map, cluster + n)) < 0) return err;
+
+	for (u64 i = cluster; i < cluster + n; ++i) {
+		if (QCOW_FREE_MAP_TEST(free_map, i) == used) continue;
+		free_map -> bitmap[i / 64] ^= 1ULL << (i % 64);
+		if (used) free_map -> free_cnt--;
+		else free_map -> free_cnt++;
+	}
+
+	// Released clusters behind the cursor are picked up again on the next allocation
+	if (!used && cluster < free_map -> cursor) free_map -> cursor = cluster;
+
+	return QCOW_NO_ERROR;
+}
+
+static bool qcow_free_map_find_run(const qcow_free_map_t* free_map, u64 from, u64 to, u64 n, u64* cluster) {
+	u64 run = 0;
+	for (u64 i = from; i < to;) {
+		if ((i % 64) == 0 && (i + 64) <= to && free_map -> bitmap[i / 64] == ~0ULL) {
+			run = 0;
+			i += 64;
+			continue;
+		}
+
+		run = QCOW_FREE_MAP_TEST(free_map, i) ? 0 : run + 1;
+		++i;
+		if (run == n) {
+			*cluster = i - n;
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/// NOTE: the run is searched from the cursor to the end of the map and then wrapping around from the start,
+///       if no run of n free clusters exists, the trailing free clusters are extended past the end of the map.
+static int qcow_free_map_claim(qcow_free_map_t* free_map, u64 n, u64* cluster) {
+	bool found = FALSE;
+	if (free_map -> free_cnt >= n) {
+		found = qcow_free_map_find_run(free_map, free_map -> cursor, free_map -> clusters_cnt, n, cluster);
+		if (!found) found = qcow_free_map_find_run(free_map, 0, MIN(free_map -> cursor + n - 1, free_map -> clusters_cnt), n, cluster);
+	}
+
+	if (!found) {
+		*cluster = free_map -> clusters_cnt;
+		while (*cluster > 0 && !QCOW_FREE_MAP_TEST(free_map, *cluster - 1)) (*cluster)--;
+	}
+
+	int err = 0;
+	if ((err = qcow_free_map_mark(free_map, *cluster, n, TRUE)) < 0) return err;
+	free_map -> cursor = *cluster + n;
+
+	return QCOW_NO_ERROR;
+}
+
+/// NOTE: the cluster is only queued, and it is reused once committed, after the tables that dropped it reached the image.
+static int qcow_free_map_release(qcow_free_map_t* free_map, u64 cluster) {
+	if (free_map -> released_cnt == free_map -> released_capacity) {
+		const u64 released_capacity = MAX(64, free_map -> released_capacity * 2);
+		u64* released = (u64*) qcow_realloc(free_map -> released, released_capacity * sizeof(u64));
+		if (released == NULL) {
+			WARNING_LOG("Failed to reallocate the released clusters.\n");
+			return -QCOW_IO_ERROR;
+		}
+		free_map -> released = released;
+		free_map -> released_capacity = released_capacity;
+	}
+
+	free_map -> released[free_map -> released_cnt++] = cluster;
+
+	return QCOW_NO_ERROR;
+}
+
+/// NOTE: frees the first n released clusters, the ones queued afterwards wait for the next commit.
+static int qcow_free_map_commit_released(qcow_free_map_t* free_map, u64 n) {
+	int err = 0;
+	n = MIN(n, free_map -> released_cnt);
+	for (u64 i = 0; i < n; ++i) {
+		if ((err = qcow_free_map_mark(free_map, free_map -> released[i], 1, FALSE)) < 0) return err;
+	}
+
+	free_map -> released_cnt -= n;
+	mem_move(free_map -> released, free_map -> released + n, free_map -> released_cnt * sizeof(u64));
+
+	return QCOW_NO_ERROR;
+}
+
+#endif //_QCOW_ALLOC_H_
@@ -0,0 +1,718 @@
+/*
+ * Copyright (C) 2025 TheProgxy <theprogxy@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _QCOW_ASYNC_H_
+#define _QCOW_ASYNC_H_
+
+#include <pthread.h>
+#include "./qcow_parser.h"
+
+#if defined(__linux__) && !defined(_QCOW_NO_URING_) && defined(__has_include)
+	#if __has_include(<linux/io_uring.h>)
+		#define _QCOW_ASYNC_URING_
+	#endif
+#endif
+
+#ifdef _QCOW_ASYNC_URING_
+	#include <sched.h>
+	#include <stdint.h>
+	#include <sys/mman.h>
+	#include <sys/syscall.h>
+	#include <linux/io_uring.h>
+#endif //_QCOW_ASYNC_URING_
+
+/* -------------------------------------------------------------------------------------------------------- */
+// -----------------
+//  Constant Values
+// -----------------
+typedef enum {
+	QCOW_ASYNC_DEFAULT_WORKERS     = 4,
+	QCOW_ASYNC_DEFAULT_QUEUE_DEPTH = 64,
+	QCOW_ASYNC_CHUNK_CLUSTERS      = 16,
+	QCOW_ASYNC_RING_MIN_ENTRIES    = 32,
+	QCOW_ASYNC_EXTENTS_BATCH       = 16
+} QCowAsyncConstants;
+
+/* -------------------------------------------------------------------------------------------------------- */
+// -------
+//  Enums
+// -------
+typedef enum PACKED_STRUCT QCowAsyncOp {
+	QCOW_ASYNC_READ = 0,
+	QCOW_ASYNC_WRITE
+} QCowAsyncOp;
+
+/* -------------------------------------------------------------------------------------------------------- */
+// ---------
+//  Structs
+// ---------
+typedef struct qcow_completion_t {
+	u64 user_data;
+	int ret;
+	QCowAsyncOp op;
+} qcow_completion_t;
+
+typedef struct qcow_async_request_t qcow_async_request_t;
+
+/// NOTE: host_offset is only used by the tasks served by the ring, which read the data straight from the clusters file.
+typedef struct qcow_async_task_t {
+	qcow_async_request_t* request;
+	u8* buffer;
+	u64 size;
+	u64 offset;
+	u64 host_offset;
+	bool ring;
+	struct qcow_async_task_t* next;
+} qcow_async_task_t;
+
+typedef struct qcow_uring_t qcow_uring_t;
+
+struct qcow_async_request_t {
+	QCowAsyncOp op;
+	u64 user_data;
+	int ret;
+	unsigned int pending_tasks;
+	qcow_async_task_t* tasks;
+};
+
+typedef struct qcow_async_ctx_t {
+	qcow_ctx_t* qcow_ctx;
+	pthread_t* workers;
+	unsigned int workers_cnt;
+	pthread_mutex_t lock;
+	pthread_cond_t sq_cond;
+	pthread_cond_t cq_cond;
+	qcow_async_task_t* sq_head;
+	qcow_async_task_t* sq_tail;
+	qcow_completion_t* cq;
+	unsigned int cq_head;
+	unsigned int cq_cnt;
+	unsigned int queue_depth;
+	unsigned int inflight;
+	bool stop;
+	qcow_uring_t* ring;
+} qcow_async_ctx_t;
+
+#ifdef _QCOW_ASYNC_URING_
+/// NOTE: the ring is only touched with the lock of the async ctx held, but for the reaper waiting for the completions.
+///       At most sq_entries reads are inflight (including the queued ones, and the NOP that wakes up the reaper on deinit),
+///       hence the submission queue never fills up and the completion queue, twice as large, never overflows.
+struct qcow_uring_t {
+	int fd;
+	u8* sq_ring;
+	u64 sq_ring_size;
+	u8* cq_ring;
+	u64 cq_ring_size;
+	struct io_uring_sqe* sqes;
+	u64 sqes_size;
+	unsigned int* sq_head;
+	unsigned int* sq_tail;
+	unsigned int* sq_array;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	unsigned int* cq_head;
+	unsigned int* cq_tail;
+	struct io_uring_cqe* cqes;
+	unsigned int cq_mask;
+	unsigned int to_submit;
+	unsigned int inflight;
+	int data_fd;
+	pthread_cond_t space_cond;
+	pthread_t reaper;
+};
+#endif //_QCOW_ASYNC_URING_
+
+/* -------------------------------------------------------------------------------------------------------- */
+// ------------------------
+//  Functions Declarations
+// ------------------------
+static void* qcow_async_worker(void* arg);
+static void push_async_completion(qcow_async_ctx_t* async_ctx, qcow_async_request_t* request);
+static void retire_async_task(qcow_async_ctx_t* async_ctx, qcow_async_task_t* task, int ret);
+static void complete_async_task(qcow_async_ctx_t* async_ctx, qcow_async_task_t* task, int ret);
+#ifdef _QCOW_ASYNC_URING_
+static int init_qcow_uring(qcow_async_ctx_t* async_ctx);
+static void deinit_qcow_uring(qcow_async_ctx_t* async_ctx);
+static int qcow_uring_enter(qcow_uring_t* ring, unsigned int to_submit, unsigned int min_complete);
+static int qcow_uring_submit(qcow_uring_t* ring);
+static void qcow_uring_queue(qcow_async_ctx_t* async_ctx, u8 opcode, qcow_async_task_t* task);
+static void* qcow_uring_reaper(void* arg);
+static int resolve_read_extents(qcow_ctx_t* qcow_ctx, u64 offset, u64 size, qcow_extent_t** extents, u32* extents_cnt);
+static int submit_ring_read(qcow_async_ctx_t* async_ctx, u8* buffer, u64 size, u64 offset, u64 user_data);
+#endif //_QCOW_ASYNC_URING_
+static int submit_async_request(qcow_async_ctx_t* async_ctx, QCowAsyncOp op, u8* buffer, u64 size, u64 offset, u64 user_data);
+int init_qcow_async(qcow_async_ctx_t* async_ctx, qcow_ctx_t* qcow_ctx, unsigned int workers_cnt, unsigned int queue_depth);
+void deinit_qcow_async(qcow_async_ctx_t* async_ctx);
+int qread_async(qcow_async_ctx_t* async_ctx, void* ptr, size_t size, size_t nmemb, u64 offset, u64 user_data);
+int qwrite_async(qcow_async_ctx_t* async_ctx, const void* data, size_t size, size_t nmemb, u64 offset, u64 user_data);
+int qwait_async(qcow_async_ctx_t* async_ctx, qcow_completion_t* completions, unsigned int min_completions, unsigned int max_completions);
+
+/* -------------------------------------------------------------------------------------------------------- */
+static void* qcow_async_worker(void* arg) {
+	qcow_async_ctx_t* async_ctx = (qcow_async_ctx_t*) arg;
+
+	while (TRUE) {
+		pthread_mutex_lock(&async_ctx -> lock);
+		while (async_ctx -> sq_head == NULL && !async_ctx -> stop) pthread_cond_wait(&async_ctx -> sq_cond, &async_ctx -> lock);
+
+		qcow_async_task_t* task = async_ctx -> sq_head;
+		if (task == NULL) {
+			pthread_mutex_unlock(&async_ctx -> lock);
+			break;
+		}
+
+		async_ctx -> sq_head = task -> next;
+		if (async_ctx -> sq_head == NULL) async_ctx -> sq_tail = NULL;
+		pthread_mutex_unlock(&async_ctx -> lock);
+
+		// The qcow_ctx serializes the accesses to its own metadata, hence the tasks can be issued without further locking
+		int ret = 0;
+		if (task -> request -> op == QCOW_ASYNC_READ) ret = qread(task -> buffer, task -> size, sizeof(u8), task -> offset, async_ctx -> qcow_ctx);
+		else ret = qwrite(task -> buffer, task -> size, sizeof(u8), task -> offset, async_ctx -> qcow_ctx);
+
+		complete_async_task(async_ctx, task, ret);
+	}
+
+	return NULL;
+}
+
+/// NOTE: must be called with the lock of the async ctx held.
+static void push_async_completion(qcow_async_ctx_t* async_ctx, qcow_async_request_t* request) {
+	const unsigned int cq_tail = (async_ctx -> cq_head + async_ctx -> cq_cnt) % async_ctx -> queue_depth;
+	async_ctx -> cq[cq_tail] = (qcow_completion_t) { .user_data = request -> user_data, .ret = request -> ret, .op = request -> op };
+	async_ctx -> cq_cnt++;
+	QCOW_MULTI_FREE(request -> tasks, request);
+	pthread_cond_broadcast(&async_ctx -> cq_cond);
+	return;
+}
+
+/// NOTE: must be called with the lock of the async ctx held.
+static void retire_async_task(qcow_async_ctx_t* async_ctx, qcow_async_task_t* task, int ret) {
+	qcow_async_request_t* request = task -> request;
+	if (ret < 0 && request -> ret == QCOW_NO_ERROR) request -> ret = ret;
+	if (--(request -> pending_tasks) == 0) push_async_completion(async_ctx, request);
+	return;
+}
+
+static void complete_async_task(qcow_async_ctx_t* async_ctx, qcow_async_task_t* task, int ret) {
+	pthread_mutex_lock(&async_ctx -> lock);
+	retire_async_task(async_ctx, task, ret);
+	pthread_mutex_unlock(&async_ctx -> lock);
+	return;
+}
+
+#ifdef _QCOW_ASYNC_URING_
+static void release_qcow_uring(qcow_uring_t* ring) {
+	if (ring -> sqes != NULL) munmap(ring -> sqes, ring -> sqes_size);
+	if (ring -> cq_ring != NULL && ring -> cq_ring != ring -> sq_ring) munmap(ring -> cq_ring, ring -> cq_ring_size);
+	if (ring -> sq_ring != NULL) munmap(ring -> sq_ring, ring -> sq_ring_size);
+	close(ring -> fd);
+	QCOW_SAFE_FREE(ring);
+	return;
+}
+
+/// NOTE: the ring is set up through the raw syscalls, and only for images whose clusters file is served by the fd backend,
+///       as the reads are issued straight on its descriptor. On failure the reads keep being served by the workers.
+static int init_qcow_uring(qcow_async_ctx_t* async_ctx) {
+	const qcow_io_t* clusters_file = async_ctx -> qcow_ctx -> clusters_file;
+	if (clusters_file == NULL || clusters_file -> ops != &fd_io_ops) return -QCOW_INVALID_PARAMETERS;
+
+	struct io_uring_params params = {0};
+	const unsigned int entries = MAX(async_ctx -> queue_depth, (unsigned int) QCOW_ASYNC_RING_MIN_ENTRIES);
+	const int ring_fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+	if (ring_fd < 0) {
+		DEBUG_LOG("io_uring is not available, the reads are served by the workers.\n");
+		return -QCOW_IO_ERROR;
+	}
+
+	qcow_uring_t* ring = (qcow_uring_t*) qcow_calloc(1, sizeof(qcow_uring_t));
+	if (ring == NULL) {
+		close(ring_fd);
+		WARNING_LOG("Failed to allocate the ring.\n");
+		return -QCOW_IO_ERROR;
+	}
+
+	ring -> fd = ring_fd;
+	ring -> data_fd = clusters_file -> fd;
+	ring -> sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	ring -> cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) ring -> sq_ring_size = ring -> cq_ring_size = MAX(ring -> sq_ring_size, ring -> cq_ring_size);
+	ring -> sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	void* sq_ring = mmap(NULL, ring -> sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	ring -> sq_ring = (sq_ring == MAP_FAILED) ? NULL : (u8*) sq_ring;
+	void* cq_ring = (params.features & IORING_FEAT_SINGLE_MMAP) ? sq_ring : mmap(NULL, ring -> cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+	ring -> cq_ring = (cq_ring == MAP_FAILED) ? NULL : (u8*) cq_ring;
+	void* sqes = mmap(NULL, ring -> sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+	ring -> sqes = (sqes == MAP_FAILED) ? NULL : (struct io_uring_sqe*) sqes;
+	if (ring -> sq_ring == NULL || ring -> cq_ring == NULL || ring -> sqes == NULL) {
+		release_qcow_uring(ring);
+		PERROR_LOG("Failed to map the ring");
+		return -QCOW_IO_ERROR;
+	}
+
+	ring -> sq_head = QCOW_CAST_PTR(ring -> sq_ring + params.sq_off.head, unsigned int);
+	ring -> sq_tail = QCOW_CAST_PTR(ring -> sq_ring + params.sq_off.tail, unsigned int);
+	ring -> sq_array = QCOW_CAST_PTR(ring -> sq_ring + params.sq_off.array, unsigned int);
+	ring -> sq_mask = *QCOW_CAST_PTR(ring -> sq_ring + params.sq_off.ring_mask, unsigned int);
+	ring -> sq_entries = params.sq_entries;
+	ring -> cq_head = QCOW_CAST_PTR(ring -> cq_ring + params.cq_off.head, unsigned int);
+	ring -> cq_tail = QCOW_CAST_PTR(ring -> cq_ring + params.cq_off.tail, unsigned int);
+	ring -> cqes = QCOW_CAST_PTR(ring -> cq_ring + params.cq_off.cqes, struct io_uring_cqe);
+	ring -> cq_mask = *QCOW_CAST_PTR(ring -> cq_ring + params.cq_off.ring_mask, unsigned int);
+
+	pthread_cond_init(&ring -> space_cond, NULL);
+	async_ctx -> ring = ring;
+	if (pthread_create(&ring -> reaper, NULL, qcow_uring_reaper, async_ctx) != 0) {
+		async_ctx -> ring = NULL;
+		pthread_cond_destroy(&ring -> space_cond);
+		release_qcow_uring(ring);
+		WARNING_LOG("Failed to spawn the ring reaper.\n");
+		return -QCOW_IO_ERROR;
+	}
+
+	return QCOW_NO_ERROR;
+}
+
+/// NOTE: called once the workers are joined, and after the NOP waking up the reaper has been queued.
+static void deinit_qcow_uring(qcow_async_ctx_t* async_ctx) {
+	qcow_uring_t* ring = async_ctx -> ring;
+	if (ring == NULL) return;
+
+	pthread_join(ring -> reaper, NULL);
+	pthread_cond_destroy(&ring -> space_cond);
+	release_qcow_uring(ring);
+	async_ctx -> ring = NULL;
+
+	return;
+}
+
+static int qcow_uring_enter(qcow_uring_t* ring, unsigned int to_submit, unsigned int min_complete) {
+	long int ret = 0;
+	while ((ret = syscall(__NR_io_uring_enter, ring -> fd, to_submit, min_complete, min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0)) < 0 && errno == EINTR);
+	return (ret < 0) ? -errno : (int) ret;
+}
+
+/// NOTE: must be called with the lock of the async ctx held, entries that could not be submitted are left queued for the next call.
+static int qcow_uring_submit(qcow_uring_t* ring) {
+	while (ring -> to_submit > 0) {
+		const int ret = qcow_uring_enter(ring, ring -> to_submit, 0);
+		if (ret == -EAGAIN || ret == -EBUSY) {
+			sched_yield();
+			continue;
+		} else if (ret < 0) {
+			errno = -ret;
+			PERROR_LOG("Failed to submit %u ring entries", ring -> to_submit);
+			return -QCOW_IO_ERROR;
+		}
+		ring -> to_submit -= ret;
+	}
+
+	return QCOW_NO_ERROR;
+}
+
+/// NOTE: must be called with the lock of the async ctx held, which is released while waiting for a free slot.
+///       A NULL task queues the NOP used to wake up the reaper.
+static void qcow_uring_queue(qcow_async_ctx_t* async_ctx, u8 opcode, qcow_async_task_t* task) {
+	qcow_uring_t* ring = async_ctx -> ring;
+	while (ring -> inflight == ring -> sq_entries) {
+		qcow_uring_submit(ring);
+		pthread_cond_wait(&ring -> space_cond, &async_ctx -> lock);
+	}
+
+	const unsigned int tail = *(ring -> sq_tail);
+	const unsigned int index = tail & ring -> sq_mask;
+	struct io_uring_sqe* sqe = ring -> sqes + index;
+	mem_set(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe -> opcode = opcode;
+	sqe -> fd = (task != NULL) ? ring -> data_fd : -1;
+	if (task != NULL) {
+		sqe -> off = task -> host_offset;
+		sqe -> addr = (u64) (uintptr_t) task -> buffer;
+		sqe -> len = (u32) task -> size;
+	}
+	sqe -> user_data = (u64) (uintptr_t) task;
+	ring -> sq_array[index] = index;
+	__atomic_store_n(ring -> sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	ring -> to_submit++;
+	ring -> inflight++;
+
+	return;
+}
+
+/// NOTE: short reads are queued again for the rest of the task, while reading past the end of the file fails as in fd_io_read.
+static void* qcow_uring_reaper(void* arg) {
+	qcow_async_ctx_t* async_ctx = (qcow_async_ctx_t*) arg;
+	qcow_uring_t* ring = async_ctx -> ring;
+
+	while (TRUE) {
+		int err = qcow_uring_enter(ring, 0, 1);
+		if (err < 0 && err != -EAGAIN && err != -EBUSY) {
+			errno = -err;
+			PERROR_LOG("Failed to wait for the ring completions");
+			sched_yield();
+		}
+
+		pthread_mutex_lock(&async_ctx -> lock);
+
+		bool requeued = FALSE;
+		unsigned int head = *(ring -> cq_head);
+		const unsigned int tail = __atomic_load_n(ring -> cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; ++head) {
+			const struct io_uring_cqe cqe = ring -> cqes[head & ring -> cq_mask];
+			qcow_async_task_t* task = (qcow_async_task_t*) (uintptr_t) cqe.user_data;
+			ring -> inflight--;
+			if (task == NULL) continue;
+
+			if (cqe.res == -EINTR || cqe.res == -EAGAIN || (cqe.res > 0 && (u64) cqe.res < task -> size)) {
+				const u64 bytes_read = (cqe.res > 0) ? (u64) cqe.res : 0;
+				task -> buffer += bytes_read;
+				task -> host_offset += bytes_read;
+				task -> size -= bytes_read;
+				qcow_uring_queue(async_ctx, IORING_OP_READ, task);
+				requeued = TRUE;
+				continue;
+			}
+
+			int ret = QCOW_NO_ERROR;
+			if (cqe.res < 0) {
+				errno = -cqe.res;
+				PERROR_LOG("Failed to read %llu bytes at pos 0x%llX", task -> size, task -> host_offset);
+				ret = -QCOW_IO_ERROR;
+			} else if (cqe.res == 0) {
+				WARNING_LOG("Unexpected end of file while reading %llu bytes at pos 0x%llX.\n", task -> size, task -> host_offset);
+				ret = -QCOW_IO_ERROR;
+			}
+
+			retire_async_task(async_ctx, task, ret);
+		}
+
+		__atomic_store_n(ring -> cq_head, head, __ATOMIC_RELEASE);
+		if (requeued) qcow_uring_submit(ring);
+		pthread_cond_broadcast(&ring -> space_cond);
+
+		const bool done = async_ctx -> stop && ring -> inflight == 0;
+		pthread_mutex_unlock(&async_ctx -> lock);
+		if (done) break;
+	}
+
+	return NULL;
+}
+
+static int resolve_read_extents(qcow_ctx_t* qcow_ctx, u64 offset, u64 size, qcow_extent_t** extents, u32* extents_cnt) {
+	u32 capacity = 0;
+	*extents = NULL;
+	*extents_cnt = 0;
+
+	while (size > 0) {
+		if (capacity - *extents_cnt < QCOW_ASYNC_EXTENTS_BATCH) {
+			capacity += QCOW_ASYNC_EXTENTS_BATCH * (capacity ? capacity / QCOW_ASYNC_EXTENTS_BATCH : 1);
+			qcow_extent_t* new_extents = (qcow_extent_t*) qcow_realloc(*extents, capacity * sizeof(qcow_extent_t));
+			if (new_extents == NULL) {
+				QCOW_SAFE_FREE(*extents);
+				WARNING_LOG("Failed to allocate the read extents.\n");
+				return -QCOW_IO_ERROR;
+			}
+			*extents = new_extents;
+		}
+
+		const int ret = qblock_status(qcow_ctx, offset, size, *extents + *extents_cnt, capacity - *extents_cnt);
+		if (ret <= 0) {
+			QCOW_SAFE_FREE(*extents);
+			WARNING_LOG("Failed to resolve the extents of the read.\n");
+			return (ret < 0) ? ret : -QCOW_IO_ERROR;
+		}
+
+		const qcow_extent_t* last = *extents + *extents_cnt + ret - 1;
+		const u64 resolved = last -> offset + last -> length - offset;
+		offset += resolved;
+		size -= resolved;
+		*extents_cnt += ret;
+	}
+
+	return QCOW_NO_ERROR;
+}
+
+/// NOTE: the range is resolved into extents up front: the data extents are read straight from the clusters file through the ring,
+///       the zero and unallocated ones are filled in place, while the compressed ones and those falling through to the backing chain
+///       are handed to the workers. All of them are split in chunks of QCOW_ASYNC_CHUNK_CLUSTERS clusters, as the plain reads.
+static int submit_ring_read(qcow_async_ctx_t* async_ctx, u8* buffer, u64 size, u64 offset, u64 user_data) {
+	const u64 chunk_size = QCOW_ASYNC_CHUNK_CLUSTERS * async_ctx -> qcow_ctx -> cluster_size;
+
+	int err = 0;
+	u32 extents_cnt = 0;
+	qcow_extent_t* extents = NULL;
+	if ((err = resolve_read_extents(async_ctx -> qcow_ctx, offset, size, &extents, &extents_cnt)) < 0) return err;
+
+	unsigned int tasks_cnt = 0;
+	for (u32 i = 0; i < extents_cnt; ++i) {
+		if (extents[i].status == QCOW_BLOCK_ZERO || extents[i].status == QCOW_BLOCK_UNALLOCATED) continue;
+		tasks_cnt += CEILING((extents[i].offset % chunk_size) + extents[i].length, chunk_size);
+	}
+
+	qcow_async_request_t* request = (qcow_async_request_t*) qcow_calloc(1, sizeof(qcow_async_request_t));
+	if (request == NULL) {
+		QCOW_SAFE_FREE(extents);
+		WARNING_LOG("Failed to allocate the async request.\n");
+		return -QCOW_IO_ERROR;
+	}
+
+	request -> tasks = (qcow_async_task_t*) qcow_calloc(MAX(tasks_cnt, 1U), sizeof(qcow_async_task_t));
+	if (request -> tasks == NULL) {
+		QCOW_MULTI_FREE(extents, request);
+		WARNING_LOG("Failed to allocate the async tasks.\n");
+		return -QCOW_IO_ERROR;
+	}
+
+	request -> op = QCOW_ASYNC_READ;
+	request -> user_data = user_data;
+	request -> pending_tasks = tasks_cnt;
+
+	qcow_async_task_t* pool_head = NULL;
+	qcow_async_task_t* pool_tail = NULL;
+	qcow_async_task_t* task = request -> tasks;
+	for (u32 i = 0; i < extents_cnt; ++i) {
+		const qcow_extent_t* extent = extents + i;
+		if (extent -> status == QCOW_BLOCK_ZERO || extent -> status == QCOW_BLOCK_UNALLOCATED) continue;
+
+		for (u64 submitted = 0; submitted < extent -> length; submitted += task -> size, ++task) {
+			task -> request = request;
+			task -> offset = extent -> offset + submitted;
+			task -> buffer = buffer + (task -> offset - offset);
+			task -> size = MIN(extent -> length - submitted, chunk_size - (task -> offset % chunk_size));
+			task -> host_offset = extent -> host_offset + submitted;
+			task -> ring = (extent -> status == QCOW_BLOCK_DATA);
+			if (task -> ring) continue;
+			if (pool_tail == NULL) pool_head = task;
+			else pool_tail -> next = task;
+			pool_tail = task;
+		}
+	}
+
+	pthread_mutex_lock(&async_ctx -> lock);
+	if (async_ctx -> inflight >= async_ctx -> queue_depth) {
+		pthread_mutex_unlock(&async_ctx -> lock);
+		QCOW_MULTI_FREE(extents, request -> tasks, request);
+		return -QCOW_QUEUE_FULL;
+	}
+	async_ctx -> inflight++;
+	pthread_mutex_unlock(&async_ctx -> lock);
+
+	for (u32 i = 0; i < extents_cnt; ++i) {
+		if (extents[i].status == QCOW_BLOCK_ZERO || extents[i].status == QCOW_BLOCK_UNALLOCATED) mem_set(buffer + (extents[i].offset - offset), 0, extents[i].length);
+	}
+	QCOW_SAFE_FREE(extents);
+
+	pthread_mutex_lock(&async_ctx -> lock);
+
+	if (tasks_cnt == 0) {
+		push_async_completion(async_ctx, request);
+		pthread_mutex_unlock(&async_ctx -> lock);
+		return QCOW_NO_ERROR;
+	}
+
+	if (pool_head != NULL) {
+		if (async_ctx -> sq_tail == NULL) async_ctx -> sq_head = pool_head;
+		else async_ctx -> sq_tail -> next = pool_head;
+		async_ctx -> sq_tail = pool_tail;
+		pthread_cond_broadcast(&async_ctx -> sq_cond);
+	}
+
+	// The request cannot complete before all of its tasks are queued, as its pending tasks include those still to be queued
+	for (unsigned int i = 0; i < tasks_cnt; ++i) {
+		if ((request -> tasks)[i].ring) qcow_uring_queue(async_ctx, IORING_OP_READ, request -> tasks + i);
+	}
+	qcow_uring_submit(async_ctx -> ring);
+
+	pthread_mutex_unlock(&async_ctx -> lock);
+
+	return QCOW_NO_ERROR;
+}
+#endif //_QCOW_ASYNC_URING_
+
+/// NOTE: reads are split in chunks of QCOW_ASYNC_CHUNK_CLUSTERS clusters, so that a single large
+///       request is served by all the workers, while writes are queued as a single task.
+///       When the ring is available the reads within the image are served by submit_ring_read instead.
+static int submit_async_request(qcow_async_ctx_t* async_ctx, QCowAsyncOp op, u8* buffer, u64 size, u64 offset, u64 user_data) {
+	if (async_ctx == NULL || buffer == NULL || size == 0) return -QCOW_INVALID_PARAMETERS;
+
+#ifdef _QCOW_ASYNC_URING_
+	if (op == QCOW_ASYNC_READ && async_ctx -> ring != NULL && offset + size <= async_ctx -> qcow_ctx -> size) {
+		return submit_ring_read(async_ctx, buffer, size, offset, user_data);
+	}
+#endif //_QCOW_ASYNC_URING_
+
+	const u64 chunk_size = QCOW_ASYNC_CHUNK_CLUSTERS * async_ctx -> qcow_ctx -> cluster_size;
+	unsigned int tasks_cnt = 1;
+	if (op == QCOW_ASYNC_READ) tasks_cnt = CEILING((offset % chunk_size) + size, chunk_size);
+
+	qcow_async_request_t* request = (qcow_async_request_t*) qcow_calloc(1, sizeof(qcow_async_request_t));
+	if (request == NULL) {
+		WARNING_LOG("Failed to allocate the async request.\n");
+		return -QCOW_IO_ERROR;
+	}
+
+	request -> tasks = (qcow_async_task_t*) qcow_calloc(tasks_cnt, sizeof(qcow_async_task_t));
+	if (request -> tasks == NULL) {
+		QCOW_SAFE_FREE(request);
+		WARNING_LOG("Failed to allocate the async tasks.\n");
+		return -QCOW_IO_ERROR;
+	}
+
+	request -> op = op;
+	request -> user_data = user_data;
+	request -> pending_tasks = tasks_cnt;
+
+	for (u64 i = 0, submitted = 0; i < tasks_cnt; ++i) {
+		qcow_async_task_t* task = request -> tasks + i;
+		task -> request = request;
+		task -> buffer = buffer + submitted;
+		task -> offset = offset + submitted;
+		task -> size = (op == QCOW_ASYNC_READ) ? MIN(size - submitted, chunk_size - (task -> offset % chunk_size)) : size;
+		task -> next = (i + 1 < tasks_cnt) ? request -> tasks + i + 1 : NULL;
+		submitted += task -> size;
+	}
+
+	pthread_mutex_lock(&async_ctx -> lock);
+
+	if (async_ctx -> inflight >= async_ctx -> queue_depth) {
+		pthread_mutex_unlock(&async_ctx -> lock);
+		QCOW_MULTI_FREE(request -> tasks, request);
+		return -QCOW_QUEUE_FULL;
+	}
+
+	async_ctx -> inflight++;
+	if (async_ctx -> sq_tail == NULL) async_ctx -> sq_head = request -> tasks;
+	else async_ctx -> sq_tail -> next = request -> tasks;
+	async_ctx -> sq_tail = request -> tasks + tasks_cnt - 1;
+
+	pthread_cond_broadcast(&async_ctx -> sq_cond);
+	pthread_mutex_unlock(&async_ctx -> lock);
+
+	return QCOW_NO_ERROR;
+}
+
+/// NOTE: the qcow_ctx must stay valid until deinit_qcow_async has returned,
+///       and it should not be accessed with qread/qwrite while requests are inflight.
+int init_qcow_async(qcow_async_ctx_t* async_ctx, qcow_ctx_t* qcow_ctx, unsigned int workers_cnt, unsigned int queue_depth) {
+	if (async_ctx == NULL || qcow_ctx == NULL) return -QCOW_INVALID_PARAMETERS;
+
+	mem_set(async_ctx, 0, sizeof(qcow_async_ctx_t));
+	async_ctx -> qcow_ctx = qcow_ctx;
+	async_ctx -> workers_cnt = workers_cnt ? workers_cnt : QCOW_ASYNC_DEFAULT_WORKERS;
+	async_ctx -> queue_depth = queue_depth ? queue_depth : QCOW_ASYNC_DEFAULT_QUEUE_DEPTH;
+
+	async_ctx -> cq = (qcow_completion_t*) qcow_calloc(async_ctx -> queue_depth, sizeof(qcow_completion_t));
+	if (async_ctx -> cq == NULL) {
+		WARNING_LOG("Failed to allocate the completion queue.\n");
+		return -QCOW_IO_ERROR;
+	}
+
+	async_ctx -> workers = (pthread_t*) qcow_calloc(async_ctx -> workers_cnt, sizeof(pthread_t));
+	if (async_ctx -> workers == NULL) {
+		QCOW_SAFE_FREE(async_ctx -> cq);
+		WARNING_LOG("Failed to allocate the workers.\n");
+		return -QCOW_IO_ERROR;
+	}
+
+	pthread_mutex_init(&async_ctx -> lock, NULL);
+	pthread_cond_init(&async_ctx -> sq_cond, NULL);
+	pthread_cond_init(&async_ctx -> cq_cond, NULL);
+
+	for (unsigned int i = 0; i < async_ctx -> workers_cnt; ++i) {
+		if (pthread_create(async_ctx -> workers + i, NULL, qcow_async_worker, async_ctx) != 0) {
+			async_ctx -> workers_cnt = i;
+			deinit_qcow_async(async_ctx);
+			WARNING_LOG("Failed to spawn the worker %u.\n", i);
+			return -QCOW_IO_ERROR;
+		}
+	}
+
+#ifdef _QCOW_ASYNC_URING_
+	init_qcow_uring(async_ctx);
+#endif //_QCOW_ASYNC_URING_
+
+	return QCOW_NO_ERROR;
+}
+
+/// NOTE: pending requests are completed before the workers and the reaper are joined, but their completions are discarded.
+void deinit_qcow_async(qcow_async_ctx_t* async_ctx) {
+	if (async_ctx == NULL || async_ctx -> workers == NULL) return;
+
+	pthread_mutex_lock(&async_ctx -> lock);
+	async_ctx -> stop = TRUE;
+	pthread_cond_broadcast(&async_ctx -> sq_cond);
+#ifdef _QCOW_ASYNC_URING_
+	if (async_ctx -> ring != NULL) {
+		qcow_uring_queue(async_ctx, IORING_OP_NOP, NULL);
+		qcow_uring_submit(async_ctx -> ring);
+	}
+#endif //_QCOW_ASYNC_URING_
+	pthread_mutex_unlock(&async_ctx -> lock);
+
+	for (unsigned int i = 0; i < async_ctx -> workers_cnt; ++i) pthread_join(async_ctx -> workers[i], NULL);
+#ifdef _QCOW_ASYNC_URING_
+	deinit_qcow_uring(async_ctx);
+#endif //_QCOW_ASYNC_URING_
+
+	pthread_mutex_destroy(&async_ctx -> lock);
+	pthread_cond_destroy(&async_ctx -> sq_cond);
+	pthread_cond_destroy(&async_ctx -> cq_cond);
+
+	QCOW_MULTI_FREE(async_ctx -> workers, async_ctx -> cq);
+	async_ctx -> workers = NULL;
+	async_ctx -> cq = NULL;
+
+	return;
+}
+
+/// NOTE: the ptr must stay valid until the completion with the given user_data has been reaped.
+int qread_async(qcow_async_ctx_t* async_ctx, void* ptr, size_t size, size_t nmemb, u64 offset, u64 user_data) {
+	return submit_async_request(async_ctx, QCOW_ASYNC_READ, (u8*) ptr, (u64) size * nmemb, offset, user_data);
+}
+
+/// NOTE: the data must stay valid until the completion with the given user_data has been reaped.
+int qwrite_async(qcow_async_ctx_t* async_ctx, const void* data, size_t size, size_t nmemb, u64 offset, u64 user_data) {
+	return submit_async_request(async_ctx, QCOW_ASYNC_WRITE, (u8*) data, (u64) size * nmemb, offset, user_data);
+}
+
+/// NOTE: blocks until at least min_completions requests (clamped to the inflight ones) have completed,
+///       and returns the number of completions copied in the completions array.
+int qwait_async(qcow_async_ctx_t* async_ctx, qcow_completion_t* completions, unsigned int min_completions, unsigned int max_completions) {
+	if (async_ctx == NULL || completions == NULL) return -QCOW_INVALID_PARAMETERS;
+
+	pthread_mutex_lock(&async_ctx -> lock);
+
+	min_completions = MIN(MIN(min_completions, max_completions), async_ctx -> inflight);
+	while (async_ctx -> cq_cnt < min_completions) pthread_cond_wait(&async_ctx -> cq_cond, &async_ctx -> lock);
+
+	unsigned int reaped = 0;
+	for (; reaped < max_completions && async_ctx -> cq_cnt > 0; ++reaped) {
+		completions[reaped] = async_ctx -> cq[async_ctx -> cq_head];
+		async_ctx -> cq_head = (async_ctx -> cq_head + 1) % async_ctx -> queue_depth;
+		async_ctx -> cq_cnt--;
+		async_ctx -> inflight--;
+	}
+
+	pthread_mutex_unlock(&async_ctx -> lock);
+
+	return reaped;
+}
+
+#endif //_QCOW_ASYNC_H_
+
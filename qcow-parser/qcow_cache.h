@@ -0,0 +1,570 @@
+/*
+ * Copyright (C) 2025 TheProgxy <theprogxy@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _QCOW_CACHE_H_
+#define _QCOW_CACHE_H_
+
+#include <pthread.h>
+#include "../common/utils.h"
+#include "./qcow_io.h"
+
+/* -------------------------------------------------------------------------------------------------------- */
+// -----------------
+//  Constant Values
+// -----------------
+typedef enum {
+	QCOW_DEFAULT_L2_CACHE_SIZE       = 1024 * 1024,
+	QCOW_DEFAULT_REFCOUNT_CACHE_SIZE = 256 * 1024,
+	QCOW_DEFAULT_CLUSTER_CACHE_SIZE  = 4 * 1024 * 1024,
+	QCOW_CLUSTER_CACHE_SHARDS        = 16,
+	QCOW_CHAIN_CACHE_ENTRIES         = 4096
+} QCowCacheConstants;
+
+typedef enum QCowChainOwner {
+	QCOW_CHAIN_ZEROS,
+	QCOW_CHAIN_LAYER,
+	QCOW_CHAIN_RAW,
+	QCOW_CHAIN_DELEGATE
+} QCowChainOwner;
+
+/* -------------------------------------------------------------------------------------------------------- */
+// ---------
+//  Structs
+// ---------
+typedef struct qcow_cache_slot_t {
+	u8* table;
+	u64 offset;
+	u32 index;
+	bool referenced;
+	bool dirty;
+} qcow_cache_slot_t;
+
+/// NOTE: The cache holds a bounded number of metadata tables, each one cluster wide, in their on-disk (big-endian) format.
+///       Tables are identified by their index in the parent table (e.g. the l1_index for the l2 tables), which is
+///       mapped to the slot holding it through index_slots, while the victims are chosen with the CLOCK algorithm.
+///       Dirty tables are written back only when evicted or flushed, and if the cache has a dependency,
+///       the dirty tables of the dependency are written back and synced first (e.g. refcounts before l2 entries).
+///       The unsynced flag tracks the tables written back since the last sync, so that those written back on eviction,
+///       or by an explicit flush of the dependency, are still synced before any table of the dependent cache is written.
+typedef struct qcow_cache_t qcow_cache_t;
+
+struct qcow_cache_t {
+	qcow_io_t* file;
+	qcow_cache_t* dependency;
+	qcow_cache_slot_t* slots;
+	u32 slots_cnt;
+	u32 clock_hand;
+	u32 dirty_cnt;
+	bool unsynced;
+	u32* index_slots;
+	u32 indexes_cnt;
+	u64 table_size;
+	pthread_mutex_t lock;
+};
+
+typedef struct qcow_cluster_cache_entry_t {
+	const qcow_io_t* file;
+	u64 offset;
+	u8* cluster;
+	u32 cluster_size;
+	u64 last_use;
+} qcow_cluster_cache_entry_t;
+
+typedef struct qcow_cluster_cache_shard_t {
+	qcow_cluster_cache_entry_t* entries;
+	u32 entries_cnt;
+	u64 clock;
+	u64 hits;
+	u64 misses;
+	pthread_mutex_t lock;
+} qcow_cluster_cache_shard_t;
+
+/// NOTE: The cluster cache holds decompressed clusters, keyed by the file and the host offset of the compressed data,
+///       and it is split in QCOW_CLUSTER_CACHE_SHARDS shards, each with its own lock and its own LRU eviction,
+///       so that threads reading different clusters rarely contend. The entries are never dirty, as writes to a
+///       compressed cluster simply drop it from the cache.
+typedef struct qcow_cluster_cache_t {
+	qcow_cluster_cache_shard_t shards[QCOW_CLUSTER_CACHE_SHARDS];
+} qcow_cluster_cache_t;
+
+/// NOTE: The owner of a guest cluster within the backing chain, where layer is the qcow_ctx owning the cluster
+///       (or the one whose raw backing file holds it), l2_entry its l2 entry in that layer, and limit the guest offset
+///       past which the chain reads as zeros, as each layer can be smaller than the one above it.
+typedef struct qcow_chain_cache_entry_t {
+	u64 tag;
+	struct qcow_ctx_t* layer;
+	u64 l2_entry;
+	u64 limit;
+	QCowChainOwner owner;
+} qcow_chain_cache_entry_t;
+
+/// NOTE: The chain cache remembers which layer of the backing chain owns each guest cluster, so that a read falling through
+///       the top image costs a single lookup instead of walking every layer. It is direct-mapped on the guest cluster,
+///       and it never needs to be invalidated, as the backing layers are read-only, while the top image is always checked first.
+typedef struct qcow_chain_cache_t {
+	qcow_chain_cache_entry_t entries[QCOW_CHAIN_CACHE_ENTRIES];
+	u64 hits;
+	u64 misses;
+	pthread_mutex_t lock;
+} qcow_chain_cache_t;
+
+typedef struct qcow_cache_stats_t {
+	u64 hits;
+	u64 misses;
+	u64 cached_clusters;
+	u64 chain_hits;
+	u64 chain_misses;
+} qcow_cache_stats_t;
+
+/* -------------------------------------------------------------------------------------------------------- */
+// ------------------------
+//  Functions Declarations
+// ------------------------
+static int init_qcow_cache(qcow_cache_t** cache, qcow_io_t* file, u64 table_size, u32 indexes_cnt, u64 cache_size);
+static int deinit_qcow_cache(qcow_cache_t* cache);
+static void qcow_cache_set_dependency(qcow_cache_t* cache, qcow_cache_t* dependency);
+static int qcow_cache_write_back(qcow_cache_t* cache, qcow_cache_slot_t* slot);
+static int qcow_cache_flush_locked(qcow_cache_t* cache);
+static int qcow_cache_flush_dependency(qcow_cache_t* cache);
+static int qcow_cache_evict(qcow_cache_t* cache, qcow_cache_slot_t** slot);
+static int qcow_cache_lookup(qcow_cache_t* cache, u32 index, u64 offset, bool load, qcow_cache_slot_t** slot);
+static int qcow_cache_read(qcow_cache_t* cache, u32 index, u64 offset, u64 pos, void* data, u64 size);
+static int qcow_cache_write(qcow_cache_t* cache, u32 index, u64 offset, u64 pos, const void* data, u64 size);
+static int qcow_cache_new_table(qcow_cache_t* cache, u32 index, u64 offset);
+static void qcow_cache_discard(qcow_cache_t* cache, u32 index);
+static int qcow_cache_flush(qcow_cache_t* cache);
+static int qcow_cache_sync(qcow_cache_t* cache);
+static int init_qcow_cluster_cache(qcow_cluster_cache_t** cache, u64 cluster_size, u64 cache_size);
+static void deinit_qcow_cluster_cache(qcow_cluster_cache_t* cache);
+static inline qcow_cluster_cache_shard_t* qcow_cluster_cache_shard(qcow_cluster_cache_t* cache, u64 offset);
+static bool qcow_cluster_cache_get(qcow_cluster_cache_t* cache, const qcow_io_t* file, u64 offset, u64 pos, void* data, u64 size);
+static void qcow_cluster_cache_put(qcow_cluster_cache_t* cache, const qcow_io_t* file, u64 offset, u8* cluster, u32 cluster_size);
+static void qcow_cluster_cache_drop(qcow_cluster_cache_t* cache, const qcow_io_t* file, u64 offset);
+static void qcow_cluster_cache_stats(qcow_cluster_cache_t* cache, qcow_cache_stats_t* stats);
+static int init_qcow_chain_cache(qcow_chain_cache_t** cache);
+static void deinit_qcow_chain_cache(qcow_chain_cache_t* cache);
+static bool qcow_chain_cache_get(qcow_chain_cache_t* cache, u64 cluster, qcow_chain_cache_entry_t* entry);
+static void qcow_chain_cache_put(qcow_chain_cache_t* cache, u64 cluster, const qcow_chain_cache_entry_t* entry);
+
+/* -------------------------------------------------------------------------------------------------------- */
+/// NOTE: cache_size is the memory budget in bytes, and it is rounded down to a whole number of tables,
+///       keeping at least one slot, and no more slots than the tables that can be cached.
+static int init_qcow_cache(qcow_cache_t** cache, qcow_io_t* file, u64 table_size, u32 indexes_cnt, u64 cache_size) {
+	if ((*cache = (qcow_cache_t*) qcow_calloc(1, sizeof(qcow_cache_t))) == NULL) {
+		WARNING_LOG("Failed to allocate the cache.\n");
+		return -QCOW_IO_ERROR;
+	}
+
+	(*cache) -> file = file;
+	(*cache) -> table_size = table_size;
+	(*cache) -> indexes_cnt = indexes_cnt;
+	(*cache) -> slots_cnt = MAX(MIN(cache_size / table_size, (u64) indexes_cnt), 1ULL);
+
+	// The tables are allocated on first use, so that small images do not pay for the whole budget
+	(*cache) -> slots = (qcow_cache_slot_t*) qcow_calloc((*cache) -> slots_cnt, sizeof(qcow_cache_slot_t));
+	(*cache) -> index_slots = (u32*) qcow_calloc(MAX(indexes_cnt, 1U), sizeof(u32));
+	if ((*cache) -> slots == NULL || (*cache) -> index_slots == NULL) {
+		QCOW_MULTI_FREE((*cache) -> slots, (*cache) -> index_slots, *cache);
+		WARNING_LOG("Failed to allocate the cache slots.\n");
+		return -QCOW_IO_ERROR;
+	}
+
+	pthread_mutex_init(&((*cache) -> lock), NULL);
+
+	DEBUG_LOG("Cache of %u slots, for %u tables of %llu bytes.\n", (*cache) -> slots_cnt, indexes_cnt, table_size);
+
+	return QCOW_NO_ERROR;
+}
+
+/// NOTE: the dirty tables are written back before releasing the cache, and the first error encountered is returned.
+static int deinit_qcow_cache(qcow_cache_t* cache) {
+	if (cache == NULL) return QCOW_NO_ERROR;
+
+	int err = qcow_cache_flush(cache);
+	for (u32 i = 0; i < cache -> slots_cnt; ++i) QCOW_SAFE_FREE(cache -> slots[i].table);
+	pthread_mutex_destroy(&(cache -> lock));
+	QCOW_MULTI_FREE(cache -> slots, cache -> index_slots, cache);
+
+	return err;
+}
+
+/// NOTE: the dependency must outlive the cache, and it must never depend back on it.
+static void qcow_cache_set_dependency(qcow_cache_t* cache, qcow_cache_t* dependency) {
+	pthread_mutex_lock(&(cache -> lock));
+	cache -> dependency = dependency;
+	pthread_mutex_unlock(&(cache -> lock));
+	return;
+}
+
+/// NOTE: the cache lock must be held, and the dependency must have been already flushed.
+static int qcow_cache_write_back(qcow_cache_t* cache, qcow_cache_slot_t* slot) {
+	if (!slot -> dirty) return QCOW_NO_ERROR;
+
+	int err = 0;
+	if ((err = write_at(cache -> file, slot -> offset, slot -> table, sizeof(u8), cache -> table_size)) < 0) {
+		WARNING_LOG("Failed to write back the table %u at pos 0x%llX.\n", slot -> index, slot -> offset);
+		return err;
+	}
+
+	slot -> dirty = FALSE;
+	cache -> dirty_cnt--;
+	cache -> unsynced = TRUE;
+
+	return QCOW_NO_ERROR;
+}
+
+/// NOTE: the cache lock must be held.
+static int qcow_cache_flush_locked(qcow_cache_t* cache) {
+	if (cache -> dirty_cnt == 0) return QCOW_NO_ERROR;
+
+	int err = 0;
+	if ((err = qcow_cache_flush_dependency(cache)) < 0) return err;
+
+	for (u32 i = 0; i < cache -> slots_cnt; ++i) {
+		if (cache -> slots[i].table == NULL) continue;
+		int ret = qcow_cache_write_back(cache, cache -> slots + i);
+		if (err == 0) err = ret;
+	}
+
+	return err;
+}
+
+/// NOTE: the dependency is synced after being flushed, so that its tables are durable before any table of this cache is written.
+static int qcow_cache_flush_dependency(qcow_cache_t* cache) {
+	if (cache -> dependency == NULL) return QCOW_NO_ERROR;
+
+	int err = qcow_cache_sync(cache -> dependency);
+	if (err < 0) WARNING_LOG("Failed to flush the dependency of the cache.\n");
+
+	return err;
+}
+
+static int qcow_cache_evict(qcow_cache_t* cache, qcow_cache_slot_t** slot) {
+	// Each slot gets a second chance: the referenced bit is cleared the first time the hand passes over it
+	qcow_cache_slot_t* victim = NULL;
+	while (victim == NULL) {
+		qcow_cache_slot_t* candidate = cache -> slots + cache -> clock_hand;
+		cache -> clock_hand = (cache -> clock_hand + 1) % cache -> slots_cnt;
+		if (candidate -> table != NULL && candidate -> referenced) candidate -> referenced = FALSE;
+		else victim = candidate;
+	}
+
+	if (victim -> table == NULL) {
+		if ((victim -> table = (u8*) qcow_calloc(cache -> table_size, sizeof(u8))) == NULL) {
+			WARNING_LOG("Failed to allocate the cached table.\n");
+			return -QCOW_IO_ERROR;
+		}
+	} else {
+		int err = 0;
+		if (victim -> dirty && (err = qcow_cache_flush_dependency(cache)) < 0) return err;
+		if ((err = qcow_cache_write_back(cache, victim)) < 0) return err;
+		if (cache -> index_slots[victim -> index] == (u32) (victim - cache -> slots) + 1) cache -> index_slots[victim -> index] = 0;
+	}
+
+	*slot = victim;
+
+	return QCOW_NO_ERROR;
+}
+
+/// NOTE: the cache lock must be held, and if load is FALSE the table is zeroed-out instead of being read from the file.
+static int qcow_cache_lookup(qcow_cache_t* cache, u32 index, u64 offset, bool load, qcow_cache_slot_t** slot) {
+	if (index >= cache -> indexes_cnt) {
+		WARNING_LOG("Invalid table index %u, the cache can hold only %u tables.\n", index, cache -> indexes_cnt);
+		return -QCOW_INVALID_OFFSET;
+	}
+
+	if (cache -> index_slots[index] != 0) {
+		*slot = cache -> slots + cache -> index_slots[index] - 1;
+		(*slot) -> referenced = TRUE;
+		return QCOW_NO_ERROR;
+	}
+
+	int err = 0;
+	qcow_cache_slot_t* new_slot = NULL;
+	if ((err = qcow_cache_evict(cache, &new_slot)) < 0) {
+		WARNING_LOG("Failed to evict a table from the cache.\n");
+		return err;
+	}
+
+	if (!load) mem_set(new_slot -> table, 0, cache -> table_size);
+	else if ((err = read_at(cache -> file, offset, new_slot -> table, sizeof(u8), cache -> table_size)) < 0) {
+		WARNING_LOG("Failed to read the table %u at pos 0x%llX.\n", index, offset);
+		return err;
+	}
+
+	new_slot -> offset = offset;
+	new_slot -> index = index;
+	new_slot -> referenced = TRUE;
+	new_slot -> dirty = FALSE;
+	cache -> index_slots[index] = (new_slot - cache -> slots) + 1;
+	*slot = new_slot;
+
+	return QCOW_NO_ERROR;
+}
+
+static int qcow_cache_read(qcow_cache_t* cache, u32 index, u64 offset, u64 pos, void* data, u64 size) {
+	pthread_mutex_lock(&(cache -> lock));
+
+	int err = 0;
+	qcow_cache_slot_t* slot = NULL;
+	if ((err = qcow_cache_lookup(cache, index, offset, TRUE, &slot)) < 0) {
+		pthread_mutex_unlock(&(cache -> lock));
+		return err;
+	}
+
+	mem_cpy(data, slot -> table + pos, size);
+
+	pthread_mutex_unlock(&(cache -> lock));
+
+	return QCOW_NO_ERROR;
+}
+
+static int qcow_cache_write(qcow_cache_t* cache, u32 index, u64 offset, u64 pos, const void* data, u64 size) {
+	pthread_mutex_lock(&(cache -> lock));
+
+	int err = 0;
+	qcow_cache_slot_t* slot = NULL;
+	if ((err = qcow_cache_lookup(cache, index, offset, TRUE, &slot)) < 0) {
+		pthread_mutex_unlock(&(cache -> lock));
+		return err;
+	}
+
+	mem_cpy(slot -> table + pos, data, size);
+	if (!slot -> dirty) cache -> dirty_cnt++;
+	slot -> dirty = TRUE;
+
+	pthread_mutex_unlock(&(cache -> lock));
+
+	return QCOW_NO_ERROR;
+}
+
+/// NOTE: used for freshly allocated tables, which are already zeroed-out on disk, hence there is nothing to read.
+static int qcow_cache_new_table(qcow_cache_t* cache, u32 index, u64 offset) {
+	pthread_mutex_lock(&(cache -> lock));
+
+	qcow_cache_slot_t* slot = NULL;
+	int err = qcow_cache_lookup(cache, index, offset, FALSE, &slot);
+
+	pthread_mutex_unlock(&(cache -> lock));
+
+	if (err < 0) WARNING_LOG("Failed to insert the new table %u in the cache.\n", index);
+
+	return err;
+}
+
+/// NOTE: the table is dropped without being written back, used when the table itself is deallocated.
+static void qcow_cache_discard(qcow_cache_t* cache, u32 index) {
+	pthread_mutex_lock(&(cache -> lock));
+	
+	if (index < cache -> indexes_cnt && cache -> index_slots[index] != 0) {
+		qcow_cache_slot_t* slot = cache -> slots + cache -> index_slots[index] - 1;
+		if (slot -> dirty) cache -> dirty_cnt--;
+		slot -> dirty = FALSE;
+		slot -> referenced = FALSE;
+		cache -> index_slots[index] = 0;
+	}
+
+	pthread_mutex_unlock(&(cache -> lock));
+
+	return;
+}
+
+static int qcow_cache_flush(qcow_cache_t* cache) {
+	pthread_mutex_lock(&(cache -> lock));
+	int err = qcow_cache_flush_locked(cache);
+	pthread_mutex_unlock(&(cache -> lock));
+	return err;
+}
+
+/// NOTE: flushes the dirty tables and syncs the ones written back since the last sync, so that the metadata
+///       written outside of the caches (e.g. the l1 entries) can point to the tables they count.
+static int qcow_cache_sync(qcow_cache_t* cache) {
+	pthread_mutex_lock(&(cache -> lock));
+	int err = qcow_cache_flush_locked(cache);
+	if (err == 0 && cache -> unsynced && (err = fsync_file(cache -> file)) == 0) cache -> unsynced = FALSE;
+	pthread_mutex_unlock(&(cache -> lock));
+	return err;
+}
+
+/// NOTE: cache_size is the memory budget in bytes, split evenly among the shards, each holding at least one cluster.
+static int init_qcow_cluster_cache(qcow_cluster_cache_t** cache, u64 cluster_size, u64 cache_size) {
+	if ((*cache = (qcow_cluster_cache_t*) qcow_calloc(1, sizeof(qcow_cluster_cache_t))) == NULL) {
+		WARNING_LOG("Failed to allocate the cluster cache.\n");
+		return -QCOW_IO_ERROR;
+	}
+
+	const u32 entries_cnt = MAX(cache_size / cluster_size / QCOW_CLUSTER_CACHE_SHARDS, 1ULL);
+	for (u32 i = 0; i < QCOW_CLUSTER_CACHE_SHARDS; ++i) {
+		qcow_cluster_cache_shard_t* shard = (*cache) -> shards + i;
+		if ((shard -> entries = (qcow_cluster_cache_entry_t*) qcow_calloc(entries_cnt, sizeof(qcow_cluster_cache_entry_t))) == NULL) {
+			for (u32 j = 0; j < i; ++j) pthread_mutex_destroy(&((*cache) -> shards[j].lock));
+			for (u32 j = 0; j < i; ++j) QCOW_SAFE_FREE((*cache) -> shards[j].entries);
+			QCOW_SAFE_FREE(*cache);
+			WARNING_LOG("Failed to allocate the cluster cache entries.\n");
+			return -QCOW_IO_ERROR;
+		}
+		shard -> entries_cnt = entries_cnt;
+		pthread_mutex_init(&(shard -> lock), NULL);
+	}
+
+	DEBUG_LOG("Cluster cache of %u shards with %u entries each.\n", QCOW_CLUSTER_CACHE_SHARDS, entries_cnt);
+
+	return QCOW_NO_ERROR;
+}
+
+static void deinit_qcow_cluster_cache(qcow_cluster_cache_t* cache) {
+	if (cache == NULL) return;
+
+	for (u32 i = 0; i < QCOW_CLUSTER_CACHE_SHARDS; ++i) {
+		qcow_cluster_cache_shard_t* shard = cache -> shards + i;
+		for (u32 j = 0; j < shard -> entries_cnt; ++j) QCOW_SAFE_FREE(shard -> entries[j].cluster);
+		QCOW_SAFE_FREE(shard -> entries);
+		pthread_mutex_destroy(&(shard -> lock));
+	}
+
+	QCOW_SAFE_FREE(cache);
+
+	return;
+}
+
+static inline qcow_cluster_cache_shard_t* qcow_cluster_cache_shard(qcow_cluster_cache_t* cache, u64 offset) {
+	// Compressed clusters are sector aligned, hence the low bits carry no information
+	const u64 hash = (offset >> 9) * 0x9E3779B97F4A7C15ULL;
+	return cache -> shards + (hash >> 60) % QCOW_CLUSTER_CACHE_SHARDS;
+}
+
+/// NOTE: on a hit size bytes starting at pos within the decompressed cluster are copied to data, under the shard lock.
+static bool qcow_cluster_cache_get(qcow_cluster_cache_t* cache, const qcow_io_t* file, u64 offset, u64 pos, void* data, u64 size) {
+	qcow_cluster_cache_shard_t* shard = qcow_cluster_cache_shard(cache, offset);
+	pthread_mutex_lock(&(shard -> lock));
+
+	for (u32 i = 0; i < shard -> entries_cnt; ++i) {
+		qcow_cluster_cache_entry_t* entry = shard -> entries + i;
+		if (entry -> cluster == NULL || entry -> file != file || entry -> offset != offset) continue;
+		else if (pos + size > entry -> cluster_size) break;
+		
+		mem_cpy(data, entry -> cluster + pos, size);
+		entry -> last_use = ++(shard -> clock);
+		shard -> hits++;
+		pthread_mutex_unlock(&(shard -> lock));
+		return TRUE;
+	}
+
+	shard -> misses++;
+	pthread_mutex_unlock(&(shard -> lock));
+
+	return FALSE;
+}
+
+/// NOTE: the cache takes ownership of the cluster buffer, replacing the least recently used entry of the shard,
+///       where the empty entries always come first, as their last_use is 0.
+static void qcow_cluster_cache_put(qcow_cluster_cache_t* cache, const qcow_io_t* file, u64 offset, u8* cluster, u32 cluster_size) {
+	qcow_cluster_cache_shard_t* shard = qcow_cluster_cache_shard(cache, offset);
+	pthread_mutex_lock(&(shard -> lock));
+
+	qcow_cluster_cache_entry_t* victim = shard -> entries;
+	for (u32 i = 0; i < shard -> entries_cnt; ++i) {
+		qcow_cluster_cache_entry_t* entry = shard -> entries + i;
+		if (entry -> cluster != NULL && entry -> file == file && entry -> offset == offset) {
+			victim = entry;
+			break;
+		} else if (entry -> last_use < victim -> last_use) victim = entry;
+	}
+
+	QCOW_SAFE_FREE(victim -> cluster);
+	*victim = (qcow_cluster_cache_entry_t) { .file = file, .offset = offset, .cluster = cluster, .cluster_size = cluster_size, .last_use = ++(shard -> clock) };
+
+	pthread_mutex_unlock(&(shard -> lock));
+
+	return;
+}
+
+static void qcow_cluster_cache_drop(qcow_cluster_cache_t* cache, const qcow_io_t* file, u64 offset) {
+	qcow_cluster_cache_shard_t* shard = qcow_cluster_cache_shard(cache, offset);
+	pthread_mutex_lock(&(shard -> lock));
+	
+	for (u32 i = 0; i < shard -> entries_cnt; ++i) {
+		qcow_cluster_cache_entry_t* entry = shard -> entries + i;
+		if (entry -> cluster == NULL || entry -> file != file || entry -> offset != offset) continue;
+		QCOW_SAFE_FREE(entry -> cluster);
+		entry -> last_use = 0;
+	}
+
+	pthread_mutex_unlock(&(shard -> lock));
+
+	return;
+}
+
+static void qcow_cluster_cache_stats(qcow_cluster_cache_t* cache, qcow_cache_stats_t* stats) {
+	*stats = (qcow_cache_stats_t) {0};
+	for (u32 i = 0; i < QCOW_CLUSTER_CACHE_SHARDS; ++i) {
+		qcow_cluster_cache_shard_t* shard = cache -> shards + i;
+		pthread_mutex_lock(&(shard -> lock));
+		stats -> hits += shard -> hits;
+		stats -> misses += shard -> misses;
+		for (u32 j = 0; j < shard -> entries_cnt; ++j) stats -> cached_clusters += (shard -> entries[j].cluster != NULL);
+		pthread_mutex_unlock(&(shard -> lock));
+	}
+
+	return;
+}
+
+static int init_qcow_chain_cache(qcow_chain_cache_t** cache) {
+	if ((*cache = (qcow_chain_cache_t*) qcow_calloc(1, sizeof(qcow_chain_cache_t))) == NULL) {
+		WARNING_LOG("Failed to allocate the chain cache.\n");
+		return -QCOW_IO_ERROR;
+	}
+
+	pthread_mutex_init(&((*cache) -> lock), NULL);
+
+	return QCOW_NO_ERROR;
+}
+
+static void deinit_qcow_chain_cache(qcow_chain_cache_t* cache) {
+	if (cache == NULL) return;
+	pthread_mutex_destroy(&(cache -> lock));
+	QCOW_SAFE_FREE(cache);
+	return;
+}
+
+/// NOTE: the entries are tagged with the guest cluster plus one, so that the zeroed-out entries never match.
+static bool qcow_chain_cache_get(qcow_chain_cache_t* cache, u64 cluster, qcow_chain_cache_entry_t* entry) {
+	pthread_mutex_lock(&(cache -> lock));
+	
+	const qcow_chain_cache_entry_t* slot = cache -> entries + (cluster % QCOW_CHAIN_CACHE_ENTRIES);
+	const bool hit = (slot -> tag == cluster + 1);
+	if (hit) {
+		*entry = *slot;
+		cache -> hits++;
+	} else cache -> misses++;
+	
+	pthread_mutex_unlock(&(cache -> lock));
+
+	return hit;
+}
+
+static void qcow_chain_cache_put(qcow_chain_cache_t* cache, u64 cluster, const qcow_chain_cache_entry_t* entry) {
+	pthread_mutex_lock(&(cache -> lock));
+	qcow_chain_cache_entry_t* slot = cache -> entries + (cluster % QCOW_CHAIN_CACHE_ENTRIES);
+	*slot = *entry;
+	slot -> tag = cluster + 1;
+	pthread_mutex_unlock(&(cache -> lock));
+	return;
+}
+
+#endif //_QCOW_CACHE_H_
+
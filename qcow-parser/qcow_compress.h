@@ -0,0 +1,267 @@
+/*
+ * Copyright (C) 2025 TheProgxy <theprogxy@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _QCOW_COMPRESS_H_
+#define _QCOW_COMPRESS_H_
+
+#include <pthread.h>
+#include <unistd.h>
+#include "./qcow_parser.h"
+
+/* -------------------------------------------------------------------------------------------------------- */
+// -----------------
+//  Constant Values
+// -----------------
+typedef enum {
+	QCOW_COMPRESS_DEFAULT_WORKERS     = 4,
+	QCOW_COMPRESS_JOBS_PER_WORKER     = 4,
+	QCOW_COMPRESS_MIN_QUEUE_DEPTH     = 16
+} QCowCompressConstants;
+
+/* -------------------------------------------------------------------------------------------------------- */
+// ---------
+//  Structs
+// ---------
+typedef struct qcow_compress_job_t {
+	u8* cluster;
+	u8* compressed_cluster;
+	unsigned int compressed_cluster_size;
+	u64 offset;
+	int ret;
+	bool is_zero;
+	bool done;
+} qcow_compress_job_t;
+
+/// NOTE: The jobs are a ring of queue_depth slots, where the clusters in [head, next) are being compressed by the workers,
+///       and the ones in [next, tail) are waiting for a worker, while the submitting thread appends the compressed clusters
+///       to the image strictly in the order they have been queued, starting from the head, so that the image layout
+///       does not depend on the scheduling of the workers.
+typedef struct qcow_compress_ctx_t {
+	qcow_ctx_t* qcow_ctx;
+	pthread_t* workers;
+	unsigned int workers_cnt;
+	pthread_mutex_t lock;
+	pthread_cond_t job_cond;
+	pthread_cond_t done_cond;
+	qcow_compress_job_t* jobs;
+	unsigned int queue_depth;
+	u64 head;
+	u64 next;
+	u64 tail;
+	int ret;
+	bool stop;
+} qcow_compress_ctx_t;
+
+/* -------------------------------------------------------------------------------------------------------- */
+// ------------------------
+//  Functions Declarations
+// ------------------------
+static void* qcow_compress_worker(void* arg);
+static int append_compress_job(qcow_compress_ctx_t* compress_ctx, qcow_compress_job_t* job);
+static int reap_compress_job(qcow_compress_ctx_t* compress_ctx);
+int init_qcow_compress(qcow_compress_ctx_t* compress_ctx, qcow_ctx_t* qcow_ctx, unsigned int workers_cnt, unsigned int queue_depth);
+void deinit_qcow_compress(qcow_compress_ctx_t* compress_ctx);
+int qwrite_compress(qcow_compress_ctx_t* compress_ctx, const void* data, u64 size, u64 offset);
+int qflush_compress(qcow_compress_ctx_t* compress_ctx);
+
+/* -------------------------------------------------------------------------------------------------------- */
+static void* qcow_compress_worker(void* arg) {
+	qcow_compress_ctx_t* compress_ctx = (qcow_compress_ctx_t*) arg;
+	const u64 cluster_size = compress_ctx -> qcow_ctx -> cluster_size;
+
+	// Without a backing file the clusters made only of zeros can be left unallocated
+	const bool skip_zeros = (compress_ctx -> qcow_ctx -> backing_file_name_size == 0);
+
+	while (TRUE) {
+		pthread_mutex_lock(&compress_ctx -> lock);
+		while (compress_ctx -> next == compress_ctx -> tail && !compress_ctx -> stop) pthread_cond_wait(&compress_ctx -> job_cond, &compress_ctx -> lock);
+
+		if (compress_ctx -> next == compress_ctx -> tail) {
+			pthread_mutex_unlock(&compress_ctx -> lock);
+			break;
+		}
+
+		qcow_compress_job_t* job = compress_ctx -> jobs + (compress_ctx -> next++ % compress_ctx -> queue_depth);
+		pthread_mutex_unlock(&compress_ctx -> lock);
+
+		job -> is_zero = skip_zeros;
+		for (u64 i = 0; job -> is_zero && i < cluster_size; ++i) job -> is_zero = (job -> cluster[i] == 0);
+		if (!job -> is_zero) job -> ret = qcompress_cluster(compress_ctx -> qcow_ctx, job -> cluster, &job -> compressed_cluster, &job -> compressed_cluster_size);
+
+		pthread_mutex_lock(&compress_ctx -> lock);
+		job -> done = TRUE;
+		pthread_cond_broadcast(&compress_ctx -> done_cond);
+		pthread_mutex_unlock(&compress_ctx -> lock);
+	}
+
+	return NULL;
+}
+
+/// NOTE: the clusters not shrinking below the cluster size are stored uncompressed, as a compressed cluster
+///       must fit within a cluster, while the data past the end of the disk is never written.
+static int append_compress_job(qcow_compress_ctx_t* compress_ctx, qcow_compress_job_t* job) {
+	qcow_ctx_t* qcow_ctx = compress_ctx -> qcow_ctx;
+
+	int err = job -> ret;
+	if (err < 0) WARNING_LOG("Failed to compress the cluster at LBA 0x%llX.\n", job -> offset);
+	else if (job -> is_zero) err = QCOW_NO_ERROR;
+	else if (job -> compressed_cluster_size < qcow_ctx -> cluster_size) err = qwrite_compressed(qcow_ctx, job -> compressed_cluster, job -> compressed_cluster_size, job -> offset);
+	else err = qwrite(job -> cluster, sizeof(u8), MIN(qcow_ctx -> cluster_size, qcow_ctx -> size - job -> offset), job -> offset, qcow_ctx);
+
+	QCOW_MULTI_FREE(job -> cluster, job -> compressed_cluster);
+	job -> cluster = NULL;
+	job -> compressed_cluster = NULL;
+
+	return err;
+}
+
+/// NOTE: only the submitting thread reaps the jobs, hence the head is advanced outside of the lock,
+///       as the workers never access the slots preceding next.
+static int reap_compress_job(qcow_compress_ctx_t* compress_ctx) {
+	qcow_compress_job_t* job = compress_ctx -> jobs + (compress_ctx -> head % compress_ctx -> queue_depth);
+
+	pthread_mutex_lock(&compress_ctx -> lock);
+	while (!job -> done) pthread_cond_wait(&compress_ctx -> done_cond, &compress_ctx -> lock);
+	pthread_mutex_unlock(&compress_ctx -> lock);
+
+	int err = append_compress_job(compress_ctx, job);
+	if (err < 0 && compress_ctx -> ret == QCOW_NO_ERROR) compress_ctx -> ret = err;
+
+	compress_ctx -> head++;
+
+	return err;
+}
+
+/// NOTE: the number of workers defaults to the online cores, as the compression is the bottleneck of the pipeline,
+///       and the qcow_ctx must stay valid, and should not be written by anyone else, until deinit_qcow_compress has returned.
+int init_qcow_compress(qcow_compress_ctx_t* compress_ctx, qcow_ctx_t* qcow_ctx, unsigned int workers_cnt, unsigned int queue_depth) {
+	if (compress_ctx == NULL || qcow_ctx == NULL) return -QCOW_INVALID_PARAMETERS;
+	else if (qcow_ctx -> read_only) {
+		WARNING_LOG("Cannot write to an image opened read-only.\n");
+		return -QCOW_READ_ONLY_IMAGE;
+	}
+
+	const long int cores_cnt = sysconf(_SC_NPROCESSORS_ONLN);
+
+	mem_set(compress_ctx, 0, sizeof(qcow_compress_ctx_t));
+	compress_ctx -> qcow_ctx = qcow_ctx;
+	compress_ctx -> workers_cnt = workers_cnt ? workers_cnt : ((cores_cnt > 0) ? (unsigned int) cores_cnt : QCOW_COMPRESS_DEFAULT_WORKERS);
+	compress_ctx -> queue_depth = queue_depth ? queue_depth : MAX(compress_ctx -> workers_cnt * QCOW_COMPRESS_JOBS_PER_WORKER, (unsigned int) QCOW_COMPRESS_MIN_QUEUE_DEPTH);
+
+	compress_ctx -> jobs = (qcow_compress_job_t*) qcow_calloc(compress_ctx -> queue_depth, sizeof(qcow_compress_job_t));
+	if (compress_ctx -> jobs == NULL) {
+		WARNING_LOG("Failed to allocate the compression jobs.\n");
+		return -QCOW_IO_ERROR;
+	}
+
+	compress_ctx -> workers = (pthread_t*) qcow_calloc(compress_ctx -> workers_cnt, sizeof(pthread_t));
+	if (compress_ctx -> workers == NULL) {
+		QCOW_SAFE_FREE(compress_ctx -> jobs);
+		WARNING_LOG("Failed to allocate the workers.\n");
+		return -QCOW_IO_ERROR;
+	}
+
+	pthread_mutex_init(&compress_ctx -> lock, NULL);
+	pthread_cond_init(&compress_ctx -> job_cond, NULL);
+	pthread_cond_init(&compress_ctx -> done_cond, NULL);
+
+	for (unsigned int i = 0; i < compress_ctx -> workers_cnt; ++i) {
+		if (pthread_create(compress_ctx -> workers + i, NULL, qcow_compress_worker, compress_ctx) != 0) {
+			compress_ctx -> workers_cnt = i;
+			deinit_qcow_compress(compress_ctx);
+			WARNING_LOG("Failed to spawn the worker %u.\n", i);
+			return -QCOW_IO_ERROR;
+		}
+	}
+
+	return QCOW_NO_ERROR;
+}
+
+/// NOTE: the clusters still queued are discarded, hence qflush_compress should be called first.
+void deinit_qcow_compress(qcow_compress_ctx_t* compress_ctx) {
+	if (compress_ctx == NULL || compress_ctx -> workers == NULL) return;
+
+	pthread_mutex_lock(&compress_ctx -> lock);
+	compress_ctx -> stop = TRUE;
+	pthread_cond_broadcast(&compress_ctx -> job_cond);
+	pthread_mutex_unlock(&compress_ctx -> lock);
+
+	for (unsigned int i = 0; i < compress_ctx -> workers_cnt; ++i) pthread_join(compress_ctx -> workers[i], NULL);
+
+	for (unsigned int i = 0; i < compress_ctx -> queue_depth; ++i) QCOW_MULTI_FREE(compress_ctx -> jobs[i].cluster, compress_ctx -> jobs[i].compressed_cluster);
+
+	pthread_mutex_destroy(&compress_ctx -> lock);
+	pthread_cond_destroy(&compress_ctx -> job_cond);
+	pthread_cond_destroy(&compress_ctx -> done_cond);
+
+	QCOW_MULTI_FREE(compress_ctx -> workers, compress_ctx -> jobs);
+	compress_ctx -> workers = NULL;
+	compress_ctx -> jobs = NULL;
+
+	return;
+}
+
+/// NOTE: the data is split in clusters, copied, and queued to the workers, blocking only while the ring is full,
+///       hence the offset must be cluster aligned, as must be the size unless the data reaches the end of the disk.
+///       The returned error may belong to a cluster queued by a previous call, as the clusters are appended asynchronously.
+int qwrite_compress(qcow_compress_ctx_t* compress_ctx, const void* data, u64 size, u64 offset) {
+	if (compress_ctx == NULL || data == NULL) return -QCOW_INVALID_PARAMETERS;
+
+	qcow_ctx_t* qcow_ctx = compress_ctx -> qcow_ctx;
+	if (!IS_CLUSTER_ALIGNED(offset, qcow_ctx -> cluster_size) || (!IS_CLUSTER_ALIGNED(size, qcow_ctx -> cluster_size) && offset + size != qcow_ctx -> size)) {
+		WARNING_LOG("The range 0x%llX-0x%llX is not cluster aligned.\n", offset, offset + size);
+		return -QCOW_UNALIGNED_CLUSTER;
+	} else if (offset + size > qcow_ctx -> size) {
+		WARNING_LOG("The range 0x%llX-0x%llX is past the end of the disk.\n", offset, offset + size);
+		return -QCOW_INVALID_OFFSET;
+	}
+
+	for (u64 queued = 0; queued < size && compress_ctx -> ret == QCOW_NO_ERROR; queued += qcow_ctx -> cluster_size) {
+		if (compress_ctx -> tail - compress_ctx -> head == compress_ctx -> queue_depth) reap_compress_job(compress_ctx);
+
+		qcow_compress_job_t* job = compress_ctx -> jobs + (compress_ctx -> tail % compress_ctx -> queue_depth);
+		if ((job -> cluster = (u8*) qcow_calloc(qcow_ctx -> cluster_size, sizeof(u8))) == NULL) {
+			WARNING_LOG("Failed to allocate the cluster to compress.\n");
+			compress_ctx -> ret = -QCOW_IO_ERROR;
+			break;
+		}
+
+		mem_cpy(job -> cluster, QCOW_CAST_PTR(data, u8) + queued, MIN(size - queued, qcow_ctx -> cluster_size));
+		job -> compressed_cluster = NULL;
+		job -> compressed_cluster_size = 0;
+		job -> offset = offset + queued;
+		job -> ret = QCOW_NO_ERROR;
+		job -> is_zero = FALSE;
+		job -> done = FALSE;
+
+		pthread_mutex_lock(&compress_ctx -> lock);
+		compress_ctx -> tail++;
+		pthread_cond_signal(&compress_ctx -> job_cond);
+		pthread_mutex_unlock(&compress_ctx -> lock);
+	}
+
+	return compress_ctx -> ret;
+}
+
+/// NOTE: waits for every queued cluster to be appended, and returns the first error met since the initialization.
+int qflush_compress(qcow_compress_ctx_t* compress_ctx) {
+	if (compress_ctx == NULL) return -QCOW_INVALID_PARAMETERS;
+	while (compress_ctx -> head != compress_ctx -> tail) reap_compress_job(compress_ctx);
+	return compress_ctx -> ret;
+}
+
+#endif //_QCOW_COMPRESS_H_
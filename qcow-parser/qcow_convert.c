@@ -0,0 +1,537 @@
+/*
+ * Copyright (C) 2025 TheProgxy <theprogxy@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+
+#define _QCOW_PRINTING_UTILS_
+#define _QCOW_UTILS_IMPLEMENTATION_
+#define _QCOW_SPECIAL_TYPE_SUPPORT_
+#include "./qcow_async.h"
+#include "./qcow_compress.h"
+
+/* -------------------------------------------------------------------------------------------------------- */
+// -----------------
+//  Constant Values
+// -----------------
+typedef enum {
+	CONVERT_CHUNK_SIZE    = 1024 * 1024,
+	CONVERT_QUEUE_DEPTH   = 16,
+	CONVERT_EXTENTS_CNT   = 64,
+	CONVERT_CLUSTER_BITS  = 16,
+	CONVERT_HEADER_LENGTH = 112
+} ConvertConstants;
+
+/* -------------------------------------------------------------------------------------------------------- */
+// ---------
+//  Structs
+// ---------
+typedef struct convert_slot_t {
+	u8* buffer;
+	u64 offset;
+	u64 size;
+	bool busy;
+} convert_slot_t;
+
+/// NOTE: The conversion is a pipeline, where the async workers read (and decompress) or write the qcow image,
+///       while the main thread walks the allocated extents, and reads or writes the raw file,
+///       with up to CONVERT_QUEUE_DEPTH chunks in flight, each one owning its slot buffer until it is reaped.
+typedef struct convert_ctx_t {
+	qcow_async_ctx_t async_ctx;
+	convert_slot_t slots[CONVERT_QUEUE_DEPTH];
+	u64 chunk_size;
+	int raw_fd;
+	QCowAsyncOp op;
+	u64 data_bytes;
+	u64 skipped_bytes;
+} convert_ctx_t;
+
+/* -------------------------------------------------------------------------------------------------------- */
+static bool is_zero_buffer(const u8* buffer, u64 size) {
+	for (u64 i = 0; i < size; ++i) {
+		if (buffer[i]) return FALSE;
+	}
+	return TRUE;
+}
+
+static int pwrite_all(int fd, const u8* data, u64 size, u64 offset) {
+	for (u64 written = 0; written < size;) {
+		ssize_t ret = pwrite(fd, data + written, size - written, offset + written);
+		if (ret < 0 && errno == EINTR) continue;
+		else if (ret <= 0) {
+			PERROR_LOG("Failed to write %llu bytes at pos 0x%llX", size - written, offset + written);
+			return -QCOW_IO_ERROR;
+		}
+		written += ret;
+	}
+
+	return QCOW_NO_ERROR;
+}
+
+static int pread_all(int fd, u8* data, u64 size, u64 offset) {
+	for (u64 bytes_read = 0; bytes_read < size;) {
+		ssize_t ret = pread(fd, data + bytes_read, size - bytes_read, offset + bytes_read);
+		if (ret < 0 && errno == EINTR) continue;
+		else if (ret <= 0) {
+			PERROR_LOG("Failed to read %llu bytes at pos 0x%llX", size - bytes_read, offset + bytes_read);
+			return -QCOW_IO_ERROR;
+		}
+		bytes_read += ret;
+	}
+
+	return QCOW_NO_ERROR;
+}
+
+static int init_convert_ctx(convert_ctx_t* convert_ctx, qcow_ctx_t* qcow_ctx, int raw_fd, QCowAsyncOp op) {
+	mem_set(convert_ctx, 0, sizeof(convert_ctx_t));
+	convert_ctx -> raw_fd = raw_fd;
+	convert_ctx -> op = op;
+	convert_ctx -> chunk_size = MAX((u64) CONVERT_CHUNK_SIZE, qcow_ctx -> cluster_size);
+
+	for (unsigned int i = 0; i < CONVERT_QUEUE_DEPTH; ++i) {
+		if ((convert_ctx -> slots[i].buffer = (u8*) qcow_calloc(convert_ctx -> chunk_size, sizeof(u8))) == NULL) {
+			for (unsigned int j = 0; j < i; ++j) QCOW_SAFE_FREE(convert_ctx -> slots[j].buffer);
+			WARNING_LOG("Failed to allocate the slot buffers.\n");
+			return -QCOW_IO_ERROR;
+		}
+	}
+
+	int err = 0;
+	if ((err = init_qcow_async(&convert_ctx -> async_ctx, qcow_ctx, 0, CONVERT_QUEUE_DEPTH)) < 0) {
+		for (unsigned int i = 0; i < CONVERT_QUEUE_DEPTH; ++i) QCOW_SAFE_FREE(convert_ctx -> slots[i].buffer);
+		WARNING_LOG("Failed to initialize the async engine.\n");
+		return err;
+	}
+
+	return QCOW_NO_ERROR;
+}
+
+static void deinit_convert_ctx(convert_ctx_t* convert_ctx) {
+	deinit_qcow_async(&convert_ctx -> async_ctx);
+	for (unsigned int i = 0; i < CONVERT_QUEUE_DEPTH; ++i) QCOW_SAFE_FREE(convert_ctx -> slots[i].buffer);
+	return;
+}
+
+/// NOTE: the chunks read from the qcow image are written to the raw file as they complete, unless they are all zeros,
+///       as the raw file has been created sparse.
+static int reap_slots(convert_ctx_t* convert_ctx, unsigned int min_completions) {
+	qcow_completion_t completions[CONVERT_QUEUE_DEPTH] = {0};
+	int reaped = qwait_async(&convert_ctx -> async_ctx, completions, min_completions, CONVERT_QUEUE_DEPTH);
+	if (reaped < 0) return reaped;
+
+	int err = 0;
+	for (int i = 0; i < reaped; ++i) {
+		convert_slot_t* slot = convert_ctx -> slots + completions[i].user_data;
+		slot -> busy = FALSE;
+		if (completions[i].ret < 0) {
+			WARNING_LOG("Failed to convert the chunk at LBA 0x%llX, ret: %d - '%s'\n", slot -> offset, completions[i].ret, qcow_errors_str[-completions[i].ret]);
+			err = completions[i].ret;
+		} else if (convert_ctx -> op == QCOW_ASYNC_READ && is_zero_buffer(slot -> buffer, slot -> size)) {
+			convert_ctx -> skipped_bytes += slot -> size;
+		} else if (convert_ctx -> op == QCOW_ASYNC_READ && (err = pwrite_all(convert_ctx -> raw_fd, slot -> buffer, slot -> size, slot -> offset)) == 0) {
+			convert_ctx -> data_bytes += slot -> size;
+		}
+	}
+
+	return err;
+}
+
+static int get_free_slot(convert_ctx_t* convert_ctx, unsigned int* slot_index) {
+	while (TRUE) {
+		for (unsigned int i = 0; i < CONVERT_QUEUE_DEPTH; ++i) {
+			if (convert_ctx -> slots[i].busy) continue;
+			*slot_index = i;
+			return QCOW_NO_ERROR;
+		}
+
+		int err = 0;
+		if ((err = reap_slots(convert_ctx, 1)) < 0) return err;
+	}
+}
+
+static int drain_slots(convert_ctx_t* convert_ctx) {
+	int err = 0;
+	unsigned int busy_cnt = 0;
+	do {
+		busy_cnt = 0;
+		for (unsigned int i = 0; i < CONVERT_QUEUE_DEPTH; ++i) busy_cnt += convert_ctx -> slots[i].busy;
+		int ret = (busy_cnt > 0) ? reap_slots(convert_ctx, busy_cnt) : QCOW_NO_ERROR;
+		if (ret < 0) err = ret;
+	} while (busy_cnt > 0);
+
+	return err;
+}
+
+/// NOTE: the data extents are split in chunks aligned to the chunk size, each read by the async workers,
+///       while the extents reading as zeros (or unallocated without a backing file) are never read nor written.
+static int qcow_to_raw(const char* path_qcow, const char* path_raw) {
+	qcow_ctx_t qcow_ctx = {0};
+	qcow_ctx.read_only = TRUE;
+	if (init_qcow(&qcow_ctx, path_qcow) < 0) {
+		WARNING_LOG("Failed to parse the qcow image.\n");
+		return -QCOW_IO_ERROR;
+	}
+
+	int raw_fd = open(path_raw, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (raw_fd < 0) {
+		deinit_qcow(&qcow_ctx);
+		PERROR_LOG("Failed to create '%s'", path_raw);
+		return -QCOW_IO_ERROR;
+	}
+
+	// The raw file starts as a single hole as large as the virtual disk
+	if (ftruncate(raw_fd, qcow_ctx.size) < 0) {
+		close(raw_fd);
+		deinit_qcow(&qcow_ctx);
+		PERROR_LOG("Failed to resize '%s' to %llu bytes", path_raw, qcow_ctx.size);
+		return -QCOW_IO_ERROR;
+	}
+
+	int err = 0;
+	convert_ctx_t convert_ctx = {0};
+	if ((err = init_convert_ctx(&convert_ctx, &qcow_ctx, raw_fd, QCOW_ASYNC_READ)) < 0) {
+		close(raw_fd);
+		deinit_qcow(&qcow_ctx);
+		return err;
+	}
+
+	u64 offset = 0;
+	while (err == 0 && offset < qcow_ctx.size) {
+		qcow_extent_t extents[CONVERT_EXTENTS_CNT] = {0};
+		int extents_cnt = qblock_status(&qcow_ctx, offset, qcow_ctx.size - offset, extents, CONVERT_EXTENTS_CNT);
+		if (extents_cnt <= 0) {
+			err = (extents_cnt < 0) ? extents_cnt : -QCOW_IO_ERROR;
+			WARNING_LOG("Failed to retrieve the block status at LBA 0x%llX.\n", offset);
+			break;
+		}
+
+		for (int i = 0; err == 0 && i < extents_cnt; ++i) {
+			const qcow_extent_t* extent = extents + i;
+			offset = extent -> offset + extent -> length;
+			if (extent -> status == QCOW_BLOCK_ZERO || extent -> status == QCOW_BLOCK_UNALLOCATED) {
+				convert_ctx.skipped_bytes += extent -> length;
+				continue;
+			}
+
+			for (u64 pos = extent -> offset; err == 0 && pos < offset;) {
+				unsigned int slot_index = 0;
+				if ((err = get_free_slot(&convert_ctx, &slot_index)) < 0) break;
+
+				convert_slot_t* slot = convert_ctx.slots + slot_index;
+				slot -> offset = pos;
+				slot -> size = MIN(offset - pos, convert_ctx.chunk_size - (pos % convert_ctx.chunk_size));
+				slot -> busy = TRUE;
+				if ((err = qread_async(&convert_ctx.async_ctx, slot -> buffer, sizeof(u8), slot -> size, slot -> offset, slot_index)) < 0) {
+					slot -> busy = FALSE;
+					break;
+				}
+
+				pos += slot -> size;
+			}
+		}
+	}
+
+	int ret = drain_slots(&convert_ctx);
+	if (err == 0) err = ret;
+
+	if (err == 0) printf("Converted '%s' to '%s': %llu bytes of data, %llu bytes skipped.\n", path_qcow, path_raw, convert_ctx.data_bytes, convert_ctx.skipped_bytes);
+
+	deinit_convert_ctx(&convert_ctx);
+	if (fsync(raw_fd) < 0 && err == 0) {
+		PERROR_LOG("Failed to sync '%s'", path_raw);
+		err = -QCOW_IO_ERROR;
+	}
+
+	close(raw_fd);
+	deinit_qcow(&qcow_ctx);
+
+	return err;
+}
+
+/// NOTE: the image is created with a single refcount block and an empty l1 table, leaving every cluster unallocated,
+///       so that the l2 tables and the data clusters are allocated by qwrite only for the written ranges.
+///       A compression type other than DEFLATE is stored in the header, and flagged in the incompatible features.
+static int create_qcow_img(const char* path_qcow, u64 size, CompressionType compression_type) {
+	const u64 cluster_size = 1ULL << CONVERT_CLUSTER_BITS;
+	const u64 l1_size = CEILING(size, cluster_size * (cluster_size / sizeof(u64)));
+	const u64 l1_clusters = MAX(CEILING(l1_size * sizeof(u64), cluster_size), 1ULL);
+	const u64 metadata_clusters = 3 + l1_clusters;
+	if (metadata_clusters > cluster_size / sizeof(u16)) {
+		WARNING_LOG("The disk size %llu is too large to be converted.\n", size);
+		return -QCOW_INVALID_SIZE;
+	}
+
+	u8* metadata = (u8*) qcow_calloc(metadata_clusters, cluster_size);
+	if (metadata == NULL) {
+		WARNING_LOG("Failed to allocate the image metadata.\n");
+		return -QCOW_IO_ERROR;
+	}
+
+	// The header is followed by the refcount table, the refcount block, and the l1 table
+	qcow_header_t qcow_header = {
+		.magic = { 'Q', 'F', 'I', '\xfb' },
+		.version = 3,
+		.cluster_bits = CONVERT_CLUSTER_BITS,
+		.size = size,
+		.l1_size = l1_size,
+		.l1_table_offset = 3 * cluster_size,
+		.refcount_table_offset = cluster_size,
+		.refcount_table_clusters = 1,
+		.incompatible_features = (compression_type != DEFLATE) << 3,
+		.refcount_order = 4,
+		.header_length = CONVERT_HEADER_LENGTH
+	};
+	format_qcow_header(&qcow_header, 2);
+	format_qcow_header(&qcow_header, 3);
+	mem_cpy(metadata, &qcow_header, sizeof(qcow_header_t));
+	metadata[104] = compression_type;
+
+	u64 refcount_block_offset = 2 * cluster_size;
+	QCOW_BE_CONVERT(&refcount_block_offset, sizeof(u64));
+	mem_cpy(metadata + cluster_size, &refcount_block_offset, sizeof(u64));
+
+	u16* ref_cnts = (u16*) (metadata + 2 * cluster_size);
+	for (u64 i = 0; i < metadata_clusters; ++i) ref_cnts[i] = 1;
+	cpu_to_be16_array(ref_cnts, metadata_clusters);
+
+	int qcow_fd = open(path_qcow, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (qcow_fd < 0) {
+		QCOW_SAFE_FREE(metadata);
+		PERROR_LOG("Failed to create '%s'", path_qcow);
+		return -QCOW_IO_ERROR;
+	}
+
+	int err = pwrite_all(qcow_fd, metadata, metadata_clusters * cluster_size, 0);
+	QCOW_SAFE_FREE(metadata);
+	close(qcow_fd);
+
+	return err;
+}
+
+/// NOTE: the data regions of the raw file are found through SEEK_DATA/SEEK_HOLE, so that its holes are never read,
+///       the chunks are read by the main thread, and written to the image by the async workers,
+///       while the chunks made only of zeros are not written, so that they stay unallocated.
+static int raw_to_qcow(const char* path_raw, const char* path_qcow) {
+	int raw_fd = open(path_raw, O_RDONLY);
+	if (raw_fd < 0) {
+		PERROR_LOG("Failed to open '%s'", path_raw);
+		return -QCOW_IO_ERROR;
+	}
+
+	struct stat raw_stat = {0};
+	if (fstat(raw_fd, &raw_stat) < 0) {
+		close(raw_fd);
+		PERROR_LOG("Failed to stat '%s'", path_raw);
+		return -QCOW_IO_ERROR;
+	}
+
+	int err = 0;
+	const u64 size = CEILING((u64) raw_stat.st_size, (u64) COMPRESSED_SECTOR_SIZE) * COMPRESSED_SECTOR_SIZE;
+	if ((err = create_qcow_img(path_qcow, size, DEFLATE)) < 0) {
+		close(raw_fd);
+		WARNING_LOG("Failed to create the qcow image.\n");
+		return err;
+	}
+
+	qcow_ctx_t qcow_ctx = {0};
+	if (init_qcow(&qcow_ctx, path_qcow) < 0) {
+		close(raw_fd);
+		WARNING_LOG("Failed to parse the qcow image.\n");
+		return -QCOW_IO_ERROR;
+	}
+
+	convert_ctx_t convert_ctx = {0};
+	if ((err = init_convert_ctx(&convert_ctx, &qcow_ctx, raw_fd, QCOW_ASYNC_WRITE)) < 0) {
+		close(raw_fd);
+		deinit_qcow(&qcow_ctx);
+		return err;
+	}
+
+	const u64 raw_size = raw_stat.st_size;
+	for (u64 offset = 0; err == 0 && offset < raw_size;) {
+		off_t data_start = lseek(raw_fd, offset, SEEK_DATA);
+		if (data_start < 0 && errno == ENXIO) {
+			convert_ctx.skipped_bytes += raw_size - offset;
+			break;
+		} else if (data_start < 0) data_start = offset;
+
+		off_t data_end = lseek(raw_fd, data_start, SEEK_HOLE);
+		if (data_end < 0) data_end = raw_size;
+
+		convert_ctx.skipped_bytes += data_start - offset;
+
+		for (u64 pos = data_start; err == 0 && pos < (u64) data_end;) {
+			unsigned int slot_index = 0;
+			if ((err = get_free_slot(&convert_ctx, &slot_index)) < 0) break;
+
+			convert_slot_t* slot = convert_ctx.slots + slot_index;
+			slot -> offset = pos;
+			slot -> size = MIN(data_end - pos, convert_ctx.chunk_size - (pos % convert_ctx.chunk_size));
+			pos += slot -> size;
+			if ((err = pread_all(raw_fd, slot -> buffer, slot -> size, slot -> offset)) < 0) break;
+			else if (is_zero_buffer(slot -> buffer, slot -> size)) {
+				convert_ctx.skipped_bytes += slot -> size;
+				continue;
+			}
+
+			slot -> busy = TRUE;
+			if ((err = qwrite_async(&convert_ctx.async_ctx, slot -> buffer, sizeof(u8), slot -> size, slot -> offset, slot_index)) < 0) {
+				slot -> busy = FALSE;
+				break;
+			}
+
+			convert_ctx.data_bytes += slot -> size;
+		}
+
+		offset = data_end;
+	}
+
+	int ret = drain_slots(&convert_ctx);
+	if (err == 0) err = ret;
+	deinit_convert_ctx(&convert_ctx);
+
+	if (err == 0 && (err = qfsync(&qcow_ctx)) < 0) WARNING_LOG("Failed to sync the qcow image.\n");
+	if (err == 0) printf("Converted '%s' to '%s': %llu bytes of data, %llu bytes skipped.\n", path_raw, path_qcow, convert_ctx.data_bytes, convert_ctx.skipped_bytes);
+
+	close(raw_fd);
+	deinit_qcow(&qcow_ctx);
+
+	return err;
+}
+
+/// NOTE: the data regions of the raw file are widened to whole chunks, which are read by the main thread and handed
+///       to the compression workers, so that the clusters are compressed in parallel, but appended to the image in order.
+static int raw_to_compressed_qcow(const char* path_raw, const char* path_qcow, CompressionType compression_type) {
+	int raw_fd = open(path_raw, O_RDONLY);
+	if (raw_fd < 0) {
+		PERROR_LOG("Failed to open '%s'", path_raw);
+		return -QCOW_IO_ERROR;
+	}
+
+	struct stat raw_stat = {0};
+	if (fstat(raw_fd, &raw_stat) < 0) {
+		close(raw_fd);
+		PERROR_LOG("Failed to stat '%s'", path_raw);
+		return -QCOW_IO_ERROR;
+	}
+
+	int err = 0;
+	const u64 size = CEILING((u64) raw_stat.st_size, (u64) COMPRESSED_SECTOR_SIZE) * COMPRESSED_SECTOR_SIZE;
+	if ((err = create_qcow_img(path_qcow, size, compression_type)) < 0) {
+		close(raw_fd);
+		WARNING_LOG("Failed to create the qcow image.\n");
+		return err;
+	}
+
+	qcow_ctx_t qcow_ctx = {0};
+	if (init_qcow(&qcow_ctx, path_qcow) < 0) {
+		close(raw_fd);
+		WARNING_LOG("Failed to parse the qcow image.\n");
+		return -QCOW_IO_ERROR;
+	}
+
+	const u64 chunk_size = MAX((u64) CONVERT_CHUNK_SIZE, qcow_ctx.cluster_size);
+	u8* chunk = (u8*) qcow_calloc(chunk_size, sizeof(u8));
+	if (chunk == NULL) {
+		close(raw_fd);
+		deinit_qcow(&qcow_ctx);
+		WARNING_LOG("Failed to allocate the chunk buffer.\n");
+		return -QCOW_IO_ERROR;
+	}
+
+	qcow_compress_ctx_t compress_ctx = {0};
+	if ((err = init_qcow_compress(&compress_ctx, &qcow_ctx, 0, 0)) < 0) {
+		QCOW_SAFE_FREE(chunk);
+		close(raw_fd);
+		deinit_qcow(&qcow_ctx);
+		WARNING_LOG("Failed to initialize the compression workers.\n");
+		return err;
+	}
+
+	u64 data_bytes = 0;
+	u64 next_chunk = 0;
+	const u64 raw_size = raw_stat.st_size;
+	for (u64 offset = 0; err == 0 && offset < raw_size;) {
+		off_t data_start = lseek(raw_fd, offset, SEEK_DATA);
+		if (data_start < 0 && errno == ENXIO) break;
+		else if (data_start < 0) data_start = offset;
+
+		off_t data_end = lseek(raw_fd, data_start, SEEK_HOLE);
+		if (data_end < 0) data_end = raw_size;
+
+		// The chunk holding the start of the region may have been already queued along with the previous region
+		for (u64 pos = MAX(next_chunk, data_start - (data_start % chunk_size)); err == 0 && pos < (u64) data_end; pos += chunk_size) {
+			const u64 chunk_bytes = MIN(chunk_size, size - pos);
+			const u64 raw_bytes = MIN(chunk_bytes, raw_size - pos);
+			mem_set(chunk + raw_bytes, 0, chunk_bytes - raw_bytes);
+			if ((err = pread_all(raw_fd, chunk, raw_bytes, pos)) < 0) break;
+			
+			next_chunk = pos + chunk_size;
+			if (is_zero_buffer(chunk, chunk_bytes)) continue;
+
+			if ((err = qwrite_compress(&compress_ctx, chunk, chunk_bytes, pos)) < 0) break;
+			data_bytes += chunk_bytes;
+		}
+
+		offset = data_end;
+	}
+
+	int ret = qflush_compress(&compress_ctx);
+	if (err == 0) err = ret;
+	deinit_qcow_compress(&compress_ctx);
+	QCOW_SAFE_FREE(chunk);
+
+	long long int img_size = 0;
+	if (err == 0 && (err = qfsync(&qcow_ctx)) < 0) WARNING_LOG("Failed to sync the qcow image.\n");
+	if (err == 0 && (img_size = fsize(qcow_ctx.img_file)) >= 0) printf("Compressed '%s' into '%s': %llu bytes of data stored in an image of %lld bytes.\n", path_raw, path_qcow, data_bytes, img_size);
+
+	close(raw_fd);
+	deinit_qcow(&qcow_ctx);
+
+	return err;
+}
+
+int main(int argc, char* argv[]) {
+	if (argc < 4) {
+		WARNING_LOG("Usage: %s <to-raw|to-qcow|to-compressed-qcow> <input> <output> [deflate|zstd]\n", argv[0]);
+		return -1;
+	}
+
+	CompressionType compression_type = DEFLATE;
+	if (argc > 4 && str_n_cmp(argv[4], "zstd", 5) == 0) compression_type = ZSTD;
+	else if (argc > 4 && str_n_cmp(argv[4], "deflate", 8) != 0) {
+		WARNING_LOG("Unknown compression '%s', expected either 'deflate' or 'zstd'.\n", argv[4]);
+		return -1;
+	}
+
+	int err = 0;
+	if (str_n_cmp(argv[1], "to-raw", 7) == 0) err = qcow_to_raw(argv[2], argv[3]);
+	else if (str_n_cmp(argv[1], "to-qcow", 8) == 0) err = raw_to_qcow(argv[2], argv[3]);
+	else if (str_n_cmp(argv[1], "to-compressed-qcow", 19) == 0) err = raw_to_compressed_qcow(argv[2], argv[3], compression_type);
+	else {
+		WARNING_LOG("Unknown conversion '%s', expected either 'to-raw', 'to-qcow' or 'to-compressed-qcow'.\n", argv[1]);
+		return -1;
+	}
+
+	if (err < 0) {
+		WARNING_LOG("Failed to convert '%s' into '%s': '%s'.\n", argv[2], argv[3], qcow_errors_str[-err]);
+		return -1;
+	}
+
+	return 0;
+}
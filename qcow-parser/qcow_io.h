@@ -0,0 +1,364 @@
+/*
+ * Copyright (C) 2025 TheProgxy <theprogxy@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _QCOW_IO_H_
+#define _QCOW_IO_H_
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "../common/utils.h"
+
+/* -------------------------------------------------------------------------------------------------------- */
+// -----------------
+//  Constant Values
+// -----------------
+typedef enum {
+	QCOW_ZERO_CHUNK_SIZE = 64 * 1024
+} QCowIOConstants;
+
+/* -------------------------------------------------------------------------------------------------------- */
+// ---------
+//  Structs
+// ---------
+typedef struct qcow_io_t qcow_io_t;
+
+/// NOTE: A backend only has to provide positional primitives, every call carries its own offset,
+///       hence the same qcow_io_t can be shared without any notion of a "current position".
+///       The map primitive is optional, and it is provided only by backends that can expose
+///       the file contents in memory, to allow zero-copy access to the clusters.
+///       The zero primitive is optional as well, if missing the zeros are written out explicitly.
+typedef struct qcow_io_ops_t {
+	int (*open)(qcow_io_t* io, const char* path, bool writable);
+	int (*read)(qcow_io_t* io, u64 offset, void* data, u64 size);
+	int (*write)(qcow_io_t* io, u64 offset, const void* data, u64 size);
+	long long int (*size)(qcow_io_t* io);
+	void (*close)(qcow_io_t* io);
+	const void* (*map)(qcow_io_t* io, u64 offset, u64 size);
+	int (*sync)(qcow_io_t* io);
+	int (*zero)(qcow_io_t* io, u64 offset, u64 size);
+} qcow_io_ops_t;
+
+struct qcow_io_t {
+	const qcow_io_ops_t* ops;
+	int fd;
+	void* handle;
+	u8* map;
+	u64 map_size;
+};
+
+/* -------------------------------------------------------------------------------------------------------- */
+// ------------------------
+//  Functions Declarations
+// ------------------------
+static int fd_io_open(qcow_io_t* io, const char* path, bool writable);
+static int fd_io_read(qcow_io_t* io, u64 offset, void* data, u64 size);
+static int fd_io_write(qcow_io_t* io, u64 offset, const void* data, u64 size);
+static long long int fd_io_size(qcow_io_t* io);
+static void fd_io_close(qcow_io_t* io);
+static int fd_io_sync(qcow_io_t* io);
+static int fd_io_zero(qcow_io_t* io, u64 offset, u64 size);
+static int mmap_io_open(qcow_io_t* io, const char* path, bool writable);
+static int mmap_io_read(qcow_io_t* io, u64 offset, void* data, u64 size);
+static int mmap_io_write(qcow_io_t* io, u64 offset, const void* data, u64 size);
+static long long int mmap_io_size(qcow_io_t* io);
+static void mmap_io_close(qcow_io_t* io);
+static const void* mmap_io_map(qcow_io_t* io, u64 offset, u64 size);
+static int mmap_io_sync(qcow_io_t* io);
+static int qcow_io_open(const qcow_io_ops_t* ops, const char* path, bool writable, qcow_io_t** io);
+static void qcow_io_close(qcow_io_t* io);
+static inline int write_at(qcow_io_t* io, u64 offset, const void* data, size_t size, size_t nmemb);
+static inline int read_at(qcow_io_t* io, u64 offset, void* data, size_t size, size_t nmemb);
+static int write_zeros_at(qcow_io_t* io, u64 offset, u64 n);
+static int zero_out_at(qcow_io_t* io, u64 offset, u64 n);
+static inline long long int fsize(qcow_io_t* io);
+static inline int fsync_file(qcow_io_t* io);
+
+/* -------------------------------------------------------------------------------------------------------- */
+// ------------------------
+// Static Variables
+// ------------------------
+static const qcow_io_ops_t fd_io_ops = {
+	.open  = fd_io_open,
+	.read  = fd_io_read,
+	.write = fd_io_write,
+	.size  = fd_io_size,
+	.close = fd_io_close,
+	.map   = NULL,
+	.sync  = fd_io_sync,
+	.zero  = fd_io_zero
+};
+
+static const qcow_io_ops_t mmap_io_ops = {
+	.open  = mmap_io_open,
+	.read  = mmap_io_read,
+	.write = mmap_io_write,
+	.size  = mmap_io_size,
+	.close = mmap_io_close,
+	.map   = mmap_io_map,
+	.sync  = mmap_io_sync,
+	.zero  = NULL
+};
+
+/* -------------------------------------------------------------------------------------------------------- */
+static int fd_io_open(qcow_io_t* io, const char* path, bool writable) {
+	if ((io -> fd = open(path, writable ? O_RDWR : O_RDONLY)) < 0) {
+		PERROR_LOG("Failed to open '%s'", path);
+		return -QCOW_IO_ERROR;
+	}
+
+	return QCOW_NO_ERROR;
+}
+
+static int fd_io_read(qcow_io_t* io, u64 offset, void* data, u64 size) {
+	u64 bytes_read = 0;
+	while (bytes_read < size) {
+		ssize_t ret = pread(io -> fd, QCOW_CAST_PTR(data, u8) + bytes_read, size - bytes_read, offset + bytes_read);
+		if (ret < 0 && errno == EINTR) continue;
+		else if (ret < 0) {
+			PERROR_LOG("Failed to read %llu bytes at pos 0x%llX", size - bytes_read, offset + bytes_read);
+			return -QCOW_IO_ERROR;
+		} else if (ret == 0) {
+			WARNING_LOG("Unexpected end of file while reading %llu bytes at pos 0x%llX.\n", size - bytes_read, offset + bytes_read);
+			return -QCOW_IO_ERROR;
+		}
+		bytes_read += ret;
+	}
+
+	return QCOW_NO_ERROR;
+}
+
+static int fd_io_write(qcow_io_t* io, u64 offset, const void* data, u64 size) {
+	u64 bytes_written = 0;
+	while (bytes_written < size) {
+		ssize_t ret = pwrite(io -> fd, QCOW_CAST_PTR(data, u8) + bytes_written, size - bytes_written, offset + bytes_written);
+		if (ret < 0 && errno == EINTR) continue;
+		else if (ret <= 0) {
+			PERROR_LOG("Failed to write %llu bytes at pos 0x%llX", size - bytes_written, offset + bytes_written);
+			return -QCOW_IO_ERROR;
+		}
+		bytes_written += ret;
+	}
+
+	return QCOW_NO_ERROR;
+}
+
+static long long int fd_io_size(qcow_io_t* io) {
+	struct stat file_stat = {0};
+	if (fstat(io -> fd, &file_stat) < 0) {
+		PERROR_LOG("Failed to stat the file");
+		return -QCOW_IO_ERROR;
+	}
+
+	return file_stat.st_size;
+}
+
+static void fd_io_close(qcow_io_t* io) {
+	if (io -> fd >= 0) close(io -> fd);
+	io -> fd = -1;
+	return;
+}
+
+static int fd_io_sync(qcow_io_t* io) {
+	while (fdatasync(io -> fd) < 0) {
+		if (errno == EINTR) continue;
+		PERROR_LOG("Failed to sync the file");
+		return -QCOW_IO_ERROR;
+	}
+
+	return QCOW_NO_ERROR;
+}
+
+/// NOTE: the part of the region past the end of the file is reserved in a single posix_fallocate call, falling back
+///       to ftruncate if the filesystem does not support it, so that it reads as zeros without writing a single byte,
+///       while only the part overlapping the current file contents has to be overwritten.
+///       Callers racing to extend the same file must still serialize, as the ftruncate fallback is not atomic with its size check.
+static int fd_io_zero(qcow_io_t* io, u64 offset, u64 size) {
+	long long int file_size = 0;
+	if ((file_size = fd_io_size(io)) < 0) return file_size;
+	
+	const u64 eof = (u64) file_size;
+	if (offset + size > eof) {
+		const u64 start = MAX(offset, eof);
+		int err = 0;
+		while ((err = posix_fallocate(io -> fd, start, offset + size - start)) == EINTR);
+		if (err == EINVAL || err == EOPNOTSUPP) {
+			// The file is only ever grown, as it may have been extended past the region since its size was read
+			if ((file_size = fd_io_size(io)) < 0) return file_size;
+			if ((u64) file_size < offset + size && ftruncate(io -> fd, offset + size) < 0) {
+				PERROR_LOG("Failed to extend the file to %llu bytes", offset + size);
+				return -QCOW_IO_ERROR;
+			}
+		} else if (err != 0) {
+			errno = err;
+			PERROR_LOG("Failed to reserve %llu bytes at pos 0x%llX", offset + size - start, start);
+			return -QCOW_IO_ERROR;
+		}
+	}
+
+	if (offset >= eof) return QCOW_NO_ERROR;
+
+	return write_zeros_at(io, offset, MIN(size, eof - offset));
+}
+
+/// NOTE: The mmap backend is read-only, the whole file is mapped at open time,
+///       and the reads are served as plain copies out of the mapping.
+static int mmap_io_open(qcow_io_t* io, const char* path, bool writable) {
+	if (writable) {
+		WARNING_LOG("The mmap backend can only open files as read-only.\n");
+		return -QCOW_READ_ONLY_IMAGE;
+	}
+
+	int err = 0;
+	if ((err = fd_io_open(io, path, FALSE)) < 0) return err;
+
+	long long int file_size = 0;
+	if ((file_size = fd_io_size(io)) <= 0) {
+		fd_io_close(io);
+		WARNING_LOG("Cannot map the empty or unreadable file '%s'.\n", path);
+		return -QCOW_IO_ERROR;
+	}
+
+	void* map = mmap(NULL, file_size, PROT_READ, MAP_SHARED, io -> fd, 0);
+	if (map == MAP_FAILED) {
+		fd_io_close(io);
+		PERROR_LOG("Failed to map '%s'", path);
+		return -QCOW_IO_ERROR;
+	}
+
+	io -> map = (u8*) map;
+	io -> map_size = file_size;
+
+	return QCOW_NO_ERROR;
+}
+
+static int mmap_io_read(qcow_io_t* io, u64 offset, void* data, u64 size) {
+	if (offset > io -> map_size || size > io -> map_size - offset) {
+		WARNING_LOG("Unexpected end of file while reading %llu bytes at pos 0x%llX.\n", size, offset);
+		return -QCOW_IO_ERROR;
+	}
+
+	mem_cpy(data, io -> map + offset, size);
+
+	return QCOW_NO_ERROR;
+}
+
+static int mmap_io_write(qcow_io_t* io, u64 offset, const void* data, u64 size) {
+	UNUSED_VAR(io);
+	UNUSED_VAR(data);
+	WARNING_LOG("Cannot write %llu bytes at pos 0x%llX, as the file is mapped read-only.\n", size, offset);
+	return -QCOW_READ_ONLY_IMAGE;
+}
+
+static long long int mmap_io_size(qcow_io_t* io) {
+	return io -> map_size;
+}
+
+static void mmap_io_close(qcow_io_t* io) {
+	if (io -> map != NULL) munmap(io -> map, io -> map_size);
+	io -> map = NULL;
+	io -> map_size = 0;
+	fd_io_close(io);
+	return;
+}
+
+static const void* mmap_io_map(qcow_io_t* io, u64 offset, u64 size) {
+	if (offset > io -> map_size || size > io -> map_size - offset) return NULL;
+	return io -> map + offset;
+}
+
+static int mmap_io_sync(qcow_io_t* io) {
+	UNUSED_VAR(io);
+	return QCOW_NO_ERROR;
+}
+
+/// NOTE: if ops is NULL the default fd backend is used.
+static int qcow_io_open(const qcow_io_ops_t* ops, const char* path, bool writable, qcow_io_t** io) {
+	*io = (qcow_io_t*) qcow_calloc(1, sizeof(qcow_io_t));
+	if (*io == NULL) {
+		WARNING_LOG("Failed to allocate the io handle.\n");
+		return -QCOW_IO_ERROR;
+	}
+
+	(*io) -> ops = (ops == NULL) ? &fd_io_ops : ops;
+	(*io) -> fd = -1;
+
+	int err = 0;
+	if ((err = (*io) -> ops -> open(*io, path, writable)) < 0) {
+		QCOW_SAFE_FREE(*io);
+		return err;
+	}
+
+	return QCOW_NO_ERROR;
+}
+
+static void qcow_io_close(qcow_io_t* io) {
+	if (io == NULL) return;
+	io -> ops -> close(io);
+	qcow_free(io);
+	return;
+}
+
+static inline int write_at(qcow_io_t* io, u64 offset, const void* data, size_t size, size_t nmemb) {
+	return io -> ops -> write(io, offset, data, (u64) size * nmemb);
+}
+
+static inline int read_at(qcow_io_t* io, u64 offset, void* data, size_t size, size_t nmemb) {
+	return io -> ops -> read(io, offset, data, (u64) size * nmemb);
+}
+
+static int write_zeros_at(qcow_io_t* io, u64 offset, u64 n) {
+	if (n == 0) return QCOW_NO_ERROR;
+
+	const u64 chunk_size = MIN(n, (u64) QCOW_ZERO_CHUNK_SIZE);
+	u8* zero = (u8*) qcow_calloc(chunk_size, sizeof(u8));
+	if (zero == NULL) {
+		WARNING_LOG("Failed to allocate the zero buffer.\n");
+		return -QCOW_IO_ERROR;
+	}
+
+	int err = 0;
+	for (u64 i = 0; i < n; i += chunk_size) {
+		if ((err = write_at(io, offset + i, zero, sizeof(u8), MIN(chunk_size, n - i))) < 0) {
+			QCOW_SAFE_FREE(zero);
+			WARNING_LOG("Failed to write zeros at pos 0x%llX.\n", offset + i);
+			return err;
+		}
+	}
+
+	QCOW_SAFE_FREE(zero);
+
+	return QCOW_NO_ERROR;
+}
+
+static int zero_out_at(qcow_io_t* io, u64 offset, u64 n) {
+	if (n == 0) return QCOW_NO_ERROR;
+	else if (io -> ops -> zero != NULL) return io -> ops -> zero(io, offset, n);
+	return write_zeros_at(io, offset, n);
+}
+
+static inline long long int fsize(qcow_io_t* io) {
+	return io -> ops -> size(io);
+}
+
+static inline int fsync_file(qcow_io_t* io) {
+	return io -> ops -> sync(io);
+}
+
+#endif //_QCOW_IO_H_
+
@@ -15,7 +15,6 @@
  * along with this program. If not, see <https://www.gnu.org/licenses/>.
  */
 
-// TODO: Add support for ZSTD compression.
 // TODO: Add support for snapshots: it requires the nb_snapshots and the offset of the table, 
 //       also requires a bit of rethinking of the entire system, as it needs to
 //       parse the entries in the snapshot table,
@@ -35,7 +34,11 @@
 #define _QCOW_PARSER_H_
 
 #include "../common/utils.h"
-#include "./xcomp.h" // TODO: Note that ZSTD is missing a compressor
+#include <pthread.h>
+#include "./qcow_io.h"
+#include "./qcow_cache.h"
+#include "./qcow_alloc.h"
+#include "./xcomp.h"
 
 /* -------------------------------------------------------------------------------------------------------- */
 // -----------------
@@ -43,6 +46,7 @@
 // -----------------
 typedef enum {
 #define COMPRESSED_CLUSTER 0x4000000000000000
+#define ALL_SUBCLUSTERS_ALLOCATED 0xFFFFFFFFU
 	QCOW_HEADER_HEADER_START = 8,
 	DEFAULT_REF_CNT_BITS     = 16,
 	SHARED_FIELDS_SIZE       = 52,
@@ -54,7 +58,9 @@ typedef enum {
 	INCOMPATIBLE_FEATURE     = 0,
 	COMPATIBLE_FEATURE       = 1,
 	AUTOCLEAR_FEATURE        = 2,
-	COMPRESSED_SECTOR_SIZE   = 512
+	COMPRESSED_SECTOR_SIZE   = 512,
+	MAX_BACKING_CHAIN_DEPTH  = 32,
+	MAX_BACKING_FILE_NAME    = 1023
 } QCowParserConstants;
 
 /* -------------------------------------------------------------------------------------------------------- */
@@ -66,7 +72,7 @@ typedef enum {
 #define FLOORING(dividend, divisor)                                     (((dividend) - ((dividend) % (divisor))) / (divisor))
 #define CEILING(dividend, divisor)                                      (((dividend) - ((dividend) % (divisor))) / (divisor) + (((dividend) % (divisor)) > 0)) 
 #define IS_CLUSTER_ALIGNED(cluster_offset, cluster_size)                (((cluster_offset) % (cluster_size)) == 0)
-#define IMG_OFFSET_INFO(img_offset)                                     DEBUG_LOG("0x%llX: img_offset: 0x%llX, is_compressed_cluster: '%s'.\n", \
+#define IMG_OFFSET_INFO(img_offset)                                     TRACE_LOG("0x%llX: img_offset: 0x%llX, is_compressed_cluster: '%s'.\n", \
 																		img_offset, img_offset & QCOW_MASK_BITS_INTERVAL(56, 9), QCOW_BOOL2STR(IS_COMPRESSED_CLUSTER(img_offset))) 
 
 /* -------------------------------------------------------------------------------------------------------- */
@@ -105,6 +111,22 @@ static const char* compression_type_str[] = {
 	"ZSTD" 
 };
 
+typedef enum PACKED_STRUCT QCowBlockStatus {
+	QCOW_BLOCK_DATA = 0,
+	QCOW_BLOCK_ZERO,
+	QCOW_BLOCK_UNALLOCATED,
+	QCOW_BLOCK_COMPRESSED,
+	QCOW_BLOCK_BACKING
+} QCowBlockStatus;
+
+__attribute__((unused)) static const char* qcow_block_status_strs[] = { 
+	"DATA", 
+	"ZERO", 
+	"UNALLOCATED", 
+	"COMPRESSED", 
+	"BACKING" 
+};
+
 /* -------------------------------------------------------------------------------------------------------- */
 // ---------
 //  Structs
@@ -136,6 +158,15 @@ typedef struct PACKED_STRUCT qcow_header_ext_t {
 	u8* data;
 } qcow_header_ext_t;
 
+/// NOTE: the lock order is l2_locks -> refcount_lock -> alloc_lock, where the
+///       alloc_lock only guards the growth of the image files, hence it is never held while taking another lock.
+typedef struct qcow_locks_t {
+	pthread_rwlock_t* l2_locks;
+	u32 l2_locks_cnt;
+	pthread_rwlock_t refcount_lock;
+	pthread_mutex_t alloc_lock;
+} qcow_locks_t;
+
 typedef struct PACKED_STRUCT qcow_ctx_t {
     CompressionType compression_type;
     u64 backing_file_offset;
@@ -152,19 +183,35 @@ typedef struct PACKED_STRUCT qcow_ctx_t {
 	u32 table_cluster_entries;
 	u32 refcount_table_size;
 	u8 refcount_bytes;
-	void** refcount_table;
-	void** l1_table;
+	u64* refcount_table;
+	u64* l1_table;
 	u8 l2_entries_size;
-	FILE* img_file;
+	qcow_io_t* img_file;
 	long long int img_size;
 	long long int img_file_base;
-	FILE* backing_file;
+	qcow_io_t* backing_file;
 	long long int backing_file_size;
-	FILE* clusters_file;
+	qcow_io_t* clusters_file;
 	long long int clusters_file_size;
 	long long int clusters_file_base;
 	u8 use_erdf;
 	u8 use_extended_l2_entries;
+	const qcow_io_ops_t* io_ops;
+	u8 read_only;
+	qcow_locks_t* locks;
+	u64 l2_cache_size;
+	qcow_cache_t* l2_cache;
+	u64 refcount_cache_size;
+	qcow_cache_t* refcount_cache;
+	qcow_free_map_t* free_map;
+	u64 cluster_cache_size;
+	qcow_cluster_cache_t* cluster_cache;
+	u8 skip_checksums;
+	struct qcow_ctx_t* backing_ctx;
+	u32 chain_depth;
+	qcow_chain_cache_t* chain_cache;
+	u64 compressed_pos;
+	u64 compressed_end;
 } qcow_ctx_t;
 
 typedef struct PACKED_STRUCT subcluster_info_t {
@@ -178,46 +225,81 @@ typedef struct PACKED_STRUCT {
 	const char feature_name[MAX_FEATURE_NAME_SIZE];
 } feature_name_table_t;
 
+/// NOTE: A guest range sharing the same block status, where host_offset is the offset of the data within the clusters file,
+///       which is only meaningful for QCOW_BLOCK_DATA extents, as those are merged only while contiguous in the image.
+typedef struct qcow_extent_t {
+	u64 offset;
+	u64 length;
+	u64 host_offset;
+	QCowBlockStatus status;
+} qcow_extent_t;
+
 /* -------------------------------------------------------------------------------------------------------- */
 // ------------------------
 //  Functions Declarations
 // ------------------------
 static inline QCowExtType to_qcow_ext_type(u32 val);
-static inline int write_at(FILE* file, u64 offset, const void* data, size_t size, size_t nmemb);
-static inline int read_at(FILE* file, u64 offset, void* data, size_t size, size_t nmemb);
-static inline int zero_out_at(FILE* file, u64 offset, u64 n);
+static int init_qcow_locks(qcow_ctx_t* qcow_ctx);
+static void deinit_qcow_locks(qcow_ctx_t* qcow_ctx);
+static inline int get_l2_lock(qcow_ctx_t* qcow_ctx, u64 offset, pthread_rwlock_t** l2_lock);
 static inline void deinit_qcow(qcow_ctx_t* qcow_ctx);
 static inline void format_qcow_header(qcow_header_t* qcow_header, u8 version);
 static inline void dump_qcow_header(const qcow_header_t* qcow_header);
 static inline void dump_qcow_header_extension(const qcow_header_ext_t* qcow_header_ext);
-static int parse_qcow_ext(qcow_header_ext_t** qcow_exts, FILE* file);
+static int parse_qcow_ext(qcow_header_ext_t** qcow_exts, qcow_io_t* file, u64 offset);
 static int parse_ref_cnt_table(qcow_ctx_t* qcow_ctx);
 static int parse_l1_table(qcow_ctx_t* qcow_ctx);
+static int init_free_map(qcow_ctx_t* qcow_ctx);
 static int parse_qcow_header(qcow_ctx_t* qcow_ctx, qcow_header_t* qcow_header);
 static int init_qcow_img(qcow_ctx_t* qcow_ctx, const char* path_qcow);
 int init_qcow(qcow_ctx_t* qcow_ctx, const char* path_qcow);
-static inline int get_ref_cnt(qcow_ctx_t qcow_ctx, u64 offset, u64* ref_cnt);
-static int allocate_ref_cnt_table(qcow_ctx_t qcow_ctx, u64 refcount_table_index);
-static int update_ref_cnt(qcow_ctx_t qcow_ctx, u64 offset, u64 new_ref_cnt);
-static inline int lba_to_img_offset(qcow_ctx_t qcow_ctx, u64 offset, u64* img_offset, subcluster_info_t* subcluster_info);
-static int allocate_l2_table(qcow_ctx_t qcow_ctx, u64 l1_index);
-static int set_lba_at_img_offset(qcow_ctx_t qcow_ctx, u64 offset, u64 new_entry, subcluster_info_t new_subcluster_info);
-static int extend_img_file(FILE* file, u64 n, u64 file_boundary_base, u64 boundary, u64* end_pos);
-static inline int find_unallocated_cluster(qcow_ctx_t qcow_ctx, u64* offset);
-static int alloc_cluster(qcow_ctx_t qcow_ctx, u64* offset, u64* cluster_offset);
-static int cow_alloc_cluster(qcow_ctx_t qcow_ctx, u64 offset, u64* cluster_offset);
-static int write_compressed_cluster(qcow_ctx_t qcow_ctx, u64 img_offset, unsigned int* recompressed_cluster_size, unsigned int compressed_cluster_size, u8* cluster, unsigned int cluster_data_size);
-static int read_compressed_cluster(qcow_ctx_t qcow_ctx, FILE* file, u64* cluster_offset, u8** clusters, unsigned int *cluster_data_size, unsigned int* compressed_clusters_size);
-static int get_lba_img_offset_for_write(qcow_ctx_t qcow_ctx, u64 offset, u64* img_offset, subcluster_info_t* subcluster_info);
-int qwrite(const void* data, size_t size, size_t nmemb, unsigned int offset, qcow_ctx_t qcow_ctx) ;
-int qread(void* ptr, size_t size, size_t nmemb, unsigned int offset, qcow_ctx_t qcow_ctx);
+int init_qcow_mmap(qcow_ctx_t* qcow_ctx, const char* path_qcow);
+static inline int get_ref_cnt(qcow_ctx_t* qcow_ctx, u64 offset, u64* ref_cnt);
+static int allocate_ref_cnt_table(qcow_ctx_t* qcow_ctx, u64 refcount_table_index);
+static int set_ref_cnt(qcow_ctx_t* qcow_ctx, u64 offset, u64 new_ref_cnt);
+static int update_ref_cnt(qcow_ctx_t* qcow_ctx, u64 offset, u64 new_ref_cnt);
+static int decrease_ref_cnt(qcow_ctx_t* qcow_ctx, u64 offset);
+static int increase_ref_cnt(qcow_ctx_t* qcow_ctx, u64 offset);
+static inline int lba_to_img_offset(qcow_ctx_t* qcow_ctx, u64 offset, u64* img_offset, subcluster_info_t* subcluster_info);
+static int allocate_l2_table(qcow_ctx_t* qcow_ctx, u64 l1_index);
+static int set_lba_at_img_offset(qcow_ctx_t* qcow_ctx, u64 offset, u64 new_entry, subcluster_info_t new_subcluster_info);
+static int extend_img_file(qcow_ctx_t* qcow_ctx, qcow_io_t* file, u64 n, u64 file_boundary_base, u64 boundary, u64* region_pos);
+static int claim_clusters(qcow_ctx_t* qcow_ctx, u64 n, u64* region_pos);
+static int alloc_clusters(qcow_ctx_t* qcow_ctx, u64 n, u64* region_pos);
+static int alloc_compressed_bytes(qcow_ctx_t* qcow_ctx, u64 size, u64* host_offset);
+static int alloc_cluster(qcow_ctx_t* qcow_ctx, u64 offset, u64* cluster_offset);
+static int cow_alloc_cluster(qcow_ctx_t* qcow_ctx, u64 offset, u64* cluster_offset);
+static inline u64 compressed_l2_entry(qcow_ctx_t* qcow_ctx, u64 host_offset, u64 compressed_cluster_size);
+static int write_compressed_cluster(qcow_ctx_t* qcow_ctx, const u8* cluster, u64* l2_entry);
+static int read_compressed_cluster(qcow_ctx_t* qcow_ctx, qcow_io_t* file, u64* cluster_offset, u8* cluster, unsigned int *cluster_data_size, unsigned int* compressed_clusters_size);
+static int read_cached_compressed_cluster(qcow_ctx_t* qcow_ctx, qcow_io_t* file, u64 cluster_offset, u8* ptr, u64 pos, u64 size);
+static int get_lba_img_offset_for_write(qcow_ctx_t* qcow_ctx, u64 offset, u64* img_offset, subcluster_info_t* subcluster_info);
+static int qwrite_cluster(const u8* data, u64 writable_bytes, u64 offset, qcow_ctx_t* qcow_ctx);
+static int qwrite_extent(const u8* data, u64 size, u64 offset, qcow_ctx_t* qcow_ctx, u64* extent_bytes);
+int qwrite(const void* data, size_t size, size_t nmemb, u64 offset, qcow_ctx_t* qcow_ctx);
+int qcompress_cluster(qcow_ctx_t* qcow_ctx, const void* cluster, u8** compressed_cluster, unsigned int* compressed_cluster_size);
+int qwrite_compressed(qcow_ctx_t* qcow_ctx, const void* compressed_cluster, unsigned int compressed_cluster_size, u64 offset);
+static int read_l2_entry_data(qcow_ctx_t* qcow_ctx, u64 l2_entry, u8* ptr, u64 readable_bytes, u64 offset);
+static int find_backing_owner(qcow_ctx_t* qcow_ctx, u64 offset, qcow_chain_cache_entry_t* owner);
+static int read_from_backing_file(u8* ptr, u64 readable_bytes, u64 offset, qcow_ctx_t* qcow_ctx);
+static int copy_from_backing_file(qcow_ctx_t* qcow_ctx, u64 offset, u64 img_offset, u64 size);
+static int qread_cluster(u8* ptr, u64 readable_bytes, u64 offset, qcow_ctx_t* qcow_ctx);
+static int qread_extent(u8* ptr, u64 size, u64 offset, qcow_ctx_t* qcow_ctx, u64* extent_bytes);
+int qread(void* ptr, size_t size, size_t nmemb, u64 offset, qcow_ctx_t* qcow_ctx);
+int qborrow_cluster(const void** ptr, u64* size, u64 offset, qcow_ctx_t* qcow_ctx);
+int qflush(qcow_ctx_t* qcow_ctx);
+int qfsync(qcow_ctx_t* qcow_ctx);
+int qcache_stats(qcow_ctx_t* qcow_ctx, qcow_cache_stats_t* stats);
+static int get_block_status(qcow_ctx_t* qcow_ctx, u64 offset, u64 size, qcow_extent_t* extent);
+int qblock_status(qcow_ctx_t* qcow_ctx, u64 offset, u64 size, qcow_extent_t* extents, u32 extents_cnt);
 
 /* -------------------------------------------------------------------------------------------------------- */
 // ------------------------
 // Static Variables
 // ------------------------
-#define deinit_default_qcow()        deinit_qcow(&default_qcow_ctx)
-#define init_default_qcow(qcow_path) init_qcow(&default_qcow_ctx, qcow_path)
+#define deinit_default_qcow()             deinit_qcow(&default_qcow_ctx)
+#define init_default_qcow(qcow_path)      init_qcow(&default_qcow_ctx, qcow_path)
+#define init_default_qcow_mmap(qcow_path) init_qcow_mmap(&default_qcow_ctx, qcow_path)
 static qcow_ctx_t default_qcow_ctx = {0};
 
 static inline QCowExtType to_qcow_ext_type(u32 val) {
@@ -229,96 +311,86 @@ static inline QCowExtType to_qcow_ext_type(u32 val) {
 }
 
 /* -------------------------------------------------------------------------------------------------------- */
-static inline int write_at(FILE* file, u64 offset, const void* data, size_t size, size_t nmemb) {
-	int ret = fseek(file, offset, SEEK_SET);							
-	if (ret < 0) {															
-		WARNING_LOG("Failed to seek at pos: 0x%llX\n", offset);			
-		return -QCOW_IO_ERROR;												
-	}							
-
-	if (fwrite(data, size, nmemb, file) != nmemb) { 	
-		PERROR_LOG("Failed to write %lu bytes at pos 0x%llX", size * nmemb, offset);											
-		return -QCOW_IO_ERROR;												
+static int init_qcow_locks(qcow_ctx_t* qcow_ctx) {
+	qcow_locks_t* locks = (qcow_locks_t*) qcow_calloc(1, sizeof(qcow_locks_t));
+	if (locks == NULL) {
+		WARNING_LOG("Failed to allocate the locks.\n");
+		return -QCOW_IO_ERROR;
 	}
 
-	return QCOW_NO_ERROR;																	
-}
-
-static inline int read_at(FILE* file, u64 offset, void* data, size_t size, size_t nmemb) {
-	int ret = fseek(file, offset, SEEK_SET);							
-	if (ret < 0) {															
-		WARNING_LOG("Failed to seek at pos: 0x%llX\n", offset);			
-		return -QCOW_IO_ERROR;												
-	}								
+	// Each l2 table has its own lock, so that accesses to different regions of the disk do not contend
+	if ((locks -> l2_locks = (pthread_rwlock_t*) qcow_calloc(MAX(qcow_ctx -> l1_size, 1), sizeof(pthread_rwlock_t))) == NULL) {
+		QCOW_SAFE_FREE(locks);
+		WARNING_LOG("Failed to allocate the l2 locks.\n");
+		return -QCOW_IO_ERROR;
+	}
 
-	if (fread(data, size, nmemb, file) != nmemb) { 	
-		PERROR_LOG("Failed to read %lu bytes at pos 0x%llX", size * nmemb, offset);											
-		return -QCOW_IO_ERROR;												
-	}			
+	locks -> l2_locks_cnt = qcow_ctx -> l1_size;
+	for (u32 i = 0; i < locks -> l2_locks_cnt; ++i) pthread_rwlock_init(locks -> l2_locks + i, NULL);
+	pthread_rwlock_init(&(locks -> refcount_lock), NULL);
+	pthread_mutex_init(&(locks -> alloc_lock), NULL);
+	qcow_ctx -> locks = locks;
 	
 	return QCOW_NO_ERROR;
 }
 
-static inline int zero_out_at(FILE* file, u64 offset, u64 n) {
-	if (offset) {													
-		int ret = fseek(file, offset, SEEK_SET);					
-		if (ret < 0) {												
-			WARNING_LOG("Failed to seek at pos: 0x%llX\n", offset);	
-			return -QCOW_IO_ERROR;									
-		}															
-	}									
-
-	u8 zero[] = {0};										
-	for (unsigned int i = 0; i < n; ++i) {							
-		if (fwrite(zero, sizeof(u8), 1, file) != 1) {	
-			PERROR_LOG("Failed to write zero at pos 0x%llX", offset + i);								
-			return -QCOW_IO_ERROR;									
-		}															
-	}					
+static void deinit_qcow_locks(qcow_ctx_t* qcow_ctx) {
+	qcow_locks_t* locks = qcow_ctx -> locks;
+	if (locks == NULL) return;
+	
+	for (u32 i = 0; i < locks -> l2_locks_cnt; ++i) pthread_rwlock_destroy(locks -> l2_locks + i);
+	pthread_rwlock_destroy(&(locks -> refcount_lock));
+	pthread_mutex_destroy(&(locks -> alloc_lock));
+	QCOW_MULTI_FREE(locks -> l2_locks, locks);
+	qcow_ctx -> locks = NULL;
 
-	return QCOW_NO_ERROR;
+	return;
 }
 
-static inline long long int fsize(FILE* file) {
-	int ret = fseek(file, 0, SEEK_END);
-	if (ret < 0) {
-		PERROR_LOG("Failed to seek to the end of the file.\n");
-		return -QCOW_IO_ERROR;
-	}
-
-	long long int pos = ftell(file);
-	if (pos < 0) {
-		PERROR_LOG("Failed to read the current pos.\n");
-		return -QCOW_IO_ERROR;
+static inline int get_l2_lock(qcow_ctx_t* qcow_ctx, u64 offset, pthread_rwlock_t** l2_lock) {
+	u64 l1_index = (offset / qcow_ctx -> cluster_size) / qcow_ctx -> table_cluster_entries;
+	if (l1_index >= qcow_ctx -> locks -> l2_locks_cnt) {
+		WARNING_LOG("Invalid offset points to unallocated l1_table: 0x%llX\n", offset);
+		return -QCOW_INVALID_OFFSET;
 	}
 
-	if ((ret = fseek(file, 0, SEEK_SET)) < 0) {
-		PERROR_LOG("Failed to seek to the start of the file.\n");
-		return -QCOW_IO_ERROR;
-	}
+	*l2_lock = qcow_ctx -> locks -> l2_locks + l1_index;
 
-	return pos;
+	return QCOW_NO_ERROR;
 }
 
 static inline void deinit_qcow(qcow_ctx_t* qcow_ctx) {
-	if (qcow_ctx -> refcount_table != NULL) {
-		for (unsigned int i = 0; i < qcow_ctx -> refcount_table_size; ++i) QCOW_SAFE_FREE((qcow_ctx -> refcount_table)[i]);
-		QCOW_SAFE_FREE(qcow_ctx -> refcount_table);
-	}
-	if (qcow_ctx -> l1_table != NULL) {
-		for (unsigned int i = 0; i < qcow_ctx -> l1_size; ++i) QCOW_SAFE_FREE((qcow_ctx -> l1_table)[i]);
-		QCOW_SAFE_FREE(qcow_ctx -> l1_table);
-	}
-
-	if (qcow_ctx -> img_file != qcow_ctx -> clusters_file) fclose(qcow_ctx -> clusters_file);
+	// The l2_cache depends on the refcount_cache, hence it has to be released first
+	if (deinit_qcow_cache(qcow_ctx -> l2_cache) < 0) WARNING_LOG("Failed to write back the dirty l2 tables.\n");
+	qcow_ctx -> l2_cache = NULL;
+	QCOW_SAFE_FREE(qcow_ctx -> l1_table);
+	if (deinit_qcow_cache(qcow_ctx -> refcount_cache) < 0) WARNING_LOG("Failed to write back the dirty refcount blocks.\n");
+	qcow_ctx -> refcount_cache = NULL;
+	QCOW_SAFE_FREE(qcow_ctx -> refcount_table);
+	deinit_qcow_free_map(qcow_ctx -> free_map);
+	qcow_ctx -> free_map = NULL;
+	deinit_qcow_cluster_cache(qcow_ctx -> cluster_cache);
+	qcow_ctx -> cluster_cache = NULL;
+
+	if (qcow_ctx -> img_file != qcow_ctx -> clusters_file) qcow_io_close(qcow_ctx -> clusters_file);
 	qcow_ctx -> clusters_file = NULL;
 
-	if (qcow_ctx -> img_file) fclose(qcow_ctx -> img_file);
-   	qcow_ctx -> img_file = NULL;
+	qcow_io_close(qcow_ctx -> img_file);
+	qcow_ctx -> img_file = NULL;
 
-	if (qcow_ctx -> backing_file) fclose(qcow_ctx -> backing_file);
+	qcow_io_close(qcow_ctx -> backing_file);
 	qcow_ctx -> backing_file = NULL;
 
+	if (qcow_ctx -> backing_ctx != NULL) deinit_qcow(qcow_ctx -> backing_ctx);
+	QCOW_SAFE_FREE(qcow_ctx -> backing_ctx);
+	deinit_qcow_chain_cache(qcow_ctx -> chain_cache);
+	qcow_ctx -> chain_cache = NULL;
+
+	qcow_ctx -> compressed_pos = 0;
+	qcow_ctx -> compressed_end = 0;
+
+	deinit_qcow_locks(qcow_ctx);
+
 	return;
 }
 
@@ -346,27 +418,20 @@ static inline void format_qcow_header(qcow_header_t* qcow_header, u8 version) {
 	return;
 }
 
+/// NOTE: the dumps of the header and of its extensions are INFO messages, hence they are printed only once the
+///       log level is raised with qcow_set_log_level, while the raw bytes of the extensions are DEBUG ones.
 static inline void dump_qcow_header(const qcow_header_t* qcow_header) {
-    printf(" -- QCowHeader Dump --\n");
-    printf(" %-25s: '%.3s'\n", "magic", qcow_header -> magic);
-    printf(" %-25s: %u\n", "version", qcow_header -> version);
-    printf(" %-25s: 0x%llX\n", "backing_file_offset", qcow_header -> backing_file_offset);
-    printf(" %-25s: %u\n", "backing_file_name_size", qcow_header -> backing_file_name_size);
-    printf(" %-25s: %u - cluster size: %u bytes\n", "cluster_bits", qcow_header -> cluster_bits, 1 << qcow_header -> cluster_bits);
-	printf(" %-25s: %.2LfGB\n", "size", qcow_header -> size / (1024.0L * 1024.0L * 1024.0L));
-    printf(" %-25s: %s\n", "crypt_method", qcow_header -> crypt_method ? "AES_ENCRYPTION" : "NO_ENCRYPTION");
-    printf(" %-25s: %u\n", "l1_size", qcow_header -> l1_size);
-    printf(" %-25s: 0x%llX\n", "l1_table_offset", qcow_header -> l1_table_offset);
-    printf(" %-25s: 0x%llX\n", "refcount_table_offset", qcow_header -> refcount_table_offset);
-    printf(" %-25s: %u\n", "refcount_table_clusters", qcow_header -> refcount_table_clusters);
-    printf(" %-25s: %u\n", "nb_snapshots", qcow_header -> nb_snapshots);
-    printf(" %-25s: 0x%llX\n", "snapshots_offset", qcow_header -> snapshots_offset);
-	printf(" %-25s: 0x%llX\n", "incompatible_features", qcow_header->incompatible_features);
-    printf(" %-25s: 0x%llX\n", "compatible_features", qcow_header->compatible_features);
-    printf(" %-25s: 0x%llX\n", "autoclear_features", qcow_header->autoclear_features);
-    printf(" %-25s: %u\n", "refcount_order", qcow_header->refcount_order);
-    printf(" %-25s: %u\n", "header_length", qcow_header->header_length);
-    printf(" ---------------------\n");
+	INFO_LOG("QCowHeader Dump:\n"
+			 " %-25s: '%.3s'\n %-25s: %u\n %-25s: 0x%llX\n %-25s: %u\n %-25s: %u - cluster size: %u bytes\n %-25s: %.2LfGB\n"
+			 " %-25s: %s\n %-25s: %u\n %-25s: 0x%llX\n %-25s: 0x%llX\n %-25s: %u\n %-25s: %u\n %-25s: 0x%llX\n"
+			 " %-25s: 0x%llX\n %-25s: 0x%llX\n %-25s: 0x%llX\n %-25s: %u\n %-25s: %u\n",
+			 "magic", qcow_header -> magic, "version", qcow_header -> version, "backing_file_offset", qcow_header -> backing_file_offset,
+			 "backing_file_name_size", qcow_header -> backing_file_name_size, "cluster_bits", qcow_header -> cluster_bits, 1 << qcow_header -> cluster_bits,
+			 "size", qcow_header -> size / (1024.0L * 1024.0L * 1024.0L), "crypt_method", qcow_header -> crypt_method ? "AES_ENCRYPTION" : "NO_ENCRYPTION",
+			 "l1_size", qcow_header -> l1_size, "l1_table_offset", qcow_header -> l1_table_offset, "refcount_table_offset", qcow_header -> refcount_table_offset,
+			 "refcount_table_clusters", qcow_header -> refcount_table_clusters, "nb_snapshots", qcow_header -> nb_snapshots, "snapshots_offset", qcow_header -> snapshots_offset,
+			 "incompatible_features", qcow_header -> incompatible_features, "compatible_features", qcow_header -> compatible_features,
+			 "autoclear_features", qcow_header -> autoclear_features, "refcount_order", qcow_header -> refcount_order, "header_length", qcow_header -> header_length);
 	return;
 }
 
@@ -376,33 +441,24 @@ static inline void dump_qcow_header_extension(const qcow_header_ext_t* qcow_head
         return;
     } 
     
-	printf(" -- QCowHeaderExtension Dump --\n");
-    
-	printf("- %s\n", qcow_ext_types_strs[qcow_header_ext -> ext_type]);
-	printf(" %-25s: %u\n", "ext_length", qcow_header_ext -> ext_length);
-
-    if (qcow_header_ext -> data) {
-        printf(" %-25s: [Data Start]\n", "data");
-        for (u32 i = 0; i < qcow_header_ext -> ext_length; ++i) {
-            printf("  %02X", (qcow_header_ext -> data)[i]);
-            if ((i + 1) % 16 == 0 || i + 1 == qcow_header_ext -> ext_length) {
-                printf("\n");
-            }
-        }
-    } else {
-        printf(" %-25s: NULL\n", "data");
-    }
+	INFO_LOG("QCowHeaderExtension Dump: '%s', ext_length: %u\n", qcow_ext_types_strs[qcow_header_ext -> ext_type], qcow_header_ext -> ext_length);
+	if (qcow_header_ext -> data == NULL) return;
 
-    printf(" -------------------------------\n");
+	// One line of sixteen bytes at a time, as each message carries its own prefix
+	for (u32 i = 0; i < qcow_header_ext -> ext_length; i += 16) {
+		char line[16 * 4 + 1] = {0};
+		for (u32 j = i, pos = 0; j < MIN(i + 16, qcow_header_ext -> ext_length); ++j, pos += 4) snprintf(line + pos, sizeof(line) - pos, "  %02X", (qcow_header_ext -> data)[j]);
+		DEBUG_LOG("%s\n", line);
+	}
 
     return;
 }
 
-static int parse_qcow_ext(qcow_header_ext_t** qcow_exts, FILE* file) {
+static int parse_qcow_ext(qcow_header_ext_t** qcow_exts, qcow_io_t* file, u64 offset) {
 	int exts_cnt = 0;
 	while (TRUE) {
 		u32 ext_type = 0;
-		if (fread(&ext_type, sizeof(u32), 1, file) != 1) {
+		if (read_at(file, offset, &ext_type, sizeof(u32), 1) < 0) {
 			for (int i = 0; i < exts_cnt; ++i) QCOW_SAFE_FREE((*qcow_exts) -> data); 
 			QCOW_SAFE_FREE(*qcow_exts);
 			PERROR_LOG("An error occurred while reading the extension type");
@@ -414,7 +470,7 @@ static int parse_qcow_ext(qcow_header_ext_t** qcow_exts, FILE* file) {
 		qcow_header_ext_t qcow_ext_header = {0};
 		qcow_ext_header.ext_type = to_qcow_ext_type(ext_type);
 
-		if (fread(&(qcow_ext_header.ext_length), sizeof(u32), 1, file) != 1) {
+		if (read_at(file, offset + sizeof(u32), &(qcow_ext_header.ext_length), sizeof(u32), 1) < 0) {
 			for (int i = 0; i < exts_cnt; ++i) QCOW_SAFE_FREE((*qcow_exts) -> data); 
 			QCOW_SAFE_FREE(*qcow_exts);
 			PERROR_LOG("An error occurred while reading the extension length");
@@ -422,6 +478,7 @@ static int parse_qcow_ext(qcow_header_ext_t** qcow_exts, FILE* file) {
 		}
 
 		QCOW_BE_CONVERT(&(qcow_ext_header.ext_length), sizeof(u32));	
+		offset += 2 * sizeof(u32);
 		
 		if (qcow_ext_header.ext_length) {
 			qcow_ext_header.data = (u8*) qcow_calloc(qcow_ext_header.ext_length, sizeof(u8));
@@ -432,7 +489,7 @@ static int parse_qcow_ext(qcow_header_ext_t** qcow_exts, FILE* file) {
 				return -QCOW_IO_ERROR;
 			}
 			
-			if (fread(qcow_ext_header.data, sizeof(u8), qcow_ext_header.ext_length, file) != qcow_ext_header.ext_length) {
+			if (read_at(file, offset, qcow_ext_header.data, sizeof(u8), qcow_ext_header.ext_length) < 0) {
 				for (int i = 0; i < exts_cnt; ++i) QCOW_SAFE_FREE((*qcow_exts) -> data); 
 				QCOW_SAFE_FREE(*qcow_exts);
 				PERROR_LOG("An error occurred while reading the data");
@@ -442,7 +499,7 @@ static int parse_qcow_ext(qcow_header_ext_t** qcow_exts, FILE* file) {
 			// Padding zero-data to set the current pos to the next multiple of 8
 			u64 padding = 0;
 			u8 padding_size = 8 - (qcow_ext_header.ext_length % 8);
-			if (padding_size < 8 && fread(&padding, sizeof(u8), padding_size, file) != padding_size) {
+			if (padding_size < 8 && read_at(file, offset + qcow_ext_header.ext_length, &padding, sizeof(u8), padding_size) < 0) {
 				for (int i = 0; i < exts_cnt; ++i) QCOW_SAFE_FREE((*qcow_exts) -> data); 
 				QCOW_SAFE_FREE(*qcow_exts);
 				PERROR_LOG("Failed to read the padding with size %u bytes", padding_size);
@@ -455,6 +512,8 @@ static int parse_qcow_ext(qcow_header_ext_t** qcow_exts, FILE* file) {
 				WARNING_LOG("Padding field must be zero, but found: %llu\n", padding);
 				return -QCOW_USE_OF_RESERVED_FIELD;
 			}
+
+			offset += qcow_ext_header.ext_length + (padding_size % 8);
 		}
 	
 		DEBUG_LOG("exts_cnt: %d, ext_type: '%s', len: %u\n", exts_cnt + 1, qcow_ext_types_strs[qcow_ext_header.ext_type], qcow_ext_header.ext_length);
@@ -463,21 +522,15 @@ static int parse_qcow_ext(qcow_header_ext_t** qcow_exts, FILE* file) {
 			QCOW_SAFE_FREE(qcow_ext_header.data);
 			break;
 		} else if (qcow_ext_header.ext_type == FEATURE_NAME_TABLE) {
-			printf(" -- Feature Name Table --\n");
-			
 			for (unsigned int i = 0, j = 0; i < qcow_ext_header.ext_length; ++j, i += sizeof(feature_name_table_t)) {
 				feature_name_table_t* feature_name_table = ((feature_name_table_t*) qcow_ext_header.data) + j;
-				if (feature_name_table -> type == INCOMPATIBLE_FEATURE)    printf("INCOMPATIBLE");
-				else if (feature_name_table -> type == COMPATIBLE_FEATURE) printf("COMPATIBLE  ");
-				else if (feature_name_table -> type == AUTOCLEAR_FEATURE)  printf("AUTOCLEAR   ");
-				else                                                       printf("UNKNOWN     ");
-				printf(" FEATURE ");
-				printf("(bit number: %02u): ", feature_name_table -> bit_number & 0x3F);
-				printf("'%.*s'\n", MAX_FEATURE_NAME_SIZE, feature_name_table -> feature_name);
+				const char* feature_type = "UNKNOWN";
+				if (feature_name_table -> type == INCOMPATIBLE_FEATURE)    feature_type = "INCOMPATIBLE";
+				else if (feature_name_table -> type == COMPATIBLE_FEATURE) feature_type = "COMPATIBLE";
+				else if (feature_name_table -> type == AUTOCLEAR_FEATURE)  feature_type = "AUTOCLEAR";
+				INFO_LOG("%-12s FEATURE (bit number: %02u): '%.*s'\n", feature_type, feature_name_table -> bit_number & 0x3F, MAX_FEATURE_NAME_SIZE, feature_name_table -> feature_name);
 			}
 			
-			printf("----------------------------\n");	
-			
 			QCOW_SAFE_FREE(qcow_ext_header.data);
 			
 			continue;
@@ -498,106 +551,156 @@ static int parse_qcow_ext(qcow_header_ext_t** qcow_exts, FILE* file) {
 	return exts_cnt;
 }
 
+/// NOTE: only the refcount table is read at init time, with a single read, while the refcount blocks are loaded
+///       on first use through the refcount_cache, whose memory budget is refcount_cache_size bytes
+///       (QCOW_DEFAULT_REFCOUNT_CACHE_SIZE if left to 0 before init_qcow).
 static int parse_ref_cnt_table(qcow_ctx_t* qcow_ctx) {
-	qcow_ctx -> refcount_table = qcow_calloc(qcow_ctx -> refcount_table_size, sizeof(void*));
+	qcow_ctx -> refcount_table = (u64*) qcow_calloc(MAX(qcow_ctx -> refcount_table_size, 1U), sizeof(u64));
 	if (qcow_ctx -> refcount_table == NULL) {
 		WARNING_LOG("Failed to allocate refcount table.\n");
 		return -QCOW_IO_ERROR;
 	}
 
 	int ret = 0;
-	for (unsigned int refcnt_table_idx = 0; refcnt_table_idx < qcow_ctx -> refcount_table_size; ++refcnt_table_idx) {
-		u64 refcount_block_offset = 0;
-		u64 offset = qcow_ctx -> refcount_table_offset + refcnt_table_idx * sizeof(u64);
-		if ((ret = read_at(qcow_ctx -> img_file, offset, &refcount_block_offset, sizeof(u64), 1)) < 0) {
-			WARNING_LOG("Failed to read the offset.\n");
-			return ret;
-		}
+	if ((ret = read_at(qcow_ctx -> img_file, qcow_ctx -> refcount_table_offset, qcow_ctx -> refcount_table, sizeof(u64), qcow_ctx -> refcount_table_size)) < 0) {
+		WARNING_LOG("Failed to read the refcount table at pos: 0x%llX.\n", qcow_ctx -> refcount_table_offset);
+		return ret;
+	}
 
-		QCOW_BE_CONVERT((u8*) &refcount_block_offset, sizeof(u64));
+	be64_to_cpu_array(qcow_ctx -> refcount_table, qcow_ctx -> refcount_table_size);
+	for (unsigned int refcnt_table_idx = 0; refcnt_table_idx < qcow_ctx -> refcount_table_size; ++refcnt_table_idx) {
+		const u64* refcount_block_offset = qcow_ctx -> refcount_table + refcnt_table_idx;
 
 		// The refcount table and its clusters are unallocated
-		if (refcount_block_offset == 0) continue; 
-		else if (refcount_block_offset & QCOW_MASK_BITS_INTERVAL(9, 0)) {
-			WARNING_LOG("Reserved bits set in refcount_block_offset: 0x%llX\n", refcount_block_offset);
+		if (*refcount_block_offset == 0) continue; 
+		else if (*refcount_block_offset & QCOW_MASK_BITS_INTERVAL(9, 0)) {
+			WARNING_LOG("Reserved bits set in refcount_block_offset: 0x%llX\n", *refcount_block_offset);
 			return -QCOW_USE_OF_RESERVED_FIELD;
-		} else if (!IS_CLUSTER_ALIGNED(refcount_block_offset, qcow_ctx -> cluster_size)) {
-			WARNING_LOG("The table must be aligned to a cluster boundary %llu, %llu, %u.\n", refcount_block_offset, qcow_ctx -> img_file_base, refcnt_table_idx);
+		} else if (!IS_CLUSTER_ALIGNED(*refcount_block_offset, qcow_ctx -> cluster_size)) {
+			WARNING_LOG("The table must be aligned to a cluster boundary %llu, %llu, %u.\n", *refcount_block_offset, qcow_ctx -> img_file_base, refcnt_table_idx);
 			return -QCOW_UNALIGNED_CLUSTER;
 		}
-	
-		(qcow_ctx -> refcount_table)[refcnt_table_idx] = qcow_calloc(qcow_ctx -> refcount_block_entries, qcow_ctx -> refcount_bytes);
-		if ((qcow_ctx -> refcount_table)[refcnt_table_idx] == NULL) {
-			WARNING_LOG("Failed to allocate %u refcount block.\n", refcnt_table_idx);
-			return -QCOW_IO_ERROR;
-		}	
-
-		ret = fseek(qcow_ctx -> img_file, refcount_block_offset, SEEK_SET);
-		if (ret < 0) {
-			PERROR_LOG("Failed to seek at pos: 0x%llX.\n", refcount_block_offset);
-			return -QCOW_IO_ERROR;
-		}
+	}
 
-		for (unsigned int refcnt_block = 0; refcnt_block < qcow_ctx -> refcount_block_entries; ++refcnt_block) {
-			if (fread(QCOW_CAST_PTR((qcow_ctx -> refcount_table)[refcnt_table_idx], u8) + refcnt_block * qcow_ctx -> refcount_bytes, qcow_ctx -> refcount_bytes, 1, qcow_ctx -> img_file) != 1) {
-				PERROR_LOG("Failed to read the refcount");
-				return -QCOW_IO_ERROR;
-			}
-			QCOW_BE_CONVERT(QCOW_CAST_PTR((qcow_ctx -> refcount_table)[refcnt_table_idx], u8) + refcnt_block * qcow_ctx -> refcount_bytes, qcow_ctx -> refcount_bytes);
-		}
+	const u64 refcount_cache_size = (qcow_ctx -> refcount_cache_size == 0) ? QCOW_DEFAULT_REFCOUNT_CACHE_SIZE : qcow_ctx -> refcount_cache_size;
+	qcow_cache_t* refcount_cache = NULL;
+	if ((ret = init_qcow_cache(&refcount_cache, qcow_ctx -> img_file, qcow_ctx -> cluster_size, qcow_ctx -> refcount_table_size, refcount_cache_size)) < 0) {
+		WARNING_LOG("Failed to initialize the refcount cache.\n");
+		return ret;
 	}
 
+	qcow_ctx -> refcount_cache = refcount_cache;
+
 	return QCOW_NO_ERROR;
 }
 
+/// NOTE: only the l1 table is read at init time, while the l2 tables are loaded on first use through the l2_cache,
+///       whose memory budget is l2_cache_size bytes (QCOW_DEFAULT_L2_CACHE_SIZE if left to 0 before init_qcow).
 static int parse_l1_table(qcow_ctx_t* qcow_ctx) {
-	qcow_ctx -> l1_table = (void**) qcow_calloc(qcow_ctx -> l1_size, sizeof(void*));
+	qcow_ctx -> l1_table = (u64*) qcow_calloc(MAX(qcow_ctx -> l1_size, 1U), sizeof(u64));
 	if (qcow_ctx -> l1_table == NULL) {
 		WARNING_LOG("Failed to allocate l1 table.\n");
 		return -QCOW_IO_ERROR;
 	}
 
 	int ret = 0;
+	if ((ret = read_at(qcow_ctx -> img_file, qcow_ctx -> l1_table_offset, qcow_ctx -> l1_table, sizeof(u64), qcow_ctx -> l1_size)) < 0) {
+		WARNING_LOG("Failed to read the l1 table at pos: 0x%llX.\n", qcow_ctx -> l1_table_offset);
+		return ret;
+	}
+
+	be64_to_cpu_array(qcow_ctx -> l1_table, qcow_ctx -> l1_size);
 	for (unsigned int l2_entry = 0; l2_entry < qcow_ctx -> l1_size; ++l2_entry) {
-		u64 l2_offset = 0;
-		u64 offset = qcow_ctx -> l1_table_offset + l2_entry * sizeof(u64);
-		if ((ret = read_at(qcow_ctx -> img_file, offset, &l2_offset, sizeof(u64), 1)) < 0) {
-			WARNING_LOG("Failed to read the offset.\n");
-			return ret;
-		}
-		
-		QCOW_BE_CONVERT((u8*) &l2_offset, sizeof(u64));
+		const u64* l2_offset = qcow_ctx -> l1_table + l2_entry;
 		
 		// The l2 table and its clusters are unallocated
-		if (l2_offset == 0 || (l2_offset & QCOW_MASK_BITS_INTERVAL(56, 9)) == 0) continue; 
-		else if ((l2_offset & QCOW_MASK_BITS_INTERVAL(9, 0)) || (l2_offset & QCOW_MASK_BITS_INTERVAL(63, 52))) {
-			WARNING_LOG("Reserved bits set in l1_entry: 0x%llX.\n", l2_offset);
+		if (*l2_offset == 0 || (*l2_offset & QCOW_MASK_BITS_INTERVAL(56, 9)) == 0) continue; 
+		else if ((*l2_offset & QCOW_MASK_BITS_INTERVAL(9, 0)) || (*l2_offset & QCOW_MASK_BITS_INTERVAL(63, 52))) {
+			WARNING_LOG("Reserved bits set in l1_entry: 0x%llX.\n", *l2_offset);
 			return -QCOW_USE_OF_RESERVED_FIELD;
-		} else if (!IS_CLUSTER_ALIGNED(l2_offset, qcow_ctx -> cluster_size)) {
+		} else if (!IS_CLUSTER_ALIGNED(*l2_offset & QCOW_MASK_BITS_INTERVAL(56, 9), qcow_ctx -> cluster_size)) {
 			WARNING_LOG("The table must be aligned to a cluster boundary.\n");
 			return -QCOW_UNALIGNED_CLUSTER;
 		}
+	}
+
+	const u64 l2_cache_size = (qcow_ctx -> l2_cache_size == 0) ? QCOW_DEFAULT_L2_CACHE_SIZE : qcow_ctx -> l2_cache_size;
+	qcow_cache_t* l2_cache = NULL;
+	if ((ret = init_qcow_cache(&l2_cache, qcow_ctx -> img_file, qcow_ctx -> cluster_size, qcow_ctx -> l1_size, l2_cache_size)) < 0) {
+		WARNING_LOG("Failed to initialize the l2 cache.\n");
+		return ret;
+	}
+
+	qcow_ctx -> l2_cache = l2_cache;
+
+	return QCOW_NO_ERROR;
+}
+
+/// NOTE: the free map is built once at init time by walking every refcount block, while the header and the
+///       metadata tables are always marked as used, even if the image forgot to count them.
+static int init_free_map(qcow_ctx_t* qcow_ctx) {
+	long long int file_size = 0;
+	if ((file_size = fsize(qcow_ctx -> img_file)) < 0) {
+		WARNING_LOG("Failed to get the size of the image file.\n");
+		return file_size;
+	}
+
+	int err = 0;
+	const u64 clusters_cnt = CEILING((u64) file_size, qcow_ctx -> cluster_size);
+	qcow_free_map_t* free_map = NULL;
+	if ((err = init_qcow_free_map(&free_map, clusters_cnt)) < 0) {
+		WARNING_LOG("Failed to initialize the free map.\n");
+		return err;
+	}
+
+	// The header and a trailing partial cluster, which holds the tail of the last compressed cluster
+	qcow_free_map_mark(free_map, 0, 1, TRUE);
+	if (file_size % qcow_ctx -> cluster_size) qcow_free_map_mark(free_map, clusters_cnt - 1, 1, TRUE);
+	
+	qcow_free_map_mark(free_map, qcow_ctx -> refcount_table_offset / qcow_ctx -> cluster_size, qcow_ctx -> refcount_table_clusters, TRUE);
+	qcow_free_map_mark(free_map, qcow_ctx -> l1_table_offset / qcow_ctx -> cluster_size, CEILING(qcow_ctx -> l1_size * sizeof(u64), qcow_ctx -> cluster_size), TRUE);
+	for (unsigned int i = 0; i < qcow_ctx -> l1_size; ++i) {
+		const u64 l2_offset = (qcow_ctx -> l1_table)[i] & QCOW_MASK_BITS_INTERVAL(56, 9);
+		if (l2_offset != 0) qcow_free_map_mark(free_map, l2_offset / qcow_ctx -> cluster_size, 1, TRUE);
+	}
+
+	u8* refcount_block = (u8*) qcow_calloc(qcow_ctx -> cluster_size, sizeof(u8));
+	if (refcount_block == NULL) {
+		deinit_qcow_free_map(free_map);
+		WARNING_LOG("Failed to allocate the refcount block buffer.\n");
+		return -QCOW_IO_ERROR;
+	}
+
+	for (unsigned int refcnt_block = 0; refcnt_block < qcow_ctx -> refcount_table_size; ++refcnt_block) {
+		const u64 refcount_block_offset = (qcow_ctx -> refcount_table)[refcnt_block];
+		const u64 first_cluster = (u64) refcnt_block * qcow_ctx -> refcount_block_entries;
+		if (refcount_block_offset == 0 || first_cluster >= clusters_cnt) continue;
 		
-		ret = fseek(qcow_ctx -> img_file, l2_offset & QCOW_MASK_BITS_INTERVAL(56, 9), SEEK_SET);
-		if (ret < 0) {
-			PERROR_LOG("Failed to read the l2 table offset");
-			return -QCOW_IO_ERROR;
+		qcow_free_map_mark(free_map, refcount_block_offset / qcow_ctx -> cluster_size, 1, TRUE);
+		if ((err = qcow_cache_read(qcow_ctx -> refcount_cache, refcnt_block, refcount_block_offset, 0, refcount_block, qcow_ctx -> cluster_size)) < 0) {
+			QCOW_SAFE_FREE(refcount_block);
+			deinit_qcow_free_map(free_map);
+			WARNING_LOG("Failed to read the refcount block %u.\n", refcnt_block);
+			return err;
 		}
 
-		(qcow_ctx -> l1_table)[l2_entry] = qcow_calloc(qcow_ctx -> table_cluster_entries, qcow_ctx -> l2_entries_size);
-		if ((qcow_ctx -> l1_table)[l2_entry] == NULL) {
-			WARNING_LOG("Failed to allocate %u l2 table.\n", l2_entry);
-			return -QCOW_IO_ERROR;
-		}	
-
-		for (unsigned int i = 0; i < qcow_ctx -> table_cluster_entries; ++i) {
-			if (fread(QCOW_CAST_PTR((qcow_ctx -> l1_table)[l2_entry], u8) + i * qcow_ctx -> l2_entries_size, qcow_ctx -> l2_entries_size, 1, qcow_ctx -> img_file) != 1) {
-				PERROR_LOG("Failed to read the l2 table entry");
-				return -QCOW_IO_ERROR;
+		// A refcount is non-zero if any of its bytes is, regardless of the endianness
+		const u64 entries = MIN(qcow_ctx -> refcount_block_entries, clusters_cnt - first_cluster);
+		for (u64 i = 0; i < entries; ++i) {
+			const u8* ref_cnt = refcount_block + i * qcow_ctx -> refcount_bytes;
+			for (u8 j = 0; j < qcow_ctx -> refcount_bytes; ++j) {
+				if (ref_cnt[j] == 0) continue;
+				qcow_free_map_mark(free_map, first_cluster + i, 1, TRUE);
+				break;
 			}
-			QCOW_BE_CONVERT(QCOW_CAST_PTR((qcow_ctx -> l1_table)[l2_entry], u8) + i * qcow_ctx -> l2_entries_size, qcow_ctx -> l2_entries_size);
 		}
 	}
+	
+	QCOW_SAFE_FREE(refcount_block);
+
+	qcow_ctx -> free_map = free_map;
+	
+	DEBUG_LOG("free_map: %llu free clusters out of %llu\n", free_map -> free_cnt, free_map -> clusters_cnt);
 
 	return QCOW_NO_ERROR;
 }
@@ -646,14 +749,10 @@ static int recompute_ref_cnt(qcow_ctx_t* qcow_ctx) {
 	// Deallocate all the ref_cnt tables
 	int err = 0;
 	for (unsigned int i = 0; i < qcow_ctx -> refcount_table_size; ++i) {
-		if (qcow_ctx -> refcount_table[i] == NULL) continue;
-		
-		u64 ref_cnt_table_offset = 0;
-		if ((err = read_at(qcow_ctx -> img_file, qcow_ctx -> refcount_table_offset + i * sizeof(u64), &ref_cnt_table_offset, sizeof(u64), 1)) < 0) {
-			WARNING_LOG("Failed to read the refcnt_table offset.\n");
-			return err;
-		}
+		const u64 ref_cnt_table_offset = (qcow_ctx -> refcount_table)[i];
+		if (ref_cnt_table_offset == 0) continue;
 
+		qcow_cache_discard(qcow_ctx -> refcount_cache, i);
 		if ((err = deallocate_cluster(qcow_ctx, ref_cnt_table_offset)) < 0) {
 			WARNING_LOG("Failed to deallocate the cluster containing the ref_cnt table.\n");
 			return err;
@@ -665,18 +764,33 @@ static int recompute_ref_cnt(qcow_ctx_t* qcow_ctx) {
 			return err;
 		}
 		
-		QCOW_SAFE_FREE((qcow_ctx -> refcount_table)[i]);
+		(qcow_ctx -> refcount_table)[i] = 0;
+	}
+
+	// Allocate the ref_cnt tables by walking through the l2_entries, reading and converting each l2 table whole
+	u64* l2_table = (u64*) qcow_calloc(qcow_ctx -> cluster_size, sizeof(u8));
+	if (l2_table == NULL) {
+		WARNING_LOG("Failed to allocate the l2 table buffer.\n");
+		return -QCOW_IO_ERROR;
 	}
 
-	// Allocate the ref_cnt tables by walking through the l2_entries
+	const u64 l2_entry_words = qcow_ctx -> l2_entries_size / sizeof(u64);
 	for (unsigned int l2_entry = 0; l2_entry < qcow_ctx -> l1_size; ++l2_entry) {
-		if ((qcow_ctx -> l1_table)[l2_entry] == NULL) continue;
+		const u64 l2_offset = (qcow_ctx -> l1_table)[l2_entry] & QCOW_MASK_BITS_INTERVAL(56, 9);
+		if (l2_offset == 0) continue;
+		if ((err = qcow_cache_read(qcow_ctx -> l2_cache, l2_entry, l2_offset, 0, l2_table, qcow_ctx -> cluster_size)) < 0) {
+			QCOW_SAFE_FREE(l2_table);
+			WARNING_LOG("Failed to read the l2 table %u.\n", l2_entry);
+			return err;
+		}
+		
+		be64_to_cpu_array(l2_table, qcow_ctx -> cluster_size / sizeof(u64));
 		for (unsigned int j = 0; j < qcow_ctx -> table_cluster_entries; ++j) {
-			u64 cluster_offset = 0;
-			mem_cpy(&cluster_offset, QCOW_CAST_PTR((qcow_ctx -> l1_table)[l2_entry], u8) + j * qcow_ctx -> l2_entries_size, sizeof(u64));
+			const u64 cluster_offset = l2_table[j * l2_entry_words];
 			if ((cluster_offset & QCOW_MASK_BITS_INTERVAL(56, 9)) == 0 && (((cluster_offset >> 63) & 1) == 0 || qcow_ctx -> backing_file == NULL)) {
 				u64 offset = j + (l2_entry * qcow_ctx -> cluster_size * qcow_ctx -> table_cluster_entries);
-				if ((err = update_ref_cnt(*qcow_ctx, offset, 1)) < 0) {
+				if ((err = update_ref_cnt(qcow_ctx, offset, 1)) < 0) {
+					QCOW_SAFE_FREE(l2_table);
 					WARNING_LOG("Failed to update the ref cnt.\n");
 					return err;
 				}
@@ -684,6 +798,8 @@ static int recompute_ref_cnt(qcow_ctx_t* qcow_ctx) {
 		}
 	}
 
+	QCOW_SAFE_FREE(l2_table);
+
 	return QCOW_NO_ERROR;
 }
 
@@ -742,9 +858,10 @@ static inline int check_version_three_features(qcow_header_t* qcow_header, qcow_
 }
 
 static int parse_qcow_header(qcow_ctx_t* qcow_ctx, qcow_header_t* qcow_header) {
-	if (fread(qcow_header, 1, QCOW_HEADER2_SIZE, qcow_ctx -> img_file) != QCOW_HEADER2_SIZE) {
-		PERROR_LOG("An error occurred while reading the qcow header");
-		return -QCOW_IO_ERROR;
+	int err = 0;
+	if ((err = read_at(qcow_ctx -> img_file, 0, qcow_header, sizeof(u8), QCOW_HEADER2_SIZE)) < 0) {
+		WARNING_LOG("An error occurred while reading the qcow header.\n");
+		return err;
 	}
 
 	format_qcow_header(qcow_header, 2);
@@ -766,9 +883,9 @@ static int parse_qcow_header(qcow_ctx_t* qcow_ctx, qcow_header_t* qcow_header) {
 		return -QCOW_CLUSTER_BITS_TOO_SMALL;
 	} 
 
-	if (fread(QCOW_CAST_PTR(qcow_header, u8) + QCOW_HEADER2_SIZE, QCOW_HEADER3_EXT, 1, qcow_ctx -> img_file) != 1) {
-		PERROR_LOG("An error occurred while reading the qcow header");
-		return -QCOW_IO_ERROR;
+	if ((err = read_at(qcow_ctx -> img_file, QCOW_HEADER2_SIZE, QCOW_CAST_PTR(qcow_header, u8) + QCOW_HEADER2_SIZE, QCOW_HEADER3_EXT, 1)) < 0) {
+		WARNING_LOG("An error occurred while reading the qcow header.\n");
+		return err;
 	}
 
 	format_qcow_header(qcow_header, 3);
@@ -778,25 +895,27 @@ static int parse_qcow_header(qcow_ctx_t* qcow_ctx, qcow_header_t* qcow_header) {
 	else qcow_ctx -> l2_entries_size = L2_ENTRY_SIZE;
 	qcow_ctx -> use_erdf = (qcow_header -> incompatible_features >> 2) & 1;
 
-	int err = 0;
 	if (qcow_header -> version >= 3 && (err = check_version_three_features(qcow_header, qcow_ctx)) < 0) {
 		WARNING_LOG("An error occurred while checking for version >=3 features.\n");
 		return err;
 	}
 
 	dump_qcow_header(qcow_header);
-	printf(" Compression Type: '%s'\n", compression_type_str[qcow_ctx -> compression_type]);
-    printf(" ---------------------\n");
+	INFO_LOG("Compression Type: '%s'\n", compression_type_str[qcow_ctx -> compression_type]);
 
 	return QCOW_NO_ERROR;
 }
 
 static int init_qcow_img(qcow_ctx_t* qcow_ctx, const char* path_qcow) {
-	if ((qcow_ctx -> img_file = fopen(path_qcow, "rb+")) == NULL) {
-		PERROR_LOG("An error occurred while opening the qcow file");
-		return -QCOW_IO_ERROR;
+	int err = 0;
+	qcow_io_t* img_file = NULL;
+	if ((err = qcow_io_open(qcow_ctx -> io_ops, path_qcow, !qcow_ctx -> read_only, &img_file)) < 0) {
+		WARNING_LOG("An error occurred while opening the qcow file.\n");
+		return err;
 	}
 
+	qcow_ctx -> img_file = img_file;
+
 	if ((qcow_ctx -> img_size = fsize(qcow_ctx -> img_file)) < 0) {
 		WARNING_LOG("Failed to get the size of the backing file.\n");
 		return qcow_ctx -> img_size; 
@@ -807,50 +926,103 @@ static int init_qcow_img(qcow_ctx_t* qcow_ctx, const char* path_qcow) {
 	return QCOW_NO_ERROR;
 }
 
-static int init_backing_file(qcow_ctx_t* qcow_ctx) {
-	long int old_pos = 0;
-	if ((old_pos = ftell(qcow_ctx -> img_file)) < 0) {
-		PERROR_LOG("Failed to get the current pos.\n");
-		return -QCOW_IO_ERROR;
+/// NOTE: the backing file name is resolved against the directory of the image unless it is an absolute path,
+///       then a qcow2 backing file is parsed as its own read-only qcow_ctx, which in turn initializes the rest of the chain,
+///       while any other backing file is read as a raw image.
+static int init_backing_file(qcow_ctx_t* qcow_ctx, const char* path_qcow) {
+	if (qcow_ctx -> chain_depth + 1 >= MAX_BACKING_CHAIN_DEPTH) {
+		WARNING_LOG("The backing chain is deeper than %u layers.\n", MAX_BACKING_CHAIN_DEPTH);
+		return -QCOW_BACKING_CHAIN_TOO_DEEP;
+	} else if (qcow_ctx -> backing_file_name_size > MAX_BACKING_FILE_NAME) {
+		WARNING_LOG("The backing file name is too long: %u bytes.\n", qcow_ctx -> backing_file_name_size);
+		return -QCOW_INVALID_SIZE;
 	}
-	
+
 	int err = 0;
-	char path_backing_file[1024] = {0};
-	if ((err = read_at(qcow_ctx -> img_file, qcow_ctx -> backing_file_offset, path_backing_file, sizeof(u8), qcow_ctx -> backing_file_size)) < 0) {
+	char backing_file_name[MAX_BACKING_FILE_NAME + 1] = {0};
+	if ((err = read_at(qcow_ctx -> img_file, qcow_ctx -> backing_file_offset, backing_file_name, sizeof(u8), qcow_ctx -> backing_file_name_size)) < 0) {
 		WARNING_LOG("Failed to read the backing file name.\n");
 		return err;
 	}
+
+	char path_backing_file[2 * (MAX_BACKING_FILE_NAME + 1)] = {0};
+	size_t dir_len = 0;
+	if (backing_file_name[0] != '/') {
+		for (size_t i = 0; path_qcow[i] != '\0' && i < MAX_BACKING_FILE_NAME; ++i) {
+			if (path_qcow[i] == '/') dir_len = i + 1;
+		}
+		mem_cpy(path_backing_file, path_qcow, dir_len);
+	}
+	mem_cpy(path_backing_file + dir_len, backing_file_name, qcow_ctx -> backing_file_name_size);
 	
-	DEBUG_LOG("Using backing file: '%.*s'.\n", (int) qcow_ctx -> backing_file_offset, path_backing_file);
+	DEBUG_LOG("Using backing file: '%s' (depth: %u).\n", path_backing_file, qcow_ctx -> chain_depth + 1);
 
-	if ((qcow_ctx -> backing_file = fopen(path_backing_file, "rb")) == NULL) {
-		PERROR_LOG("An error occurred while opening the backing file");
-		return -QCOW_IO_ERROR;
+	qcow_io_t* backing_file = NULL;
+	if ((err = qcow_io_open(qcow_ctx -> io_ops, path_backing_file, FALSE, &backing_file)) < 0) {
+		WARNING_LOG("An error occurred while opening the backing file.\n");
+		return err;
 	}
+
+	qcow_ctx -> backing_file = backing_file;
 	
 	if ((qcow_ctx -> backing_file_size = fsize(qcow_ctx -> backing_file)) < 0) {
 		WARNING_LOG("Failed to get the size of the backing file.\n");
 		return qcow_ctx -> backing_file_size; 
 	}
 
-	DEBUG_LOG("File len: %.2LfMB (0x%llX)\n", qcow_ctx -> backing_file_size / (1024.0L * 1024.0L), qcow_ctx -> backing_file_size);
+	char magic[5] = {0};
+	if (qcow_ctx -> backing_file_size < (long long int) QCOW_HEADER2_SIZE || read_at(qcow_ctx -> backing_file, 0, magic, sizeof(u8), 4) < 0 || str_n_cmp(magic, "QFI\xfb", 4) != 0) {
+		DEBUG_LOG("Raw backing file len: %.2LfMB (0x%llX)\n", qcow_ctx -> backing_file_size / (1024.0L * 1024.0L), qcow_ctx -> backing_file_size);
+		return QCOW_NO_ERROR;
+	}
+
+	// The qcow2 backing layer owns its own handle of the file
+	qcow_io_close(qcow_ctx -> backing_file);
+	qcow_ctx -> backing_file = NULL;
 	
-	if ((err = fseek(qcow_ctx -> img_file, old_pos, SEEK_SET)) < 0) {
-		PERROR_LOG("Failed to seek at pos: %ld\n", old_pos);
+	qcow_ctx_t* backing_ctx = (qcow_ctx_t*) qcow_calloc(1, sizeof(qcow_ctx_t));
+	if (backing_ctx == NULL) {
+		WARNING_LOG("Failed to allocate the backing layer.\n");
 		return -QCOW_IO_ERROR;
 	}
 
+	backing_ctx -> io_ops = qcow_ctx -> io_ops;
+	backing_ctx -> read_only = TRUE;
+	backing_ctx -> chain_depth = qcow_ctx -> chain_depth + 1;
+	backing_ctx -> l2_cache_size = qcow_ctx -> l2_cache_size;
+	backing_ctx -> cluster_cache_size = qcow_ctx -> cluster_cache_size;
+	backing_ctx -> skip_checksums = qcow_ctx -> skip_checksums;
+	if ((err = init_qcow(backing_ctx, path_backing_file)) < 0) {
+		QCOW_SAFE_FREE(backing_ctx);
+		WARNING_LOG("Failed to init the backing layer '%s'.\n", path_backing_file);
+		return err;
+	}
+
+	qcow_ctx -> backing_ctx = backing_ctx;
+	qcow_ctx -> backing_file_size = backing_ctx -> size;
+
+	qcow_chain_cache_t* chain_cache = NULL;
+	if ((err = init_qcow_chain_cache(&chain_cache)) < 0) {
+		WARNING_LOG("Failed to initialize the chain cache.\n");
+		return err;
+	}
+
+	qcow_ctx -> chain_cache = chain_cache;
+
 	return QCOW_NO_ERROR;
 }
 
 static int init_raw_external_data(qcow_ctx_t* qcow_ctx, qcow_header_ext_t qcow_header_ext) {
 	DEBUG_LOG("Using raw external data file: '%.*s'.\n", (int) qcow_header_ext.ext_length, qcow_header_ext.data);
 	
-	if ((qcow_ctx -> clusters_file = fopen((char*) qcow_header_ext.data, "rb+")) == NULL) {
-		PERROR_LOG("Failed to open the raw external data file");
-		return -QCOW_IO_ERROR;
+	int err = 0;
+	qcow_io_t* clusters_file = NULL;
+	if ((err = qcow_io_open(qcow_ctx -> io_ops, (char*) qcow_header_ext.data, !qcow_ctx -> read_only, &clusters_file)) < 0) {
+		WARNING_LOG("Failed to open the raw external data file.\n");
+		return err;
 	}
-	
+
+	qcow_ctx -> clusters_file = clusters_file;
 
 	if ((qcow_ctx -> clusters_file_size = fsize(qcow_ctx -> clusters_file)) < 0) {
 		WARNING_LOG("Failed to get the size of the raw external data file.\n");
@@ -879,14 +1051,9 @@ int init_qcow(qcow_ctx_t* qcow_ctx, const char* path_qcow) {
 		return err;
 	}
 
-	if (qcow_ctx -> backing_file_name_size > 0 && (err = init_backing_file(qcow_ctx)) < 0) {
-		deinit_qcow(qcow_ctx);
-		WARNING_LOG("Failed to init the backing file.\n");
-		return err;
-	}
-
 	qcow_header_ext_t* qcow_header_exts = NULL;
-    int header_exts_cnts = parse_qcow_ext(&qcow_header_exts, qcow_ctx -> img_file);
+	const u64 header_exts_offset = (qcow_header.version >= 3) ? qcow_header.header_length : QCOW_HEADER2_SIZE;
+    int header_exts_cnts = parse_qcow_ext(&qcow_header_exts, qcow_ctx -> img_file, header_exts_offset);
 	if (header_exts_cnts < 0) {
 		deinit_qcow(qcow_ctx);
 		WARNING_LOG("An error occurred while parsing the header extensions.\n");
@@ -915,7 +1082,7 @@ int init_qcow(qcow_ctx_t* qcow_ctx, const char* path_qcow) {
 	if (qcow_ctx -> clusters_file == NULL && qcow_ctx -> use_erdf) {
 		WARNING_LOG("Expected an external raw data file, but found none.\n");
 		return -QCOW_UNINITIALIZED_ERDF;
-	} else {
+	} else if (qcow_ctx -> clusters_file == NULL) {
 		qcow_ctx -> clusters_file = qcow_ctx -> img_file;
 		qcow_ctx -> clusters_file_size = qcow_ctx -> img_size;
 		qcow_ctx -> clusters_file_base = qcow_ctx -> img_file_base;
@@ -931,7 +1098,13 @@ int init_qcow(qcow_ctx_t* qcow_ctx, const char* path_qcow) {
 	qcow_ctx -> refcount_table_size = qcow_ctx -> refcount_table_clusters * qcow_ctx -> cluster_size / sizeof(u64); 
 	qcow_ctx -> table_cluster_entries = qcow_ctx -> cluster_size / sizeof(u64);
 	if (qcow_ctx -> use_extended_l2_entries) qcow_ctx -> table_cluster_entries /= 2;
-	if ((err = parse_ref_cnt_table(qcow_ctx)) < 0) {
+	if ((err = init_qcow_locks(qcow_ctx)) < 0) {
+		deinit_qcow(qcow_ctx);
+		WARNING_LOG("Failed to initialize the locks.\n");
+		return err;
+	}
+
+	if (!qcow_ctx -> read_only && (err = parse_ref_cnt_table(qcow_ctx)) < 0) {
 		deinit_qcow(qcow_ctx);
 		WARNING_LOG("Failed to parse ref_cnt_table.\n");
 		return -QCOW_IO_ERROR;
@@ -943,65 +1116,140 @@ int init_qcow(qcow_ctx_t* qcow_ctx, const char* path_qcow) {
 		return -QCOW_IO_ERROR;
 	}
 
-	if ((qcow_header.incompatible_features & 1) && (err = recompute_ref_cnt(qcow_ctx)) < 0) {
+	// The refcount blocks must reach the image before the l2 entries referencing the clusters they count
+	if (qcow_ctx -> refcount_cache != NULL) qcow_cache_set_dependency(qcow_ctx -> l2_cache, qcow_ctx -> refcount_cache);
+
+	const u64 cluster_cache_size = (qcow_ctx -> cluster_cache_size == 0) ? QCOW_DEFAULT_CLUSTER_CACHE_SIZE : qcow_ctx -> cluster_cache_size;
+	qcow_cluster_cache_t* cluster_cache = NULL;
+	if ((err = init_qcow_cluster_cache(&cluster_cache, qcow_ctx -> cluster_size, cluster_cache_size)) < 0) {
+		deinit_qcow(qcow_ctx);
+		WARNING_LOG("Failed to initialize the cluster cache.\n");
+		return err;
+	}
+	
+	qcow_ctx -> cluster_cache = cluster_cache;
+
+	if (qcow_ctx -> backing_file_name_size > 0 && (err = init_backing_file(qcow_ctx, path_qcow)) < 0) {
+		deinit_qcow(qcow_ctx);
+		WARNING_LOG("Failed to init the backing file.\n");
+		return err;
+	}
+
+	if ((qcow_header.incompatible_features & 1) && qcow_ctx -> read_only) {
+		DEBUG_LOG("The image is dirty, but the ref_cnt tables are not recomputed as it has been opened read-only.\n");
+	} else if ((qcow_header.incompatible_features & 1) && (err = recompute_ref_cnt(qcow_ctx)) < 0) {
 		WARNING_LOG("Failed to recompute the ref_cnt tables.\n");
 		return err;
 	}
 
+	if (!qcow_ctx -> read_only && (err = init_free_map(qcow_ctx)) < 0) {
+		deinit_qcow(qcow_ctx);
+		WARNING_LOG("Failed to build the free map.\n");
+		return err;
+	}
+
 	return QCOW_NO_ERROR;
 }
 
-static inline int get_ref_cnt(qcow_ctx_t qcow_ctx, u64 offset, u64* ref_cnt) {
-	unsigned int refcount_block_index = (offset / qcow_ctx.cluster_size) % qcow_ctx.refcount_block_entries;
-	unsigned int refcount_table_index = (offset / qcow_ctx.cluster_size) / qcow_ctx.refcount_block_entries;
+/// NOTE: the image, and the backing file if present, are opened read-only and mapped in memory,
+///       so that qread and qborrow_cluster are served straight out of the mapping, while qwrite fails.
+int init_qcow_mmap(qcow_ctx_t* qcow_ctx, const char* path_qcow) {
+	qcow_ctx -> io_ops = &mmap_io_ops;
+	qcow_ctx -> read_only = TRUE;
+	return init_qcow(qcow_ctx, path_qcow);
+}
+
+static inline int get_ref_cnt(qcow_ctx_t* qcow_ctx, u64 offset, u64* ref_cnt) {
+	unsigned int refcount_block_index = (offset / qcow_ctx -> cluster_size) % qcow_ctx -> refcount_block_entries;
+	unsigned int refcount_table_index = (offset / qcow_ctx -> cluster_size) / qcow_ctx -> refcount_block_entries;
 	
-	if (refcount_table_index >= qcow_ctx.refcount_table_size) {
+	if (qcow_ctx -> refcount_table == NULL) {
+		WARNING_LOG("The refcount metadata is not loaded, as the image has been opened read-only.\n");
+		return -QCOW_READ_ONLY_IMAGE;
+	} else if (refcount_table_index >= qcow_ctx -> refcount_table_size) {
 		WARNING_LOG("Invalid offset: 0x%llX\n", offset);
 		return -QCOW_INVALID_OFFSET;
-	} else if ((qcow_ctx.refcount_table)[refcount_table_index] == NULL) {
-		DEBUG_LOG("Unallocated refcount table and clusters.\n");
+	}
+	
+	pthread_rwlock_rdlock(&(qcow_ctx -> locks -> refcount_lock));
+	
+	const u64 refcount_block_offset = (qcow_ctx -> refcount_table)[refcount_table_index];
+	if (refcount_block_offset == 0) {
+		pthread_rwlock_unlock(&(qcow_ctx -> locks -> refcount_lock));
+		TRACE_LOG("Unallocated refcount table and clusters.\n");
 		*ref_cnt = 0;
 		return QCOW_NO_ERROR;
 	}
 	
-	mem_cpy(ref_cnt, QCOW_CAST_PTR((qcow_ctx.refcount_table)[refcount_table_index], u8) + refcount_block_index * qcow_ctx.refcount_bytes, qcow_ctx.refcount_bytes);
+	u64 value = 0;
+	int err = qcow_cache_read(qcow_ctx -> refcount_cache, refcount_table_index, refcount_block_offset, refcount_block_index * qcow_ctx -> refcount_bytes, &value, qcow_ctx -> refcount_bytes);
+	
+	pthread_rwlock_unlock(&(qcow_ctx -> locks -> refcount_lock));
+	
+	if (err < 0) {
+		WARNING_LOG("Failed to read the refcount block %u.\n", refcount_table_index);
+		return err;
+	}
+	
+	QCOW_BE_CONVERT((u8*) &value, qcow_ctx -> refcount_bytes);
+	*ref_cnt = value;
 	
 	return QCOW_NO_ERROR;
 }
 
-static int allocate_ref_cnt_table(qcow_ctx_t qcow_ctx, u64 refcount_table_index) {		
+/// NOTE: the new refcount block, counting itself, is written back and synced before the refcount table points to it,
+///       and the table entry is synced in turn, as the clusters counted by a block missing from the table would read as free.
+static int allocate_ref_cnt_table(qcow_ctx_t* qcow_ctx, u64 refcount_table_index) {		
 	int err = 0;
 	u64 refcnt_block_offset = 0;
-	if ((err = extend_img_file(qcow_ctx.img_file, qcow_ctx.cluster_size, qcow_ctx.img_file_base, qcow_ctx.cluster_size, &refcnt_block_offset)) < 0) {
-		WARNING_LOG("Failed to extend the image file by %llu bytes.\n", qcow_ctx.cluster_size);
+	if ((err = claim_clusters(qcow_ctx, 1, &refcnt_block_offset)) < 0) {
+		WARNING_LOG("Failed to claim a cluster for the refcount block.\n");
 		return err;
 	}
 	
-	QCOW_BE_CONVERT((u8*) &refcnt_block_offset, sizeof(u64));
-	u64 offset = qcow_ctx.refcount_table_offset + refcount_table_index * sizeof(u64);
-	if ((err = write_at(qcow_ctx.img_file, offset, &refcnt_block_offset, sizeof(u64), 1)) < 0) {
+	(qcow_ctx -> refcount_table)[refcount_table_index] = refcnt_block_offset;
+	if ((err = qcow_cache_new_table(qcow_ctx -> refcount_cache, refcount_table_index, refcnt_block_offset)) < 0) {
+		WARNING_LOG("Failed to cache the new refcount block.\n");
+		return err;
+	}
+
+	// The refcount block counts itself, which may in turn require allocating the block covering it
+	if ((err = set_ref_cnt(qcow_ctx, refcnt_block_offset, 1)) < 0) {
+		WARNING_LOG("Failed to update the ref_cnt of the new refcount block.\n");
+		return err;
+	}
+
+	if ((err = qcow_cache_sync(qcow_ctx -> refcount_cache)) < 0) {
+		WARNING_LOG("Failed to sync the refcount blocks.\n");
+		return err;
+	}
+
+	u64 refcount_table_entry = refcnt_block_offset;
+	QCOW_BE_CONVERT((u8*) &refcount_table_entry, sizeof(u64));
+	u64 offset = qcow_ctx -> refcount_table_offset + refcount_table_index * sizeof(u64);
+	if ((err = write_at(qcow_ctx -> img_file, offset, &refcount_table_entry, sizeof(u64), 1)) < 0) {
 		WARNING_LOG("Failed to update the ref_cnt_table index.\n");
 		return err;
 	}
-	
-	(qcow_ctx.refcount_table)[refcount_table_index] = qcow_calloc(qcow_ctx.refcount_block_entries, qcow_ctx.refcount_bytes);
-	if ((qcow_ctx.refcount_table)[refcount_table_index] == NULL) {
-		WARNING_LOG("Failed to allocate the new refcount block.\n");
-		return -QCOW_IO_ERROR;
+
+	if ((err = fsync_file(qcow_ctx -> img_file)) < 0) {
+		WARNING_LOG("Failed to sync the ref_cnt_table index.\n");
+		return err;
 	}
 
 	return QCOW_NO_ERROR;
 }
 
-static int update_ref_cnt(qcow_ctx_t qcow_ctx, u64 offset, u64 new_ref_cnt) {
-	unsigned int refcount_block_index = (offset / qcow_ctx.cluster_size) % qcow_ctx.refcount_block_entries;
-	unsigned int refcount_table_index = (offset / qcow_ctx.cluster_size) / qcow_ctx.refcount_block_entries;
+/// NOTE: the refcount is only updated in the refcount_cache, and it reaches the image once the block is evicted or flushed.
+static int set_ref_cnt(qcow_ctx_t* qcow_ctx, u64 offset, u64 new_ref_cnt) {
+	unsigned int refcount_block_index = (offset / qcow_ctx -> cluster_size) % qcow_ctx -> refcount_block_entries;
+	unsigned int refcount_table_index = (offset / qcow_ctx -> cluster_size) / qcow_ctx -> refcount_block_entries;
 	
 	int err = 0;
-	if (refcount_table_index >= qcow_ctx.refcount_table_size) {
+	if (refcount_table_index >= qcow_ctx -> refcount_table_size) {
 		WARNING_LOG("Invalid offset: 0x%llX\n", offset);
 		return -QCOW_INVALID_OFFSET;
-	} else if ((qcow_ctx.refcount_table)[refcount_table_index] == NULL) {
+	} else if ((qcow_ctx -> refcount_table)[refcount_table_index] == 0) {
 		DEBUG_LOG("ALLOCATING REF CNT TABLE.\n");
 		if ((err = allocate_ref_cnt_table(qcow_ctx, refcount_table_index)) < 0) {
 			WARNING_LOG("Failed to allocate the ref_cnt_table.\n");
@@ -1009,60 +1257,135 @@ static int update_ref_cnt(qcow_ctx_t qcow_ctx, u64 offset, u64 new_ref_cnt) {
 		}
 	}
 
-	mem_cpy(QCOW_CAST_PTR((qcow_ctx.refcount_table)[refcount_table_index], u8) + refcount_block_index * qcow_ctx.refcount_bytes, &new_ref_cnt, qcow_ctx.refcount_bytes);
+	const u64 refcount_block_offset = (qcow_ctx -> refcount_table)[refcount_table_index];
+	const bool released = (new_ref_cnt == 0);
+	QCOW_BE_CONVERT((u8*) &new_ref_cnt, qcow_ctx -> refcount_bytes);
+	if ((err = qcow_cache_write(qcow_ctx -> refcount_cache, refcount_table_index, refcount_block_offset, refcount_block_index * qcow_ctx -> refcount_bytes, &new_ref_cnt, qcow_ctx -> refcount_bytes)) < 0) {
+		WARNING_LOG("Failed to update the ref_cnt.\n");
+		return err;
+	}
 	
-	u64 refcount_block_offset = 0;
-	u64 table_offset = qcow_ctx.refcount_table_offset + refcount_table_index * sizeof(u64);
-	if ((err = read_at(qcow_ctx.img_file, table_offset, &refcount_block_offset, sizeof(u64), 1)) < 0) {
-		WARNING_LOG("Failed to read the table offset.\n");
+	// The released cluster becomes a hole that the allocations can reuse after the next qflush, as until then
+	// the cached l2 table that dropped it is not on disk, and overwriting the cluster would corrupt the old mapping
+	if (released && qcow_ctx -> free_map != NULL) {
+		pthread_mutex_lock(&(qcow_ctx -> locks -> alloc_lock));
+		err = qcow_free_map_release(qcow_ctx -> free_map, offset / qcow_ctx -> cluster_size);
+		pthread_mutex_unlock(&(qcow_ctx -> locks -> alloc_lock));
+		if (err < 0) {
+			WARNING_LOG("Failed to release the cluster in the free map.\n");
+			return err;
+		}
+	}
+
+	return QCOW_NO_ERROR;
+}
+
+static int update_ref_cnt(qcow_ctx_t* qcow_ctx, u64 offset, u64 new_ref_cnt) {
+	pthread_rwlock_wrlock(&(qcow_ctx -> locks -> refcount_lock));
+	int err = set_ref_cnt(qcow_ctx, offset, new_ref_cnt);
+	pthread_rwlock_unlock(&(qcow_ctx -> locks -> refcount_lock));
+	return err;
+}
+
+/// NOTE: the refcount is read and decreased under the same lock, so that two clusters dropping their reference
+///       to the same host cluster cannot both read the old value.
+static int decrease_ref_cnt(qcow_ctx_t* qcow_ctx, u64 offset) {
+	const unsigned int refcount_block_index = (offset / qcow_ctx -> cluster_size) % qcow_ctx -> refcount_block_entries;
+	const unsigned int refcount_table_index = (offset / qcow_ctx -> cluster_size) / qcow_ctx -> refcount_block_entries;
+	if (refcount_table_index >= qcow_ctx -> refcount_table_size) {
+		WARNING_LOG("Invalid offset: 0x%llX\n", offset);
+		return -QCOW_INVALID_OFFSET;
+	}
+
+	pthread_rwlock_wrlock(&(qcow_ctx -> locks -> refcount_lock));
+
+	int err = 0;
+	u64 ref_cnt = 0;
+	const u64 refcount_block_offset = (qcow_ctx -> refcount_table)[refcount_table_index];
+	if (refcount_block_offset != 0 && (err = qcow_cache_read(qcow_ctx -> refcount_cache, refcount_table_index, refcount_block_offset, refcount_block_index * qcow_ctx -> refcount_bytes, &ref_cnt, qcow_ctx -> refcount_bytes)) < 0) {
+		pthread_rwlock_unlock(&(qcow_ctx -> locks -> refcount_lock));
+		WARNING_LOG("Failed to read the refcount block %u.\n", refcount_table_index);
 		return err;
-	} 
+	}
 
-	QCOW_BE_CONVERT((u8*) &refcount_block_offset, sizeof(u64));
-	if (refcount_block_offset & QCOW_MASK_BITS_INTERVAL(9, 0)) {
-		WARNING_LOG("Reserved bits set in refcount_block_offset: 0x%llX\n", refcount_block_offset);
-		return -QCOW_USE_OF_RESERVED_FIELD;
+	QCOW_BE_CONVERT((u8*) &ref_cnt, qcow_ctx -> refcount_bytes);
+	if (ref_cnt == 0) {
+		pthread_rwlock_unlock(&(qcow_ctx -> locks -> refcount_lock));
+		WARNING_LOG("The cluster at 0x%llX is already unreferenced.\n", offset);
+		return -QCOW_CORRUPTED_IMAGE;
 	}
-	
-	QCOW_BE_CONVERT((u8*) &new_ref_cnt, qcow_ctx.refcount_bytes);
-	if ((err = write_at(qcow_ctx.img_file, refcount_block_offset + refcount_block_index * qcow_ctx.refcount_bytes, &new_ref_cnt, qcow_ctx.refcount_bytes, 1))) {
-		WARNING_LOG("Failed to update the ref_cnt.\n");
+
+	err = set_ref_cnt(qcow_ctx, offset, ref_cnt - 1);
+	pthread_rwlock_unlock(&(qcow_ctx -> locks -> refcount_lock));
+
+	return err;
+}
+
+/// NOTE: the caller must hold the refcount_lock, as the refcount is read and updated in two steps.
+static int increase_ref_cnt(qcow_ctx_t* qcow_ctx, u64 offset) {
+	const unsigned int refcount_block_index = (offset / qcow_ctx -> cluster_size) % qcow_ctx -> refcount_block_entries;
+	const unsigned int refcount_table_index = (offset / qcow_ctx -> cluster_size) / qcow_ctx -> refcount_block_entries;
+	if (refcount_table_index >= qcow_ctx -> refcount_table_size) {
+		WARNING_LOG("Invalid offset: 0x%llX\n", offset);
+		return -QCOW_INVALID_OFFSET;
+	}
+
+	int err = 0;
+	u64 ref_cnt = 0;
+	const u64 refcount_block_offset = (qcow_ctx -> refcount_table)[refcount_table_index];
+	if (refcount_block_offset != 0 && (err = qcow_cache_read(qcow_ctx -> refcount_cache, refcount_table_index, refcount_block_offset, refcount_block_index * qcow_ctx -> refcount_bytes, &ref_cnt, qcow_ctx -> refcount_bytes)) < 0) {
+		WARNING_LOG("Failed to read the refcount block %u.\n", refcount_table_index);
 		return err;
 	}
+
+	QCOW_BE_CONVERT((u8*) &ref_cnt, qcow_ctx -> refcount_bytes);
 	
-	return QCOW_NO_ERROR;
+	return set_ref_cnt(qcow_ctx, offset, ref_cnt + 1);
 }
 
-static inline int lba_to_img_offset(qcow_ctx_t qcow_ctx, u64 offset, u64* img_offset, subcluster_info_t* subcluster_info) {
-    u64 l1_index = (offset / qcow_ctx.cluster_size) / qcow_ctx.table_cluster_entries;
-    u64 l2_index = (offset / qcow_ctx.cluster_size) % qcow_ctx.table_cluster_entries;
+static inline int lba_to_img_offset(qcow_ctx_t* qcow_ctx, u64 offset, u64* img_offset, subcluster_info_t* subcluster_info) {
+    u64 l1_index = (offset / qcow_ctx -> cluster_size) / qcow_ctx -> table_cluster_entries;
+    u64 l2_index = (offset / qcow_ctx -> cluster_size) % qcow_ctx -> table_cluster_entries;
 
-	if (l1_index >= qcow_ctx.l1_size) {
+	if (l1_index >= qcow_ctx -> l1_size) {
 		WARNING_LOG("Invalid offset points to unallocated l1_table: 0x%llX\n", offset);
 		return -QCOW_INVALID_OFFSET;
-	} else if ((qcow_ctx.l1_table)[l1_index] == NULL) {
-		WARNING_LOG("Unallocated l1 table and clusters.\n");
+	}
+
+	const u64 l2_offset = (qcow_ctx -> l1_table)[l1_index] & QCOW_MASK_BITS_INTERVAL(56, 9);
+	if (l2_offset == 0) {
+		TRACE_LOG("Unallocated l1 table and clusters.\n");
 		return -QCOW_UNALLOCATED_L1_TABLE;
 	}
 	
-	mem_cpy(img_offset, QCOW_CAST_PTR((qcow_ctx.l1_table)[l1_index], u8) + l2_index * qcow_ctx.l2_entries_size, sizeof(u64));
+	int err = 0;
+	if ((err = qcow_cache_read(qcow_ctx -> l2_cache, l1_index, l2_offset, l2_index * qcow_ctx -> l2_entries_size, img_offset, sizeof(u64))) < 0) {
+		WARNING_LOG("Failed to read the l2 entry %llu:%llu.\n", l1_index, l2_index);
+		return err;
+	}
+	
+	QCOW_BE_CONVERT((u8*) img_offset, sizeof(u64));
 	
 	if ((*img_offset & ~(1ULL << 63)) == 0 || (*img_offset & ~(1ULL << 63)) == COMPRESSED_CLUSTER) {
-		WARNING_LOG("Unallocated cluster (img_offset: 0x%llX at %llu:%llu).\n", *img_offset, l1_index, l2_index);
+		TRACE_LOG("Unallocated cluster (img_offset: 0x%llX at %llu:%llu).\n", *img_offset, l1_index, l2_index);
 		return -QCOW_UNALLOCATED_CLUSTER;
-	} else if (!IS_COMPRESSED_CLUSTER(*img_offset) && (*img_offset & QCOW_MASK_BITS_INTERVAL(56, 9)) == 0 && ((*img_offset >> 63) & 1) && !qcow_ctx.use_erdf) {
+	} else if (!IS_COMPRESSED_CLUSTER(*img_offset) && (*img_offset & QCOW_MASK_BITS_INTERVAL(56, 9)) == 0 && ((*img_offset >> 63) & 1) && !qcow_ctx -> use_erdf) {
 		WARNING_LOG("The cluster offset can be zero only if an external raw data file is used.\n");
 		return -QCOW_INVALID_OFFSET;
 	} else if (!IS_COMPRESSED_CLUSTER(*img_offset) && ((*img_offset & QCOW_MASK_BITS_INTERVAL(9, 1)) || (*img_offset & QCOW_MASK_BITS_INTERVAL(62, 56)))) {
 		WARNING_LOG("Detected use of reserved field.\n");
 		return -QCOW_USE_OF_RESERVED_FIELD;
-	} else if (!IS_COMPRESSED_CLUSTER(*img_offset) && !IS_CLUSTER_ALIGNED(*img_offset & QCOW_MASK_BITS_INTERVAL(56, 9), qcow_ctx.cluster_size)) {
+	} else if (!IS_COMPRESSED_CLUSTER(*img_offset) && !IS_CLUSTER_ALIGNED(*img_offset & QCOW_MASK_BITS_INTERVAL(56, 9), qcow_ctx -> cluster_size)) {
 		WARNING_LOG("Unaligned cluster.\n");
 		return -QCOW_UNALIGNED_CLUSTER;
 	}
 	
-	if (qcow_ctx.use_extended_l2_entries && subcluster_info != NULL) {
-		mem_cpy(subcluster_info, QCOW_CAST_PTR((qcow_ctx.l1_table)[l1_index], u8) + l2_index * qcow_ctx.l2_entries_size + sizeof(u64), sizeof(subcluster_info_t));
+	if (qcow_ctx -> use_extended_l2_entries && subcluster_info != NULL) {
+		if ((err = qcow_cache_read(qcow_ctx -> l2_cache, l1_index, l2_offset, l2_index * qcow_ctx -> l2_entries_size + sizeof(u64), subcluster_info, sizeof(subcluster_info_t))) < 0) {
+			WARNING_LOG("Failed to read the l2 extended entry %llu:%llu.\n", l1_index, l2_index);
+			return err;
+		}
+		QCOW_BE_CONVERT((u8*) subcluster_info, sizeof(subcluster_info_t));
 		if (IS_COMPRESSED_CLUSTER(*img_offset) && *QCOW_CAST_PTR(subcluster_info, u64) != 0) {
 			WARNING_LOG("If the cluster is compressed the subcluster info should be zeroed-out, but found: %llu\n", *QCOW_CAST_PTR(subcluster_info, u64));
 			return -QCOW_USE_OF_RESERVED_FIELD;
@@ -1072,89 +1395,93 @@ static inline int lba_to_img_offset(qcow_ctx_t qcow_ctx, u64 offset, u64* img_of
 	return QCOW_NO_ERROR;
 }
 
-static int allocate_l2_table(qcow_ctx_t qcow_ctx, u64 l1_index) {
+/// NOTE: the refcount of the new table is written back and synced before the l1 entry points to it, as qflush orders
+///       the refcounts before the l2 tables, while the table itself is already zeroed-out on disk by claim_clusters.
+static int allocate_l2_table(qcow_ctx_t* qcow_ctx, u64 l1_index) {
 	int err = 0;
 	u64 l2_table_offset = 0;
-	if ((err = extend_img_file(qcow_ctx.img_file, qcow_ctx.cluster_size, qcow_ctx.img_file_base, qcow_ctx.cluster_size, &l2_table_offset)) < 0) {
-		WARNING_LOG("Failed to extend the image file by %llu bytes.\n", qcow_ctx.cluster_size);
+	if ((err = alloc_clusters(qcow_ctx, 1, &l2_table_offset)) < 0) {
+		WARNING_LOG("Failed to allocate a cluster for the l2 table.\n");
 		return err;
 	}
 	
+	if ((err = qcow_cache_sync(qcow_ctx -> refcount_cache)) < 0) {
+		WARNING_LOG("Failed to sync the refcount blocks.\n");
+		return err;
+	}
+
 	l2_table_offset &= QCOW_MASK_BITS_INTERVAL(56, 9);
-	QCOW_BE_CONVERT((u8*) &l2_table_offset, sizeof(u64));
-	u64 offset = qcow_ctx.l1_table_offset + l1_index * sizeof(u64);
-	if ((err = write_at(qcow_ctx.img_file, offset, &l2_table_offset, sizeof(u64), 1))) {
+	u64 l1_entry = l2_table_offset;
+	QCOW_BE_CONVERT((u8*) &l1_entry, sizeof(u64));
+	u64 offset = qcow_ctx -> l1_table_offset + l1_index * sizeof(u64);
+	if ((err = write_at(qcow_ctx -> img_file, offset, &l1_entry, sizeof(u64), 1))) {
 		WARNING_LOG("Failed to update the l2 entry.\n");
 		return err;
 	}
 	
-	(qcow_ctx.l1_table)[l1_index] = qcow_calloc(qcow_ctx.table_cluster_entries, qcow_ctx.l2_entries_size);
-	if ((qcow_ctx.l1_table)[l1_index] == NULL) {
-		WARNING_LOG("Failed to allocate the new l2 table.\n");
-		return -QCOW_IO_ERROR;
+	(qcow_ctx -> l1_table)[l1_index] = l2_table_offset;
+	if ((err = qcow_cache_new_table(qcow_ctx -> l2_cache, l1_index, l2_table_offset)) < 0) {
+		WARNING_LOG("Failed to cache the new l2 table.\n");
+		return err;
 	}	
 
 	return QCOW_NO_ERROR;
 }
 
-static int set_lba_at_img_offset(qcow_ctx_t qcow_ctx, u64 offset, u64 new_entry, subcluster_info_t new_subcluster_info) {
-    u64 l1_index = (offset / qcow_ctx.cluster_size) / qcow_ctx.table_cluster_entries;
-    u64 l2_index = (offset / qcow_ctx.cluster_size) % qcow_ctx.table_cluster_entries;
+/// NOTE: the l2 entry is only updated in the l2_cache, and it reaches the image once the table is evicted or flushed.
+static int set_lba_at_img_offset(qcow_ctx_t* qcow_ctx, u64 offset, u64 new_entry, subcluster_info_t new_subcluster_info) {
+    u64 l1_index = (offset / qcow_ctx -> cluster_size) / qcow_ctx -> table_cluster_entries;
+    u64 l2_index = (offset / qcow_ctx -> cluster_size) % qcow_ctx -> table_cluster_entries;
 	
 	int err = 0;
-	if (l1_index >= qcow_ctx.l1_size) {
+	if (l1_index >= qcow_ctx -> l1_size) {
 		WARNING_LOG("The l1_table referenced is out of the active table range, but I don't know how to increase it :< \n");
 		return -QCOW_INVALID_OFFSET;
-	} else if ((qcow_ctx.l1_table)[l1_index] == NULL) {
+	} else if (((qcow_ctx -> l1_table)[l1_index] & QCOW_MASK_BITS_INTERVAL(56, 9)) == 0) {
 		if ((err = allocate_l2_table(qcow_ctx, l1_index)) < 0) {
 			WARNING_LOG("Unallocated l1 table and clusters.\n");
 			return err;
 		}
 	}
 
-	DEBUG_LOG("new_entry: %llX at %llu:%llu\n", new_entry, l1_index, l2_index);
-	mem_cpy(QCOW_CAST_PTR((qcow_ctx.l1_table)[l1_index], u8) + l2_index * qcow_ctx.l2_entries_size, &new_entry, sizeof(u64));
-
-	u64 l2_offset = 0;
-	u64 l1_table_offset = qcow_ctx.l1_table_offset + l1_index * sizeof(u64);
-	if ((err = read_at(qcow_ctx.img_file, l1_table_offset, &l2_offset, sizeof(u64), 1)) < 0) {
-		WARNING_LOG("Failed to read the l2 offset.\n");
-		return err;
-	}
-
-	QCOW_BE_CONVERT(&l2_offset, sizeof(u64));
+	TRACE_LOG("new_entry: %llX at %llu:%llu\n", new_entry, l1_index, l2_index);
+	
+	const u64 l2_offset = (qcow_ctx -> l1_table)[l1_index] & QCOW_MASK_BITS_INTERVAL(56, 9);
 	QCOW_BE_CONVERT(&new_entry, sizeof(u64));
-
-	u64 l2_entry = (l2_offset & QCOW_MASK_BITS_INTERVAL(56, 9)) + l2_index * qcow_ctx.l2_entries_size;
-	if ((err = write_at(qcow_ctx.img_file, l2_entry, &new_entry, sizeof(u64), 1)) < 0) {
+	if ((err = qcow_cache_write(qcow_ctx -> l2_cache, l1_index, l2_offset, l2_index * qcow_ctx -> l2_entries_size, &new_entry, sizeof(u64))) < 0) {
 		WARNING_LOG("Failed to update the l2 entry.\n");
 		return err;
 	}
 	
-	if (qcow_ctx.use_extended_l2_entries) {
-		DEBUG_LOG("new_alloc_status: 0x%X, new_reads_as_zero: 0x%X\n", new_subcluster_info.alloc_status, new_subcluster_info.reads_as_zero);
-		mem_cpy(QCOW_CAST_PTR((qcow_ctx.l1_table)[l1_index], u8) + l2_index * qcow_ctx.l2_entries_size + sizeof(u64), &new_subcluster_info, sizeof(subcluster_info_t));
+	if (qcow_ctx -> use_extended_l2_entries) {
+		TRACE_LOG("new_alloc_status: 0x%X, new_reads_as_zero: 0x%X\n", new_subcluster_info.alloc_status, new_subcluster_info.reads_as_zero);
 		QCOW_BE_CONVERT(&new_subcluster_info, sizeof(subcluster_info_t));
-		if (fwrite(&new_subcluster_info, sizeof(subcluster_info_t), 1, qcow_ctx.img_file) != 1) {
-			PERROR_LOG("Failed to update the l2 extended entry.\n");
-			return -QCOW_IO_ERROR;
+		if ((err = qcow_cache_write(qcow_ctx -> l2_cache, l1_index, l2_offset, l2_index * qcow_ctx -> l2_entries_size + sizeof(u64), &new_subcluster_info, sizeof(subcluster_info_t))) < 0) {
+			WARNING_LOG("Failed to update the l2 extended entry.\n");
+			return err;
 		}
 	}
 
 	return QCOW_NO_ERROR;
 }
 
-static int extend_img_file(FILE* file, u64 n, u64 file_boundary_base, u64 boundary, u64* end_pos) {
+/// NOTE: the end of the file is read and extended under the alloc_lock, so that concurrent
+///       allocations are always handed disjoint regions of the file.
+static int extend_img_file(qcow_ctx_t* qcow_ctx, qcow_io_t* file, u64 n, u64 file_boundary_base, u64 boundary, u64* region_pos) {
+	pthread_mutex_lock(&(qcow_ctx -> locks -> alloc_lock));
+	
 	long long int eof_pos = 0;
 	if ((eof_pos = fsize(file)) < 0) {
+		pthread_mutex_unlock(&(qcow_ctx -> locks -> alloc_lock));
 		WARNING_LOG("Failed to get the file size.\n");
 		return eof_pos;
 	}
 
 	int err = 0;
-	u64 boundary_offset = (eof_pos - file_boundary_base) % boundary;
-	if (boundary && boundary_offset) {
+	u64 boundary_offset = boundary ? (eof_pos - file_boundary_base) % boundary : 0;
+	if (boundary_offset) {
 		if ((err = zero_out_at(file, eof_pos, boundary - boundary_offset)) < 0) {
+			pthread_mutex_unlock(&(qcow_ctx -> locks -> alloc_lock));
 			WARNING_LOG("Failed to zero out until reaching the requested boundary.\n");
 			return err;
 		}
@@ -1162,71 +1489,152 @@ static int extend_img_file(FILE* file, u64 n, u64 file_boundary_base, u64 bounda
 	}
 
 	if ((err = zero_out_at(file, eof_pos, n)) < 0) {
+		pthread_mutex_unlock(&(qcow_ctx -> locks -> alloc_lock));
 		WARNING_LOG("Failed to zero out the allocated cluster.\n");
 		return err;
 	}
 	
-	if (end_pos != NULL) *end_pos = eof_pos + n;
+	pthread_mutex_unlock(&(qcow_ctx -> locks -> alloc_lock));
+	
+	if (region_pos != NULL) *region_pos = eof_pos;
 
 	return QCOW_NO_ERROR;
 }
 
-static inline int find_unallocated_cluster(qcow_ctx_t qcow_ctx, u64* offset) {
-	for (unsigned int refcnt_block = 0; refcnt_block < qcow_ctx.refcount_table_size; ++refcnt_block) {
-		for (unsigned int i = 0; i < qcow_ctx.refcount_block_entries; ++i) {
-			u64 ref_cnt = 0;
-			mem_cpy(&ref_cnt, QCOW_CAST_PTR((qcow_ctx.refcount_table)[refcnt_block], u8) + i, qcow_ctx.refcount_bytes);
-			if (ref_cnt == 0 || (qcow_ctx.refcount_table)[refcnt_block] == NULL) {
-				*offset = i + (refcnt_block * qcow_ctx.cluster_size * qcow_ctx.refcount_block_entries);
-				int err = 0;
-				if ((err = update_ref_cnt(qcow_ctx, *offset, 1)) < 0) {
-					WARNING_LOG("Failed to update the ref_cnt.\n");
-					return err;
-				}
-				return QCOW_NO_ERROR;
-			}
-		}
-	}	
+/// NOTE: the clusters are claimed from the free map under the alloc_lock, reusing the holes left by released clusters
+///       before growing the image file, and are zeroed out as a reused cluster may still hold stale data.
+///       The refcount of the claimed clusters is left to the caller.
+static int claim_clusters(qcow_ctx_t* qcow_ctx, u64 n, u64* region_pos) {
+	if (qcow_ctx -> free_map == NULL) {
+		return extend_img_file(qcow_ctx, qcow_ctx -> img_file, n * qcow_ctx -> cluster_size, qcow_ctx -> img_file_base, qcow_ctx -> cluster_size, region_pos);
+	}
 
-	WARNING_LOG("No space for allocation found: buy more disk space LOL!\n");
+	int err = 0;
+	u64 cluster = 0;
+	long long int eof_pos = 0;
+	pthread_mutex_lock(&(qcow_ctx -> locks -> alloc_lock));
+	
+	if ((err = qcow_free_map_claim(qcow_ctx -> free_map, n, &cluster)) < 0) {
+		pthread_mutex_unlock(&(qcow_ctx -> locks -> alloc_lock));
+		WARNING_LOG("Failed to claim %llu clusters from the free map.\n", n);
+		return err;
+	}
 
-	return -QCOW_IO_ERROR;
-}
+	// The part of the region past the end of the file is reserved before releasing the lock, so that the file only grows
+	// in claim order, and the extension for an earlier region can never cut off a region claimed (and written) after it
+	const u64 region_start = cluster * qcow_ctx -> cluster_size;
+	const u64 region_end = region_start + n * qcow_ctx -> cluster_size;
+	if ((eof_pos = fsize(qcow_ctx -> img_file)) < 0) err = eof_pos;
+	else if (region_end > (u64) eof_pos) err = zero_out_at(qcow_ctx -> img_file, MAX(region_start, (u64) eof_pos), region_end - MAX(region_start, (u64) eof_pos));
+	
+	pthread_mutex_unlock(&(qcow_ctx -> locks -> alloc_lock));
 
-static int alloc_cluster(qcow_ctx_t qcow_ctx, u64* offset, u64* cluster_offset) {
-	int err = 0;
-	// NOTE: This seems to be pretty stupid, the user is the one that tells
-	// where to write, and we need to allocate a cluster only if he wants to
-	// write in an unallocated cluster, hence why searching for something that
-	// is already given by the situation?
-	if (offset == NULL) {
-		*offset = 0;
-		if ((err = find_unallocated_cluster(qcow_ctx, offset)) < 0) {
-			WARNING_LOG("Failed to find an unallocated cluster.\n");
-			return err;
-		}
+	if (err == 0 && region_start < (u64) eof_pos) err = zero_out_at(qcow_ctx -> img_file, region_start, MIN(region_end, (u64) eof_pos) - region_start);
+	if (err < 0) {
+		WARNING_LOG("Failed to zero out the claimed clusters.\n");
+		return err;
 	}
 
-	subcluster_info_t subcluster_info = { .alloc_status = 0xFFFF, .reads_as_zero = 0 };
-	if ((err = lba_to_img_offset(qcow_ctx, *offset, cluster_offset, NULL)) == QCOW_NO_ERROR) {
+	*region_pos = region_start;
+
+	return QCOW_NO_ERROR;
+}
+
+/// NOTE: the claim and the refcount update happen under the refcount_lock, so that the clusters are never
+///       seen as allocated but unreferenced by the other allocators.
+static int alloc_clusters(qcow_ctx_t* qcow_ctx, u64 n, u64* region_pos) {
+	pthread_rwlock_wrlock(&(qcow_ctx -> locks -> refcount_lock));
+	
+	int err = 0;
+	if ((err = claim_clusters(qcow_ctx, n, region_pos)) < 0) {
+		pthread_rwlock_unlock(&(qcow_ctx -> locks -> refcount_lock));
+		return err;
+	}
+
+	for (u64 i = 0; i < n; ++i) {
+		if ((err = set_ref_cnt(qcow_ctx, *region_pos + i * qcow_ctx -> cluster_size, 1)) < 0) {
+			pthread_rwlock_unlock(&(qcow_ctx -> locks -> refcount_lock));
+			WARNING_LOG("Failed to update the ref_cnt.\n");
+			return err;
+		}
+	}
+	
+	pthread_rwlock_unlock(&(qcow_ctx -> locks -> refcount_lock));
+
+	return QCOW_NO_ERROR;
+}
+
+/// NOTE: the compressed clusters are packed back to back within the host clusters claimed for them, so that a compressed cluster
+///       spans two host clusters only if the second one has been claimed right after the first, otherwise the tail of the first is left unused.
+///       Each host cluster holds a reference for every compressed cluster touching it, while the packing cursor is guarded by the refcount_lock.
+static int alloc_compressed_bytes(qcow_ctx_t* qcow_ctx, u64 size, u64* host_offset) {
+	if (size == 0 || size >= qcow_ctx -> cluster_size) return -QCOW_INVALID_SIZE;
+
+	pthread_rwlock_wrlock(&(qcow_ctx -> locks -> refcount_lock));
+
+	int err = 0;
+	while (qcow_ctx -> compressed_end - qcow_ctx -> compressed_pos < size) {
+		u64 cluster_offset = 0;
+		if ((err = claim_clusters(qcow_ctx, 1, &cluster_offset)) < 0) {
+			pthread_rwlock_unlock(&(qcow_ctx -> locks -> refcount_lock));
+			WARNING_LOG("Failed to claim a cluster for the compressed clusters.\n");
+			return err;
+		}
+
+		if (cluster_offset != qcow_ctx -> compressed_end) qcow_ctx -> compressed_pos = cluster_offset;
+		qcow_ctx -> compressed_end = cluster_offset + qcow_ctx -> cluster_size;
+	}
+
+	*host_offset = qcow_ctx -> compressed_pos;
+	qcow_ctx -> compressed_pos += size;
+
+	for (u64 cluster_offset = *host_offset - (*host_offset % qcow_ctx -> cluster_size); cluster_offset < *host_offset + size; cluster_offset += qcow_ctx -> cluster_size) {
+		if ((err = increase_ref_cnt(qcow_ctx, cluster_offset)) < 0) {
+			pthread_rwlock_unlock(&(qcow_ctx -> locks -> refcount_lock));
+			WARNING_LOG("Failed to update the ref_cnt.\n");
+			return err;
+		}
+	}
+
+	pthread_rwlock_unlock(&(qcow_ctx -> locks -> refcount_lock));
+
+	return QCOW_NO_ERROR;
+}
+
+/// NOTE: the clusters of the external data file are not refcounted, hence they are simply appended to it.
+static int alloc_cluster(qcow_ctx_t* qcow_ctx, u64 offset, u64* cluster_offset) {
+	int err = 0;
+	subcluster_info_t subcluster_info = { .alloc_status = ALL_SUBCLUSTERS_ALLOCATED, .reads_as_zero = 0 };
+	if ((err = lba_to_img_offset(qcow_ctx, offset, cluster_offset, NULL)) == QCOW_NO_ERROR && (*cluster_offset & QCOW_MASK_BITS_INTERVAL(56, 9)) != 0) {
+		// The cluster is preallocated (e.g. a zero cluster) hence it only needs to be marked as in use
 		*cluster_offset = (*cluster_offset & QCOW_MASK_BITS_INTERVAL(56, 9)) | (1ULL << 63);
-		if ((err = set_lba_at_img_offset(qcow_ctx, *offset, *cluster_offset, subcluster_info)) == 0) return QCOW_NO_ERROR;
+		if ((err = set_lba_at_img_offset(qcow_ctx, offset, *cluster_offset, subcluster_info)) == 0) return QCOW_NO_ERROR;
 		WARNING_LOG("Failed to update the l2 entry.\n");
 		return err;
-	} else if (-err != QCOW_UNALLOCATED_CLUSTER && -err != QCOW_UNALLOCATED_L1_TABLE) {
+	} else if (err < 0 && -err != QCOW_UNALLOCATED_CLUSTER && -err != QCOW_UNALLOCATED_L1_TABLE) {
 		WARNING_LOG("Failed to perform lba_to_img_offset: '%s'\n", qcow_errors_str[-err]);
 		return err;
 	}
 
+	// Only the unallocated clusters read through to the backing chain, while the zero clusters stay zeroed-out
+	const bool unallocated = (err < 0);
 	u64 cluster_pos = 0;
-	if ((err = extend_img_file(qcow_ctx.clusters_file, qcow_ctx.cluster_size, qcow_ctx.clusters_file_base, qcow_ctx.cluster_size, &cluster_pos)) < 0) {
-		WARNING_LOG("Failed to extend the image file by %llu bytes.\n", qcow_ctx.cluster_size);
+	if (qcow_ctx -> clusters_file == qcow_ctx -> img_file) err = alloc_clusters(qcow_ctx, 1, &cluster_pos);
+	else err = extend_img_file(qcow_ctx, qcow_ctx -> clusters_file, qcow_ctx -> cluster_size, qcow_ctx -> clusters_file_base, qcow_ctx -> cluster_size, &cluster_pos);
+	
+	if (err < 0) {
+		WARNING_LOG("Failed to allocate a cluster of %llu bytes.\n", qcow_ctx -> cluster_size);
+		return err;
+	}
+
+	if (unallocated && (err = copy_from_backing_file(qcow_ctx, offset - (offset % qcow_ctx -> cluster_size), cluster_pos, qcow_ctx -> cluster_size)) < 0) {
+		WARNING_LOG("Failed to copy the backing cluster.\n");
 		return err;
 	}
 
 	// Update the l2 entry and set the subcluster_info to allocated in case it uses l2_extended
 	*cluster_offset = (cluster_pos & QCOW_MASK_BITS_INTERVAL(56, 9)) | (1ULL << 63);
-	if ((err = set_lba_at_img_offset(qcow_ctx, *offset, *cluster_offset, subcluster_info)) < 0) {
+	if ((err = set_lba_at_img_offset(qcow_ctx, offset, *cluster_offset, subcluster_info)) < 0) {
 		WARNING_LOG("Failed to update the l2 entry.\n");
 		return err;
 	}
@@ -1234,43 +1642,34 @@ static int alloc_cluster(qcow_ctx_t qcow_ctx, u64* offset, u64* cluster_offset)
 	return QCOW_NO_ERROR;
 }
 
-static int cow_alloc_cluster(qcow_ctx_t qcow_ctx, u64 offset, u64* cluster_offset) {
+/// NOTE: only standard clusters are copied on write, and the reference to the shared cluster is dropped once
+///       the l2 entry points to the private copy.
+static int cow_alloc_cluster(qcow_ctx_t* qcow_ctx, u64 offset, u64* cluster_offset) {
 	int err = 0;
 	u64 original_img_offset = 0;
 	if ((err = lba_to_img_offset(qcow_ctx, offset, &original_img_offset, NULL)) < 0) return err;
-
-	// Allocate the required clusters
-	unsigned int additional_sectors = 0;
-	u64 cluster_boundary = qcow_ctx.cluster_size * IS_COMPRESSED_CLUSTER(original_img_offset);
-	if (IS_COMPRESSED_CLUSTER(original_img_offset)) {
-		unsigned int x = 62 - (qcow_ctx.cluster_bits - 8);
-		additional_sectors = (original_img_offset & QCOW_MASK_BITS_INTERVAL(62, x)) >> x;
-		original_img_offset &= QCOW_MASK_BITS_INTERVAL(x, 0); 
-	} else {
-		original_img_offset &= QCOW_MASK_BITS_INTERVAL(56, 9);
-	}
+	original_img_offset &= QCOW_MASK_BITS_INTERVAL(56, 9);
 
 	u64 cluster_pos = 0;
-	u64 additional_clusters = CEILING(additional_sectors, qcow_ctx.cluster_size / COMPRESSED_SECTOR_SIZE);
-	u64 clusters_size = (1 + additional_clusters) * qcow_ctx.cluster_size;
-	if ((err = extend_img_file(qcow_ctx.clusters_file, clusters_size, qcow_ctx.clusters_file_base, cluster_boundary, &cluster_pos)) < 0) {
-		WARNING_LOG("Failed to extend the image file by %llu bytes.\n", clusters_size);
+	if ((err = alloc_clusters(qcow_ctx, 1, &cluster_pos)) < 0) {
+		WARNING_LOG("Failed to allocate a cluster of %llu bytes.\n", qcow_ctx -> cluster_size);
 		return err;
 	}
 
-	// Copy the data from the old clusters
-	FILE* file = qcow_ctx.clusters_file;
-	if (qcow_ctx.backing_file && (original_img_offset + clusters_size) <= (u64) qcow_ctx.backing_file_size) file = qcow_ctx.backing_file;
-	
-	u8* cluster_data = (u8*) qcow_calloc(clusters_size, sizeof(u8));
-	if ((err = read_at(file, original_img_offset, cluster_data, sizeof(u8), clusters_size)) < 0) {
+	// Copy the data from the shared cluster
+	u8* cluster_data = (u8*) qcow_calloc(qcow_ctx -> cluster_size, sizeof(u8));
+	if (cluster_data == NULL) {
+		WARNING_LOG("Failed to allocate the cluster buffer.\n");
+		return -QCOW_IO_ERROR;
+	}
+
+	if ((err = read_at(qcow_ctx -> clusters_file, original_img_offset, cluster_data, sizeof(u8), qcow_ctx -> cluster_size)) < 0) {
 		QCOW_SAFE_FREE(cluster_data);
 		WARNING_LOG("Failed to read the cluster at offset: 0x%llX.\n", offset);
 		return err;
 	}
 	
-	// Copy the data to the newly allocated clusters
-	if ((err = write_at(qcow_ctx.clusters_file, cluster_pos, cluster_data, sizeof(u8), clusters_size)) < 0) {
+	if ((err = write_at(qcow_ctx -> clusters_file, cluster_pos, cluster_data, sizeof(u8), qcow_ctx -> cluster_size)) < 0) {
 		QCOW_SAFE_FREE(cluster_data);
 		WARNING_LOG("Failed to copy the cluster data.\n");
 		return err;
@@ -1278,78 +1677,117 @@ static int cow_alloc_cluster(qcow_ctx_t qcow_ctx, u64 offset, u64* cluster_offse
 
 	QCOW_SAFE_FREE(cluster_data);
 	
-	// Update the l2 entry and ref_cnt for the original offset and also set the subclusters to allocated in case of use_l2_extended
-	subcluster_info_t subcluster_info = { .alloc_status = 0xFFFF, .reads_as_zero = 0 };
+	// Update the l2 entry and also set the subclusters to allocated in case of use_l2_extended
+	subcluster_info_t subcluster_info = { .alloc_status = ALL_SUBCLUSTERS_ALLOCATED, .reads_as_zero = 0 };
 	*cluster_offset = (cluster_pos & QCOW_MASK_BITS_INTERVAL(56, 9)) | (1ULL << 63);
-	if ((err = set_lba_at_img_offset(qcow_ctx, offset, *cluster_offset, subcluster_info)) == 0) {
+	if ((err = set_lba_at_img_offset(qcow_ctx, offset, *cluster_offset, subcluster_info)) < 0) {
 		WARNING_LOG("Failed to update the l2 entry.\n");
-		return QCOW_NO_ERROR;
+		return err;
 	}
 
-	if ((err = update_ref_cnt(qcow_ctx, offset, 1)) < 0) {
-		WARNING_LOG("Failed to update the ref_cnt.\n");
+	if ((err = decrease_ref_cnt(qcow_ctx, original_img_offset)) < 0) {
+		WARNING_LOG("Failed to update the ref_cnt of the shared cluster.\n");
 		return err;
 	}
 
 	return QCOW_NO_ERROR;
 }
 
-static int write_compressed_cluster(qcow_ctx_t qcow_ctx, u64 img_offset, unsigned int* recompressed_cluster_size, unsigned int compressed_cluster_size, u8* cluster, unsigned int cluster_data_size) {
+/// NOTE: the additional sectors count the sectors touched by the compressed cluster past the one containing its host offset.
+static inline u64 compressed_l2_entry(qcow_ctx_t* qcow_ctx, u64 host_offset, u64 compressed_cluster_size) {
+	const unsigned int x = 62 - (qcow_ctx -> cluster_bits - 8);
+	const u64 additional_sectors = (host_offset + compressed_cluster_size - 1) / COMPRESSED_SECTOR_SIZE - host_offset / COMPRESSED_SECTOR_SIZE;
+	return COMPRESSED_CLUSTER | ((additional_sectors & QCOW_MASK_BITS_PRECEDING(62 - x)) << x) | host_offset;
+}
+
+/// NOTE: the recompressed cluster is always appended as a new compressed cluster, as the sectors spanned by the old one
+///       may be shared with the compressed clusters packed around it, the caller releases them once the new entry is set.
+///       A cluster that no longer compresses below cluster_size is written uncompressed into a standard cluster instead.
+static int write_compressed_cluster(qcow_ctx_t* qcow_ctx, const u8* cluster, u64* l2_entry) {
 	int err = 0;
 	u8* recompressed_cluster = NULL;
-	if (qcow_ctx.compression_type == DEFLATE) {
-		recompressed_cluster = zlib_deflate(cluster, cluster_data_size, recompressed_cluster_size, &err);
-		if (err) {
-			printf(COLOR_STR("ZLIB_ERROR::%s: ", RED) "%s", zlib_errors_str[-err], recompressed_cluster);
-			return -QCOW_DEFLATE_ERROR; 
+	unsigned int recompressed_cluster_size = 0;
+	if ((err = qcompress_cluster(qcow_ctx, cluster, &recompressed_cluster, &recompressed_cluster_size)) < 0) {
+		WARNING_LOG("Failed to recompress the cluster.\n");
+		return err;
+	}
+
+	if (recompressed_cluster_size >= qcow_ctx -> cluster_size) {
+		QCOW_SAFE_FREE(recompressed_cluster);
+		u64 cluster_pos = 0;
+		if ((err = alloc_clusters(qcow_ctx, 1, &cluster_pos)) < 0) {
+			WARNING_LOG("Failed to allocate the cluster for the incompressible cluster.\n");
+			return err;
 		}
-	} else {
-		WARNING_LOG("ZSTD compression is not yet implemented.");
-		return -QCOW_TODO;
+
+		if ((err = write_at(qcow_ctx -> clusters_file, cluster_pos, cluster, sizeof(u8), qcow_ctx -> cluster_size)) < 0) return err;
+
+		*l2_entry = cluster_pos | (1ULL << 63);
+
+		return QCOW_NO_ERROR;
 	}
 
-	if ((err = zero_out_at(qcow_ctx.clusters_file, img_offset, compressed_cluster_size)) < 0){
+	u64 host_offset = 0;
+	if ((err = alloc_compressed_bytes(qcow_ctx, recompressed_cluster_size, &host_offset)) < 0) {
 		QCOW_SAFE_FREE(recompressed_cluster);
+		WARNING_LOG("Failed to allocate the sectors for the recompressed cluster.\n");
 		return err;
 	}
 
-	if ((err = write_at(qcow_ctx.clusters_file, img_offset, recompressed_cluster, sizeof(u8), *recompressed_cluster_size)) < 0) {
+	if ((err = write_at(qcow_ctx -> clusters_file, host_offset, recompressed_cluster, sizeof(u8), recompressed_cluster_size)) < 0) {
 		QCOW_SAFE_FREE(recompressed_cluster);	
 		return err;
 	}
 
 	QCOW_SAFE_FREE(recompressed_cluster);
 
+	*l2_entry = compressed_l2_entry(qcow_ctx, host_offset, recompressed_cluster_size);
+
 	return QCOW_NO_ERROR;
 }
 
-static int read_compressed_cluster(qcow_ctx_t qcow_ctx, FILE* file, u64* cluster_offset, u8** clusters, unsigned int *cluster_data_size, unsigned int* compressed_clusters_size) {
-	unsigned int x = 62 - (qcow_ctx.cluster_bits - 8);
+/// NOTE: the cluster is decompressed straight into the cluster buffer, which must hold cluster_size bytes.
+static int read_compressed_cluster(qcow_ctx_t* qcow_ctx, qcow_io_t* file, u64* cluster_offset, u8* cluster, unsigned int *cluster_data_size, unsigned int* compressed_clusters_size) {
+	unsigned int x = 62 - (qcow_ctx -> cluster_bits - 8);
 	unsigned int additional_sectors = (*cluster_offset & QCOW_MASK_BITS_INTERVAL(62, x)) >> x;
 	*cluster_offset &= QCOW_MASK_BITS_INTERVAL(x, 0); 
-	DEBUG_LOG("img_offset: 0x%llX, additional_sectors: %u\n", *cluster_offset, additional_sectors);
+	TRACE_LOG("img_offset: 0x%llX, additional_sectors: %u\n", *cluster_offset, additional_sectors);
+
+	long long int file_size = 0;
+	if ((file_size = fsize(file)) < 0) {
+		WARNING_LOG("Failed to get the file size.\n");
+		return file_size;
+	} else if (*cluster_offset >= (u64) file_size) {
+		WARNING_LOG("The compressed cluster at 0x%llX is past the end of the file.\n", *cluster_offset);
+		return -QCOW_INVALID_OFFSET;
+	}
 
+	// The last sector of the last compressed cluster may be cut short by the end of the file
 	int err = 0;
-	*compressed_clusters_size = qcow_ctx.cluster_size + additional_sectors * COMPRESSED_SECTOR_SIZE;
+	*compressed_clusters_size = (additional_sectors + 1) * COMPRESSED_SECTOR_SIZE - (*cluster_offset % COMPRESSED_SECTOR_SIZE);
+	*compressed_clusters_size = MIN(*compressed_clusters_size, (u64) file_size - *cluster_offset);
 	u8* compressed_clusters = (u8*) qcow_calloc(*compressed_clusters_size, sizeof(u8));
 	if ((err = read_at(file, *cluster_offset, compressed_clusters, sizeof(u8), *compressed_clusters_size)) < 0) {
 		QCOW_SAFE_FREE(compressed_clusters);
 		WARNING_LOG("Failed to read the compressed cluster.\n");
+		return err;
 	}
 
-	DEBUG_LOG("Compressed virtual disk block with compression_method: '%s'.\n", compression_type_str[qcow_ctx.compression_type]);
+	TRACE_LOG("Compressed virtual disk block with compression_method: '%s'.\n", compression_type_str[qcow_ctx -> compression_type]);
 	
-	if (qcow_ctx.compression_type == DEFLATE) {
-		*clusters = zlib_inflate(compressed_clusters, *compressed_clusters_size, cluster_data_size, &err);
+	if (qcow_ctx -> compression_type == DEFLATE) {
+		err = zlib_inflate_into(cluster, qcow_ctx -> cluster_size, compressed_clusters, *compressed_clusters_size, cluster_data_size);
+		QCOW_SAFE_FREE(compressed_clusters);
 		if (err) {
-			printf(COLOR_STR("ZLIB_ERROR::%s: ", RED) "%s", zlib_errors_str[-err], *clusters);
+			ERROR_LOG("ZLIB_ERROR::%s: Failed to inflate the compressed cluster.\n", zlib_errors_str[-err]);
 			return -QCOW_DEFLATE_ERROR; 
 		}
 	} else {
-		*cluster_data_size = qcow_ctx.cluster_size;
-		*clusters = zstd_inflate(compressed_clusters, *compressed_clusters_size, cluster_data_size, &err);
+		err = zstd_inflate_into(cluster, qcow_ctx -> cluster_size, compressed_clusters, *compressed_clusters_size, cluster_data_size, !qcow_ctx -> skip_checksums);
+		QCOW_SAFE_FREE(compressed_clusters);
+		if (!err && *cluster_data_size != qcow_ctx -> cluster_size) err = -ZSTD_DECOMPRESSED_SIZE_MISMATCH;
 		if (err) {
-			printf(COLOR_STR("ZSTD_ERROR::%s: ", RED) "%s", zstd_errors_str[-err], *clusters);
+			ERROR_LOG("ZSTD_ERROR::%s: Failed to inflate the compressed cluster.\n", zstd_errors_str[-err]);
 			return -QCOW_DEFLATE_ERROR; 
 		}
 	}
@@ -1357,36 +1795,63 @@ static int read_compressed_cluster(qcow_ctx_t qcow_ctx, FILE* file, u64* cluster
 	return QCOW_NO_ERROR;
 }
 
-static int get_lba_img_offset_for_write(qcow_ctx_t qcow_ctx, u64 offset, u64* img_offset, subcluster_info_t* subcluster_info) {
+/// NOTE: the decompressed cluster is served from the cluster_cache when possible, otherwise it is inflated
+///       and then handed over to the cache, so that the following reads within it skip the decompression,
+///       unless the whole cluster is read, which is inflated straight into ptr.
+static int read_cached_compressed_cluster(qcow_ctx_t* qcow_ctx, qcow_io_t* file, u64 cluster_offset, u8* ptr, u64 pos, u64 size) {
+	const unsigned int x = 62 - (qcow_ctx -> cluster_bits - 8);
+	const u64 host_offset = cluster_offset & QCOW_MASK_BITS_INTERVAL(x, 0);
+	if (qcow_ctx -> cluster_cache != NULL && qcow_cluster_cache_get(qcow_ctx -> cluster_cache, file, host_offset, pos, ptr, size)) return QCOW_NO_ERROR;
+	
+	// A read of the whole cluster is decompressed straight into the caller buffer, and it is not cached, as such
+	// reads usually stream through the image, and would only evict the clusters that partial reads keep hitting
+	const bool is_whole_cluster = pos == 0 && size == qcow_ctx -> cluster_size;
+	u8* cluster = is_whole_cluster ? ptr : (u8*) qcow_calloc(qcow_ctx -> cluster_size, sizeof(u8));
+	if (cluster == NULL) {
+		WARNING_LOG("Failed to allocate the buffer for the decompressed cluster.\n");
+		return -QCOW_IO_ERROR;
+	}
+
 	int err = 0;
-	u64 ref_cnt = 0;
-	if ((err = get_ref_cnt(qcow_ctx, offset, &ref_cnt)) < 0) return err;
-	DEBUG_LOG("ref_cnt at LBA 0x%llX: %llu\n", offset, ref_cnt);
+	unsigned int cluster_data_size = 0;
+	unsigned int compressed_cluster_size = 0;
+	if ((err = read_compressed_cluster(qcow_ctx, file, &cluster_offset, cluster, &cluster_data_size, &compressed_cluster_size)) < 0) {
+		if (!is_whole_cluster) QCOW_SAFE_FREE(cluster);
+		WARNING_LOG("Failed to read compressed cluster at img_offset: 0x%llX\n", cluster_offset);
+		return err;
+	} else if (pos + size > cluster_data_size) {
+		if (!is_whole_cluster) QCOW_SAFE_FREE(cluster);
+		WARNING_LOG("Invalid range %llu-%llu in cluster of size: %u.\n", pos, pos + size, cluster_data_size);
+		return -QCOW_IO_ERROR;
+	}
 	
-	if (ref_cnt == 0) {
-		if ((err = alloc_cluster(qcow_ctx, &offset, img_offset)) < 0) {
+	if (is_whole_cluster) return QCOW_NO_ERROR;
+	mem_cpy(ptr, cluster + pos, size);
+
+	if (qcow_ctx -> cluster_cache != NULL) qcow_cluster_cache_put(qcow_ctx -> cluster_cache, file, host_offset, cluster, cluster_data_size);
+	else QCOW_SAFE_FREE(cluster);
+
+	return QCOW_NO_ERROR;
+}
+
+/// NOTE: the refcount is indexed by the host cluster, which is shared (and hence copied on write) if referenced more than once.
+static int get_lba_img_offset_for_write(qcow_ctx_t* qcow_ctx, u64 offset, u64* img_offset, subcluster_info_t* subcluster_info) {
+	int err = lba_to_img_offset(qcow_ctx, offset, img_offset, subcluster_info);
+	if (-err == QCOW_UNALLOCATED_CLUSTER || -err == QCOW_UNALLOCATED_L1_TABLE) {
+		if ((err = alloc_cluster(qcow_ctx, offset, img_offset)) < 0) {
 			WARNING_LOG("Failed to allocate the cluster.\n");
 			return err;
 		}
-	} else if (ref_cnt > 1) {
-		err = cow_alloc_cluster(qcow_ctx, offset, img_offset);
-		if (-err == QCOW_UNALLOCATED_CLUSTER) {
-			if ((err = alloc_cluster(qcow_ctx, &offset, img_offset)) < 0) {
-				WARNING_LOG("Failed to allocate the cluster.\n");
-				return err;
-			}
-		} else if (err < 0) {
-			WARNING_LOG("Failed to allocate the cluster.\n");
+	} else if (err < 0) return err;
+	else if (!IS_COMPRESSED_CLUSTER(*img_offset) && (*img_offset & QCOW_MASK_BITS_INTERVAL(56, 9)) != 0 && qcow_ctx -> clusters_file == qcow_ctx -> img_file) {
+		u64 ref_cnt = 0;
+		if ((err = get_ref_cnt(qcow_ctx, *img_offset & QCOW_MASK_BITS_INTERVAL(56, 9), &ref_cnt)) < 0) return err;
+		TRACE_LOG("ref_cnt at img_offset 0x%llX: %llu\n", *img_offset & QCOW_MASK_BITS_INTERVAL(56, 9), ref_cnt);
+		
+		if (ref_cnt > 1 && (err = cow_alloc_cluster(qcow_ctx, offset, img_offset)) < 0) {
+			WARNING_LOG("Failed to copy on write the cluster.\n");
 			return err;
 		}
-	} else {
-		err = lba_to_img_offset(qcow_ctx, offset, img_offset, subcluster_info);
-		if (-err == QCOW_UNALLOCATED_CLUSTER) {
-			if ((err = alloc_cluster(qcow_ctx, &offset, img_offset)) < 0) {
-				WARNING_LOG("Failed to allocate the cluster.\n");
-				return err;
-			}
-		} else if (err < 0) return err;
 	}
 
 	IMG_OFFSET_INFO(*img_offset);
@@ -1394,80 +1859,182 @@ static int get_lba_img_offset_for_write(qcow_ctx_t qcow_ctx, u64 offset, u64* im
 	return QCOW_NO_ERROR;
 }
 
-int qwrite(const void* data, size_t size, size_t nmemb, unsigned int offset, qcow_ctx_t qcow_ctx) {	
+static int qwrite_cluster(const u8* data, u64 writable_bytes, u64 offset, qcow_ctx_t* qcow_ctx) {
 	int err = 0;
-	const u64 start_cluster = offset / qcow_ctx.cluster_size;
-	const u64 end_cluster   = (offset + size * nmemb) / qcow_ctx.cluster_size;
-	
-	for (u64 i = start_cluster, bytes_written = 0; bytes_written < (size * nmemb) && i <= end_cluster; ++i) {
-		const u64 writable_bytes = MIN(size * nmemb - bytes_written, qcow_ctx.cluster_size - (offset % qcow_ctx.cluster_size));
+	u64 img_offset = 0;
+	subcluster_info_t subcluster_info = {0};
+	if ((err = get_lba_img_offset_for_write(qcow_ctx, offset, &img_offset, &subcluster_info)) < 0) {
+		WARNING_LOG("Failed to retrieve the img_offset.\n");
+		return err;
+	}
 
-		u64 img_offset = 0;
-		subcluster_info_t subcluster_info = {0};
-		if ((err = get_lba_img_offset_for_write(qcow_ctx, offset, &img_offset, &subcluster_info)) < 0) {
-			WARNING_LOG("Failed to retrieve the img_offset.\n");
+	if (IS_COMPRESSED_CLUSTER(img_offset)) {
+		u8* cluster = (u8*) qcow_calloc(qcow_ctx -> cluster_size, sizeof(u8));
+		if (cluster == NULL) {
+			WARNING_LOG("Failed to allocate the buffer for the decompressed cluster.\n");
+			return -QCOW_IO_ERROR;
+		}
+
+		unsigned int cluster_data_size = 0;
+		unsigned int compressed_cluster_size = 0;
+		if ((err = read_compressed_cluster(qcow_ctx, qcow_ctx -> clusters_file, &img_offset, cluster, &cluster_data_size, &compressed_cluster_size)) < 0) {
+			QCOW_SAFE_FREE(cluster);
+			WARNING_LOG("Failed to read compressed cluster at img_offset: 0x%llX\n", img_offset);
 			return err;
 		}
 
-		if (IS_COMPRESSED_CLUSTER(img_offset)) {
-			u8* cluster = NULL;
-			unsigned int cluster_data_size = 0;
-			unsigned int compressed_cluster_size = 0;
-			if ((err = read_compressed_cluster(qcow_ctx, qcow_ctx.clusters_file, &img_offset, &cluster, &cluster_data_size, &compressed_cluster_size)) < 0) {
-				WARNING_LOG("Failed to read compressed cluster at img_offset: 0x%llX\n", img_offset);
-				return err;
-			}
+		unsigned int cluster_offset = offset % qcow_ctx -> cluster_size;
+		if (cluster_offset >= cluster_data_size) {
+			QCOW_SAFE_FREE(cluster);
+			WARNING_LOG("Invalid offset %u in cluster of size: %u.\n", cluster_offset, cluster_data_size);
+			return -QCOW_IO_ERROR;
+		}
+		
+		mem_cpy(cluster + cluster_offset, data, writable_bytes);
 
-			unsigned int cluster_offset = offset % qcow_ctx.cluster_size;
-			if (cluster_offset >= cluster_data_size) {
-				WARNING_LOG("Invalid offset %u in cluster of size: %u.\n", cluster_offset, cluster_data_size);
-				return -QCOW_IO_ERROR;
-			}
-			
-			mem_cpy(cluster + cluster_offset, QCOW_CAST_PTR(data, u8) + bytes_written, writable_bytes);
+		const u64 old_host_offset = img_offset;
+		if (qcow_ctx -> cluster_cache != NULL) qcow_cluster_cache_drop(qcow_ctx -> cluster_cache, qcow_ctx -> clusters_file, img_offset);
+		err = write_compressed_cluster(qcow_ctx, cluster, &img_offset);
+		QCOW_SAFE_FREE(cluster);
+		if (err < 0) {
+			WARNING_LOG("Failed to write back the recompressed cluster.\n");
+			return err;
+		}
 
-			unsigned int recompressed_cluster_size = 0;
-			if ((err = write_compressed_cluster(qcow_ctx, img_offset, &recompressed_cluster_size, compressed_cluster_size, cluster, cluster_data_size)) < 0) {
-				WARNING_LOG("Failed to write back the recompressed cluster.\n");
-				return err;
-			}
+		// The standard cluster holding an incompressible cluster is fully allocated
+		subcluster_info = IS_COMPRESSED_CLUSTER(img_offset) ? (subcluster_info_t) {0} : (subcluster_info_t) { .alloc_status = ALL_SUBCLUSTERS_ALLOCATED, .reads_as_zero = 0 };
+		if ((err = set_lba_at_img_offset(qcow_ctx, offset, img_offset, subcluster_info))) {
+			WARNING_LOG("Failed to set the new address for the modified lba.\n");
+			return err;
+		}
 
-			subcluster_info = (subcluster_info_t) {0};
-			unsigned int x = 62 - (qcow_ctx.cluster_bits - 8);
-			u64 new_additional_sectors = recompressed_cluster_size > qcow_ctx.cluster_size ? (((recompressed_cluster_size - qcow_ctx.cluster_size) / COMPRESSED_SECTOR_SIZE) & QCOW_MASK_BITS_PRECEDING(61 - x)) << (x + 1) : 0;
-			if ((err = set_lba_at_img_offset(qcow_ctx, offset, new_additional_sectors | img_offset | COMPRESSED_CLUSTER, subcluster_info))) {
-				WARNING_LOG("Failed to set the new address for the modified lba.\n");
+		// Drop the reference the old compressed cluster held on each host cluster it spans, the same ones
+		// alloc_compressed_bytes referenced, so that a host cluster left without packed data is freed
+		for (u64 cluster_offset = old_host_offset - old_host_offset % qcow_ctx -> cluster_size; cluster_offset < old_host_offset + compressed_cluster_size; cluster_offset += qcow_ctx -> cluster_size) {
+			if ((err = decrease_ref_cnt(qcow_ctx, cluster_offset)) < 0) {
+				WARNING_LOG("Failed to release the host cluster 0x%llX of the old compressed cluster.\n", cluster_offset);
 				return err;
 			}
-		} else {
-			if (((img_offset & QCOW_MASK_BITS_INTERVAL(62, 56)) != 0) || ((img_offset & QCOW_MASK_BITS_INTERVAL(9, 0)) != 0)) {
-				WARNING_LOG("Use of reserved field in l2 entry.\n");
-				return -QCOW_USE_OF_RESERVED_FIELD;
-			} else if ((img_offset & QCOW_MASK_BITS_INTERVAL(56, 9)) == 0 && ((img_offset >> 63) & 1) == 0 && !qcow_ctx.use_erdf) {
-				if ((err = alloc_cluster(qcow_ctx, NULL, &img_offset)) < 0) {
-					WARNING_LOG("Failed to allocate the cluster.\n");
-					return err;
-				}
+		}
+	} else {
+		if (((img_offset & QCOW_MASK_BITS_INTERVAL(62, 56)) != 0) || ((img_offset & QCOW_MASK_BITS_INTERVAL(9, 0)) != 0)) {
+			WARNING_LOG("Use of reserved field in l2 entry.\n");
+			return -QCOW_USE_OF_RESERVED_FIELD;
+		} else if ((img_offset & QCOW_MASK_BITS_INTERVAL(56, 9)) == 0 && ((img_offset >> 63) & 1) == 0 && !qcow_ctx -> use_erdf) {
+			if ((err = alloc_cluster(qcow_ctx, offset, &img_offset)) < 0) {
+				WARNING_LOG("Failed to allocate the cluster.\n");
+				return err;
 			}
-			
-			if (qcow_ctx.use_extended_l2_entries) {
-				u64 subcluster_size = qcow_ctx.cluster_size / 32;
-				u64 subcluster_pos = offset % subcluster_size;
-				u8 subcluster_index = FLOORING(offset % qcow_ctx.cluster_size, subcluster_size);
-				u8 subclusters_used = FLOORING(subcluster_pos + writable_bytes, subcluster_size);
-				subcluster_info.alloc_status |= QCOW_MASK_BITS_INTERVAL(subclusters_used + subcluster_index + 1, subcluster_index);
-				subcluster_info.reads_as_zero &= QCOW_MASK_BITS_INTERVAL(32, subcluster_index + subclusters_used + 1) | QCOW_MASK_BITS_INTERVAL(subcluster_index, 0);
-				if ((err = set_lba_at_img_offset(qcow_ctx, offset, img_offset, subcluster_info))) {
-					WARNING_LOG("Failed to set the update the subcluster info for the modified lba.\n");
-					return err;
-				}
+		}
+		
+		if (qcow_ctx -> use_extended_l2_entries) {
+			u64 subcluster_size = qcow_ctx -> cluster_size / 32;
+			u64 subcluster_pos = offset % subcluster_size;
+			u8 subcluster_index = FLOORING(offset % qcow_ctx -> cluster_size, subcluster_size);
+			u8 subclusters_used = FLOORING(subcluster_pos + writable_bytes, subcluster_size);
+			subcluster_info.alloc_status |= QCOW_MASK_BITS_INTERVAL(subclusters_used + subcluster_index + 1, subcluster_index);
+			subcluster_info.reads_as_zero &= QCOW_MASK_BITS_INTERVAL(32, subcluster_index + subclusters_used + 1) | QCOW_MASK_BITS_INTERVAL(subcluster_index, 0);
+			if ((err = set_lba_at_img_offset(qcow_ctx, offset, img_offset, subcluster_info))) {
+				WARNING_LOG("Failed to set the update the subcluster info for the modified lba.\n");
+				return err;
 			}
-			
-			img_offset = (img_offset & QCOW_MASK_BITS_INTERVAL(56, 9)) + (offset % qcow_ctx.cluster_size);
-			write_at(qcow_ctx.clusters_file, img_offset, QCOW_CAST_PTR(data, u8) + bytes_written, writable_bytes, 1);
 		}
 		
-		update_ref_cnt(qcow_ctx, offset, 1);
+		img_offset = (img_offset & QCOW_MASK_BITS_INTERVAL(56, 9)) + (offset % qcow_ctx -> cluster_size);
+		if ((err = write_at(qcow_ctx -> clusters_file, img_offset, data, writable_bytes, 1)) < 0) {
+			WARNING_LOG("Failed to write to the qcow image.\n");
+			return err;
+		}
+	}
+	
+	return QCOW_NO_ERROR;
+}
+
+/// NOTE: a run of unallocated clusters covered by the same l2 table is allocated as a single contiguous host extent,
+///       its data written with a single write, and the l2 entries updated only afterwards, while extent_bytes
+///       is left to 0 whenever the write has to go through qwrite_cluster instead (e.g. the first cluster is allocated).
+static int qwrite_extent(const u8* data, u64 size, u64 offset, qcow_ctx_t* qcow_ctx, u64* extent_bytes) {
+	*extent_bytes = 0;
+	if (qcow_ctx -> use_erdf || (offset % qcow_ctx -> cluster_size) + size <= qcow_ctx -> cluster_size) return QCOW_NO_ERROR;
+
+	const u64 first_cluster = offset / qcow_ctx -> cluster_size;
+	const u64 l1_index = first_cluster / qcow_ctx -> table_cluster_entries;
+	const u64 clusters_cnt = MIN(CEILING((offset % qcow_ctx -> cluster_size) + size, qcow_ctx -> cluster_size), qcow_ctx -> table_cluster_entries - (first_cluster % qcow_ctx -> table_cluster_entries));
+	
+	int err = 0;
+	u64 run = 0;
+	for (; run < clusters_cnt; ++run) {
+		u64 img_offset = 0;
+		err = lba_to_img_offset(qcow_ctx, (first_cluster + run) * qcow_ctx -> cluster_size, &img_offset, NULL);
+		if (-err == QCOW_UNALLOCATED_L1_TABLE) {
+			run = clusters_cnt;
+			break;
+		} else if (-err != QCOW_UNALLOCATED_CLUSTER) break;
+	}
+
+	if (run < 2) return QCOW_NO_ERROR;
+
+	u64 extent_pos = 0;
+	if (qcow_ctx -> clusters_file == qcow_ctx -> img_file) err = alloc_clusters(qcow_ctx, run, &extent_pos);
+	else err = extend_img_file(qcow_ctx, qcow_ctx -> clusters_file, run * qcow_ctx -> cluster_size, qcow_ctx -> clusters_file_base, qcow_ctx -> cluster_size, &extent_pos);
+
+	if (err < 0) {
+		WARNING_LOG("Failed to allocate an extent of %llu clusters.\n", run);
+		return err;
+	}
+
+	// The head of the first cluster and the tail of the last one keep reading the data of the backing chain
+	const u64 bytes = MIN(size, run * qcow_ctx -> cluster_size - (offset % qcow_ctx -> cluster_size));
+	const u64 extent_end = (offset % qcow_ctx -> cluster_size) + bytes;
+	if ((err = copy_from_backing_file(qcow_ctx, first_cluster * qcow_ctx -> cluster_size, extent_pos, offset % qcow_ctx -> cluster_size)) < 0) return err;
+	else if ((err = copy_from_backing_file(qcow_ctx, first_cluster * qcow_ctx -> cluster_size + extent_end, extent_pos + extent_end, (qcow_ctx -> cluster_size - (extent_end % qcow_ctx -> cluster_size)) % qcow_ctx -> cluster_size)) < 0) return err;
+	
+	if ((err = write_at(qcow_ctx -> clusters_file, extent_pos + (offset % qcow_ctx -> cluster_size), data, sizeof(u8), bytes)) < 0) {
+		WARNING_LOG("Failed to write the extent at img_offset 0x%llX.\n", extent_pos);
+		return err;
+	}
+
+	subcluster_info_t subcluster_info = { .alloc_status = ALL_SUBCLUSTERS_ALLOCATED, .reads_as_zero = 0 };
+	for (u64 i = 0; i < run; ++i) {
+		const u64 cluster_offset = ((extent_pos + i * qcow_ctx -> cluster_size) & QCOW_MASK_BITS_INTERVAL(56, 9)) | (1ULL << 63);
+		if ((err = set_lba_at_img_offset(qcow_ctx, (first_cluster + i) * qcow_ctx -> cluster_size, cluster_offset, subcluster_info)) < 0) {
+			WARNING_LOG("Failed to update the l2 entry %llu:%llu.\n", l1_index, (first_cluster + i) % qcow_ctx -> table_cluster_entries);
+			return err;
+		}
+	}
+	
+	*extent_bytes = bytes;
+
+	return QCOW_NO_ERROR;
+}
+
+/// NOTE: the l2 table covering each cluster is write-locked while the cluster is updated,
+///       so that concurrent readers and writers of the same qcow_ctx see consistent metadata.
+int qwrite(const void* data, size_t size, size_t nmemb, u64 offset, qcow_ctx_t* qcow_ctx) {	
+	if (qcow_ctx -> read_only) {
+		WARNING_LOG("Cannot write to an image opened read-only.\n");
+		return -QCOW_READ_ONLY_IMAGE;
+	}
+
+	int err = 0;
+	for (u64 bytes_written = 0; bytes_written < (size * nmemb);) {
+		u64 writable_bytes = MIN(size * nmemb - bytes_written, qcow_ctx -> cluster_size - (offset % qcow_ctx -> cluster_size));
+
+		pthread_rwlock_t* l2_lock = NULL;
+		if ((err = get_l2_lock(qcow_ctx, offset, &l2_lock)) < 0) return err;
+
+		u64 extent_bytes = 0;
+		pthread_rwlock_wrlock(l2_lock);
+		err = qwrite_extent(QCOW_CAST_PTR(data, u8) + bytes_written, size * nmemb - bytes_written, offset, qcow_ctx, &extent_bytes);
+		if (err == QCOW_NO_ERROR && extent_bytes > 0) writable_bytes = extent_bytes;
+		else if (err == QCOW_NO_ERROR) err = qwrite_cluster(QCOW_CAST_PTR(data, u8) + bytes_written, writable_bytes, offset, qcow_ctx);
+		pthread_rwlock_unlock(l2_lock);
+		
+		if (err < 0) {
+			WARNING_LOG("Failed to write the cluster at LBA 0x%llX.\n", offset);
+			return err;
+		}
+
 		bytes_written += writable_bytes;
 		offset += writable_bytes;
 	}
@@ -1475,150 +2042,309 @@ int qwrite(const void* data, size_t size, size_t nmemb, unsigned int offset, qco
 	return QCOW_NO_ERROR;
 }
 
-static int read_from_backing_file(void* ptr, size_t size, size_t nmemb, u64 cluster_offset, unsigned int offset, qcow_ctx_t qcow_ctx) {
+/// NOTE: the cluster is copied, as the compressor takes ownership of its input, and the qcow_ctx is only read for its
+///       compression type and cluster size, so that the clusters of an image can be compressed concurrently by a pool of workers.
+int qcompress_cluster(qcow_ctx_t* qcow_ctx, const void* cluster, u8** compressed_cluster, unsigned int* compressed_cluster_size) {
+	u8* cluster_copy = (u8*) qcow_calloc(qcow_ctx -> cluster_size, sizeof(u8));
+	if (cluster_copy == NULL) {
+		WARNING_LOG("Failed to allocate the cluster to compress.\n");
+		return -QCOW_IO_ERROR;
+	}
+	
+	mem_cpy(cluster_copy, cluster, qcow_ctx -> cluster_size);
+
 	int err = 0;
-	if (IS_COMPRESSED_CLUSTER(cluster_offset)) {
-		u8* cluster = NULL;
-		unsigned int cluster_data_size = 0;
-		unsigned int compressed_cluster_size = 0;
-		if ((err = read_compressed_cluster(qcow_ctx, qcow_ctx.backing_file, &cluster_offset, &cluster, &cluster_data_size, &compressed_cluster_size)) < 0) {
-			WARNING_LOG("Failed to read compressed cluster at cluster_offset: 0x%llX\n", cluster_offset);
+	if (qcow_ctx -> compression_type == DEFLATE) {
+		*compressed_cluster = zlib_deflate(cluster_copy, qcow_ctx -> cluster_size, compressed_cluster_size, &err);
+		if (err) {
+			ERROR_LOG("ZLIB_ERROR::%s: %s", zlib_errors_str[-err], *compressed_cluster);
+			*compressed_cluster = NULL;
+			return -QCOW_DEFLATE_ERROR; 
+		}
+	} else {
+		*compressed_cluster = zstd_deflate(cluster_copy, qcow_ctx -> cluster_size, compressed_cluster_size, &err);
+		if (err) {
+			ERROR_LOG("ZSTD_ERROR::%s: Failed to compress the cluster.\n", zstd_errors_str[-err]);
+			*compressed_cluster = NULL;
+			return -QCOW_DEFLATE_ERROR; 
+		}
+	}
+
+	return QCOW_NO_ERROR;
+}
+
+/// NOTE: the compressed cluster is appended at the packing cursor and mapped at the guest cluster starting at offset,
+///       whose previous mapping is replaced without being released, hence it is meant to fill the clusters of a new image.
+///       A cluster not shrinking below the cluster size should rather be written uncompressed through qwrite.
+int qwrite_compressed(qcow_ctx_t* qcow_ctx, const void* compressed_cluster, unsigned int compressed_cluster_size, u64 offset) {
+	if (qcow_ctx -> read_only) {
+		WARNING_LOG("Cannot write to an image opened read-only.\n");
+		return -QCOW_READ_ONLY_IMAGE;
+	} else if (qcow_ctx -> clusters_file != qcow_ctx -> img_file) {
+		WARNING_LOG("The compressed clusters cannot be stored in an external data file.\n");
+		return -QCOW_INVALID_PARAMETERS;
+	} else if (!IS_CLUSTER_ALIGNED(offset, qcow_ctx -> cluster_size) || offset >= qcow_ctx -> size) {
+		WARNING_LOG("Invalid compressed cluster offset: 0x%llX\n", offset);
+		return -QCOW_UNALIGNED_CLUSTER;
+	}
+
+	int err = 0;
+	u64 host_offset = 0;
+	if ((err = alloc_compressed_bytes(qcow_ctx, compressed_cluster_size, &host_offset)) < 0) {
+		WARNING_LOG("Failed to allocate %u bytes for the compressed cluster.\n", compressed_cluster_size);
+		return err;
+	}
+
+	if ((err = write_at(qcow_ctx -> img_file, host_offset, compressed_cluster, sizeof(u8), compressed_cluster_size)) < 0) {
+		WARNING_LOG("Failed to write the compressed cluster.\n");
+		return err;
+	}
+
+	pthread_rwlock_t* l2_lock = NULL;
+	if ((err = get_l2_lock(qcow_ctx, offset, &l2_lock)) < 0) return err;
+
+	pthread_rwlock_wrlock(l2_lock);
+	err = set_lba_at_img_offset(qcow_ctx, offset, compressed_l2_entry(qcow_ctx, host_offset, compressed_cluster_size), (subcluster_info_t) {0});
+	pthread_rwlock_unlock(l2_lock);
+	
+	if (err < 0) {
+		WARNING_LOG("Failed to map the compressed cluster at LBA 0x%llX.\n", offset);
+		return err;
+	}
+
+	return QCOW_NO_ERROR;
+}
+
+/// NOTE: l2_entry is an allocated l2 entry of the given layer, and the readable_bytes starting at offset must lie within its cluster.
+static int read_l2_entry_data(qcow_ctx_t* qcow_ctx, u64 l2_entry, u8* ptr, u64 readable_bytes, u64 offset) {
+	int err = 0;
+	if (IS_COMPRESSED_CLUSTER(l2_entry)) {
+		if ((err = read_cached_compressed_cluster(qcow_ctx, qcow_ctx -> clusters_file, l2_entry, ptr, offset % qcow_ctx -> cluster_size, readable_bytes)) < 0) {
+			WARNING_LOG("Failed to read compressed cluster at img_offset: 0x%llX\n", l2_entry);
 			return err;
 		}
 		
-		mem_cpy(ptr, cluster + (offset % qcow_ctx.cluster_size), MIN(cluster_data_size, size * nmemb));
-		QCOW_SAFE_FREE(cluster);
-			
 		return QCOW_NO_ERROR;
 	} 
 
-	if (((cluster_offset & QCOW_MASK_BITS_INTERVAL(62, 56)) != 0) || ((cluster_offset & QCOW_MASK_BITS_INTERVAL(9, 0)) != 0)) {
+	if (((l2_entry & QCOW_MASK_BITS_INTERVAL(62, 56)) != 0) || ((l2_entry & QCOW_MASK_BITS_INTERVAL(9, 1)) != 0)) {
 		WARNING_LOG("Use of reserved field in l2 entry.\n");
 		return -QCOW_USE_OF_RESERVED_FIELD;
-	} 
+	} else if ((l2_entry & 1) || ((l2_entry & QCOW_MASK_BITS_INTERVAL(56, 9)) == 0 && ((l2_entry >> 63) & 1) == 0 && !qcow_ctx -> use_erdf)) {
+		mem_set(ptr, 0, readable_bytes);
+		return QCOW_NO_ERROR;
+	}
 
-	cluster_offset = (cluster_offset & QCOW_MASK_BITS_INTERVAL(56, 9)) + (offset % qcow_ctx.cluster_size);
-	if ((err = read_at(qcow_ctx.backing_file, cluster_offset, ptr, size, nmemb)) < 0) {
-		WARNING_LOG("Failed to read the cluster from the backing file.\n");
+	const u64 img_offset = (l2_entry & QCOW_MASK_BITS_INTERVAL(56, 9)) + (offset % qcow_ctx -> cluster_size);
+	if ((err = read_at(qcow_ctx -> clusters_file, img_offset, ptr, readable_bytes, 1)) < 0) {
+		WARNING_LOG("Failed to read from the qcow image.\n");
 		return err;
 	}
 
 	return QCOW_NO_ERROR;
 }
 
-/// NOTE: the function expects that the ptr has been already allocated, so that it has no responsibility for its de/allocation.
-int qread(void* ptr, size_t size, size_t nmemb, unsigned int offset, qcow_ctx_t qcow_ctx) {
-	int err = 0;
-	
-	const u64 start_cluster = offset / qcow_ctx.cluster_size;
-	const u64 end_cluster   = (offset + size * nmemb) / qcow_ctx.cluster_size;
-	
-	for (u64 i = start_cluster, bytes_read = 0; bytes_read < (size * nmemb) && i <= end_cluster; ++i) {
-		const u64 readable_bytes = MIN(size * nmemb - bytes_read, qcow_ctx.cluster_size - (offset % qcow_ctx.cluster_size));
+/// NOTE: the layers below the image are walked until the first one that allocates the cluster, unless the owner is already
+///       known to the chain cache, and whenever a layer has a different cluster size, or uses extended l2 entries,
+///       the read is delegated to that layer as a whole, as its clusters do not map one to one onto the ones above.
+static int find_backing_owner(qcow_ctx_t* qcow_ctx, u64 offset, qcow_chain_cache_entry_t* owner) {
+	const u64 cluster = offset / qcow_ctx -> cluster_size;
+	if (qcow_ctx -> chain_cache != NULL && qcow_chain_cache_get(qcow_ctx -> chain_cache, cluster, owner)) return QCOW_NO_ERROR;
 
-		u64 ref_cnt = 0;
-		if ((err = get_ref_cnt(qcow_ctx, offset, &ref_cnt)) < 0) {
-			WARNING_LOG("An error occurred while fetching the ref_cnt on cluster %llu (traversing clusters: %llu - %llu).\n", i, start_cluster, end_cluster);
-			return err;
+	*owner = (qcow_chain_cache_entry_t) { .owner = QCOW_CHAIN_ZEROS, .limit = (u64) qcow_ctx -> backing_file_size };
+	qcow_ctx_t* layer = qcow_ctx;
+	while (TRUE) {
+		if (layer -> backing_ctx == NULL) {
+			if (layer -> backing_file == NULL) break;
+			owner -> owner = QCOW_CHAIN_RAW;
+			owner -> layer = layer;
+			owner -> limit = MIN(owner -> limit, (u64) layer -> backing_file_size);
+			break;
 		}
-
-		DEBUG_LOG("ref_cnt at LBA 0x%X: %llu\n", offset, ref_cnt);
-		
-		if (ref_cnt == 0 && qcow_ctx.backing_file == NULL) {
-			mem_set(QCOW_CAST_PTR(ptr, u8) + bytes_read, 0, readable_bytes);
-			bytes_read += readable_bytes;
-			offset += readable_bytes;
-			continue;
-		} 
 		
-		u64 img_offset = 0;
-		subcluster_info_t subcluster_info = {0};
+		layer = layer -> backing_ctx;
+		owner -> limit = MIN(owner -> limit, layer -> size);
+		if (cluster * qcow_ctx -> cluster_size >= owner -> limit) break;
+		else if (layer -> cluster_size != qcow_ctx -> cluster_size || layer -> use_extended_l2_entries) {
+			owner -> owner = QCOW_CHAIN_DELEGATE;
+			owner -> layer = layer;
+			break;
+		}
 
-		err = lba_to_img_offset(qcow_ctx, offset, &img_offset, &subcluster_info);
-		if (-err == QCOW_UNALLOCATED_CLUSTER) {
-			mem_set(QCOW_CAST_PTR(ptr, u8) + bytes_read, 0, readable_bytes);
-			bytes_read += readable_bytes;
-			offset += readable_bytes;
-			continue;
-		} else if (err < 0) {
-			WARNING_LOG("An error occurred while translating the LBA into an image offset on cluster %llu (traversing clusters: %llu - %llu).\n", i, start_cluster, end_cluster);
+		u64 l2_entry = 0;
+		int err = lba_to_img_offset(layer, cluster * qcow_ctx -> cluster_size, &l2_entry, NULL);
+		if (-err == QCOW_UNALLOCATED_CLUSTER || -err == QCOW_UNALLOCATED_L1_TABLE) continue;
+		else if (err < 0) {
+			WARNING_LOG("Failed to translate the LBA 0x%llX in the backing layer %u.\n", offset, layer -> chain_depth);
 			return err;
 		}
+
+		owner -> owner = QCOW_CHAIN_LAYER;
+		owner -> layer = layer;
+		owner -> l2_entry = l2_entry;
+		break;
+	}
+
+	if (qcow_ctx -> chain_cache != NULL) qcow_chain_cache_put(qcow_ctx -> chain_cache, cluster, owner);
+
+	return QCOW_NO_ERROR;
+}
+
+/// NOTE: the readable_bytes starting at offset must lie within a single cluster of the image, and everything past
+///       the end of the backing chain reads as zeros.
+static int read_from_backing_file(u8* ptr, u64 readable_bytes, u64 offset, qcow_ctx_t* qcow_ctx) {
+	if (qcow_ctx -> backing_file == NULL && qcow_ctx -> backing_ctx == NULL) {
+		mem_set(ptr, 0, readable_bytes);
+		return QCOW_NO_ERROR;
+	}
+
+	int err = 0;
+	qcow_chain_cache_entry_t owner = {0};
+	if ((err = find_backing_owner(qcow_ctx, offset, &owner)) < 0) return err;
+
+	const u64 backing_bytes = (offset >= owner.limit) ? 0 : MIN(readable_bytes, owner.limit - offset);
+	mem_set(ptr + backing_bytes, 0, readable_bytes - backing_bytes);
+	if (backing_bytes == 0) return QCOW_NO_ERROR;
+
+	if (owner.owner == QCOW_CHAIN_LAYER) err = read_l2_entry_data(owner.layer, owner.l2_entry, ptr, backing_bytes, offset);
+	else if (owner.owner == QCOW_CHAIN_RAW) err = read_at(owner.layer -> backing_file, offset, ptr, sizeof(u8), backing_bytes);
+	else if (owner.owner == QCOW_CHAIN_DELEGATE) err = qread(ptr, sizeof(u8), backing_bytes, offset, owner.layer);
+	else mem_set(ptr, 0, backing_bytes);
+	
+	if (err < 0) {
+		WARNING_LOG("Failed to read the LBA 0x%llX from the backing chain.\n", offset);
+		return err;
+	}
+
+	return QCOW_NO_ERROR;
+}
+
+/// NOTE: used to fill the part of a newly allocated cluster that is not going to be written, so that it keeps reading
+///       the data of the backing chain.
+static int copy_from_backing_file(qcow_ctx_t* qcow_ctx, u64 offset, u64 img_offset, u64 size) {
+	if (size == 0 || (qcow_ctx -> backing_file == NULL && qcow_ctx -> backing_ctx == NULL)) return QCOW_NO_ERROR;
+
+	u8* data = (u8*) qcow_calloc(size, sizeof(u8));
+	if (data == NULL) {
+		WARNING_LOG("Failed to allocate the buffer for the backing data.\n");
+		return -QCOW_IO_ERROR;
+	}
+
+	int err = 0;
+	if ((err = read_from_backing_file(data, size, offset, qcow_ctx)) < 0 || (err = write_at(qcow_ctx -> clusters_file, img_offset, data, sizeof(u8), size)) < 0) {
+		QCOW_SAFE_FREE(data);
+		WARNING_LOG("Failed to copy the backing data at LBA 0x%llX.\n", offset);
+		return err;
+	}
+
+	QCOW_SAFE_FREE(data);
+
+	return QCOW_NO_ERROR;
+}
+
+/// NOTE: the guest data is located only through the l1/l2 tables, hence the read path never touches the refcount metadata.
+static int qread_cluster(u8* ptr, u64 readable_bytes, u64 offset, qcow_ctx_t* qcow_ctx) {
+	int err = 0;
+	u64 img_offset = 0;
+	subcluster_info_t subcluster_info = {0};
+
+	err = lba_to_img_offset(qcow_ctx, offset, &img_offset, &subcluster_info);
+	if (-err == QCOW_UNALLOCATED_CLUSTER || -err == QCOW_UNALLOCATED_L1_TABLE) {
+		return read_from_backing_file(ptr, readable_bytes, offset, qcow_ctx);
+	} else if (err < 0) {
+		WARNING_LOG("An error occurred while translating the LBA 0x%llX into an image offset.\n", offset);
+		return err;
+	}
+	
+	IMG_OFFSET_INFO(img_offset);
+	
+	if (qcow_ctx -> use_extended_l2_entries && !IS_COMPRESSED_CLUSTER(img_offset)) {
+		u64 subcluster_size = qcow_ctx -> cluster_size / 32;
+		u8 subcluster_index = FLOORING(offset % qcow_ctx -> cluster_size, subcluster_size);
 		
-		IMG_OFFSET_INFO(img_offset);
-		
-		if (ref_cnt == 0 && (img_offset + size * nmemb) <= (u64) qcow_ctx.backing_file_size) {
-			if ((err = read_from_backing_file(ptr, size, nmemb, img_offset, offset, qcow_ctx)) < 0) {
-				WARNING_LOG("Failed to read from the backing file at img_offset: 0x%llX\n", img_offset);
-				return err;
-			}
-			return size;
-		} else if (ref_cnt == 0) {
-			mem_set(QCOW_CAST_PTR(ptr, u8) + bytes_read, 0, readable_bytes);
-			bytes_read += readable_bytes;
-			offset += readable_bytes;
-			continue;
+		if ((subcluster_info.alloc_status >> subcluster_index & 1) && (subcluster_info.reads_as_zero >> subcluster_index & 1)) {
+			WARNING_LOG("Allocation status and reads as zero cannot be both set to 1 for the same subcluster.\n");
+			return -QCOW_INVALID_SUBCLUSTER_BITMAP;
 		}
 		
-		if (qcow_ctx.use_extended_l2_entries && !IS_COMPRESSED_CLUSTER(img_offset)) {
-			u64 subcluster_size = qcow_ctx.cluster_size / 32;
-			u64 subcluster_pos = offset % qcow_ctx.cluster_size;
-			u8 subcluster_index = FLOORING(offset % qcow_ctx.cluster_size, subcluster_size);
-			
-			if ((subcluster_info.alloc_status >> subcluster_index & 1) && (subcluster_info.reads_as_zero >> subcluster_index & 1)) {
-				WARNING_LOG("Allocation status and reads as zero cannot be both set to 1 for the same subcluster.\n");
-				return -QCOW_INVALID_SUBCLUSTER_BITMAP;
-			}
-			
-			if ((subcluster_info.alloc_status >> subcluster_index & 1) == 0 || (subcluster_info.reads_as_zero >> subcluster_index & 1)) {
-				if (qcow_ctx.backing_file == NULL && (img_offset + subcluster_pos + readable_bytes) > (u64) qcow_ctx.backing_file_size) {
-					mem_set(QCOW_CAST_PTR(ptr, u8) + bytes_read, 0, readable_bytes);
-					bytes_read += readable_bytes;
-					offset += readable_bytes;
-					continue;
-				}
-				
-				if ((err = read_from_backing_file(QCOW_CAST_PTR(ptr, u8) + bytes_read, readable_bytes, 1, img_offset, offset, qcow_ctx)) < 0) {
-					WARNING_LOG("Failed to read from the backing file at img_offset: 0x%llX\n", img_offset);
-					return err;
-				}
-				
-				bytes_read += readable_bytes;
-				offset += readable_bytes;
-				continue;
-			}
+		if (subcluster_info.reads_as_zero >> subcluster_index & 1) {
+			mem_set(ptr, 0, readable_bytes);
+			return QCOW_NO_ERROR;
+		} else if ((subcluster_info.alloc_status >> subcluster_index & 1) == 0) {
+			return read_from_backing_file(ptr, readable_bytes, offset, qcow_ctx);
 		}
+	}
+	
+	return read_l2_entry_data(qcow_ctx, img_offset, ptr, readable_bytes, offset);
+}
+
+/// NOTE: the clusters covered by the same l2 table are merged into a single extent as long as they are either all
+///       standard clusters stored back to back in the image, or all reading as zeros, so that the whole extent is
+///       served by a single read (or mem_set), while extent_bytes is left to 0 whenever the first cluster
+///       has to go through qread_cluster instead (e.g. compressed clusters or extended l2 entries).
+static int qread_extent(u8* ptr, u64 size, u64 offset, qcow_ctx_t* qcow_ctx, u64* extent_bytes) {
+	*extent_bytes = 0;
+	if (qcow_ctx -> use_extended_l2_entries) return QCOW_NO_ERROR;
+
+	const u64 first_cluster = offset / qcow_ctx -> cluster_size;
+	const u64 cluster_pos = offset % qcow_ctx -> cluster_size;
+	const u64 clusters_cnt = MIN(CEILING(cluster_pos + size, qcow_ctx -> cluster_size), qcow_ctx -> table_cluster_entries - (first_cluster % qcow_ctx -> table_cluster_entries));
+
+	u64 run = 0;
+	u64 extent_pos = 0;
+	bool reads_as_zero = FALSE;
+	for (; run < clusters_cnt; ++run) {
+		u64 img_offset = 0;
+		bool zero_cluster = FALSE;
+		int err = lba_to_img_offset(qcow_ctx, (first_cluster + run) * qcow_ctx -> cluster_size, &img_offset, NULL);
+		if ((-err == QCOW_UNALLOCATED_CLUSTER || -err == QCOW_UNALLOCATED_L1_TABLE) && qcow_ctx -> backing_file == NULL && qcow_ctx -> backing_ctx == NULL) zero_cluster = TRUE;
+		else if (err < 0 || IS_COMPRESSED_CLUSTER(img_offset)) break;
+		else if ((img_offset & QCOW_MASK_BITS_INTERVAL(62, 56)) || (img_offset & QCOW_MASK_BITS_INTERVAL(9, 0))) break;
+		else if ((img_offset & QCOW_MASK_BITS_INTERVAL(56, 9)) == 0 && ((img_offset >> 63) & 1) == 0 && !qcow_ctx -> use_erdf) zero_cluster = TRUE;
 		
-		if (IS_COMPRESSED_CLUSTER(img_offset)) {
-			u8* cluster = NULL;
-			unsigned int cluster_data_size = 0;
-			unsigned int compressed_cluster_size = 0;
-			if ((err = read_compressed_cluster(qcow_ctx, qcow_ctx.clusters_file, &img_offset, &cluster, &cluster_data_size, &compressed_cluster_size)) < 0) {
-				WARNING_LOG("Failed to read compressed cluster at img_offset: 0x%llX\n", img_offset);
-				return err;
-			}
-			
-			mem_cpy(QCOW_CAST_PTR(ptr, u8) + bytes_read, cluster + (offset % cluster_data_size), readable_bytes);
-			QCOW_SAFE_FREE(cluster);
-			
-			bytes_read += readable_bytes;
-			offset += readable_bytes;
-			continue;	
-		} 
+		img_offset &= QCOW_MASK_BITS_INTERVAL(56, 9);
+		if (run == 0) {
+			reads_as_zero = zero_cluster;
+			extent_pos = img_offset;
+		} else if (zero_cluster != reads_as_zero || (!zero_cluster && img_offset != extent_pos + run * qcow_ctx -> cluster_size)) break;
+	}
 
-		if (((img_offset & QCOW_MASK_BITS_INTERVAL(62, 56)) != 0) || ((img_offset & QCOW_MASK_BITS_INTERVAL(9, 0)) != 0)) {
-			WARNING_LOG("Use of reserved field in l2 entry.\n");
-			return -QCOW_USE_OF_RESERVED_FIELD;
-		} else if ((img_offset & QCOW_MASK_BITS_INTERVAL(56, 9)) == 0 && ((img_offset >> 63) & 1) == 0 && !qcow_ctx.use_erdf) {
-			mem_set(QCOW_CAST_PTR(ptr, u8) + bytes_read, 0, readable_bytes);
-			bytes_read += readable_bytes;
-			offset += readable_bytes;
-			continue;
+	if (run == 0) return QCOW_NO_ERROR;
+
+	const u64 bytes = MIN(size, run * qcow_ctx -> cluster_size - cluster_pos);
+	if (reads_as_zero) mem_set(ptr, 0, bytes);
+	else {
+		int err = 0;
+		if ((err = read_at(qcow_ctx -> clusters_file, extent_pos + cluster_pos, ptr, sizeof(u8), bytes)) < 0) {
+			WARNING_LOG("Failed to read the extent at img_offset 0x%llX.\n", extent_pos);
+			return err;
 		}
+	}
+
+	*extent_bytes = bytes;
+
+	return QCOW_NO_ERROR;
+}
+
+/// NOTE: the function expects that the ptr has been already allocated, so that it has no responsibility for its de/allocation.
+///       The l2 table covering each cluster is read-locked while the cluster is read, so that multiple threads can qread in parallel.
+int qread(void* ptr, size_t size, size_t nmemb, u64 offset, qcow_ctx_t* qcow_ctx) {
+	int err = 0;
+	for (u64 bytes_read = 0; bytes_read < (size * nmemb);) {
+		u64 readable_bytes = MIN(size * nmemb - bytes_read, qcow_ctx -> cluster_size - (offset % qcow_ctx -> cluster_size));
 
-		img_offset = (img_offset & QCOW_MASK_BITS_INTERVAL(56, 9)) + (offset % qcow_ctx.cluster_size);
-		if ((err = read_at(qcow_ctx.clusters_file, img_offset, QCOW_CAST_PTR(ptr, u8) + bytes_read, readable_bytes, 1)) < 0) {
-			WARNING_LOG("Failed to read from the qcow image.\n");
+		pthread_rwlock_t* l2_lock = NULL;
+		if ((err = get_l2_lock(qcow_ctx, offset, &l2_lock)) < 0) return err;
+
+		u64 extent_bytes = 0;
+		pthread_rwlock_rdlock(l2_lock);
+		err = qread_extent(QCOW_CAST_PTR(ptr, u8) + bytes_read, size * nmemb - bytes_read, offset, qcow_ctx, &extent_bytes);
+		if (err == QCOW_NO_ERROR && extent_bytes > 0) readable_bytes = extent_bytes;
+		else if (err == QCOW_NO_ERROR) err = qread_cluster(QCOW_CAST_PTR(ptr, u8) + bytes_read, readable_bytes, offset, qcow_ctx);
+		pthread_rwlock_unlock(l2_lock);
+
+		if (err < 0) {
+			WARNING_LOG("Failed to read the cluster at LBA 0x%llX.\n", offset);
 			return err;
 		}
 	
@@ -1629,4 +2355,215 @@ int qread(void* ptr, size_t size, size_t nmemb, unsigned int offset, qcow_ctx_t
 	return QCOW_NO_ERROR;
 }
 
+/// NOTE: the dirty metadata cached by qwrite is written back to the image, the refcount blocks first and the l2 tables after,
+///       while qfsync also makes the written data and metadata durable on the underlying storage.
+/// NOTE: the clusters released before the flush are handed back to the free map only once the tables
+///       that dropped them are synced, while the ones released meanwhile wait for the next flush.
+int qflush(qcow_ctx_t* qcow_ctx) {
+	if (qcow_ctx -> read_only) return QCOW_NO_ERROR;
+
+	u64 released_cnt = 0;
+	if (qcow_ctx -> free_map != NULL) {
+		pthread_mutex_lock(&(qcow_ctx -> locks -> alloc_lock));
+		released_cnt = qcow_ctx -> free_map -> released_cnt;
+		pthread_mutex_unlock(&(qcow_ctx -> locks -> alloc_lock));
+	}
+
+	int err = 0;
+	if (qcow_ctx -> refcount_cache != NULL && (err = qcow_cache_flush(qcow_ctx -> refcount_cache)) < 0) {
+		WARNING_LOG("Failed to flush the refcount blocks.\n");
+		return err;
+	}
+
+	if ((err = qcow_cache_flush(qcow_ctx -> l2_cache)) < 0) {
+		WARNING_LOG("Failed to flush the l2 tables.\n");
+		return err;
+	}
+
+	if (released_cnt == 0) return QCOW_NO_ERROR;
+
+	if ((err = fsync_file(qcow_ctx -> img_file)) < 0) {
+		WARNING_LOG("Failed to sync the l2 tables.\n");
+		return err;
+	}
+
+	pthread_mutex_lock(&(qcow_ctx -> locks -> alloc_lock));
+	err = qcow_free_map_commit_released(qcow_ctx -> free_map, released_cnt);
+	pthread_mutex_unlock(&(qcow_ctx -> locks -> alloc_lock));
+	if (err < 0) {
+		WARNING_LOG("Failed to release the clusters in the free map.\n");
+		return err;
+	}
+
+	return QCOW_NO_ERROR;
+}
+
+int qfsync(qcow_ctx_t* qcow_ctx) {
+	int err = 0;
+	if ((err = qflush(qcow_ctx)) < 0) return err;
+	
+	if (qcow_ctx -> clusters_file != qcow_ctx -> img_file && (err = fsync_file(qcow_ctx -> clusters_file)) < 0) {
+		WARNING_LOG("Failed to sync the external data file.\n");
+		return err;
+	}
+
+	if ((err = fsync_file(qcow_ctx -> img_file)) < 0) {
+		WARNING_LOG("Failed to sync the image file.\n");
+		return err;
+	}
+
+	return QCOW_NO_ERROR;
+}
+
+/// NOTE: the statistics of the decompressed-cluster cache and of the backing chain lookups, cumulative since init_qcow.
+int qcache_stats(qcow_ctx_t* qcow_ctx, qcow_cache_stats_t* stats) {
+	if (qcow_ctx -> cluster_cache == NULL) {
+		WARNING_LOG("The cluster cache is not initialized.\n");
+		return -QCOW_IO_ERROR;
+	}
+
+	qcow_cluster_cache_stats(qcow_ctx -> cluster_cache, stats);
+	
+	if (qcow_ctx -> chain_cache != NULL) {
+		pthread_mutex_lock(&(qcow_ctx -> chain_cache -> lock));
+		stats -> chain_hits = qcow_ctx -> chain_cache -> hits;
+		stats -> chain_misses = qcow_ctx -> chain_cache -> misses;
+		pthread_mutex_unlock(&(qcow_ctx -> chain_cache -> lock));
+	}
+
+	return QCOW_NO_ERROR;
+}
+
+/// NOTE: the status of the range starting at offset up to the end of its cluster, or of its subcluster when extended l2 entries are used.
+static int get_block_status(qcow_ctx_t* qcow_ctx, u64 offset, u64 size, qcow_extent_t* extent) {
+	int err = 0;
+	pthread_rwlock_t* l2_lock = NULL;
+	if ((err = get_l2_lock(qcow_ctx, offset, &l2_lock)) < 0) return err;
+
+	u64 l2_entry = 0;
+	subcluster_info_t subcluster_info = {0};
+	pthread_rwlock_rdlock(l2_lock);
+	err = lba_to_img_offset(qcow_ctx, offset, &l2_entry, &subcluster_info);
+	pthread_rwlock_unlock(l2_lock);
+
+	const u64 cluster_pos = offset % qcow_ctx -> cluster_size;
+	const bool has_backing = (qcow_ctx -> backing_file != NULL || qcow_ctx -> backing_ctx != NULL);
+	*extent = (qcow_extent_t) { .offset = offset, .length = MIN(size, qcow_ctx -> cluster_size - cluster_pos) };
+	if (-err == QCOW_UNALLOCATED_CLUSTER || -err == QCOW_UNALLOCATED_L1_TABLE) {
+		extent -> status = has_backing ? QCOW_BLOCK_BACKING : QCOW_BLOCK_UNALLOCATED;
+		return QCOW_NO_ERROR;
+	} else if (err < 0) {
+		WARNING_LOG("An error occurred while translating the LBA 0x%llX into an image offset.\n", offset);
+		return err;
+	}
+
+	if (IS_COMPRESSED_CLUSTER(l2_entry)) {
+		extent -> status = QCOW_BLOCK_COMPRESSED;
+		return QCOW_NO_ERROR;
+	} else if ((l2_entry & QCOW_MASK_BITS_INTERVAL(62, 56)) || (l2_entry & QCOW_MASK_BITS_INTERVAL(9, 1))) {
+		WARNING_LOG("Use of reserved field in l2 entry.\n");
+		return -QCOW_USE_OF_RESERVED_FIELD;
+	} else if ((l2_entry & 1) || ((l2_entry & QCOW_MASK_BITS_INTERVAL(56, 9)) == 0 && ((l2_entry >> 63) & 1) == 0 && !qcow_ctx -> use_erdf)) {
+		extent -> status = QCOW_BLOCK_ZERO;
+		return QCOW_NO_ERROR;
+	}
+
+	extent -> status = QCOW_BLOCK_DATA;
+	extent -> host_offset = (l2_entry & QCOW_MASK_BITS_INTERVAL(56, 9)) + cluster_pos;
+	
+	if (qcow_ctx -> use_extended_l2_entries) {
+		const u64 subcluster_size = qcow_ctx -> cluster_size / 32;
+		const u8 subcluster_index = cluster_pos / subcluster_size;
+		extent -> length = MIN(size, (subcluster_index + 1) * subcluster_size - cluster_pos);
+		if ((subcluster_info.alloc_status >> subcluster_index & 1) && (subcluster_info.reads_as_zero >> subcluster_index & 1)) {
+			WARNING_LOG("Allocation status and reads as zero cannot be both set to 1 for the same subcluster.\n");
+			return -QCOW_INVALID_SUBCLUSTER_BITMAP;
+		} else if (subcluster_info.reads_as_zero >> subcluster_index & 1) {
+			extent -> status = QCOW_BLOCK_ZERO;
+			extent -> host_offset = 0;
+		} else if ((subcluster_info.alloc_status >> subcluster_index & 1) == 0) {
+			extent -> status = has_backing ? QCOW_BLOCK_BACKING : QCOW_BLOCK_UNALLOCATED;
+			extent -> host_offset = 0;
+		}
+	}
+
+	return QCOW_NO_ERROR;
+}
+
+/// NOTE: the range is clipped to the virtual size of the image, and it is described by merged extents written to the given array,
+///       without reading any guest data. The number of extents filled is returned, and when the array runs out
+///       the extents stop short of the end of the range, so that the caller can query again from the end of the last one.
+int qblock_status(qcow_ctx_t* qcow_ctx, u64 offset, u64 size, qcow_extent_t* extents, u32 extents_cnt) {
+	if (extents == NULL || extents_cnt == 0) return -QCOW_INVALID_PARAMETERS;
+	size = (offset >= qcow_ctx -> size) ? 0 : MIN(size, qcow_ctx -> size - offset);
+
+	int err = 0;
+	u32 cnt = 0;
+	while (size > 0) {
+		qcow_extent_t extent = {0};
+		if ((err = get_block_status(qcow_ctx, offset, size, &extent)) < 0) return err;
+
+		qcow_extent_t* last = (cnt > 0) ? extents + cnt - 1 : NULL;
+		if (last != NULL && last -> status == extent.status && (extent.status != QCOW_BLOCK_DATA || last -> host_offset + last -> length == extent.host_offset)) {
+			last -> length += extent.length;
+		} else if (cnt == extents_cnt) break;
+		else extents[cnt++] = extent;
+
+		offset += extent.length;
+		size -= extent.length;
+	}
+
+	return cnt;
+}
+
+/// NOTE: on success ptr points directly to the cluster data inside the mapping of the image, starting from the given offset,
+///       and size is set to the number of contiguous readable bytes, up to the end of the cluster.
+///       The pointer is valid until deinit_qcow, and only uncompressed and allocated clusters can be borrowed,
+///       otherwise QCOW_UNBORROWABLE_CLUSTER is returned, and the caller should fall back to qread.
+int qborrow_cluster(const void** ptr, u64* size, u64 offset, qcow_ctx_t* qcow_ctx) {
+	if (ptr == NULL || size == NULL) return -QCOW_INVALID_PARAMETERS;
+	else if (qcow_ctx -> clusters_file == NULL || qcow_ctx -> clusters_file -> ops -> map == NULL) return -QCOW_UNBORROWABLE_CLUSTER;
+
+	int err = 0;
+	pthread_rwlock_t* l2_lock = NULL;
+	if ((err = get_l2_lock(qcow_ctx, offset, &l2_lock)) < 0) return err;
+
+	u64 img_offset = 0;
+	subcluster_info_t subcluster_info = {0};
+	pthread_rwlock_rdlock(l2_lock);
+	err = lba_to_img_offset(qcow_ctx, offset, &img_offset, &subcluster_info);
+	pthread_rwlock_unlock(l2_lock);
+	if (err < 0) {
+		if (-err == QCOW_UNALLOCATED_CLUSTER || -err == QCOW_UNALLOCATED_L1_TABLE) return -QCOW_UNBORROWABLE_CLUSTER;
+		WARNING_LOG("An error occurred while translating the LBA into an image offset.\n");
+		return err;
+	}
+
+	if (IS_COMPRESSED_CLUSTER(img_offset) || (img_offset & QCOW_MASK_BITS_INTERVAL(9, 0)) || (img_offset & QCOW_MASK_BITS_INTERVAL(56, 9)) == 0) {
+		return -QCOW_UNBORROWABLE_CLUSTER;
+	}
+
+	const u64 cluster_offset = offset % qcow_ctx -> cluster_size;
+	u64 borrowable_size = qcow_ctx -> cluster_size - cluster_offset;
+	if (qcow_ctx -> use_extended_l2_entries) {
+		// Only the run of allocated subclusters that do not read as zero can be borrowed
+		const u64 subcluster_size = qcow_ctx -> cluster_size / 32;
+		unsigned int subcluster_index = cluster_offset / subcluster_size;
+		unsigned int last_subcluster = subcluster_index;
+		while (last_subcluster < 32 && (subcluster_info.alloc_status >> last_subcluster & 1) && !(subcluster_info.reads_as_zero >> last_subcluster & 1)) last_subcluster++;
+		if (last_subcluster == subcluster_index) return -QCOW_UNBORROWABLE_CLUSTER;
+		borrowable_size = last_subcluster * subcluster_size - cluster_offset;
+	}
+
+	const u64 host_offset = (img_offset & QCOW_MASK_BITS_INTERVAL(56, 9)) + cluster_offset;
+	if ((*ptr = qcow_ctx -> clusters_file -> ops -> map(qcow_ctx -> clusters_file, host_offset, borrowable_size)) == NULL) {
+		WARNING_LOG("The cluster at img_offset 0x%llX lies outside of the mapped image.\n", host_offset);
+		return -QCOW_IO_ERROR;
+	}
+
+	*size = borrowable_size;
+
+	return QCOW_NO_ERROR;
+}
+
 #endif // _QCOW_PARSER_H_
@@ -39,6 +39,184 @@ int contains_substr(const char* str, const char* substr) {
 	return 0;
 }
 
+#ifndef QCOW_CONVERT_PATH
+	#define QCOW_CONVERT_PATH "./qcow_convert"
+#endif
+
+#define ROUND_TRIP_SIZE (4 * 1024 * 1024ULL)
+
+static u64 next_rand(u64* state) {
+	*state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+	return *state >> 33;
+}
+
+/// NOTE: the disk holds compressible text, a zero run left unallocated by the conversion and incompressible random bytes.
+static void generate_disk_data(u8* data, u64 size, u64 seed) {
+	const char* words[] = { "qcow ", "cluster ", "refcount ", "table ", "deflate ", "zstd ", "l2 ", "entry\n" };
+	u64 state = seed;
+	for (u64 i = 0; i < size;) {
+		const u64 region = (i * 4) / size;
+		if (region == 1) {
+			data[i++] = 0;
+		} else if (region == 2) {
+			data[i++] = next_rand(&state);
+		} else {
+			const char* word = words[next_rand(&state) % QCOW_ARR_SIZE(words)];
+			for (unsigned int j = 0; word[j] != '\0' && i < size; ++j) data[i++] = word[j];
+		}
+	}
+	return;
+}
+
+static u64 first_mismatch(const u8* data, const u8* expected, u64 size) {
+	for (u64 i = 0; i < size; ++i) {
+		if (data[i] != expected[i]) return i;
+	}
+	return size;
+}
+
+static int write_raw_file(const char* path, const u8* data, u64 size) {
+	FILE* file = fopen(path, "wb");
+	if (file == NULL) {
+		WARNING_LOG("Failed to create '%s'.\n", path);
+		return -QCOW_IO_ERROR;
+	}
+
+	const size_t written = fwrite(data, sizeof(u8), size, file);
+	fclose(file);
+
+	return (written == size) ? QCOW_NO_ERROR : -QCOW_IO_ERROR;
+}
+
+static int read_raw_file(const char* path, u8* data, u64 size) {
+	FILE* file = fopen(path, "rb");
+	if (file == NULL) {
+		WARNING_LOG("Failed to open '%s'.\n", path);
+		return -QCOW_IO_ERROR;
+	}
+
+	const size_t read = fread(data, sizeof(u8), size, file);
+	fclose(file);
+
+	return (read == size) ? QCOW_NO_ERROR : -QCOW_IO_ERROR;
+}
+
+static int run_convert(const char* conversion, const char* input, const char* output, CompressionType compression_type) {
+	char command[512] = {0};
+	snprintf(command, sizeof(command), "%s %s %s %s %s > /dev/null", QCOW_CONVERT_PATH, conversion, input, output, compression_type == ZSTD ? "zstd" : "deflate");
+	if (system(command) != 0) {
+		WARNING_LOG("Failed to run '%s'.\n", command);
+		return -QCOW_IO_ERROR;
+	}
+	return QCOW_NO_ERROR;
+}
+
+static int check_raw_round_trip(const char* path_qcow, const char* path_raw, const u8* expected, u8* data, CompressionType compression_type) {
+	int err = 0;
+	if ((err = run_convert("to-raw", path_qcow, path_raw, compression_type)) < 0) return err;
+	if ((err = read_raw_file(path_raw, data, ROUND_TRIP_SIZE)) < 0) {
+		WARNING_LOG("Failed to read back '%s'.\n", path_raw);
+		return err;
+	}
+
+	const u64 mismatch = first_mismatch(data, expected, ROUND_TRIP_SIZE);
+	if (mismatch != ROUND_TRIP_SIZE) {
+		WARNING_LOG("'%s' differs from the expected data at 0x%llX.\n", path_raw, mismatch);
+		return -QCOW_IO_ERROR;
+	}
+
+	return QCOW_NO_ERROR;
+}
+
+/// NOTE: the raw disk is converted into a compressed qcow and back, then qwrites land on the compressed clusters,
+///       both partially and fully covering them, with compressible and incompressible data, and the image is checked
+///       through qread and through a second conversion back to raw, once closed.
+static int test_compressed_round_trip(CompressionType compression_type) {
+	const char* name = (compression_type == ZSTD) ? "zstd" : "deflate";
+	char path_raw[64] = {0};
+	char path_qcow[64] = {0};
+	char path_back[64] = {0};
+	snprintf(path_raw, sizeof(path_raw), "qcow_test_%s.raw", name);
+	snprintf(path_qcow, sizeof(path_qcow), "qcow_test_%s.qcow2", name);
+	snprintf(path_back, sizeof(path_back), "qcow_test_%s_back.raw", name);
+
+	u8* expected = qcow_calloc(ROUND_TRIP_SIZE, sizeof(u8));
+	u8* data = qcow_calloc(ROUND_TRIP_SIZE, sizeof(u8));
+	if (expected == NULL || data == NULL) {
+		QCOW_MULTI_FREE(expected, data);
+		WARNING_LOG("Failed to allocate the round trip buffers.\n");
+		return -QCOW_IO_ERROR;
+	}
+
+	int err = 0;
+	generate_disk_data(expected, ROUND_TRIP_SIZE, 0x51F1);
+	remove(path_qcow);
+	if ((err = write_raw_file(path_raw, expected, ROUND_TRIP_SIZE)) < 0 || (err = run_convert("to-compressed-qcow", path_raw, path_qcow, compression_type)) < 0) {
+		QCOW_MULTI_FREE(expected, data);
+		WARNING_LOG("Failed to create the %s compressed image.\n", name);
+		return err;
+	}
+
+	DEBUG_LOG("Checking the %s conversion round trip...\n", name);
+	if ((err = check_raw_round_trip(path_qcow, path_back, expected, data, compression_type)) < 0) {
+		QCOW_MULTI_FREE(expected, data);
+		return err;
+	}
+
+	qcow_ctx_t qcow_ctx = {0};
+	if ((err = init_qcow(&qcow_ctx, path_qcow)) < 0) {
+		QCOW_MULTI_FREE(expected, data);
+		WARNING_LOG("Failed to parse the %s compressed image.\n", name);
+		return err;
+	}
+
+	DEBUG_LOG("Writing into the %s compressed clusters...\n", name);
+	// Each write is either compressible text or random bytes, where the random rewrite of all but one byte of a compressed
+	// cluster no longer fits in a compressed cluster, while the ones past 1 MiB land on unallocated and standard clusters
+	const u64 writes[][3] = { { 0x18000, 200000, FALSE }, { 0x50001, 0xFFFF, TRUE }, { 0x20010, 100, TRUE }, { 0x1F8000, 0x14000, FALSE }, { 0x210000, 0x8000, FALSE } };
+	u64 state = 0xC0FFEE;
+	for (unsigned int i = 0; i < QCOW_ARR_SIZE(writes); ++i) {
+		const u64 offset = writes[i][0];
+		const u64 size = writes[i][1];
+		if (writes[i][2]) for (u64 j = 0; j < size; ++j) expected[offset + j] = next_rand(&state);
+		else generate_disk_data(expected + offset, size, state++);
+		
+		if ((err = qwrite(expected + offset, size, sizeof(u8), offset, &qcow_ctx)) < 0) {
+			deinit_qcow(&qcow_ctx);
+			QCOW_MULTI_FREE(expected, data);
+			WARNING_LOG("Failed to write %llu bytes at 0x%llX, err: '%s'\n", size, offset, qcow_errors_str[-err]);
+			return err;
+		}
+	}
+
+	if ((err = qread(data, ROUND_TRIP_SIZE, sizeof(u8), 0, &qcow_ctx)) < 0) {
+		deinit_qcow(&qcow_ctx);
+		QCOW_MULTI_FREE(expected, data);
+		WARNING_LOG("Failed to read back the %s compressed image, err: '%s'\n", name, qcow_errors_str[-err]);
+		return err;
+	}
+
+	deinit_qcow(&qcow_ctx);
+
+	const u64 mismatch = first_mismatch(data, expected, ROUND_TRIP_SIZE);
+	if (mismatch != ROUND_TRIP_SIZE) {
+		QCOW_MULTI_FREE(expected, data);
+		WARNING_LOG("The %s compressed image differs from the written data at 0x%llX.\n", name, mismatch);
+		return -QCOW_IO_ERROR;
+	}
+
+	DEBUG_LOG("Checking the %s image after the writes...\n", name);
+	err = check_raw_round_trip(path_qcow, path_back, expected, data, compression_type);
+	QCOW_MULTI_FREE(expected, data);
+	if (err < 0) return err;
+
+	remove(path_raw);
+	remove(path_qcow);
+	remove(path_back);
+
+	return QCOW_NO_ERROR;
+}
+
 int main(int argc, char* argv[]) {
 	if (argc < 2) {
 		WARNING_LOG("Usage: %s <path to qcow image>\n", argv[0]);
@@ -65,7 +243,7 @@ int main(int argc, char* argv[]) {
 	}
 
 	DEBUG_LOG("Reading original data...\n");
-	int ret = qread(original_data, size, sizeof(u8), offset, qcow_ctx);
+	int ret = qread(original_data, size, sizeof(u8), offset, &qcow_ctx);
 	if (ret < 0) {
 		QCOW_SAFE_FREE(original_data);
 		WARNING_LOG("Failed to read %llu bytes at LBA 0x%llX, ret: %d - '%s'\n", size, offset, ret, qcow_errors_str[-ret]);
@@ -88,7 +266,7 @@ int main(int argc, char* argv[]) {
 	data[370017] = 0x17;
 
 	DEBUG_LOG("Writing new data...\n");
-	ret = qwrite(data, size, sizeof(u8), offset, qcow_ctx);
+	ret = qwrite(data, size, sizeof(u8), offset, &qcow_ctx);
 	if (ret < 0) {
 		QCOW_SAFE_FREE(original_data);
 		QCOW_SAFE_FREE(data);
@@ -98,7 +276,7 @@ int main(int argc, char* argv[]) {
 	}
 
 	DEBUG_LOG("Reading back new data...\n");
-	ret = qread(data, size, sizeof(u8), offset, qcow_ctx);
+	ret = qread(data, size, sizeof(u8), offset, &qcow_ctx);
 	if (ret < 0) {
 		QCOW_SAFE_FREE(original_data);
 		QCOW_SAFE_FREE(data);
@@ -115,7 +293,7 @@ int main(int argc, char* argv[]) {
 	for (u8 i = 0; i < 32; ++i) printf("[0x%llX]: 0x%X\n", offset + i + n_off, data[i + n_off]);
 
 	DEBUG_LOG("Writing back original data...\n");
-	ret = qwrite(original_data, size, sizeof(u8), offset, qcow_ctx);
+	ret = qwrite(original_data, size, sizeof(u8), offset, &qcow_ctx);
 	if (ret < 0) {
 		QCOW_SAFE_FREE(original_data);
 		QCOW_SAFE_FREE(data);
@@ -129,6 +307,15 @@ int main(int argc, char* argv[]) {
 
 	deinit_qcow(&qcow_ctx);
 
+	const CompressionType compression_types[] = { DEFLATE, ZSTD };
+	for (unsigned int i = 0; i < QCOW_ARR_SIZE(compression_types); ++i) {
+		if ((ret = test_compressed_round_trip(compression_types[i])) < 0) {
+			WARNING_LOG("The %s round trip failed, err: '%s'\n", compression_type_str[compression_types[i]], qcow_errors_str[-ret]);
+			return -1;
+		}
+		DEBUG_LOG("The %s round trip succeeded.\n", compression_type_str[compression_types[i]]);
+	}
+
 	return 0;
 }
 
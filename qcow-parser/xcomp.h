@@ -18,6 +18,7 @@
 #define _XCOMP_H_
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
 /*
  * Copyright (C) 2025 TheProgxy <theprogxy@gmail.com>
  *
@@ -64,6 +65,13 @@
     #define DEBUG_LOG(...)
 #endif //_DEBUG
 
+// The per-block and per-frame messages of the codecs are only built with _XCOMP_TRACE_
+#ifdef _XCOMP_TRACE_
+	#define TRACE_LOG(format, ...) printf(COLOR_STR("TRACE:" __FILE__ ":%u: ", DEBUG_COLOR) format, __LINE__, ##__VA_ARGS__)
+#else 
+    #define TRACE_LOG(...)
+#endif //_XCOMP_TRACE_
+
 #ifndef _XCOMP_NO_PERROR_
 	#include "./str_error.h"
 	#define PERROR_LOG(format, ...) printf(COLOR_STR("WARNING:" __FILE__ ":%u: ", BRIGHT_YELLOW) format ", because: " COLOR_STR("'%s'", BRIGHT_YELLOW) ".\n", __LINE__, ##__VA_ARGS__, str_error())
@@ -156,29 +164,204 @@ UNUSED_FUNCTION static int str_n_cmp(const char* str1, const char* str2, size_t
 
 /* -------------------------------------------------------------------------------------------------------- */
 #ifdef _XCOMP_UTILS_IMPLEMENTATION_
+#if defined(__x86_64__) && !defined(_XCOMP_NO_SIMD_)
+	#include <immintrin.h>
+	#define _XCOMP_MEM_SIMD_
+#endif //__x86_64__
+
+/// NOTE: the memory kernels below work word-at-a-time: 8-byte words go through __builtin_memcpy, so that the accesses are
+///       unaligned-safe, while on x86-64 the bulk of the buffers longer than XCOMP_MEM_SIMD_THRESHOLD bytes is moved with 32-byte
+///       AVX2 vectors, when the cpu supports them, or 16-byte SSE2 ones otherwise. The vector kernels first bring the destination
+///       to the vector alignment, so that only the loads are unaligned. Every chunk is loaded whole before it is stored, hence
+///       the forward copy stays correct also when the ranges overlap with dest below src, while dest above src needs the
+///       backward copy, both used by mem_move so that it needs no temporary buffer.
+#define XCOMP_MEM_SIMD_THRESHOLD 64
+
+static inline void xcomp_mem_cpy_words(unsigned char* dest, const unsigned char* src, size_t size) {
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8) {
+		unsigned long long int word = 0;
+		__builtin_memcpy(&word, src + i, sizeof(unsigned long long int));
+		__builtin_memcpy(dest + i, &word, sizeof(unsigned long long int));
+	}
+	for (; i < size; ++i) dest[i] = src[i];
+	return;
+}
+
+static inline void xcomp_mem_cpy_words_backward(unsigned char* dest, const unsigned char* src, size_t size) {
+	size_t i = size;
+	for (; i >= 8; i -= 8) {
+		unsigned long long int word = 0;
+		__builtin_memcpy(&word, src + i - 8, sizeof(unsigned long long int));
+		__builtin_memcpy(dest + i - 8, &word, sizeof(unsigned long long int));
+	}
+	while (i--) dest[i] = src[i];
+	return;
+}
+
+/// NOTE: fills ptr[i] with the byte i % 8 of the pattern, as laid out in memory.
+static inline void xcomp_mem_set_words(unsigned char* ptr, unsigned long long int pattern, size_t size) {
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8) __builtin_memcpy(ptr + i, &pattern, sizeof(unsigned long long int));
+	for (; i < size; ++i) ptr[i] = XCOMP_CAST_PTR(&pattern, unsigned char)[i % 8];
+	return;
+}
+
+#ifdef _XCOMP_MEM_SIMD_
+/// NOTE: returns the pattern as seen from shift bytes further in the buffer, used once the head has been aligned.
+static inline unsigned long long int xcomp_mem_shift_pattern(unsigned long long int pattern, size_t shift) {
+	unsigned char shifted_bytes[8] = {0};
+	for (unsigned char i = 0; i < 8; ++i) shifted_bytes[i] = XCOMP_CAST_PTR(&pattern, unsigned char)[(i + shift) % 8];
+	__builtin_memcpy(&pattern, shifted_bytes, sizeof(unsigned long long int));
+	return pattern;
+}
+
+static void xcomp_mem_cpy_sse2(unsigned char* dest, const unsigned char* src, size_t size) {
+	size_t i = (0 - (size_t) dest) & 15;
+	xcomp_mem_cpy_words(dest, src, i);
+	for (; i + 32 <= size; i += 32) {
+		const __m128i lo = _mm_loadu_si128((const __m128i*) (src + i));
+		const __m128i hi = _mm_loadu_si128((const __m128i*) (src + i + 16));
+		_mm_store_si128((__m128i*) (dest + i), lo);
+		_mm_store_si128((__m128i*) (dest + i + 16), hi);
+	}
+	xcomp_mem_cpy_words(dest + i, src + i, size - i);
+	return;
+}
+
+static void xcomp_mem_cpy_backward_sse2(unsigned char* dest, const unsigned char* src, size_t size) {
+	size_t i = size - (((size_t) dest + size) & 15);
+	xcomp_mem_cpy_words_backward(dest + i, src + i, size - i);
+	for (; i >= 32; i -= 32) {
+		const __m128i lo = _mm_loadu_si128((const __m128i*) (src + i - 32));
+		const __m128i hi = _mm_loadu_si128((const __m128i*) (src + i - 16));
+		_mm_store_si128((__m128i*) (dest + i - 32), lo);
+		_mm_store_si128((__m128i*) (dest + i - 16), hi);
+	}
+	xcomp_mem_cpy_words_backward(dest, src, i);
+	return;
+}
+
+static void xcomp_mem_set_sse2(unsigned char* ptr, unsigned long long int pattern, size_t size) {
+	size_t i = (0 - (size_t) ptr) & 15;
+	xcomp_mem_set_words(ptr, pattern, i);
+	pattern = xcomp_mem_shift_pattern(pattern, i);
+	const __m128i vec_pattern = _mm_set1_epi64x((long long int) pattern);
+	for (; i + 32 <= size; i += 32) {
+		_mm_store_si128((__m128i*) (ptr + i), vec_pattern);
+		_mm_store_si128((__m128i*) (ptr + i + 16), vec_pattern);
+	}
+	xcomp_mem_set_words(ptr + i, pattern, size - i);
+	return;
+}
+
+__attribute__((target("avx2"))) static void xcomp_mem_cpy_avx2(unsigned char* dest, const unsigned char* src, size_t size) {
+	size_t i = (0 - (size_t) dest) & 31;
+	xcomp_mem_cpy_words(dest, src, i);
+	for (; i + 64 <= size; i += 64) {
+		const __m256i lo = _mm256_loadu_si256((const __m256i*) (src + i));
+		const __m256i hi = _mm256_loadu_si256((const __m256i*) (src + i + 32));
+		_mm256_store_si256((__m256i*) (dest + i), lo);
+		_mm256_store_si256((__m256i*) (dest + i + 32), hi);
+	}
+	xcomp_mem_cpy_words(dest + i, src + i, size - i);
+	return;
+}
+
+__attribute__((target("avx2"))) static void xcomp_mem_cpy_backward_avx2(unsigned char* dest, const unsigned char* src, size_t size) {
+	size_t i = size - (((size_t) dest + size) & 31);
+	xcomp_mem_cpy_words_backward(dest + i, src + i, size - i);
+	for (; i >= 64; i -= 64) {
+		const __m256i lo = _mm256_loadu_si256((const __m256i*) (src + i - 64));
+		const __m256i hi = _mm256_loadu_si256((const __m256i*) (src + i - 32));
+		_mm256_store_si256((__m256i*) (dest + i - 64), lo);
+		_mm256_store_si256((__m256i*) (dest + i - 32), hi);
+	}
+	xcomp_mem_cpy_words_backward(dest, src, i);
+	return;
+}
+
+__attribute__((target("avx2"))) static void xcomp_mem_set_avx2(unsigned char* ptr, unsigned long long int pattern, size_t size) {
+	size_t i = (0 - (size_t) ptr) & 31;
+	xcomp_mem_set_words(ptr, pattern, i);
+	pattern = xcomp_mem_shift_pattern(pattern, i);
+	const __m256i vec_pattern = _mm256_set1_epi64x((long long int) pattern);
+	for (; i + 64 <= size; i += 64) {
+		_mm256_store_si256((__m256i*) (ptr + i), vec_pattern);
+		_mm256_store_si256((__m256i*) (ptr + i + 32), vec_pattern);
+	}
+	xcomp_mem_set_words(ptr + i, pattern, size - i);
+	return;
+}
+#endif //_XCOMP_MEM_SIMD_
+
 static void mem_set_var(void* ptr, int value, size_t size, size_t val_size) {
-	if (ptr == NULL) return;
-	for (size_t i = 0; i < size; ++i) XCOMP_CAST_PTR(ptr, unsigned char)[i] = XCOMP_CAST_PTR(&value, unsigned char)[i % val_size]; 
+	if (ptr == NULL || val_size == 0 || val_size > sizeof(unsigned long long int)) return;
+	
+	// The bytes past the int, reached only by mem_set_64, hold its sign extension
+	unsigned char value_bytes[sizeof(unsigned long long int)] = {0};
+	for (unsigned char i = 0; i < sizeof(unsigned long long int); ++i) value_bytes[i] = (value < 0) ? 0xFF : 0x00;
+	__builtin_memcpy(value_bytes, &value, sizeof(int));
+	
+	if (8 % val_size) {
+		for (size_t i = 0; i < size; ++i) XCOMP_CAST_PTR(ptr, unsigned char)[i] = value_bytes[i % val_size];
+		return;
+	}
+
+	unsigned char pattern_bytes[8] = {0};
+	for (unsigned char i = 0; i < 8; ++i) pattern_bytes[i] = value_bytes[i % val_size];
+	unsigned long long int pattern = 0;
+	__builtin_memcpy(&pattern, pattern_bytes, sizeof(unsigned long long int));
+
+#ifdef _XCOMP_MEM_SIMD_
+	if (size >= XCOMP_MEM_SIMD_THRESHOLD) {
+		if (__builtin_cpu_supports("avx2")) xcomp_mem_set_avx2(ptr, pattern, size);
+		else xcomp_mem_set_sse2(ptr, pattern, size);
+		return;
+	}
+#endif //_XCOMP_MEM_SIMD_
+
+	xcomp_mem_set_words(ptr, pattern, size);
+	
 	return;
 }
 
 static void* mem_cpy(void* dest, const void* src, size_t size) {
 	if (dest == NULL || src == NULL) return NULL;
-	for (size_t i = 0; i < size; ++i) XCOMP_CAST_PTR(dest, unsigned char)[i] = XCOMP_CAST_PTR(src, unsigned char)[i];
+
+#ifdef _XCOMP_MEM_SIMD_
+	if (size >= XCOMP_MEM_SIMD_THRESHOLD) {
+		if (__builtin_cpu_supports("avx2")) xcomp_mem_cpy_avx2(dest, src, size);
+		else xcomp_mem_cpy_sse2(dest, src, size);
+		return dest;
+	}
+#endif //_XCOMP_MEM_SIMD_
+
+	xcomp_mem_cpy_words(dest, src, size);
+	
 	return dest;
 }
 
 static void mem_move(void* dest, const void* src, size_t size) {
-    if (dest == NULL || src == NULL || size == 0) return;
-    
-	unsigned char* temp = (unsigned char*) xcomp_calloc(size, sizeof(unsigned char));
+	if (dest == NULL || src == NULL || size == 0 || dest == src) return;
 	
-	for (size_t i = 0; i < size; ++i) *XCOMP_CAST_PTR(temp + i, unsigned char) = *XCOMP_CAST_PTR(XCOMP_CAST_PTR(src, unsigned char) + i, unsigned char); 
-    for (size_t i = 0; i < size; ++i) *XCOMP_CAST_PTR(XCOMP_CAST_PTR(dest, unsigned char) + i, unsigned char) = *XCOMP_CAST_PTR(temp + i, unsigned char);
-    
-	XCOMP_SAFE_FREE(temp);
-    
-    return;
+	// Unless dest lies within (src, src + size), the forward copy never reads a byte it has already written
+	if ((size_t) dest - (size_t) src >= size) {
+		mem_cpy(dest, src, size);
+		return;
+	}
+
+#ifdef _XCOMP_MEM_SIMD_
+	if (size >= XCOMP_MEM_SIMD_THRESHOLD) {
+		if (__builtin_cpu_supports("avx2")) xcomp_mem_cpy_backward_avx2(dest, src, size);
+		else xcomp_mem_cpy_backward_sse2(dest, src, size);
+		return;
+	}
+#endif //_XCOMP_MEM_SIMD_
+
+	xcomp_mem_cpy_words_backward(dest, src, size);
+
+	return;
 }
 
 UNUSED_FUNCTION static int mem_n_cmp(const void* ptr1, const void* ptr2, size_t n) {
@@ -219,6 +402,44 @@ UNUSED_FUNCTION static int str_n_cmp(const char* str1, const char* str2, size_t
 
 #endif //_XCOMP_UTILS_IMPLEMENTATION_
 
+/// NOTE: the word accesses go through __builtin_memcpy, so that they are unaligned-safe and compiled to single loads and stores.
+static inline unsigned long long int xcomp_load_64(const void* ptr) {
+	unsigned long long int value = 0;
+	__builtin_memcpy(&value, ptr, sizeof(unsigned long long int));
+	return value;
+}
+
+static inline unsigned int xcomp_load_32(const void* ptr) {
+	unsigned int value = 0;
+	__builtin_memcpy(&value, ptr, sizeof(unsigned int));
+	return value;
+}
+
+static inline void xcomp_store_64(void* ptr, unsigned long long int value) {
+	__builtin_memcpy(ptr, &value, sizeof(unsigned long long int));
+	return;
+}
+
+/// NOTE: copies length bytes from distance bytes behind dest, as the LZ77 matches do, hence when the distance is less than
+///       the length the copy repeats the bytes it is writing. With a distance of at least 8 whole words are copied, while
+///       shorter distances broadcast their pattern in a word, which is stored every multiple of the distance within 8 bytes.
+///       No byte past dest + length is written, so that the match can end right at the end of the buffer.
+UNUSED_FUNCTION static inline void xcomp_copy_match(unsigned char* dest, unsigned int distance, unsigned int length) {
+	const unsigned char* src = dest - distance;
+	unsigned int i = 0;
+	if (distance >= 8) {
+		for (; i + 8 <= length; i += 8) xcomp_store_64(dest + i, xcomp_load_64(src + i));
+	} else if (distance > 0) {
+		unsigned char pattern_bytes[8] = {0};
+		for (unsigned char j = 0; j < 8; ++j) pattern_bytes[j] = src[j % distance];
+		const unsigned long long int pattern = xcomp_load_64(pattern_bytes);
+		const unsigned int step = 8 - (8 % distance);
+		for (; i + 8 <= length; i += step) xcomp_store_64(dest + i, pattern);
+	}
+	for (; i < length; ++i) dest[i] = src[i];
+	return;
+}
+
 #endif //_XCOMP_UTILS_H_
 
 /*
@@ -249,7 +470,7 @@ UNUSED_FUNCTION static int str_n_cmp(const char* str1, const char* str2, size_t
 #define REWIND_BIT_STREAM(bit_stream) ((bit_stream) -> byte_pos = 0, (bit_stream) -> bit_pos = 0, (bit_stream) -> error = 0)
 #define CREATE_BIT_STREAM(data_stream, data_size) (BitStream) { .stream = data_stream, .size = data_size, .byte_pos = 0, .bit_pos = 0, .bit_lower_limit = 0, .error = 0 }
 #define CREATE_REVERSED_BIT_STREAM(data_stream, data_size, data_lower_limit) (BitStream) { .stream = data_stream, .size = data_size, .byte_pos = data_size - 1, .bit_pos = 8, .bit_lower_limit = data_lower_limit, .error = 0 }
-#define PRINT_BIT_STREAM_INFO(bit_stream) DEBUG_LOG("%s: byte_pos: %u, bit_pos: %d, size: %u, error: %u, current_byte: 0x%X.\n", #bit_stream, (bit_stream) -> byte_pos, (bit_stream) -> bit_pos, (bit_stream) -> size, (bit_stream) -> error, ((bit_stream) -> stream)[(bit_stream) -> byte_pos])
+#define PRINT_BIT_STREAM_INFO(bit_stream) TRACE_LOG("%s: byte_pos: %u, bit_pos: %d, size: %u, error: %u, current_byte: 0x%X.\n", #bit_stream, (bit_stream) -> byte_pos, (bit_stream) -> bit_pos, (bit_stream) -> size, (bit_stream) -> error, ((bit_stream) -> stream)[(bit_stream) -> byte_pos])
 
 #define BITSTREAM_IO_ERROR 1
 #define SAFE_NEXT_BIT_READ(bit_stream, value, ...) 									\
@@ -349,6 +570,7 @@ typedef struct PACKED_STRUCT BitStream {
 	unsigned int byte_pos;
 	char bit_pos;
 	unsigned char error;
+	unsigned int capacity;
 } BitStream;
 
 /* ---------------------------------------------------------------------------------------------------------- */
@@ -547,14 +769,18 @@ static void resize_bit_stream(BitStream* bit_stream) {
 		return;
 	}
 
-	bit_stream -> stream = realloc(bit_stream -> stream, bit_stream -> size * sizeof(unsigned char));
+	// The capacity grows geometrically, so that writing the stream a few bits at a time stays amortized O(1)
+	if (bit_stream -> size <= bit_stream -> capacity) return;
+	unsigned int capacity = MAX(bit_stream -> size, MAX(bit_stream -> capacity * 2, 64));
+	bit_stream -> stream = realloc(bit_stream -> stream, capacity * sizeof(unsigned char));
 	if (bit_stream -> stream == NULL) {
-		WARNING_LOG("Failed to reallocate the stream to %u.\n", bit_stream -> size);
+		WARNING_LOG("Failed to reallocate the stream to %u.\n", capacity);
 		bit_stream -> error = 1;
 		return;
 	}
 	
-	mem_set(bit_stream -> stream + bit_stream -> byte_pos, 0, bit_stream -> size - bit_stream -> byte_pos);
+	mem_set(bit_stream -> stream + bit_stream -> capacity, 0, capacity - bit_stream -> capacity);
+	bit_stream -> capacity = capacity;
 
 	return;
 }
@@ -566,8 +792,8 @@ UNUSED_FUNCTION static void bitstream_bit_copy(BitStream* dest_bit_stream, BitSt
 	}
 
 	unsigned long long int bits_cnt = src_bit_stream -> byte_pos * 8 + src_bit_stream -> bit_pos;
-	for (unsigned long long int i = 0; i < bits_cnt; ++i) {
-		bitstream_write_next_bit(dest_bit_stream, (src_bit_stream -> stream)[(i - (i % 8)) / 8] >> (i % 8));
+	for (unsigned long long int i = 0; i < bits_cnt; i += 8) {
+		bitstream_write_bits(dest_bit_stream, (src_bit_stream -> stream)[i / 8], MIN(bits_cnt - i, 8));
 		if (dest_bit_stream -> error) {
 			WARNING_LOG("BitStream gen error bit copy.\n");
 			return;
@@ -639,13 +865,13 @@ UNUSED_FUNCTION static void bitstream_write_bits_reversed(BitStream* bit_stream,
 		return;
 	}
 
-	unsigned int mask = 1 << (n_bits - 1);
-	for (unsigned char i = 0; i < n_bits; ++i, mask >>= 1) {
-		bitstream_write_next_bit(bit_stream, (bits & mask) >> (n_bits - 1 - i));
-		if (bit_stream -> error) {
-			WARNING_LOG("An error occurred while writing %u bits reversed to the stream.\n", n_bits);
-			return;
-		}
+	unsigned long long int reversed_bits = 0;
+	for (unsigned char i = 0; i < n_bits; ++i, bits >>= 1) reversed_bits = (reversed_bits << 1) | (bits & 1);
+	
+	bitstream_write_bits(bit_stream, reversed_bits, n_bits);
+	if (bit_stream -> error) {
+		WARNING_LOG("An error occurred while writing %u bits reversed to the stream.\n", n_bits);
+		return;
 	}
 
 	return;
@@ -658,13 +884,45 @@ UNUSED_FUNCTION static void bitstream_write_bits(BitStream* bit_stream, unsigned
 		return;
 	}
 
-	unsigned int mask = 1;
-	for (unsigned char i = 0; i < n_bits; ++i, mask <<= 1) {
-		bitstream_write_next_bit(bit_stream, (bits & mask) >> i);
-		if (bit_stream -> error) {
-			WARNING_LOG("An error occurred while writing %u bits to the stream.\n", n_bits);
-			return;
+	if (bit_stream -> error) {
+		WARNING_LOG("BitStream error write bits.\n");
+		return;
+	}
+
+	// Up to 56 bits span at most eight bytes, which are or-ed in at once when already allocated, as the bytes past the position are still zero
+	const unsigned char bit_pos = bit_stream -> bit_pos & 7;
+	const unsigned int byte_pos = bit_stream -> byte_pos + (bit_stream -> bit_pos >> 3);
+	if (n_bits > 0 && n_bits <= 56 && byte_pos + 8 <= bit_stream -> capacity) {
+		const unsigned long long int value = (bits & ((1ULL << n_bits) - 1)) << bit_pos;
+		const unsigned char end_bit = bit_pos + n_bits;
+		for (unsigned char i = 0; i < ((end_bit + 7) >> 3); ++i) (bit_stream -> stream)[byte_pos + i] |= (unsigned char) (value >> (i * 8));
+		bit_stream -> byte_pos = byte_pos + ((end_bit - 1) >> 3);
+		bit_stream -> bit_pos = ((end_bit - 1) & 7) + 1;
+		bit_stream -> size = MAX(bit_stream -> size, bit_stream -> byte_pos + 1);
+		return;
+	}
+
+	// Fill the current byte up to its boundary at each step, rather than a single bit at a time
+	while (n_bits > 0) {
+		if (bit_stream -> bit_pos == 8) {
+			bit_stream -> bit_pos = 0;
+			(bit_stream -> byte_pos)++;
+		}
+	
+		if (bit_stream -> byte_pos >= bit_stream -> size) {
+			bit_stream -> size = bit_stream -> byte_pos + 1;
+			resize_bit_stream(bit_stream);
+			if (bit_stream -> error) {
+				WARNING_LOG("An error occurred while writing %u bits to the stream.\n", n_bits);
+				return;
+			}
 		}
+
+		const unsigned char chunk_bits = MIN(n_bits, 8 - bit_stream -> bit_pos);
+		(bit_stream -> stream)[bit_stream -> byte_pos] |= (bits & ((1U << chunk_bits) - 1)) << (bit_stream -> bit_pos);
+		bit_stream -> bit_pos += chunk_bits;
+		bits >>= chunk_bits;
+		n_bits -= chunk_bits;
 	}
 
 	return;
@@ -676,6 +934,7 @@ UNUSED_FUNCTION static void deallocate_bit_stream(BitStream* bit_stream) {
 	bit_stream -> byte_pos = 0;
 	bit_stream -> bit_pos = 0;
 	bit_stream -> size = 0;
+	bit_stream -> capacity = 0;
 	return;
 }
 
@@ -735,6 +994,11 @@ UNUSED_FUNCTION static void deallocate_bit_stream(BitStream* bit_stream) {
 // -----------------
 //  Constant Values 
 // -----------------
+typedef enum ZstdConstants {
+ ZSTD_BLOCK_MAX_SIZE = 128 * 1024,
+ ZSTD_WEIGHTS_MAX_TABLE_LOG = 6,
+ ZSTD_HUF_MAX_BITS = 11
+} ZstdConstants;
 /* -------------------------------------------------------------------------------------------------------- */
 // -------
 //  Enums
@@ -775,6 +1039,48 @@ typedef enum PACKED_STRUCT CompressionMode { PREDEFINED_MODE, RLE_MODE, FSE_COMP
  static const char* literals_blocks_type_str[] = { "RAW_LITERALS_BLOCK", "RLE_LITERALS_BLOCK", "COMPRESSED_LITERALS_BLOCK", "TREELESS_LITERALS_BLOCK" };
  static const char* block_types_str[] = { "RAW_BLOCK", "RLE_BLOCK", "COMPRESSED_BLOCK", "RESERVED_TYPE" };
  static const char* compression_modes_str[] = { "PREDEFINED_MODE", "RLE_MODE", "FSE_COMPRESSED_MODE", "REPEAT_MODE" };
+/* -------------------------------------------------------------------------------------------------------- */
+// -------------------------------
+//  Predefined Distributions Data
+// -------------------------------
+typedef enum DistributionData {
+ LL_MAX_LOG = 9,
+ ML_MAX_LOG = 9,
+ OL_MAX_LOG = 8,
+ PRED_LL_TABLE_LOG = 6,
+ PRED_ML_TABLE_LOG = 6,
+ PRED_OL_TABLE_LOG = 5
+} DistributionData;
+static const short int ll_pred_frequencies[] = {
+ 4, 3, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+    1, 1, 1, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+ 3, 2, 1, 1, 1, 1, 1, -1, -1, -1, -1
+};
+static const short int ml_pred_frequencies[] = {
+ 1, 4, 3, 2, 2, 2, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, -1, -1, -1,
+ -1, -1, -1, -1
+};
+static const short int ol_pred_frequencies[] = {
+ 1, 1, 1, 1, 1, 1, 2, 2, 2, 1, 1, 1, 1, 1, 1,
+ 1, 1, 1, 1, 1, 1, 1, 1, 1, -1, -1, -1, -1, -1
+};
+static const unsigned int ll_codes[36][2] = {
+ {0, 0}, {1, 0}, {2, 0}, {3, 0}, {4, 0}, {5, 0}, {6, 0}, {7, 0}, {8, 0}, {9, 0},
+ {10, 0}, {11, 0}, {12, 0}, {13, 0}, {14, 0}, {15, 0}, {16, 1}, {18, 1},
+ {20, 1}, {22, 1}, {24, 2}, {28, 2}, {32, 3}, {40, 3}, {48, 4}, {64, 6},
+ {128, 7}, {256, 8}, {512, 9}, {1024, 10}, {2048, 11}, {4096, 12}, {8192, 13},
+ {16384, 14}, {32768, 15}, {65536, 16}
+};
+static const unsigned int ml_codes[53][2] = {
+ {3, 0}, {4, 0}, {5, 0}, {6, 0}, {7, 0}, {8, 0}, {9, 0}, {10, 0}, {11, 0},
+ {12, 0}, {13, 0}, {14, 0}, {15, 0}, {16, 0}, {17, 0}, {18, 0}, {19, 0},
+ {20, 0}, {21, 0}, {22, 0}, {23, 0}, {24, 0}, {25, 0}, {26, 0}, {27, 0},
+ {28, 0}, {29, 0}, {30, 0}, {31, 0}, {32, 0}, {33, 0}, {34, 0}, {35, 1},
+ {37, 1}, {39, 1}, {41, 1}, {43, 2}, {47, 2}, {51, 3}, {59, 3}, {67, 4},
+ {83, 4}, {99, 5}, {131, 7}, {259, 8}, {515, 9}, {1027, 10}, {2051, 11},
+ {4099, 12}, {8195, 13}, {16387, 14}, {32771, 15}, {65539, 16}
+};
 /*
  * Copyright (C) 2025 TheProgxy <theprogxy@gmail.com>
  *
@@ -832,54 +1138,63 @@ static const u64 PRIME64_5 = 0x27D4EB2F165667C5ULL;
 // ------------------------
 //  Functions Declarations
 // ------------------------
+static inline u64 xxrotl64(u64 value, unsigned char shift);
 static inline u64 xxround(u64 acc_n, u64 lane_n);
 static inline u64 merge_accumulator(u64 acc, u64 acc_n);
-u64 xxhash64(unsigned char* lane, unsigned int byte_size, u64 seed);
+u64 xxhash64(const unsigned char* lane, unsigned int byte_size, u64 seed);
 /* -------------------------------------------------------------------------------------------------------- */
+/// NOTE: the shift is always within [1, 63], so that both shifts are defined.
+static inline u64 xxrotl64(u64 value, unsigned char shift) {
+ return (value << shift) | (value >> (64 - shift));
+}
 static inline u64 xxround(u64 acc_n, u64 lane_n) {
   acc_n += lane_n * PRIME64_2;
-  acc_n = __builtin_stdc_rotate_left(acc_n, 31);
+  acc_n = xxrotl64(acc_n, 31);
   return acc_n * PRIME64_1;
 }
 static inline u64 merge_accumulator(u64 acc, u64 acc_n) {
   acc ^= xxround(0, acc_n);
   return (acc * PRIME64_1) + PRIME64_4;
 }
-u64 xxhash64(unsigned char* lane, unsigned int byte_size, u64 seed) {
+/// NOTE: each accumulator is a serial chain of multiplications, so the four of them are kept in registers to run in parallel,
+///       which outpaces the SIMD lanes as SSE2/AVX2 lack a 64-bit multiplication.
+u64 xxhash64(const unsigned char* lane, unsigned int byte_size, u64 seed) {
  u64 acc = 0;
  unsigned int remaining_size = byte_size;
  if (byte_size >= 32) {
-  u64 accs[4] = {0};
-  accs[0] = seed + PRIME64_1 + PRIME64_2;
-  accs[1] = seed + PRIME64_2;
-  accs[2] = seed;
-  accs[3] = seed - PRIME64_1;
-  while (remaining_size >= 32) {
-   for (unsigned int i = 0; i < 4; ++i, lane += sizeof(u64)) {
-    accs[i] = xxround(accs[i], *XCOMP_CAST_PTR(lane, u64));
-   }
-   remaining_size -= 32;
-  }
-  acc = __builtin_stdc_rotate_left(accs[0], 1) + __builtin_stdc_rotate_left(accs[1], 7) + __builtin_stdc_rotate_left(accs[2], 12) + __builtin_stdc_rotate_left(accs[3], 18);
-  acc = merge_accumulator(acc, accs[0]);
-  acc = merge_accumulator(acc, accs[1]);
-  acc = merge_accumulator(acc, accs[2]);
-  acc = merge_accumulator(acc, accs[3]);
+  u64 acc_1 = seed + PRIME64_1 + PRIME64_2;
+  u64 acc_2 = seed + PRIME64_2;
+  u64 acc_3 = seed;
+  u64 acc_4 = seed - PRIME64_1;
+  const unsigned char* const stripes_end = lane + (byte_size & ~31U);
+  do {
+   acc_1 = xxround(acc_1, xcomp_load_64(lane));
+   acc_2 = xxround(acc_2, xcomp_load_64(lane + 8));
+   acc_3 = xxround(acc_3, xcomp_load_64(lane + 16));
+   acc_4 = xxround(acc_4, xcomp_load_64(lane + 24));
+   lane += 32;
+  } while (lane < stripes_end);
+  remaining_size &= 31;
+  acc = xxrotl64(acc_1, 1) + xxrotl64(acc_2, 7) + xxrotl64(acc_3, 12) + xxrotl64(acc_4, 18);
+  acc = merge_accumulator(acc, acc_1);
+  acc = merge_accumulator(acc, acc_2);
+  acc = merge_accumulator(acc, acc_3);
+  acc = merge_accumulator(acc, acc_4);
  } else acc = seed + PRIME64_5;
   acc += byte_size;
  while (remaining_size >= 8) {
-      acc ^= xxround(0, *XCOMP_CAST_PTR(lane, u64));
-      acc = __builtin_stdc_rotate_left(acc, 27) * PRIME64_1 + PRIME64_4;
+      acc ^= xxround(0, xcomp_load_64(lane));
+      acc = xxrotl64(acc, 27) * PRIME64_1 + PRIME64_4;
       lane += sizeof(u64), remaining_size -= sizeof(u64);
  }
  if (remaining_size >= 4) {
-      acc ^= (*XCOMP_CAST_PTR(lane, u32) * PRIME64_1);
-      acc = __builtin_stdc_rotate_left(acc, 23) * PRIME64_2 + PRIME64_3;
+      acc ^= (xcomp_load_32(lane) * PRIME64_1);
+      acc = xxrotl64(acc, 23) * PRIME64_2 + PRIME64_3;
    lane += sizeof(u32), remaining_size -= sizeof(u32);
  }
  while (remaining_size > 0) {
       acc ^= (*lane++) * PRIME64_5;
-      acc = __builtin_stdc_rotate_left(acc, 11) * PRIME64_1;
+      acc = xxrotl64(acc, 11) * PRIME64_1;
    remaining_size--;
  }
  acc ^= (acc >> 33);
@@ -889,30 +1204,680 @@ u64 xxhash64(unsigned char* lane, unsigned int byte_size, u64 seed) {
  acc ^= (acc >> 32);
  return acc;
 }
-// TODO: Implement the compression
 // -----------------
 //  Constant Values
 // -----------------
+typedef enum CompressionConstants {
+ ZSTD_MIN_MATCH = 4,
+ ZSTD_MIN_HASH_LOG = 10,
+ ZSTD_MAX_HASH_LOG = 16,
+ ZSTD_SEARCH_STRENGTH = 8,
+ ZSTD_FSE_MIN_TABLE_LOG = 5,
+ ZSTD_HUF_MIN_LITERALS = 64,
+ ZSTD_SINGLE_STREAM_MAX_LITERALS = 1023
+} CompressionConstants;
+// Literals length codes up to 63, and match length codes for the match length minus 3 up to 127, the longer lengths
+// have a code following from their highest bit.
+static const unsigned char ll_length_codes[64] = {
+ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+ 16, 16, 17, 17, 18, 18, 19, 19, 20, 20, 20, 20, 21, 21, 21, 21,
+ 22, 22, 22, 22, 22, 22, 22, 22, 23, 23, 23, 23, 23, 23, 23, 23,
+ 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24
+};
+static const unsigned char ml_length_codes[128] = {
+ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+ 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31,
+ 32, 32, 33, 33, 34, 34, 35, 35, 36, 36, 36, 36, 37, 37, 37, 37,
+ 38, 38, 38, 38, 38, 38, 38, 38, 39, 39, 39, 39, 39, 39, 39, 39,
+ 40, 40, 40, 40, 40, 40, 40, 40, 40, 40, 40, 40, 40, 40, 40, 40,
+ 41, 41, 41, 41, 41, 41, 41, 41, 41, 41, 41, 41, 41, 41, 41, 41,
+ 42, 42, 42, 42, 42, 42, 42, 42, 42, 42, 42, 42, 42, 42, 42, 42,
+ 42, 42, 42, 42, 42, 42, 42, 42, 42, 42, 42, 42, 42, 42, 42, 42
+};
 /* -------------------------------------------------------------------------------------------------------- */
 // ---------
 //  Structs
 // ---------
+typedef struct BitWriter {
+ unsigned char* stream;
+ unsigned int size;
+ unsigned int byte_pos;
+ unsigned long long int bit_buffer;
+ unsigned char bits_cnt;
+ unsigned char overflow;
+} BitWriter;
+typedef struct EncodedSequence {
+ unsigned int literals_length;
+ unsigned int match_length;
+ unsigned int offset_value;
+} EncodedSequence;
+typedef struct FSESymbolTransform {
+ unsigned int delta_nb_bits;
+ int delta_find_state;
+} FSESymbolTransform;
+typedef struct FSEEncodingTable {
+ unsigned short int states[1 << LL_MAX_LOG];
+ FSESymbolTransform symbols[XCOMP_ARR_SIZE(ml_codes)];
+ unsigned char table_log;
+} FSEEncodingTable;
+typedef struct HuffmanCode {
+ unsigned short int code;
+ unsigned char nb_bits;
+} HuffmanCode;
+typedef struct CompressionContext {
+ unsigned int* hash_table;
+ unsigned char hash_log;
+ unsigned char* literals;
+ unsigned int literals_cnt;
+ EncodedSequence* sequences;
+ unsigned int sequences_cnt;
+ unsigned char* sequences_codes;
+ unsigned int offset_history[3];
+ FSEEncodingTable ll_table;
+ FSEEncodingTable ml_table;
+ FSEEncodingTable ol_table;
+} CompressionContext;
 /* -------------------------------------------------------------------------------------------------------- */
 // ------------------------
 //  Functions Declarations
 // ------------------------
+static inline unsigned char floor_log2(unsigned int val);
+static inline void bit_writer_flush(BitWriter* bit_writer);
+static inline void bit_writer_add_bits(BitWriter* bit_writer, unsigned long long int value, unsigned char nb_bits);
+static unsigned int bit_writer_align(BitWriter* bit_writer);
+static unsigned int bit_writer_close(BitWriter* bit_writer);
+static inline unsigned int count_match_length(const unsigned char* data, const unsigned char* match, const unsigned char* data_end);
+static void find_sequences(CompressionContext* ctx, const unsigned char* stream, unsigned int block_start, unsigned int block_end);
+static unsigned char fse_optimal_table_log(unsigned char max_table_log, unsigned int total, unsigned char max_symbol);
+static void fse_normalize_counts(const unsigned int* counts, unsigned char max_symbol, unsigned int total, unsigned char table_log, short int* normalized);
+static void fse_build_encoding_table(const short int* normalized, unsigned char max_symbol, unsigned char table_log, FSEEncodingTable* table);
+static unsigned int fse_write_table_description(const short int* normalized, unsigned char max_symbol, unsigned char table_log, unsigned char* dst, unsigned int dst_capacity);
+static unsigned int fse_estimate_cost(const unsigned int* counts, unsigned char max_symbol, const short int* normalized, unsigned char normalized_cnt, unsigned char table_log);
+static inline void fse_init_state(unsigned int* state, const FSEEncodingTable* table, unsigned char symbol);
+static inline void fse_encode_symbol(BitWriter* bit_writer, unsigned int* state, const FSEEncodingTable* table, unsigned char symbol);
+static void build_huffman_codes(const unsigned int* counts, unsigned char max_symbol, HuffmanCode* codes, unsigned char* max_nb_bits);
+static unsigned int write_huffman_weights(const HuffmanCode* codes, unsigned char max_symbol, unsigned char max_nb_bits, unsigned char* dst, unsigned int dst_capacity);
+static unsigned int huffman_compress_stream(const unsigned char* literals, unsigned int literals_cnt, const HuffmanCode* codes, unsigned char* dst, unsigned int dst_capacity);
+static unsigned int encode_literals_section(const CompressionContext* ctx, unsigned char* dst, unsigned int dst_capacity);
+static CompressionMode select_sequences_encoding(const unsigned int* counts, unsigned char max_symbol, unsigned int sequences_cnt, const short int* predefined_frequencies, unsigned char predefined_cnt, unsigned char predefined_table_log, unsigned char max_table_log, FSEEncodingTable* table, unsigned char* table_description, unsigned int* table_description_size);
+static unsigned int encode_sequences_section(CompressionContext* ctx, unsigned char* dst, unsigned int dst_capacity);
+static unsigned int compress_zstd_block(CompressionContext* ctx, const unsigned char* stream, unsigned int block_start, unsigned int block_end, unsigned char* dst, unsigned int dst_capacity);
 /// NOTE: the stream will be always deallocated both in case of failure and success.
 /// 	  Furthermore, the function allocates the returned stream of bytes, so that
 /// 	  once it's on the hand of the caller, it's responsible to manage that memory.
 unsigned char* zstd_deflate(unsigned char* stream, unsigned int size, unsigned int* compressed_len, int* zstd_err);
 /* -------------------------------------------------------------------------------------------------------- */
+static inline unsigned char floor_log2(unsigned int val) {
+ return 31 - __builtin_clz(val);
+}
+// ----------------------
+//  Bit Writing Section
+// ----------------------
+/// NOTE: the bits are packed from the least significant one, as both the forward and the backward streams of zstd are
+///       written, once the stream is full the remaining bits are dropped, and the overflow is reported when closing it.
+static inline void bit_writer_flush(BitWriter* bit_writer) {
+ while (bit_writer -> bits_cnt >= 8) {
+  if (bit_writer -> byte_pos >= bit_writer -> size) {
+   bit_writer -> overflow = TRUE;
+   bit_writer -> bit_buffer = 0;
+   bit_writer -> bits_cnt = 0;
+   return;
+  }
+  (bit_writer -> stream)[(bit_writer -> byte_pos)++] = bit_writer -> bit_buffer & 0xFF;
+  bit_writer -> bit_buffer >>= 8;
+  bit_writer -> bits_cnt -= 8;
+ }
+ return;
+}
+/// NOTE: at most 32 bits are added at once, which always fit the bit buffer as it is flushed once it holds 32 bits.
+static inline void bit_writer_add_bits(BitWriter* bit_writer, unsigned long long int value, unsigned char nb_bits) {
+ if (bit_writer -> bits_cnt >= 32) bit_writer_flush(bit_writer);
+ bit_writer -> bit_buffer |= (value & ((1ULL << nb_bits) - 1)) << bit_writer -> bits_cnt;
+ bit_writer -> bits_cnt += nb_bits;
+ return;
+}
+static unsigned int bit_writer_align(BitWriter* bit_writer) {
+ bit_writer_flush(bit_writer);
+ if (bit_writer -> bits_cnt > 0) {
+  bit_writer -> bits_cnt = 8;
+  bit_writer_flush(bit_writer);
+ }
+ return bit_writer -> overflow ? 0 : bit_writer -> byte_pos;
+}
+/// NOTE: the backward streams end with a set bit, marking where their reader has to start from.
+static unsigned int bit_writer_close(BitWriter* bit_writer) {
+ bit_writer_add_bits(bit_writer, 1, 1);
+ return bit_writer_align(bit_writer);
+}
+// -----------------------
+//  Match Finding Section
+// -----------------------
+static inline unsigned int count_match_length(const unsigned char* data, const unsigned char* match, const unsigned char* data_end) {
+ const unsigned char* data_start = data;
+ while (data + 8 <= data_end && xcomp_load_64(data) == xcomp_load_64(match)) data += 8, match += 8;
+ while (data < data_end && *data == *match) data++, match++;
+ return data - data_start;
+}
+/// NOTE: the positions in the hash table are relative to the start of the stream, which is a single segment frame,
+///       so that the matches can reach back into the previous blocks. The step between the probed positions grows
+///       with the distance from the last match, skipping quickly through the incompressible data.
+static void find_sequences(CompressionContext* ctx, const unsigned char* stream, unsigned int block_start, unsigned int block_end) {
+ const unsigned char* data = stream + block_start;
+ const unsigned char* anchor = data;
+ const unsigned char* data_end = stream + block_end;
+ const unsigned char* data_limit = block_end - block_start > 8 ? data_end - 8 : data;
+ const unsigned char hash_shift = 32 - ctx -> hash_log;
+ ctx -> literals_cnt = 0;
+ ctx -> sequences_cnt = 0;
+ if (data == stream) data++;
+ while (data < data_limit) {
+  const unsigned int pos = data - stream;
+  const unsigned int hash = (xcomp_load_32(data) * 2654435761U) >> hash_shift;
+  const unsigned int candidate = (ctx -> hash_table)[hash];
+  (ctx -> hash_table)[hash] = pos;
+  const unsigned char* match = NULL;
+  if (data > anchor && ctx -> offset_history[0] <= pos && xcomp_load_32(data - ctx -> offset_history[0]) == xcomp_load_32(data)) {
+   match = data - ctx -> offset_history[0];
+  } else if (candidate < pos && xcomp_load_32(stream + candidate) == xcomp_load_32(data)) {
+   match = stream + candidate;
+   while (data > anchor && match > stream && data[-1] == match[-1]) data--, match--;
+  } else {
+   data += ((data - anchor) >> ZSTD_SEARCH_STRENGTH) + 1;
+   continue;
+  }
+  const unsigned int literals_length = data - anchor;
+  const unsigned int match_length = ZSTD_MIN_MATCH + count_match_length(data + ZSTD_MIN_MATCH, match + ZSTD_MIN_MATCH, data_end);
+  const unsigned int offset = data - match;
+  // The repeated offset is only referenced after some literals, as without them the repeat codes are shifted by one
+  unsigned int offset_value = 1;
+  if (literals_length == 0 || offset != ctx -> offset_history[0]) {
+   offset_value = offset + 3;
+   ctx -> offset_history[2] = ctx -> offset_history[1];
+   ctx -> offset_history[1] = ctx -> offset_history[0];
+   ctx -> offset_history[0] = offset;
+  }
+  mem_cpy(ctx -> literals + ctx -> literals_cnt, anchor, literals_length);
+  ctx -> literals_cnt += literals_length;
+  (ctx -> sequences)[(ctx -> sequences_cnt)++] = (EncodedSequence) { .literals_length = literals_length, .match_length = match_length, .offset_value = offset_value };
+  data += match_length;
+  anchor = data;
+  // Index some positions covered by the match, so that the next matches can reach them
+  if (data < data_limit) {
+   const unsigned int match_pos = pos + 2 < (unsigned int) (data - stream) ? pos + 2 : data - stream - 2;
+   (ctx -> hash_table)[(xcomp_load_32(stream + match_pos) * 2654435761U) >> hash_shift] = match_pos;
+   (ctx -> hash_table)[(xcomp_load_32(data - 2) * 2654435761U) >> hash_shift] = data - 2 - stream;
+  }
+ }
+ mem_cpy(ctx -> literals + ctx -> literals_cnt, anchor, data_end - anchor);
+ ctx -> literals_cnt += data_end - anchor;
+ return;
+}
+// ----------------------
+//  FSE Encoding Section
+// ----------------------
+static unsigned char fse_optimal_table_log(unsigned char max_table_log, unsigned int total, unsigned char max_symbol) {
+ int table_log = max_table_log;
+ const int max_bits_src = (int) floor_log2(total - 1) - 2;
+ const int min_bits = MIN(floor_log2(total) + 1, floor_log2(max_symbol) + 2);
+ if (max_bits_src < table_log) table_log = max_bits_src;
+ if (min_bits > table_log) table_log = min_bits;
+ return MIN(MAX(table_log, ZSTD_FSE_MIN_TABLE_LOG), max_table_log);
+}
+/// NOTE: the table log leaves more states than symbols, so that every present symbol keeps at least one state, while
+///       the rounding error is moved on the most probable symbols, where a state less or more costs the least.
+static void fse_normalize_counts(const unsigned int* counts, unsigned char max_symbol, unsigned int total, unsigned char table_log, short int* normalized) {
+ const int table_size = 1 << table_log;
+ int states_cnt = 0;
+ for (unsigned short int s = 0; s <= max_symbol; ++s) {
+  normalized[s] = 0;
+  if (counts[s] == 0) continue;
+  normalized[s] = MAX(((unsigned long long int) counts[s] * table_size + total / 2) / total, 1ULL);
+  states_cnt += normalized[s];
+ }
+ while (states_cnt != table_size) {
+  unsigned char largest = 0;
+  for (unsigned short int s = 1; s <= max_symbol; ++s) {
+   if (states_cnt > table_size ? normalized[s] > normalized[largest] : counts[s] > counts[largest]) largest = s;
+  }
+  normalized[largest] += states_cnt > table_size ? -1 : 1;
+  states_cnt += states_cnt > table_size ? -1 : 1;
+ }
+ return;
+}
+/// NOTE: the states are spread exactly as fse_build_table does while decoding, then for each symbol the transform
+///       gives the bits to flush from a state, and where its next state starts among the states of the symbol.
+static void fse_build_encoding_table(const short int* normalized, unsigned char max_symbol, unsigned char table_log, FSEEncodingTable* table) {
+ const unsigned int table_size = 1 << table_log;
+ const unsigned int table_mask = table_size - 1;
+ const unsigned int step = (table_size >> 1) + (table_size >> 3) + 3;
+ unsigned int high_threshold = table_size - 1;
+ unsigned char table_symbols[1 << LL_MAX_LOG] = {0};
+ unsigned int cumulative[XCOMP_ARR_SIZE(ml_codes) + 1] = {0};
+ table -> table_log = table_log;
+ for (unsigned short int s = 0; s <= max_symbol; ++s) {
+  if (normalized[s] == -1) {
+   cumulative[s + 1] = cumulative[s] + 1;
+   table_symbols[high_threshold--] = s;
+  } else cumulative[s + 1] = cumulative[s] + normalized[s];
+ }
+ unsigned int pos = 0;
+ for (unsigned short int s = 0; s <= max_symbol; ++s) {
+  for (short int i = 0; i < normalized[s]; ++i) {
+   table_symbols[pos] = s;
+   pos = (pos + step) & table_mask;
+   while (pos > high_threshold) pos = (pos + step) & table_mask;
+  }
+ }
+ for (unsigned int u = 0; u < table_size; ++u) (table -> states)[cumulative[table_symbols[u]]++] = table_size + u;
+ int total = 0;
+ for (unsigned short int s = 0; s <= max_symbol; ++s) {
+  FSESymbolTransform* transform = table -> symbols + s;
+  if (normalized[s] == 0) {
+   transform -> delta_nb_bits = ((table_log + 1) << 16) - table_size;
+  } else if (normalized[s] == -1 || normalized[s] == 1) {
+   transform -> delta_nb_bits = (table_log << 16) - table_size;
+   transform -> delta_find_state = total - 1;
+   total++;
+  } else {
+   const unsigned int max_bits_out = table_log - floor_log2(normalized[s] - 1);
+   const unsigned int min_state_plus = normalized[s] << max_bits_out;
+   transform -> delta_nb_bits = (max_bits_out << 16) - min_state_plus;
+   transform -> delta_find_state = total - normalized[s];
+   total += normalized[s];
+  }
+ }
+ return;
+}
+/// NOTE: the description is the one read by read_probabilities, where each probability plus one is written with the
+///       bits left by the remaining probabilities, and the runs of zero probabilities are written as repeat flags.
+static unsigned int fse_write_table_description(const short int* normalized, unsigned char max_symbol, unsigned char table_log, unsigned char* dst, unsigned int dst_capacity) {
+ BitWriter bit_writer = { .stream = dst, .size = dst_capacity };
+ int remaining = (1 << table_log) + 1;
+ int threshold = 1 << table_log;
+ unsigned char nb_bits = table_log + 1;
+ bit_writer_add_bits(&bit_writer, table_log - ZSTD_FSE_MIN_TABLE_LOG, 4);
+ unsigned short int symbol = 0;
+ unsigned char previous_is_zero = FALSE;
+ while (symbol <= max_symbol && remaining > 1) {
+  if (previous_is_zero) {
+   unsigned short int start = symbol;
+   while (symbol <= max_symbol && normalized[symbol] == 0) symbol++;
+   for (; symbol >= start + 24; start += 24) bit_writer_add_bits(&bit_writer, 0xFFFF, 16);
+   for (; symbol >= start + 3; start += 3) bit_writer_add_bits(&bit_writer, 3, 2);
+   bit_writer_add_bits(&bit_writer, symbol - start, 2);
+  }
+  int count = normalized[symbol++];
+  const int max = (2 * threshold - 1) - remaining;
+  remaining -= abs(count);
+  count++;
+  if (count >= threshold) count += max;
+  bit_writer_add_bits(&bit_writer, count, nb_bits - (count < max));
+  previous_is_zero = (count == 1);
+  while (remaining < threshold) nb_bits--, threshold >>= 1;
+ }
+ return bit_writer_align(&bit_writer);
+}
+/// NOTE: the cost is in 1/256 of bit, approximating the bits taken by a symbol as the table log minus the log2 of its states.
+static unsigned int fse_estimate_cost(const unsigned int* counts, unsigned char max_symbol, const short int* normalized, unsigned char normalized_cnt, unsigned char table_log) {
+ unsigned long long int cost = 0;
+ for (unsigned short int s = 0; s <= max_symbol; ++s) {
+  if (counts[s] == 0) continue;
+  else if (s >= normalized_cnt || normalized[s] == 0) return 0xFFFFFFFF;
+  const unsigned int states = normalized[s] == -1 ? 1 : normalized[s];
+  const unsigned int log2_states = (floor_log2(states) << 8) + ((states << 8) >> floor_log2(states)) - 256;
+  cost += (unsigned long long int) counts[s] * ((table_log << 8) - log2_states);
+ }
+ return MIN(cost, 0xFFFFFFFFULL);
+}
+static inline void fse_init_state(unsigned int* state, const FSEEncodingTable* table, unsigned char symbol) {
+ const FSESymbolTransform transform = (table -> symbols)[symbol];
+ const unsigned int nb_bits_out = (transform.delta_nb_bits + (1 << 15)) >> 16;
+ const unsigned int value = (nb_bits_out << 16) - transform.delta_nb_bits;
+ *state = (table -> states)[(value >> nb_bits_out) + transform.delta_find_state];
+ return;
+}
+static inline void fse_encode_symbol(BitWriter* bit_writer, unsigned int* state, const FSEEncodingTable* table, unsigned char symbol) {
+ const FSESymbolTransform transform = (table -> symbols)[symbol];
+ const unsigned int nb_bits_out = (*state + transform.delta_nb_bits) >> 16;
+ bit_writer_add_bits(bit_writer, *state, nb_bits_out);
+ *state = (table -> states)[(*state >> nb_bits_out) + transform.delta_find_state];
+ return;
+}
+// ---------------------------
+//  Literals Encoding Section
+// ---------------------------
+/// NOTE: the code lengths come from a Huffman tree built over the symbols sorted by count, then the lengths past
+///       ZSTD_HUF_MAX_BITS are capped, lengthening the rarest symbols to pay for them, and the freed codes are given back
+///       to the most frequent ones, so that the code stays complete, as the weight of the last symbol is implicit.
+static void build_huffman_codes(const unsigned int* counts, unsigned char max_symbol, HuffmanCode* codes, unsigned char* max_nb_bits) {
+ unsigned char symbols[256] = {0};
+ int lengths[256] = {0};
+ unsigned short int symbols_cnt = 0;
+ for (unsigned short int s = 0; s <= max_symbol; ++s) {
+  codes[s] = (HuffmanCode) {0};
+  if (counts[s] == 0) continue;
+  unsigned short int i = symbols_cnt++;
+  for (; i > 0 && counts[symbols[i - 1]] > counts[s]; --i) symbols[i] = symbols[i - 1];
+  symbols[i] = s;
+ }
+ // Compute the lengths in place over the sorted counts (Moffat and Katajainen)
+ for (unsigned short int i = 0; i < symbols_cnt; ++i) lengths[i] = counts[symbols[i]];
+ int root = 0;
+ int leaf = 2;
+ lengths[0] += lengths[1];
+ for (int next = 1; next < symbols_cnt - 1; ++next) {
+  if (leaf >= symbols_cnt || lengths[root] < lengths[leaf]) lengths[next] = lengths[root], lengths[root++] = next;
+  else lengths[next] = lengths[leaf++];
+  if (leaf >= symbols_cnt || (root < next && lengths[root] < lengths[leaf])) lengths[next] += lengths[root], lengths[root++] = next;
+  else lengths[next] += lengths[leaf++];
+ }
+ lengths[symbols_cnt - 2] = 0;
+ for (int next = symbols_cnt - 3; next >= 0; --next) lengths[next] = lengths[lengths[next]] + 1;
+ int available = 1;
+ int used = 0;
+ int depth = 0;
+ root = symbols_cnt - 2;
+ int next = symbols_cnt - 1;
+ while (available > 0) {
+  while (root >= 0 && lengths[root] == depth) used++, root--;
+  while (available > used) lengths[next--] = depth, available--;
+  available = 2 * used, depth++, used = 0;
+ }
+ // Limit the lengths, keeping the Kraft sum over 2^ZSTD_HUF_MAX_BITS exactly equal to it
+ int kraft_sum = 0;
+ for (unsigned short int i = 0; i < symbols_cnt; ++i) {
+  lengths[i] = MIN(lengths[i], ZSTD_HUF_MAX_BITS);
+  kraft_sum += 1 << (ZSTD_HUF_MAX_BITS - lengths[i]);
+ }
+ for (unsigned short int i = 0; kraft_sum > (1 << ZSTD_HUF_MAX_BITS); i = (i + 1) % symbols_cnt) {
+  if (lengths[i] == ZSTD_HUF_MAX_BITS) continue;
+  lengths[i]++;
+  kraft_sum -= 1 << (ZSTD_HUF_MAX_BITS - lengths[i]);
+ }
+ while (kraft_sum < (1 << ZSTD_HUF_MAX_BITS)) {
+  int candidate = -1;
+  for (int i = symbols_cnt - 1; i >= 0; --i) {
+   if (lengths[i] > 1 && kraft_sum + (1 << (ZSTD_HUF_MAX_BITS - lengths[i])) <= (1 << ZSTD_HUF_MAX_BITS) && (candidate < 0 || lengths[i] > lengths[candidate])) candidate = i;
+  }
+  kraft_sum += 1 << (ZSTD_HUF_MAX_BITS - lengths[candidate]);
+  lengths[candidate]--;
+ }
+ *max_nb_bits = 0;
+ for (unsigned short int i = 0; i < symbols_cnt; ++i) {
+  codes[symbols[i]].nb_bits = lengths[i];
+  *max_nb_bits = MAX(*max_nb_bits, lengths[i]);
+ }
+ // Assign the codes as the decoder lays out its states: from the longest codes, in increasing symbol order
+ unsigned int state = 0;
+ for (unsigned char nb_bits = *max_nb_bits; nb_bits > 0; --nb_bits) {
+  for (unsigned short int s = 0; s <= max_symbol; ++s) {
+   if (codes[s].nb_bits != nb_bits) continue;
+   codes[s].code = state >> (*max_nb_bits - nb_bits);
+   state += 1 << (*max_nb_bits - nb_bits);
+  }
+ }
+ return;
+}
+/// NOTE: the weights are stored as nibbles up to 128 of them, otherwise compressed with FSE through two interleaved
+///       states, as read_weights expects, which requires at least two distinct weights, returning 0 if they cannot be stored.
+static unsigned int write_huffman_weights(const HuffmanCode* codes, unsigned char max_symbol, unsigned char max_nb_bits, unsigned char* dst, unsigned int dst_capacity) {
+ unsigned char weights[256] = {0};
+ unsigned int weights_counts[ZSTD_HUF_MAX_BITS + 1] = {0};
+ unsigned char max_weight = 0;
+ for (unsigned short int s = 0; s < max_symbol; ++s) {
+  weights[s] = codes[s].nb_bits ? max_nb_bits + 1 - codes[s].nb_bits : 0;
+  weights_counts[weights[s]]++;
+  max_weight = MAX(max_weight, weights[s]);
+ }
+ if (max_symbol <= 128) {
+  if (dst_capacity < 1 + (max_symbol + 1U) / 2) return 0;
+  dst[0] = 127 + max_symbol;
+  for (unsigned short int s = 0; s < max_symbol; s += 2) dst[1 + s / 2] = (weights[s] << 4) | weights[s + 1];
+  return 1 + (max_symbol + 1U) / 2;
+ } else if (weights_counts[max_weight] == max_symbol || dst_capacity < 2) return 0;
+ const unsigned char table_log = fse_optimal_table_log(ZSTD_WEIGHTS_MAX_TABLE_LOG, max_symbol, max_weight);
+ short int normalized[ZSTD_HUF_MAX_BITS + 1] = {0};
+ FSEEncodingTable table = {0};
+ fse_normalize_counts(weights_counts, max_weight, max_symbol, table_log, normalized);
+ fse_build_encoding_table(normalized, max_weight, table_log, &table);
+ const unsigned int description_size = fse_write_table_description(normalized, max_weight, table_log, dst + 1, dst_capacity - 1);
+ if (description_size == 0) return 0;
+ BitWriter bit_writer = { .stream = dst + 1 + description_size, .size = dst_capacity - 1 - description_size };
+ unsigned int even_state = 0;
+ unsigned int odd_state = 0;
+ unsigned short int pos = max_symbol;
+ if (max_symbol & 1) {
+  fse_init_state(&even_state, &table, weights[--pos]);
+  fse_init_state(&odd_state, &table, weights[--pos]);
+  fse_encode_symbol(&bit_writer, &even_state, &table, weights[--pos]);
+ } else {
+  fse_init_state(&odd_state, &table, weights[--pos]);
+  fse_init_state(&even_state, &table, weights[--pos]);
+ }
+ while (pos > 0) {
+  fse_encode_symbol(&bit_writer, &odd_state, &table, weights[--pos]);
+  fse_encode_symbol(&bit_writer, &even_state, &table, weights[--pos]);
+ }
+ bit_writer_add_bits(&bit_writer, odd_state, table_log);
+ bit_writer_add_bits(&bit_writer, even_state, table_log);
+ const unsigned int stream_size = bit_writer_close(&bit_writer);
+ if (stream_size == 0 || description_size + stream_size > 127) return 0;
+ dst[0] = description_size + stream_size;
+ return 1 + description_size + stream_size;
+}
+/// NOTE: the literals are written from the last one, as the stream is read backward starting from the first one.
+static unsigned int huffman_compress_stream(const unsigned char* literals, unsigned int literals_cnt, const HuffmanCode* codes, unsigned char* dst, unsigned int dst_capacity) {
+ BitWriter bit_writer = { .stream = dst, .size = dst_capacity };
+ for (unsigned int i = literals_cnt; i > 0; --i) bit_writer_add_bits(&bit_writer, codes[literals[i - 1]].code, codes[literals[i - 1]].nb_bits);
+ return bit_writer_close(&bit_writer);
+}
+/// NOTE: the literals are Huffman compressed, in a single stream up to ZSTD_SINGLE_STREAM_MAX_LITERALS of them or in four
+///       streams otherwise, unless they are all the same byte, too few, or they would not shrink, so that they are stored raw.
+static unsigned int encode_literals_section(const CompressionContext* ctx, unsigned char* dst, unsigned int dst_capacity) {
+ const unsigned int literals_cnt = ctx -> literals_cnt;
+ const unsigned int raw_header_size = literals_cnt < 32 ? 1 : (literals_cnt < 4096 ? 2 : 3);
+ unsigned int counts[256] = {0};
+ unsigned char max_symbol = 0;
+ for (unsigned int i = 0; i < literals_cnt; ++i) counts[(ctx -> literals)[i]]++;
+ for (unsigned short int s = 0; s < 256; ++s) if (counts[s]) max_symbol = s;
+ const LiteralsBlockType block_type = (literals_cnt > 1 && counts[max_symbol] == literals_cnt) ? RLE_LITERALS_BLOCK : RAW_LITERALS_BLOCK;
+ if (literals_cnt >= ZSTD_HUF_MIN_LITERALS && block_type == RAW_LITERALS_BLOCK) {
+  HuffmanCode codes[256] = {0};
+  unsigned char max_nb_bits = 0;
+  build_huffman_codes(counts, max_symbol, codes, &max_nb_bits);
+  const unsigned char is_single_stream = literals_cnt <= ZSTD_SINGLE_STREAM_MAX_LITERALS;
+  const unsigned char size_format = is_single_stream ? 0 : (literals_cnt < 16384 ? 2 : 3);
+  const unsigned int header_size = size_format == 0 ? 3 : size_format + 2;
+  const unsigned int compressed_capacity = MIN(dst_capacity, raw_header_size + literals_cnt);
+  unsigned int compressed_size = header_size < compressed_capacity ? write_huffman_weights(codes, max_symbol, max_nb_bits, dst + header_size, compressed_capacity - header_size) : 0;
+  if (compressed_size && is_single_stream) {
+   const unsigned int stream_size = huffman_compress_stream(ctx -> literals, literals_cnt, codes, dst + header_size + compressed_size, compressed_capacity - header_size - compressed_size);
+   compressed_size = stream_size ? compressed_size + stream_size : 0;
+  } else if (compressed_size && header_size + compressed_size + 6 < compressed_capacity) {
+   // The sizes of the first three streams lead the streams, the last one takes the rest
+   const unsigned int segment_size = (literals_cnt + 3) / 4;
+   unsigned char* jump_table = dst + header_size + compressed_size;
+   compressed_size += 6;
+   for (unsigned char i = 0; i < 4 && compressed_size; ++i) {
+    const unsigned int segment_start = i * segment_size;
+    const unsigned int segment_literals = i < 3 ? segment_size : literals_cnt - segment_start;
+    const unsigned int stream_size = huffman_compress_stream(ctx -> literals + segment_start, segment_literals, codes, dst + header_size + compressed_size, compressed_capacity - header_size - compressed_size);
+    if (i < 3) jump_table[2 * i] = stream_size & 0xFF, jump_table[2 * i + 1] = stream_size >> 8;
+    compressed_size = stream_size ? compressed_size + stream_size : 0;
+   }
+  } else compressed_size = 0;
+  if (compressed_size) {
+   unsigned long long int header = COMPRESSED_LITERALS_BLOCK | (size_format << 2);
+   header |= (unsigned long long int) literals_cnt << 4;
+   header |= (unsigned long long int) compressed_size << (size_format == 0 ? 14 : (size_format == 2 ? 18 : 22));
+   for (unsigned char i = 0; i < header_size; ++i) dst[i] = (header >> (8 * i)) & 0xFF;
+   return header_size + compressed_size;
+  }
+ }
+ const unsigned int section_size = raw_header_size + (block_type == RLE_LITERALS_BLOCK ? 1 : literals_cnt);
+ if (section_size > dst_capacity) return 0;
+ const unsigned int header = block_type | (raw_header_size == 1 ? (literals_cnt << 3) : ((raw_header_size == 2 ? 1 : 3) << 2) | (literals_cnt << 4));
+ for (unsigned char i = 0; i < raw_header_size; ++i) dst[i] = (header >> (8 * i)) & 0xFF;
+ if (block_type == RLE_LITERALS_BLOCK) dst[raw_header_size] = max_symbol;
+ else mem_cpy(dst + raw_header_size, ctx -> literals, literals_cnt);
+ return section_size;
+}
+// ----------------------------
+//  Sequences Encoding Section
+// ----------------------------
+/// NOTE: a single symbol is encoded as RLE, otherwise the predefined distribution is weighed against a distribution
+///       normalized from the counts, which pays for its description, the table used by the chosen mode is built in table.
+static CompressionMode select_sequences_encoding(const unsigned int* counts, unsigned char max_symbol, unsigned int sequences_cnt, const short int* predefined_frequencies, unsigned char predefined_cnt, unsigned char predefined_table_log, unsigned char max_table_log, FSEEncodingTable* table, unsigned char* table_description, unsigned int* table_description_size) {
+ *table_description_size = 0;
+ if (counts[max_symbol] == sequences_cnt) {
+  table_description[(*table_description_size)++] = max_symbol;
+  return RLE_MODE;
+ }
+ short int normalized[XCOMP_ARR_SIZE(ml_codes)] = {0};
+ const unsigned char table_log = fse_optimal_table_log(max_table_log, sequences_cnt, max_symbol);
+ fse_normalize_counts(counts, max_symbol, sequences_cnt, table_log, normalized);
+ const unsigned int description_size = fse_write_table_description(normalized, max_symbol, table_log, table_description, 2 * XCOMP_ARR_SIZE(ml_codes));
+ const unsigned long long int compressed_cost = fse_estimate_cost(counts, max_symbol, normalized, max_symbol + 1, table_log) + (description_size << 11);
+ const unsigned int predefined_cost = fse_estimate_cost(counts, max_symbol, predefined_frequencies, predefined_cnt, predefined_table_log);
+ if (description_size == 0 || predefined_cost <= compressed_cost) {
+  fse_build_encoding_table(predefined_frequencies, predefined_cnt - 1, predefined_table_log, table);
+  return PREDEFINED_MODE;
+ }
+ *table_description_size = description_size;
+ fse_build_encoding_table(normalized, max_symbol, table_log, table);
+ return FSE_COMPRESSED_MODE;
+}
+/// NOTE: the sequences are encoded from the last one, interleaving the states of the three codes with their additional bits,
+///       so that decode_sequences reads them back starting from the first one.
+static unsigned int encode_sequences_section(CompressionContext* ctx, unsigned char* dst, unsigned int dst_capacity) {
+ const unsigned int sequences_cnt = ctx -> sequences_cnt;
+ if (dst_capacity < 4) return 0;
+ unsigned int size = 0;
+ if (sequences_cnt < 128) dst[size++] = sequences_cnt;
+ else if (sequences_cnt < 0x7F00) dst[size++] = (sequences_cnt >> 8) + 0x80, dst[size++] = sequences_cnt & 0xFF;
+ else dst[size++] = 0xFF, dst[size++] = (sequences_cnt - 0x7F00) & 0xFF, dst[size++] = (sequences_cnt - 0x7F00) >> 8;
+ if (sequences_cnt == 0) return size;
+ unsigned char* ll_codes_stream = ctx -> sequences_codes;
+ unsigned char* ml_codes_stream = ll_codes_stream + sequences_cnt;
+ unsigned char* ol_codes_stream = ml_codes_stream + sequences_cnt;
+ unsigned int ll_counts[XCOMP_ARR_SIZE(ll_codes)] = {0};
+ unsigned int ml_counts[XCOMP_ARR_SIZE(ml_codes)] = {0};
+ unsigned int ol_counts[32] = {0};
+ unsigned char ll_max = 0, ml_max = 0, ol_max = 0;
+ for (unsigned int i = 0; i < sequences_cnt; ++i) {
+  const EncodedSequence sequence = (ctx -> sequences)[i];
+  const unsigned int ml_base = sequence.match_length - 3;
+  ll_codes_stream[i] = sequence.literals_length < 64 ? ll_length_codes[sequence.literals_length] : floor_log2(sequence.literals_length) + 19;
+  ml_codes_stream[i] = ml_base < 128 ? ml_length_codes[ml_base] : floor_log2(ml_base) + 36;
+  ol_codes_stream[i] = floor_log2(sequence.offset_value);
+  ll_counts[ll_codes_stream[i]]++, ll_max = MAX(ll_max, ll_codes_stream[i]);
+  ml_counts[ml_codes_stream[i]]++, ml_max = MAX(ml_max, ml_codes_stream[i]);
+  ol_counts[ol_codes_stream[i]]++, ol_max = MAX(ol_max, ol_codes_stream[i]);
+ }
+ // The tables are described in the order they are read: literals lengths, offsets, then match lengths
+ unsigned char descriptions[3][2 * XCOMP_ARR_SIZE(ml_codes)] = {0};
+ unsigned int descriptions_size[3] = {0};
+ const CompressionMode ll_mode = select_sequences_encoding(ll_counts, ll_max, sequences_cnt, ll_pred_frequencies, XCOMP_ARR_SIZE(ll_pred_frequencies), PRED_LL_TABLE_LOG, LL_MAX_LOG, &(ctx -> ll_table), descriptions[0], descriptions_size);
+ const CompressionMode ol_mode = select_sequences_encoding(ol_counts, ol_max, sequences_cnt, ol_pred_frequencies, XCOMP_ARR_SIZE(ol_pred_frequencies), PRED_OL_TABLE_LOG, OL_MAX_LOG, &(ctx -> ol_table), descriptions[1], descriptions_size + 1);
+ const CompressionMode ml_mode = select_sequences_encoding(ml_counts, ml_max, sequences_cnt, ml_pred_frequencies, XCOMP_ARR_SIZE(ml_pred_frequencies), PRED_ML_TABLE_LOG, ML_MAX_LOG, &(ctx -> ml_table), descriptions[2], descriptions_size + 2);
+ if (size + 1 + descriptions_size[0] + descriptions_size[1] + descriptions_size[2] >= dst_capacity) return 0;
+ dst[size++] = (ll_mode << 6) | (ol_mode << 4) | (ml_mode << 2);
+ for (unsigned char i = 0; i < 3; ++i) {
+  mem_cpy(dst + size, descriptions[i], descriptions_size[i]);
+  size += descriptions_size[i];
+ }
+ BitWriter bit_writer = { .stream = dst + size, .size = dst_capacity - size };
+ unsigned int ll_state = 0, ml_state = 0, ol_state = 0;
+ for (unsigned int i = sequences_cnt; i > 0; --i) {
+  const EncodedSequence sequence = (ctx -> sequences)[i - 1];
+  const unsigned char ll_code = ll_codes_stream[i - 1];
+  const unsigned char ml_code = ml_codes_stream[i - 1];
+  const unsigned char ol_code = ol_codes_stream[i - 1];
+  if (i == sequences_cnt) {
+   if (ml_mode != RLE_MODE) fse_init_state(&ml_state, &(ctx -> ml_table), ml_code);
+   if (ol_mode != RLE_MODE) fse_init_state(&ol_state, &(ctx -> ol_table), ol_code);
+   if (ll_mode != RLE_MODE) fse_init_state(&ll_state, &(ctx -> ll_table), ll_code);
+  } else {
+   if (ol_mode != RLE_MODE) fse_encode_symbol(&bit_writer, &ol_state, &(ctx -> ol_table), ol_code);
+   if (ml_mode != RLE_MODE) fse_encode_symbol(&bit_writer, &ml_state, &(ctx -> ml_table), ml_code);
+   if (ll_mode != RLE_MODE) fse_encode_symbol(&bit_writer, &ll_state, &(ctx -> ll_table), ll_code);
+  }
+  bit_writer_add_bits(&bit_writer, sequence.literals_length - ll_codes[ll_code][0], ll_codes[ll_code][1]);
+  bit_writer_add_bits(&bit_writer, sequence.match_length - ml_codes[ml_code][0], ml_codes[ml_code][1]);
+  bit_writer_add_bits(&bit_writer, sequence.offset_value, ol_code);
+ }
+ if (ml_mode != RLE_MODE) bit_writer_add_bits(&bit_writer, ml_state, ctx -> ml_table.table_log);
+ if (ol_mode != RLE_MODE) bit_writer_add_bits(&bit_writer, ol_state, ctx -> ol_table.table_log);
+ if (ll_mode != RLE_MODE) bit_writer_add_bits(&bit_writer, ll_state, ctx -> ll_table.table_log);
+ const unsigned int stream_size = bit_writer_close(&bit_writer);
+ return stream_size ? size + stream_size : 0;
+}
+// -------------------------
+//  Block Encoding Section
+// -------------------------
+/// NOTE: returns the size of the compressed block, or 0 if it does not fit in dst_capacity bytes, in which case the
+///       caller stores the block raw, and restores the offset history, as the decoder never sees these sequences.
+static unsigned int compress_zstd_block(CompressionContext* ctx, const unsigned char* stream, unsigned int block_start, unsigned int block_end, unsigned char* dst, unsigned int dst_capacity) {
+ find_sequences(ctx, stream, block_start, block_end);
+ const unsigned int literals_size = encode_literals_section(ctx, dst, dst_capacity);
+ if (literals_size == 0) return 0;
+ const unsigned int sequences_size = encode_sequences_section(ctx, dst + literals_size, dst_capacity - literals_size);
+ if (sequences_size == 0) return 0;
+ return literals_size + sequences_size;
+}
 unsigned char* zstd_deflate(unsigned char* stream, unsigned int size, unsigned int* compressed_len, int* zstd_err) {
  *compressed_len = 0;
- *zstd_err = ZSTD_TODO;
- printf("size: %u\n", size);
- printf("Implement compression algorithm.\n");
- XCOMP_SAFE_FREE(stream);
- return NULL;
+ *zstd_err = ZSTD_NO_ERROR;
+ // Each block is at worst stored raw, behind its header
+ const unsigned int blocks_cnt = MAX((size + ZSTD_BLOCK_MAX_SIZE - 1) / ZSTD_BLOCK_MAX_SIZE, 1U);
+ unsigned char* compressed_stream = (unsigned char*) xcomp_calloc(4 + 1 + 4 + size + 3 * blocks_cnt, sizeof(unsigned char));
+ // The buffers of a block are sized for the largest block, as the clusters are usually smaller than ZSTD_BLOCK_MAX_SIZE
+ const unsigned int max_block_size = MIN(MAX(size, 1U), (unsigned int) ZSTD_BLOCK_MAX_SIZE);
+ CompressionContext ctx = { .offset_history = {1, 4, 8} };
+ const int hash_log = size > 1 ? floor_log2(size - 1) - 1 : 0;
+ ctx.hash_log = MIN(MAX(hash_log, ZSTD_MIN_HASH_LOG), ZSTD_MAX_HASH_LOG);
+ ctx.hash_table = (unsigned int*) xcomp_calloc(1U << ctx.hash_log, sizeof(unsigned int));
+ ctx.literals = (unsigned char*) xcomp_calloc(max_block_size, sizeof(unsigned char));
+ ctx.sequences = (EncodedSequence*) xcomp_calloc(max_block_size / ZSTD_MIN_MATCH + 1, sizeof(EncodedSequence));
+ ctx.sequences_codes = (unsigned char*) xcomp_calloc(3 * (max_block_size / ZSTD_MIN_MATCH + 1), sizeof(unsigned char));
+ if (compressed_stream == NULL || ctx.hash_table == NULL || ctx.literals == NULL || ctx.sequences == NULL || ctx.sequences_codes == NULL) {
+  XCOMP_MULTI_FREE(stream, compressed_stream, ctx.hash_table, ctx.literals, ctx.sequences, ctx.sequences_codes);
+  WARNING_LOG("Failed to allocate the compression buffers.\n");
+  *zstd_err = -ZSTD_IO_ERROR;
+  return ((unsigned char*) "An error occurred while allocating the compression buffers.\n");
+ }
+ // Frame header: single segment, as the window is the whole content, whose size takes 1, 2 or 4 bytes
+ unsigned int pos = 0;
+ const unsigned char frame_content_size_flag = size < 256 ? 0 : (size < 65536 + 256 ? 1 : 2);
+ const unsigned int frame_content_size = frame_content_size_flag == 1 ? size - 256 : size;
+ for (unsigned char i = 0; i < 4; ++i) compressed_stream[pos++] = (0xFD2FB528 >> (8 * i)) & 0xFF;
+ compressed_stream[pos++] = (frame_content_size_flag << 6) | (1 << 5);
+ for (unsigned char i = 0; i < (frame_content_size_flag ? 1 << frame_content_size_flag : 1); ++i) compressed_stream[pos++] = (frame_content_size >> (8 * i)) & 0xFF;
+ unsigned int block_start = 0;
+ do {
+  const unsigned int block_size = MIN(size - block_start, (unsigned int) ZSTD_BLOCK_MAX_SIZE);
+  const unsigned int block_end = block_start + block_size;
+  const unsigned char is_last_block = block_end == size;
+  unsigned int offset_history[3] = { ctx.offset_history[0], ctx.offset_history[1], ctx.offset_history[2] };
+  BlockType block_type = RLE_BLOCK;
+  unsigned int block_content_size = 1;
+  for (unsigned int i = block_start + 1; i < block_end && block_type == RLE_BLOCK; ++i) if (stream[i] != stream[block_start]) block_type = COMPRESSED_BLOCK;
+  if (block_size == 0) block_type = RAW_BLOCK, block_content_size = 0;
+  else if (block_type == RLE_BLOCK) compressed_stream[pos + 3] = stream[block_start];
+  else if ((block_content_size = compress_zstd_block(&ctx, stream, block_start, block_end, compressed_stream + pos + 3, block_size - 1)) == 0) {
+   mem_cpy(ctx.offset_history, offset_history, sizeof(offset_history));
+   mem_cpy(compressed_stream + pos + 3, stream + block_start, block_size);
+   block_type = RAW_BLOCK, block_content_size = block_size;
+  }
+  TRACE_LOG("Block at %u: '%s', %u -> %u bytes.\n", block_start, block_types_str[block_type], block_size, block_content_size);
+  const unsigned int block_header = is_last_block | (block_type << 1) | ((block_type == RLE_BLOCK ? block_size : block_content_size) << 3);
+  for (unsigned char i = 0; i < 3; ++i) compressed_stream[pos++] = (block_header >> (8 * i)) & 0xFF;
+  pos += block_content_size;
+  block_start = block_end;
+ } while (block_start < size);
+ XCOMP_MULTI_FREE(stream, ctx.hash_table, ctx.literals, ctx.sequences, ctx.sequences_codes);
+ *compressed_len = pos;
+ return compressed_stream;
 }
 /*
  * Copyright (C) 2025 TheProgxy <theprogxy@gmail.com>
@@ -958,55 +1923,16 @@ unsigned char* zstd_deflate(unsigned char* stream, unsigned int size, unsigned i
 //  Macros Definition
 // -------------------
 /* -------------------------------------------------------------------------------------------------------- */
-// -------------------------------
-//  Predefined Distributions Data
-// -------------------------------
-typedef enum DistributionData {
- LL_MAX_LOG = 9,
- ML_MAX_LOG = 9,
- OL_MAX_LOG = 8,
- PRED_LL_TABLE_LOG = 6,
- PRED_ML_TABLE_LOG = 6,
- PRED_OL_TABLE_LOG = 5
-} DistributionData;
-static const short int ll_pred_frequencies[] = {
- 4, 3, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
-    1, 1, 1, 2, 2, 2, 2, 2, 2, 2, 2, 2,
- 3, 2, 1, 1, 1, 1, 1, -1, -1, -1, -1
-};
-static const short int ml_pred_frequencies[] = {
- 1, 4, 3, 2, 2, 2, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
- 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, -1, -1, -1,
- -1, -1, -1, -1
-};
-static const short int ol_pred_frequencies[] = {
- 1, 1, 1, 1, 1, 1, 2, 2, 2, 1, 1, 1, 1, 1, 1,
- 1, 1, 1, 1, 1, 1, 1, 1, 1, -1, -1, -1, -1, -1
-};
-static const unsigned int ll_codes[36][2] = {
- {0, 0}, {1, 0}, {2, 0}, {3, 0}, {4, 0}, {5, 0}, {6, 0}, {7, 0}, {8, 0}, {9, 0},
- {10, 0}, {11, 0}, {12, 0}, {13, 0}, {14, 0}, {15, 0}, {16, 1}, {18, 1},
- {20, 1}, {22, 1}, {24, 2}, {28, 2}, {32, 3}, {40, 3}, {48, 4}, {64, 6},
- {128, 7}, {256, 8}, {512, 9}, {1024, 10}, {2048, 11}, {4096, 12}, {8192, 13},
- {16384, 14}, {32768, 15}, {65536, 16}
-};
-static const unsigned int ml_codes[53][2] = {
- {3, 0}, {4, 0}, {5, 0}, {6, 0}, {7, 0}, {8, 0}, {9, 0}, {10, 0}, {11, 0},
- {12, 0}, {13, 0}, {14, 0}, {15, 0}, {16, 0}, {17, 0}, {18, 0}, {19, 0},
- {20, 0}, {21, 0}, {22, 0}, {23, 0}, {24, 0}, {25, 0}, {26, 0}, {27, 0},
- {28, 0}, {29, 0}, {30, 0}, {31, 0}, {32, 0}, {33, 0}, {34, 0}, {35, 1},
- {37, 1}, {39, 1}, {41, 1}, {43, 2}, {47, 2}, {51, 3}, {59, 3}, {67, 4},
- {83, 4}, {99, 5}, {131, 7}, {259, 8}, {515, 9}, {1027, 10}, {2051, 11},
- {4099, 12}, {8195, 13}, {16387, 14}, {32771, 15}, {65539, 16}
-};
+// -------
+//  Enums
+// -------
+/// NOTE: the state of a backward bitstream after a reload: while it is unfinished a whole word is loaded, so that
+///       at least 57 bits can be read before the next reload, while past the start of the stream zeros are read.
+typedef enum PACKED_STRUCT BitReaderStatus { BIT_READER_UNFINISHED, BIT_READER_END_OF_BUFFER, BIT_READER_COMPLETED, BIT_READER_OVERFLOW } BitReaderStatus;
 /* -------------------------------------------------------------------------------------------------------- */
 // ---------
 //  Structs
 // ---------
-typedef struct PACKED_STRUCT LengthCode {
- unsigned int value;
- unsigned int num_bits;
-} LengthCode;
 typedef struct PACKED_STRUCT FrameHeaderDescriptor {
  unsigned char dictionary_id_flag: 2;
  unsigned char content_checksum_flag: 1;
@@ -1035,6 +1961,14 @@ typedef struct FSETableEntry {
     unsigned char nb_bits; // Bits to read for next state
     unsigned short int baseline; // Base for next state calculation
 } FSETableEntry;
+/// NOTE: the tables are sized for the largest table log of the sequences, and are kept across the blocks of a frame,
+///       so that REPEAT_MODE reuses them as they are, and the predefined ones are built only once.
+typedef struct FSEDecodingTable {
+ FSETableEntry entries[1 << LL_MAX_LOG];
+ unsigned char table_log;
+ unsigned char is_valid;
+ unsigned char is_predefined;
+} FSEDecodingTable;
 typedef struct PACKED_STRUCT LiteralsSectionHeader {
  unsigned int regenerated_size;
  unsigned int compressed_size;
@@ -1045,63 +1979,83 @@ typedef struct PACKED_STRUCT ZSTDHfEntry {
  unsigned char symbol;
  unsigned char nb_bits;
 } ZSTDHfEntry;
-typedef struct SequenceSection {
- FSETableEntry* ll_fse_table;
- unsigned char ll_table_log;
- short int ll_rle;
- FSETableEntry* ml_fse_table;
- unsigned char ml_table_log;
- short int ml_rle;
- FSETableEntry* ol_fse_table;
- unsigned char ol_table_log;
- short int ol_rle;
-} SequenceSection;
-typedef struct PACKED_STRUCT Sequence {
- unsigned int ll_value;
- unsigned int ml_value;
- unsigned int ol_value;
-} Sequence;
+/// NOTE: the stream is read from its end back to start, bit_container holds the 8 bytes at ptr,
+///       whose bits are consumed from the top, bits_consumed of them being already read.
+typedef struct BackwardBitReader {
+ const unsigned char* start;
+ const unsigned char* ptr;
+ unsigned long long int bit_container;
+ unsigned int bits_consumed;
+} BackwardBitReader;
+/// NOTE: the workspace is reused by every frame decoded on the same thread, so that decoding a block never allocates:
+///       the literals either point straight into the compressed block (raw literals) or into literals_buffer.
 typedef struct Workspace {
- unsigned int* offset_history;
+ unsigned int offset_history[3];
  unsigned char* frame_buffer;
  unsigned int frame_buffer_len;
- SequenceSection sequence_section;
- ZSTDHfEntry* hf_literals;
- unsigned char table_log;
- unsigned char* literals;
- unsigned int literals_cnt;
- Sequence* sequences;
- unsigned int sequence_len;
- unsigned int hf_tree_desc_size;
+ unsigned int frame_buffer_capacity;
+ unsigned char is_caller_data;
+ FSEDecodingTable ll_table;
+ FSEDecodingTable ml_table;
+ FSEDecodingTable ol_table;
+ ZSTDHfEntry hf_literals[1 << ZSTD_HUF_MAX_BITS];
  unsigned char max_nb_bits;
+ const unsigned char* literals;
+ unsigned int literals_cnt;
+ unsigned char literals_buffer[ZSTD_BLOCK_MAX_SIZE];
 } Workspace;
 /* -------------------------------------------------------------------------------------------------------- */
+// ------------------
+//  Static Variables
+// ------------------
+/// NOTE: the workspace of each thread is allocated on its first frame, rather than being a static TLS block of its size,
+///       and it is released by the destructor of zstd_workspace_key once the thread exits.
+static _Thread_local Workspace* zstd_workspace = NULL;
+static pthread_key_t zstd_workspace_key;
+static pthread_once_t zstd_workspace_once = PTHREAD_ONCE_INIT;
+static int zstd_workspace_key_err = 0;
+/* -------------------------------------------------------------------------------------------------------- */
 // ------------------------
 //  Functions Declarations
 // ------------------------
 static unsigned char highest_bit(unsigned long long int val);
 static void print_fhd(FrameHeaderDescriptor fhd);
+static void release_zstd_workspace(void* workspace);
+static void create_zstd_workspace_key(void);
+static Workspace* get_zstd_workspace(void);
 static void deallocate_workspace(Workspace* workspace);
-static void deallocate_sequence_section(SequenceSection* sequence_section);
-static int calc_baseline_and_numbits(unsigned int num_states_total, unsigned int num_states_symbol, unsigned int state_number, unsigned short int* a, unsigned char* b);
-static int read_probabilities(BitStream* compressed_bit_stream, unsigned char table_log, unsigned char max_symbol, short int** frequencies, unsigned short int* probabilities_cnt);
-static int fse_build_table(unsigned char table_log, short int* frequencies, unsigned short int probabilities_cnt, FSETableEntry** fse_table);
-static int read_weights(BitStream* compressed_bit_stream, unsigned char* table_log, unsigned char** weights, unsigned short int* weights_cnt);
+static inline unsigned long long int bit_reader_load(const unsigned char* ptr);
+static int bit_reader_init(BackwardBitReader* bit_reader, const unsigned char* stream, unsigned int size);
+static inline unsigned long long int bit_reader_peek(const BackwardBitReader* bit_reader, unsigned char nb_bits);
+static inline void bit_reader_skip(BackwardBitReader* bit_reader, unsigned char nb_bits);
+static inline unsigned long long int bit_reader_read(BackwardBitReader* bit_reader, unsigned char nb_bits);
+static inline BitReaderStatus bit_reader_reload(BackwardBitReader* bit_reader);
+static inline unsigned char bit_reader_is_empty(const BackwardBitReader* bit_reader);
+static int read_probabilities(BitStream* compressed_bit_stream, unsigned char table_log, unsigned char max_symbol, short int* frequencies, unsigned short int* probabilities_cnt);
+static int fse_build_table(unsigned char table_log, const short int* frequencies, unsigned short int probabilities_cnt, FSETableEntry* fse_table);
+static int read_weights(BitStream* compressed_bit_stream, unsigned char* weights, unsigned short int* weights_cnt);
 static int build_huff_table(BitStream* compressed_bit_stream, Workspace* workspace);
-static int huff_decode_stream(BitStream* literals_stream, unsigned short int hf_literals_size, unsigned int regenerated_size, Workspace* workspace);
+static inline unsigned char huff_decode_symbol(BackwardBitReader* bit_reader, const ZSTDHfEntry* hf_literals, unsigned char max_nb_bits);
+static int huff_decode_stream(BackwardBitReader* bit_reader, unsigned char* literals, unsigned char* literals_end, const Workspace* workspace);
 static int decode_literals(BitStream* compressed_bit_stream, Workspace* workspace, LiteralsSectionHeader lsh);
 static int parse_literals_section(BitStream* compressed_bit_stream, Workspace* workspace);
-static int decode_sequences(BitStream* sequence_compressed_bit_stream, Workspace* workspace);
-static int parse_sequence_section(BitStream* compressed_bit_stream, Workspace* workspace);
+static int build_sequence_table(BitStream* compressed_bit_stream, CompressionMode mode, FSEDecodingTable* table, const short int* predefined_frequencies, unsigned char predefined_cnt, unsigned char predefined_table_log, unsigned char max_table_log, unsigned char max_symbol);
 static unsigned int update_off_history(unsigned int* offset_history, unsigned int offset, unsigned int ll_value);
-static int sequence_execution(Workspace* workspace);
+static inline void copy_literals(unsigned char* dest, const unsigned char* literals, unsigned int length);
+static int decode_sequences(const unsigned char* sequences_stream, unsigned int size, unsigned int sequences_cnt, Workspace* workspace);
+static int parse_sequence_section(BitStream* compressed_bit_stream, Workspace* workspace);
 static int decompress_block(BitStream* compressed_bit_stream, Workspace* workspace);
+static int reserve_frame_buffer(Workspace* workspace, unsigned int size);
 static int parse_block(BitStream* bit_stream, Workspace* workspace, unsigned int block_maximum_size);
-static int parse_frames(BitStream* bit_stream, unsigned char** decompressed_data, unsigned int* decompressed_data_length);
+static int parse_frames(BitStream* bit_stream, unsigned char** decompressed_data, unsigned int* decompressed_data_length, unsigned char is_caller_data, unsigned int decompressed_data_capacity, unsigned char verify_checksum);
 /// NOTE: the stream will be always deallocated both in case of failure and success.
 /// 	  Furthermore, the function allocates the returned stream of bytes, so that
 /// 	  once it's on the hand of the caller, it's responsible to manage that memory.
-unsigned char* zstd_inflate(unsigned char* stream, unsigned int size, unsigned int* decompressed_data_length, int* zstd_err);
+///       The content checksums of the frames are verified only if verify_checksum is set, otherwise they are just skipped.
+unsigned char* zstd_inflate(unsigned char* stream, unsigned int size, unsigned int* decompressed_data_length, int* zstd_err, unsigned char verify_checksum);
+/// NOTE: unlike zstd_inflate, neither buffer is allocated nor deallocated, the frames are decoded straight into dst,
+///       failing with -ZSTD_DECOMPRESSED_SIZE_MISMATCH if they do not fit in dst_capacity bytes.
+int zstd_inflate_into(unsigned char* dst, unsigned int dst_capacity, const unsigned char* src, unsigned int src_len, unsigned int* decompressed_data_length, unsigned char verify_checksum);
 /* ---------------------------------------------------------------------------------------------------------- */
 // ---------------------------
 //  General Utilities Section
@@ -1111,67 +2065,122 @@ static unsigned char highest_bit(unsigned long long int val) {
 }
 static void print_fhd(FrameHeaderDescriptor fhd) {
  (void) fhd;
- DEBUG_LOG("FrameHeaderDescriptor: (0x%X)\n", *XCOMP_CAST_PTR(&fhd, unsigned char));
-    DEBUG_LOG(" - frame_content_size_flag: %u\n", fhd.frame_content_size_flag);
-    DEBUG_LOG(" - single_segment_flag: %u\n", fhd.single_segment_flag);
-    DEBUG_LOG(" - unused: %u\n", fhd.unused);
-    DEBUG_LOG(" - reserved: %u\n", fhd.reserved);
-    DEBUG_LOG(" - content_checksum_flag: %u\n", fhd.content_checksum_flag);
-    DEBUG_LOG(" - dictionary_id_flag: %u\n", fhd.dictionary_id_flag);
+ TRACE_LOG("FrameHeaderDescriptor: (0x%X)\n", *XCOMP_CAST_PTR(&fhd, unsigned char));
+    TRACE_LOG(" - frame_content_size_flag: %u\n", fhd.frame_content_size_flag);
+    TRACE_LOG(" - single_segment_flag: %u\n", fhd.single_segment_flag);
+    TRACE_LOG(" - unused: %u\n", fhd.unused);
+    TRACE_LOG(" - reserved: %u\n", fhd.reserved);
+    TRACE_LOG(" - content_checksum_flag: %u\n", fhd.content_checksum_flag);
+    TRACE_LOG(" - dictionary_id_flag: %u\n", fhd.dictionary_id_flag);
  return;
 }
-static void deallocate_workspace(Workspace* workspace) {
- XCOMP_SAFE_FREE(workspace -> frame_buffer);
- XCOMP_SAFE_FREE(workspace -> sequence_section.ll_fse_table);
- XCOMP_SAFE_FREE(workspace -> sequence_section.ml_fse_table);
- XCOMP_SAFE_FREE(workspace -> sequence_section.ol_fse_table);
- XCOMP_SAFE_FREE(workspace -> hf_literals);
- XCOMP_SAFE_FREE(workspace -> literals);
- XCOMP_SAFE_FREE(workspace -> sequences);
+static void release_zstd_workspace(void* workspace) {
+ xcomp_free(workspace);
  return;
 }
-static void deallocate_sequence_section(SequenceSection* sequence_section) {
- if (sequence_section -> ll_fse_table) XCOMP_SAFE_FREE(sequence_section -> ll_fse_table);
- if (sequence_section -> ml_fse_table) XCOMP_SAFE_FREE(sequence_section -> ml_fse_table);
- if (sequence_section -> ol_fse_table) XCOMP_SAFE_FREE(sequence_section -> ol_fse_table);
+static void create_zstd_workspace_key(void) {
+ zstd_workspace_key_err = pthread_key_create(&zstd_workspace_key, release_zstd_workspace);
  return;
 }
-// ---------------------------------------
-//  Literals Parsing and Decoding Section
-// ---------------------------------------
-// TODO: revise a simpler method to substitute this function, cause A is stolen, B is for sure too computationally expensive
-static int calc_baseline_and_numbits(unsigned int num_states_total, unsigned int num_states_symbol, unsigned int state_number, unsigned short int* a, unsigned char* b) {
-    if (num_states_symbol == 0) {
-        *a = 0, *b = 0;
-  return ZSTD_NO_ERROR;
-    }
- unsigned int num_state_slices = (1U << (highest_bit(num_states_symbol) - 1) == num_states_symbol) ? num_states_symbol : 1U << highest_bit(num_states_symbol); //always power of two
-    unsigned int num_double_width_state_slices = num_state_slices - num_states_symbol; //leftovers to the power of two need to be distributed
-    unsigned int num_single_width_state_slices = num_states_symbol - num_double_width_state_slices; //these will not receive a double width slice of states
-    unsigned int slice_width = num_states_total / num_state_slices; //size of a single width slice of states
- if (slice_width == 0) {
-  WARNING_LOG("Slice width cannot be 0.\n");
+static Workspace* get_zstd_workspace(void) {
+ if (zstd_workspace != NULL) return zstd_workspace;
+ pthread_once(&zstd_workspace_once, create_zstd_workspace_key);
+ if (zstd_workspace_key_err) {
+  WARNING_LOG("Failed to create the key of the zstd workspaces.\n");
+  return NULL;
+ }
+ Workspace* workspace = (Workspace*) xcomp_calloc(1, sizeof(Workspace));
+ if (workspace == NULL) {
+  WARNING_LOG("Failed to allocate the zstd workspace.\n");
+  return NULL;
+ }
+ if (pthread_setspecific(zstd_workspace_key, workspace)) {
+  xcomp_free(workspace);
+  WARNING_LOG("Failed to bind the zstd workspace to the thread.\n");
+  return NULL;
+ }
+ zstd_workspace = workspace;
+ return zstd_workspace;
+}
+static void deallocate_workspace(Workspace* workspace) {
+ if (!workspace -> is_caller_data) XCOMP_SAFE_FREE(workspace -> frame_buffer);
+ workspace -> frame_buffer = NULL;
+ return;
+}
+// -------------------------------
+//  Backward Bit Reading Section
+// -------------------------------
+static inline unsigned long long int bit_reader_load(const unsigned char* ptr) {
+ unsigned long long int word = 0;
+ for (unsigned char i = 0; i < 8; ++i) word |= (unsigned long long int) ptr[i] << (i * 8);
+ return word;
+}
+/// NOTE: the last byte of the stream holds its end marker, the highest set bit, which is skipped along with the padding zeros above it,
+///       while the streams shorter than a word are loaded at the bottom of bit_container, with its missing top bytes accounted as consumed.
+static int bit_reader_init(BackwardBitReader* bit_reader, const unsigned char* stream, unsigned int size) {
+ if (size == 0 || stream[size - 1] == 0) {
+  WARNING_LOG("The backward bitstream is either empty or missing its end marker.\n");
   return -ZSTD_CORRUPTED_DATA;
  }
- unsigned int num_bits = highest_bit(slice_width) - 1; //number of bits needed to read for one slice
-    if (state_number < num_double_width_state_slices) {
-        unsigned int baseline = num_single_width_state_slices * slice_width + state_number * slice_width * 2;
-        *a = baseline, *b = num_bits + 1;
-    } else {
-        unsigned int index_shifted = state_number - num_double_width_state_slices;
-        *a = (index_shifted * slice_width), *b = num_bits;
-    }
+ bit_reader -> start = stream;
+ if (size >= sizeof(unsigned long long int)) {
+  bit_reader -> ptr = stream + size - sizeof(unsigned long long int);
+  bit_reader -> bit_container = bit_reader_load(bit_reader -> ptr);
+  bit_reader -> bits_consumed = 0;
+ } else {
+  bit_reader -> ptr = stream;
+  bit_reader -> bit_container = 0;
+  for (unsigned char i = 0; i < size; ++i) bit_reader -> bit_container |= (unsigned long long int) stream[i] << (i * 8);
+  bit_reader -> bits_consumed = (sizeof(unsigned long long int) - size) * 8;
+ }
+ bit_reader -> bits_consumed += 9 - highest_bit(stream[size - 1]);
  return ZSTD_NO_ERROR;
 }
-static int read_probabilities(BitStream* compressed_bit_stream, unsigned char table_log, unsigned char max_symbol, short int** frequencies, unsigned short int* probabilities_cnt) {
+/// NOTE: the double shift lets nb_bits be 0, while the bits past the start of the stream are read as zeros.
+static inline unsigned long long int bit_reader_peek(const BackwardBitReader* bit_reader, unsigned char nb_bits) {
+ return ((bit_reader -> bit_container << (bit_reader -> bits_consumed & 63)) >> 1) >> ((63 - nb_bits) & 63);
+}
+static inline void bit_reader_skip(BackwardBitReader* bit_reader, unsigned char nb_bits) {
+ bit_reader -> bits_consumed += nb_bits;
+ return;
+}
+static inline unsigned long long int bit_reader_read(BackwardBitReader* bit_reader, unsigned char nb_bits) {
+ const unsigned long long int value = bit_reader_peek(bit_reader, nb_bits);
+ bit_reader_skip(bit_reader, nb_bits);
+ return value;
+}
+/// NOTE: while a whole word can be loaded before the current one, ptr steps back by the consumed bytes, otherwise it stops at the start of the stream,
+///       and once it got there, it is completed when every bit has been consumed, while consuming more than that overflows the stream.
+static inline BitReaderStatus bit_reader_reload(BackwardBitReader* bit_reader) {
+ if (bit_reader -> bits_consumed > 64) return BIT_READER_OVERFLOW;
+ if (bit_reader -> ptr >= bit_reader -> start + sizeof(unsigned long long int)) {
+  bit_reader -> ptr -= bit_reader -> bits_consumed >> 3;
+  bit_reader -> bits_consumed &= 7;
+  bit_reader -> bit_container = bit_reader_load(bit_reader -> ptr);
+  return BIT_READER_UNFINISHED;
+ } else if (bit_reader -> ptr == bit_reader -> start) return (bit_reader -> bits_consumed < 64) ? BIT_READER_END_OF_BUFFER : BIT_READER_COMPLETED;
+ unsigned int nb_bytes = bit_reader -> bits_consumed >> 3;
+ BitReaderStatus status = BIT_READER_UNFINISHED;
+ if ((unsigned int) (bit_reader -> ptr - bit_reader -> start) < nb_bytes) {
+  nb_bytes = bit_reader -> ptr - bit_reader -> start;
+  status = BIT_READER_END_OF_BUFFER;
+ }
+ bit_reader -> ptr -= nb_bytes;
+ bit_reader -> bits_consumed -= nb_bytes * 8;
+ bit_reader -> bit_container = bit_reader_load(bit_reader -> ptr);
+ return status;
+}
+static inline unsigned char bit_reader_is_empty(const BackwardBitReader* bit_reader) {
+ return bit_reader -> ptr == bit_reader -> start && bit_reader -> bits_consumed == 64;
+}
+// ---------------------------------------
+//  Literals Parsing and Decoding Section
+// ---------------------------------------
+/// NOTE: frequencies must fit max_symbol + 1 entries.
+static int read_probabilities(BitStream* compressed_bit_stream, unsigned char table_log, unsigned char max_symbol, short int* frequencies, unsigned short int* probabilities_cnt) {
  if (table_log > 15) return -ZSTD_TABLE_LOG_TOO_LARGE;
  int remaining = (1 << table_log) + 1;
- *frequencies = (short int*) xcomp_realloc(*frequencies, (255 + 1U) * sizeof(short int));
- if (*frequencies == NULL) {
-  WARNING_LOG("Failed to allocate frequencies.\n");
-  return -ZSTD_IO_ERROR;
- }
- mem_set(*frequencies, 0, (255 + 1U) * sizeof(short int));
+ mem_set(frequencies, 0, (max_symbol + 1U) * sizeof(short int));
  *probabilities_cnt = 0;
  unsigned short int freq_cum_sum = 0;
  unsigned char zero_repeat = FALSE;
@@ -1179,8 +2188,9 @@ static int read_probabilities(BitStream* compressed_bit_stream, unsigned char ta
   if (zero_repeat) {
    unsigned char repeat = bitstream_read_bits(compressed_bit_stream, 2);
    *probabilities_cnt += repeat;
-   if (repeat == 3) continue;
+   if (repeat == 3 && *probabilities_cnt <= max_symbol + 1) continue;
   }
+  if (*probabilities_cnt > max_symbol) break;
   unsigned char nb_bits = highest_bit(remaining);
   unsigned short int max = (1 << (nb_bits - 1)) - 1;
   unsigned short int low_threshold = ((1 << nb_bits) - 1) - remaining;
@@ -1192,255 +2202,196 @@ static int read_probabilities(BitStream* compressed_bit_stream, unsigned char ta
   } else if (value > max) value -= low_threshold;
   value--; // Prediction = value - 1
   if (value < -1 || remaining <= 1) {
-   XCOMP_SAFE_FREE(frequencies);
    WARNING_LOG("Predictions cannot be less than 1: %d\n", value);
    return -ZSTD_CORRUPTED_DATA;
   }
-  (*frequencies)[(*probabilities_cnt)++] = value;
+  frequencies[(*probabilities_cnt)++] = value;
   freq_cum_sum += abs(value);
   remaining -= abs(value);
   zero_repeat = !value;
-  if (*probabilities_cnt > max_symbol + 1 || freq_cum_sum >= (1 << table_log)) break;
+  if (freq_cum_sum >= (1 << table_log)) break;
  }
  if (*probabilities_cnt > max_symbol + 1) {
-  XCOMP_SAFE_FREE(*frequencies);
   WARNING_LOG("Probabilities_cnt %u > %u max_symbol_value.\n", *probabilities_cnt, max_symbol + 1);
   return -ZSTD_MAX_SYMBOL_VALUE_TOO_SMALL;
- } else if (freq_cum_sum != (1 << table_log)) {
-  XCOMP_SAFE_FREE(*frequencies);
+ } else if (freq_cum_sum != (1 << table_log) || compressed_bit_stream -> error) {
   WARNING_LOG("Freq_cum_sum %u != %u expected frequencies count.\n", freq_cum_sum, (1 << table_log));
   return -ZSTD_CORRUPTED_DATA;
  }
- *frequencies = (short int*) xcomp_realloc(*frequencies, *probabilities_cnt * sizeof(short int));
- if (*frequencies == NULL) {
-  WARNING_LOG("Failed to allocate frequencies.\n");
-  return -ZSTD_IO_ERROR;
- }
  if (compressed_bit_stream -> bit_pos) skip_to_next_byte(compressed_bit_stream); // Any remaining bit within the last byte is simply unused.
  return -ZSTD_NO_ERROR;
 }
-static int fse_build_table(unsigned char table_log, short int* frequencies, unsigned short int probabilities_cnt, FSETableEntry** fse_table) {
- if (table_log > 15) return -ZSTD_TABLE_LOG_TOO_LARGE;
- // Build the decoding table from those probabilites
- unsigned short int table_size = 1 << table_log;
- *fse_table = (FSETableEntry*) xcomp_realloc(*fse_table, table_size * sizeof(FSETableEntry));
- if (*fse_table == NULL) {
-  WARNING_LOG("Failed to allocate the fse table.\n");
-  return -ZSTD_IO_ERROR;
- }
+/// NOTE: the states of each symbol are numbered in table order, starting from its probability, so that the n-th one
+///       reads the bits that bring it back within [table_size, 2 * table_size) once added to its baseline.
+static int fse_build_table(unsigned char table_log, const short int* frequencies, unsigned short int probabilities_cnt, FSETableEntry* fse_table) {
+ if (table_log > LL_MAX_LOG) return -ZSTD_TABLE_LOG_TOO_LARGE;
+ const unsigned short int table_size = 1 << table_log;
+ unsigned short int symbol_next[256] = {0};
  // Start by assigning the -1 (also called "less than 1") probabilities' symbols, to the bottom of the table
  unsigned short int negative_index = table_size;
  for (unsigned short int i = 0; i < probabilities_cnt; ++i) {
   if (frequencies[i] == -1) {
    negative_index--;
-   (*fse_table)[negative_index].symbol = i;
-   (*fse_table)[negative_index].baseline = 0;
-   (*fse_table)[negative_index].nb_bits = table_log;
-  }
+   fse_table[negative_index].symbol = i;
+   symbol_next[i] = 1;
+  } else symbol_next[i] = frequencies[i];
  }
  unsigned short int update_pos = (table_size >> 1) + (table_size >> 3) + 3;
  unsigned short int tab_pos = 0;
  for (unsigned short int i = 0; i < probabilities_cnt; ++i) {
   for (short int j = 0; j < frequencies[i]; ++j) {
-   (*fse_table)[tab_pos].symbol = i;
+   fse_table[tab_pos].symbol = i;
    tab_pos = (tab_pos + update_pos) & (table_size - 1);
    while (tab_pos >= negative_index) tab_pos = (tab_pos + update_pos) & (table_size - 1);
   }
  }
  if (tab_pos != 0) {
-  XCOMP_SAFE_FREE(*fse_table);
   WARNING_LOG("Tab pos didn't go back to 0: %u.\n", tab_pos);
   return -ZSTD_CORRUPTED_DATA;
  }
- unsigned int* symbol_counter = (unsigned int*) xcomp_calloc(probabilities_cnt, sizeof(unsigned int));
- if (symbol_counter == NULL) {
-  XCOMP_SAFE_FREE(*fse_table);
-  WARNING_LOG("Failed to allocate symbol counter buffer.\n");
-  return -ZSTD_IO_ERROR;
- }
- for (unsigned short int i = 0; i < negative_index; ++i) {
-  unsigned char symbol = (*fse_table)[i].symbol;
-  short int prob = frequencies[symbol];
-  unsigned int symbol_count = symbol_counter[symbol];
-  calc_baseline_and_numbits(table_size, prob, symbol_count, &((*fse_table)[i].baseline), &((*fse_table)[i].nb_bits));
-  if ((*fse_table)[i].nb_bits > table_log) {
-   XCOMP_MULTI_FREE(*fse_table, symbol_counter);
-   WARNING_LOG("An error occurred while building the fse table.\n");
-   return -ZSTD_CORRUPTED_DATA;
-  }
-  symbol_counter[symbol]++;
+ for (unsigned short int i = 0; i < table_size; ++i) {
+  const unsigned short int next_state = symbol_next[fse_table[i].symbol]++;
+  fse_table[i].nb_bits = table_log + 1 - highest_bit(next_state);
+  fse_table[i].baseline = (next_state << fse_table[i].nb_bits) - table_size;
  }
- XCOMP_SAFE_FREE(symbol_counter);
  return ZSTD_NO_ERROR;
 }
-static int read_weights(BitStream* compressed_bit_stream, unsigned char* table_log, unsigned char** weights, unsigned short int* weights_cnt) {
+/// NOTE: weights must fit 256 entries, the last weight is not described as it is implied by the others.
+static int read_weights(BitStream* compressed_bit_stream, unsigned char* weights, unsigned short int* weights_cnt) {
  int err = ZSTD_NO_ERROR;
  unsigned char header_byte = SAFE_BYTE_READ_WITH_CAST(compressed_bit_stream, sizeof(unsigned char), 1, unsigned char, header_byte, 0);
- // Use FSE-Decoding	
+ *weights_cnt = 0;
+ // Use FSE-Decoding
  if (header_byte < 128) {
-  unsigned char* compressed_literals_stream = SAFE_BYTE_READ(compressed_bit_stream, sizeof(unsigned char), header_byte, compressed_literals_stream);
-  BitStream literals_compressed_bit_stream = CREATE_BIT_STREAM(compressed_literals_stream, header_byte);
-  *table_log = bitstream_read_bits(&literals_compressed_bit_stream, 4) + 5;
-  if (*table_log > 6) {
-   WARNING_LOG("Table log exceeds the maximum value of 6: %u.\n", *table_log);
+  unsigned char* compressed_weights = SAFE_BYTE_READ(compressed_bit_stream, sizeof(unsigned char), header_byte, compressed_weights);
+  BitStream weights_description_bit_stream = CREATE_BIT_STREAM(compressed_weights, header_byte);
+  const unsigned char table_log = bitstream_read_bits(&weights_description_bit_stream, 4) + 5;
+  if (table_log > ZSTD_WEIGHTS_MAX_TABLE_LOG) {
+   WARNING_LOG("Table log exceeds the maximum value of %u: %u.\n", ZSTD_WEIGHTS_MAX_TABLE_LOG, table_log);
    return -ZSTD_CORRUPTED_DATA;
   }
-  short int* frequencies = NULL;
+  short int frequencies[256] = {0};
   unsigned short int probabilities_cnt = 0;
-  if ((err = read_probabilities(&literals_compressed_bit_stream, *table_log, 255, &frequencies, &probabilities_cnt)) < 0) {
+  if ((err = read_probabilities(&weights_description_bit_stream, table_log, 255, frequencies, &probabilities_cnt)) < 0) {
    WARNING_LOG("An error occurred while reading the probabilities distribution.\n");
    return err;
   }
-  FSETableEntry* fse_table = NULL;
-  if ((err = fse_build_table(*table_log, frequencies, probabilities_cnt, &fse_table))) {
-   XCOMP_SAFE_FREE(frequencies);
+  FSETableEntry fse_table[1 << ZSTD_WEIGHTS_MAX_TABLE_LOG] = {0};
+  if ((err = fse_build_table(table_log, frequencies, probabilities_cnt, fse_table)) < 0) {
    WARNING_LOG("An error occurred while building the FSE Table.\n");
    return err;
   }
-  XCOMP_SAFE_FREE(frequencies);
-  // Decode the fse encoded weights
-  BitStream weights_compressed_bit_stream = CREATE_REVERSED_BIT_STREAM(literals_compressed_bit_stream.stream + literals_compressed_bit_stream.byte_pos, header_byte - literals_compressed_bit_stream.byte_pos, -(*table_log));
-  do { unsigned char bit_val = reversed_bitstream_read_next_bit(&weights_compressed_bit_stream); if (((&weights_compressed_bit_stream) -> bit_pos == 6) && ((&weights_compressed_bit_stream) -> byte_pos < (&weights_compressed_bit_stream) -> size - 1)) { WARNING_LOG("Padding zeros cannot be more than 7.\n"); err = -ZSTD_CORRUPTED_DATA; break; } else if (bit_val) break; } while(TRUE);
-  if (err < 0) {
-   XCOMP_SAFE_FREE(fse_table);
+  // Decode the fse encoded weights, interleaving two states until the stream overflows
+  BackwardBitReader bit_reader = {0};
+  if ((err = bit_reader_init(&bit_reader, compressed_weights + weights_description_bit_stream.byte_pos, header_byte - weights_description_bit_stream.byte_pos)) < 0) {
+   WARNING_LOG("An error occurred while initializing the weights bitstream.\n");
    return err;
   }
-  unsigned short int even_state = reversed_bitstream_read_bits(&weights_compressed_bit_stream, *table_log);
-  unsigned short int odd_state = reversed_bitstream_read_bits(&weights_compressed_bit_stream, *table_log);
+  unsigned char even_state = bit_reader_read(&bit_reader, table_log);
+  unsigned char odd_state = bit_reader_read(&bit_reader, table_log);
+  bit_reader_reload(&bit_reader);
   while (TRUE) {
-   *weights = (unsigned char*) xcomp_realloc(*weights, sizeof(unsigned char) * (*weights_cnt + 2));
-   if (*weights == NULL) {
-    XCOMP_SAFE_FREE(fse_table);
-    WARNING_LOG("Failed to xcomp_reallocate the weights.\n");
-    return -ZSTD_IO_ERROR;
-   }
-   (*weights)[*weights_cnt] = fse_table[even_state].symbol;
-   even_state = (fse_table)[even_state].baseline + reversed_bitstream_read_bits(&weights_compressed_bit_stream, (fse_table)[even_state].nb_bits);
-   (*weights_cnt)++;
-   if ((*weights)[*weights_cnt - 1] > 11) {
-    XCOMP_MULTI_FREE(fse_table, *weights);
-    WARNING_LOG("An error occurred while decoding the encoded weights.\n");
-    return -ZSTD_CORRUPTED_DATA;
+   if (*weights_cnt > 253) {
+    WARNING_LOG("Too many weights, cannot be more than 255.\n");
+    return -ZSTD_TOO_MANY_LITERALS;
    }
-   if (weights_compressed_bit_stream.bit_pos < 0) {
-    (*weights)[(*weights_cnt)++] = fse_table[odd_state].symbol;
-    if ((*weights)[*weights_cnt - 1] > 11) {
-     XCOMP_MULTI_FREE(fse_table, *weights);
-     WARNING_LOG("An error occurred while decoding the encoded weights.\n");
-     return -ZSTD_CORRUPTED_DATA;
-    }
+   weights[(*weights_cnt)++] = fse_table[even_state].symbol;
+   even_state = fse_table[even_state].baseline + bit_reader_read(&bit_reader, fse_table[even_state].nb_bits);
+   if (bit_reader_reload(&bit_reader) == BIT_READER_OVERFLOW) {
+    weights[(*weights_cnt)++] = fse_table[odd_state].symbol;
     break;
    }
-   (*weights)[(*weights_cnt)++] = fse_table[odd_state].symbol;
-   odd_state = (fse_table)[odd_state].baseline + reversed_bitstream_read_bits(&weights_compressed_bit_stream, (fse_table)[odd_state].nb_bits);
-   if ((*weights)[*weights_cnt - 1] > 11) {
-    XCOMP_MULTI_FREE(fse_table, *weights);
-    WARNING_LOG("An error occurred while decoding the encoded weights.\n");
-    return -ZSTD_CORRUPTED_DATA;
-   }
-   if (weights_compressed_bit_stream.bit_pos < 0) {
-    *weights = (unsigned char*) xcomp_realloc(*weights, sizeof(unsigned char) * (++(*weights_cnt)));
-    if (*weights == NULL) {
-     XCOMP_SAFE_FREE(fse_table);
-     WARNING_LOG("Failed to xcomp_reallocate the weights.\n");
-     return -ZSTD_IO_ERROR;
-    }
-    (*weights)[*weights_cnt - 1] = fse_table[even_state].symbol;
-    if ((*weights)[*weights_cnt - 1] > 11) {
-     XCOMP_MULTI_FREE(fse_table, *weights);
-     WARNING_LOG("An error occurred while decoding the encoded weights.\n");
-     return -ZSTD_CORRUPTED_DATA;
-    }
+   weights[(*weights_cnt)++] = fse_table[odd_state].symbol;
+   odd_state = fse_table[odd_state].baseline + bit_reader_read(&bit_reader, fse_table[odd_state].nb_bits);
+   if (bit_reader_reload(&bit_reader) == BIT_READER_OVERFLOW) {
+    weights[(*weights_cnt)++] = fse_table[even_state].symbol;
     break;
    }
   }
-  XCOMP_SAFE_FREE(fse_table);
-  if (*weights_cnt > 255) {
-   XCOMP_SAFE_FREE(*weights);
-   return -ZSTD_TOO_MANY_LITERALS;
-  }
  } else {
   *weights_cnt = header_byte - 127;
-  *weights = (unsigned char*) xcomp_realloc(*weights, sizeof(unsigned char) * (*weights_cnt));
-  if (*weights == NULL) {
-   WARNING_LOG("Failed to xcomp_reallocate the weights.\n");
-   return -ZSTD_IO_ERROR;
-  }
-  unsigned char temp_byte = SAFE_BYTE_READ_WITH_CAST(compressed_bit_stream, sizeof(unsigned char), 1, unsigned char, temp_byte, 0, *weights);
-  for (unsigned short int i = 0; i < *weights_cnt; ++i) {
-   if ((i % 2) == 0) (*weights)[i] = (temp_byte >> 4) & 0x0F;
-   else {
-    (*weights)[i] = temp_byte & 0x0F;
-    if ((i + 1) < *weights_cnt) {
-     temp_byte = SAFE_BYTE_READ_WITH_CAST(compressed_bit_stream, sizeof(unsigned char), 1, unsigned char, temp_byte, 0, *weights);
-    }
-   }
+  unsigned char* weights_data = SAFE_BYTE_READ(compressed_bit_stream, sizeof(unsigned char), (*weights_cnt + 1) / 2, weights_data);
+  for (unsigned short int i = 0; i < *weights_cnt; ++i) weights[i] = (i % 2) ? weights_data[i / 2] & 0x0F : weights_data[i / 2] >> 4;
+ }
+ for (unsigned short int i = 0; i < *weights_cnt; ++i) {
+  if (weights[i] > ZSTD_HUF_MAX_BITS) {
+   WARNING_LOG("An error occurred while decoding the encoded weights.\n");
+   return -ZSTD_CORRUPTED_DATA;
   }
  }
  return ZSTD_NO_ERROR;
 }
+/// NOTE: the table is indexed by the next max_nb_bits of the stream, each symbol filling 2^(weight - 1) consecutive entries,
+///       ordered by ascending weight and then by ascending symbol, as the shorter codes are the numerically larger ones.
 static int build_huff_table(BitStream* compressed_bit_stream, Workspace* workspace) {
  int err = 0;
  unsigned short int weights_cnt = 0;
- unsigned char* weights = NULL;
- workspace -> hf_tree_desc_size = compressed_bit_stream -> byte_pos;
- if ((err = read_weights(compressed_bit_stream, &(workspace -> table_log), &weights, &weights_cnt)) < 0) {
+ unsigned char weights[256] = {0};
+ workspace -> max_nb_bits = 0;
+ if ((err = read_weights(compressed_bit_stream, weights, &weights_cnt)) < 0) {
   WARNING_LOG("An error occurred while reading the weights!\n");
   return err;
  }
- workspace -> hf_tree_desc_size = compressed_bit_stream -> byte_pos - workspace -> hf_tree_desc_size;
- unsigned int exp_weights_cnt = 0;
+ unsigned int weights_sum = 0;
  for (unsigned short int i = 0; i < weights_cnt; ++i) {
-  if (weights[i] > 0) exp_weights_cnt += 1U << (weights[i] - 1);
- }
- // Infer the last weight and reconstruct the table for decoding of Huffman *state-based* Coding
- // NOTE for Adventurers: Don't be fooled by those monkeys at Meta that specify "Huffman Tree" in their RFC 8878 (sponsored as official reference of ZSTD), and instead use a state-based approach
- // Furthermore, thanks to "zstd-rs" (at "https://github.com/KillingSpark/zstd-rs") for showing what they were actually doing inside their jungle mess of code.
- workspace -> max_nb_bits = highest_bit(exp_weights_cnt);
- weights = xcomp_realloc(weights, sizeof(unsigned char) * (++weights_cnt));
- if (weights == NULL) {
-  WARNING_LOG("Failed to xcomp_reallocate the weights.\n");
-  return -ZSTD_IO_ERROR;
+  if (weights[i] > 0) weights_sum += 1U << (weights[i] - 1);
  }
- weights[weights_cnt - 1] = highest_bit((1 << workspace -> max_nb_bits) - exp_weights_cnt); // Add the hidden literal and its weight
- unsigned short int hf_literals_size = 1 << workspace -> max_nb_bits;
- unsigned short int hf_literals_cnt = 0;
- workspace -> hf_literals = (ZSTDHfEntry*) xcomp_realloc(workspace -> hf_literals, hf_literals_size * sizeof(ZSTDHfEntry));
- if (workspace -> hf_literals == NULL) {
-  XCOMP_SAFE_FREE(weights);
-  WARNING_LOG("Failed to xcomp_reallocate the huff table for literals.\n");
-  return -ZSTD_IO_ERROR;
+ if (weights_sum == 0) {
+  WARNING_LOG("The huffman weights cannot be all zeros.\n");
+  return -ZSTD_CORRUPTED_DATA;
+ }
+ // Infer the last weight, which completes the sum of the weights to the next power of two
+ const unsigned char max_nb_bits = highest_bit(weights_sum);
+ const unsigned int last_weight_value = (1U << max_nb_bits) - weights_sum;
+ if (max_nb_bits > ZSTD_HUF_MAX_BITS || (last_weight_value & (last_weight_value - 1))) {
+  WARNING_LOG("Invalid huffman weights, the max number of bits is %u, while the last weight value is %u.\n", max_nb_bits, last_weight_value);
+  return -ZSTD_CORRUPTED_DATA;
+ }
+ weights[weights_cnt++] = highest_bit(last_weight_value);
+ unsigned int rank_start[ZSTD_HUF_MAX_BITS + 1] = {0};
+ for (unsigned short int i = 0; i < weights_cnt; ++i) {
+  if (weights[i] > 0) rank_start[weights[i]] += 1U << (weights[i] - 1);
+ }
+ unsigned int next_rank_start = 0;
+ for (unsigned char w = 1; w <= max_nb_bits; ++w) {
+  const unsigned int rank_size = rank_start[w];
+  rank_start[w] = next_rank_start;
+  next_rank_start += rank_size;
  }
- mem_set(workspace -> hf_literals, 0, hf_literals_size * sizeof(ZSTDHfEntry));
  for (unsigned short int i = 0; i < weights_cnt; ++i) {
   if (weights[i] == 0) continue;
-  unsigned short int j = 0;
-  unsigned char nb_bits = workspace -> max_nb_bits + 1 - weights[i];
-  while (j < hf_literals_size && ((workspace -> hf_literals)[j].nb_bits >= nb_bits && (workspace -> hf_literals)[j].symbol < i)) ++j;
-  unsigned short int symbols_cnt = 1 << (weights[i] - 1);
-  if (j < hf_literals_cnt) mem_move(workspace -> hf_literals + j + symbols_cnt, workspace -> hf_literals + j, (hf_literals_cnt - j) * sizeof(ZSTDHfEntry));
-  for (unsigned short int s = j; s < j + symbols_cnt; ++s) (workspace -> hf_literals)[s].symbol = i, (workspace -> hf_literals)[s].nb_bits = nb_bits;
-  hf_literals_cnt += symbols_cnt;
- }
- XCOMP_SAFE_FREE(weights);
- if (hf_literals_size != hf_literals_cnt) {
-  XCOMP_SAFE_FREE(workspace -> hf_literals);
-  WARNING_LOG("Mismatch in the hf literals size: %u != %u (expected size).\n", hf_literals_size, hf_literals_cnt);
-  return -ZSTD_CORRUPTED_DATA;
+  const ZSTDHfEntry entry = { .symbol = i, .nb_bits = max_nb_bits + 1 - weights[i] };
+  const unsigned int symbols_cnt = 1U << (weights[i] - 1);
+  for (unsigned int s = rank_start[weights[i]]; s < rank_start[weights[i]] + symbols_cnt; ++s) (workspace -> hf_literals)[s] = entry;
+  rank_start[weights[i]] += symbols_cnt;
  }
+ workspace -> max_nb_bits = max_nb_bits;
  return ZSTD_NO_ERROR;
 }
-static int huff_decode_stream(BitStream* literals_stream, unsigned short int hf_literals_size, unsigned int regenerated_size, Workspace* workspace) {
- int err = 0;
- do { unsigned char bit_val = reversed_bitstream_read_next_bit(literals_stream); if (((literals_stream) -> bit_pos == 6) && ((literals_stream) -> byte_pos < (literals_stream) -> size - 1)) { WARNING_LOG("Padding zeros cannot be more than 7.\n"); err = -ZSTD_CORRUPTED_DATA; break; } else if (bit_val) break; } while(TRUE);
- if (err < 0) return err;
- unsigned short int hf_state = reversed_bitstream_read_bits(literals_stream, workspace -> max_nb_bits);
- while ((literals_stream -> bit_pos > -(workspace -> max_nb_bits)) && (workspace -> literals_cnt < regenerated_size)) {
-  (workspace -> literals)[(workspace -> literals_cnt)++] = (workspace -> hf_literals)[hf_state].symbol;
-  hf_state = ((hf_state << (workspace -> hf_literals)[hf_state].nb_bits) & (hf_literals_size - 1)) | reversed_bitstream_read_bits(literals_stream, (workspace -> hf_literals)[hf_state].nb_bits);
- }
- if (literals_stream -> byte_pos > 0) {
-  WARNING_LOG("Expected empty bitstream, but got still %u bytes inside.\n", literals_stream -> byte_pos);
+static inline unsigned char huff_decode_symbol(BackwardBitReader* bit_reader, const ZSTDHfEntry* hf_literals, unsigned char max_nb_bits) {
+ const ZSTDHfEntry entry = hf_literals[bit_reader_peek(bit_reader, max_nb_bits)];
+ bit_reader_skip(bit_reader, entry.nb_bits);
+ return entry.symbol;
+}
+/// NOTE: four symbols are decoded after each reload, as long as a whole word can be loaded, then the remaining ones one at a time,
+///       and the stream must be exactly consumed by the last of them.
+static int huff_decode_stream(BackwardBitReader* bit_reader, unsigned char* literals, unsigned char* literals_end, const Workspace* workspace) {
+ const ZSTDHfEntry* hf_literals = workspace -> hf_literals;
+ const unsigned char max_nb_bits = workspace -> max_nb_bits;
+ while (literals_end - literals >= 4 && bit_reader_reload(bit_reader) == BIT_READER_UNFINISHED) {
+  literals[0] = huff_decode_symbol(bit_reader, hf_literals, max_nb_bits);
+  literals[1] = huff_decode_symbol(bit_reader, hf_literals, max_nb_bits);
+  literals[2] = huff_decode_symbol(bit_reader, hf_literals, max_nb_bits);
+  literals[3] = huff_decode_symbol(bit_reader, hf_literals, max_nb_bits);
+  literals += 4;
+ }
+ while (literals < literals_end) {
+  const BitReaderStatus status = bit_reader_reload(bit_reader);
+  if (status == BIT_READER_COMPLETED || status == BIT_READER_OVERFLOW) break;
+  *literals++ = huff_decode_symbol(bit_reader, hf_literals, max_nb_bits);
+ }
+ if (literals != literals_end || !bit_reader_is_empty(bit_reader)) {
+  WARNING_LOG("The huffman stream does not match the size of the literals, %ld literals left.\n", (long int) (literals_end - literals));
   return -ZSTD_CORRUPTED_DATA;
  }
  return ZSTD_NO_ERROR;
@@ -1448,93 +2399,108 @@ static int huff_decode_stream(BitStream* literals_stream, unsigned short int hf_
 static int decode_literals(BitStream* compressed_bit_stream, Workspace* workspace, LiteralsSectionHeader lsh) {
  // Decode the literals from the stream/streams
  int err = 0;
+ unsigned char* compressed_literals = SAFE_BYTE_READ(compressed_bit_stream, sizeof(unsigned char), lsh.compressed_size, compressed_literals);
+ BitStream compressed_literals_bit_stream = CREATE_BIT_STREAM(compressed_literals, lsh.compressed_size);
  if (lsh.literals_block_type == COMPRESSED_LITERALS_BLOCK) {
-  if ((err = build_huff_table(compressed_bit_stream, workspace)) < 0) {
+  if ((err = build_huff_table(&compressed_literals_bit_stream, workspace)) < 0) {
    WARNING_LOG("Failed to build the huffman table.\n");
    return -ZSTD_CORRUPTED_DATA;
   }
- } else {
-  workspace -> hf_tree_desc_size = 0;
-  if (workspace -> hf_literals == NULL) {
-   WARNING_LOG("Uninitialized hf_literals for treeless compressed block, either a IO error, or the stream is corrupted.\n");
-   return -ZSTD_CORRUPTED_DATA;
-  }
+ } else if (workspace -> max_nb_bits == 0) {
+  WARNING_LOG("No huffman table from a previous block for the treeless literals block, the stream is corrupted.\n");
+  return -ZSTD_CORRUPTED_DATA;
  }
- unsigned short int hf_literals_size = 1 << workspace -> max_nb_bits;
- unsigned int total_streams_size = lsh.compressed_size - workspace -> hf_tree_desc_size;
+ const unsigned char* streams = compressed_literals + compressed_literals_bit_stream.byte_pos;
+ const unsigned int total_streams_size = lsh.compressed_size - compressed_literals_bit_stream.byte_pos;
+ unsigned char* literals = workspace -> literals_buffer;
  if (lsh.streams_cnt == 1) {
-  unsigned char* literals_stream = SAFE_BYTE_READ(compressed_bit_stream, sizeof(unsigned char), total_streams_size, literals_stream, workspace -> hf_literals);
-  BitStream literals_bit_stream = CREATE_REVERSED_BIT_STREAM(literals_stream, total_streams_size, -(workspace -> max_nb_bits));
-  if (((err = huff_decode_stream(&literals_bit_stream, hf_literals_size, lsh.regenerated_size, workspace)) < 0) || (workspace -> literals_cnt != lsh.regenerated_size)) {
-   XCOMP_SAFE_FREE(workspace -> hf_literals);
+  BackwardBitReader bit_reader = {0};
+  if ((err = bit_reader_init(&bit_reader, streams, total_streams_size)) < 0 || (err = huff_decode_stream(&bit_reader, literals, literals + lsh.regenerated_size, workspace)) < 0) {
    WARNING_LOG("An error occurred while decoding the literals huff encoded stream.\n");
    return err;
   }
- } else {
-  unsigned short int streams_size[4] = {0};
-  unsigned char* streams_size_data = SAFE_BYTE_READ(compressed_bit_stream, sizeof(unsigned short int), 3, streams_size_data, workspace -> hf_literals);
-  mem_cpy(streams_size, streams_size_data, sizeof(unsigned short int) * 3);
-  streams_size[3] = (total_streams_size - 6 - streams_size[0] - streams_size[1] - streams_size[2]);
-  for (unsigned char i = 0; i < 4; ++i) {
-   unsigned char* literals_sub_stream = SAFE_BYTE_READ(compressed_bit_stream, sizeof(unsigned char), streams_size[i], literals_sub_stream, workspace -> hf_literals);
-   BitStream literals_sub_bit_stream = CREATE_REVERSED_BIT_STREAM(literals_sub_stream, streams_size[i], -(workspace -> max_nb_bits));
-   if (compressed_bit_stream -> error) {
-    XCOMP_SAFE_FREE(workspace -> hf_literals);
-    WARNING_LOG("Not enough data for the streams.\n");
-    return -ZSTD_CORRUPTED_DATA;
-   } else if (((err = huff_decode_stream(&literals_sub_bit_stream, hf_literals_size, lsh.regenerated_size, workspace)) < 0) || (literals_sub_bit_stream.bit_pos != -(workspace -> max_nb_bits))) {
-    XCOMP_SAFE_FREE(workspace -> hf_literals);
-    WARNING_LOG("An error occurred while decoding the literals huff encoded in the substream '%u'.\n", i + 1);
-    return -ZSTD_CORRUPTED_DATA;
-   }
+  return ZSTD_NO_ERROR;
+ }
+ // The jump table holds the sizes of the first three streams, while each of them regenerates a segment of the literals, but the last one that gets the rest
+ if (total_streams_size < 6) {
+  WARNING_LOG("Not enough data for the jump table of the streams.\n");
+  return -ZSTD_CORRUPTED_DATA;
+ }
+ unsigned int streams_size[4] = {0};
+ unsigned int streams_size_sum = 6;
+ for (unsigned char i = 0; i < 3; ++i) {
+  streams_size[i] = streams[2 * i] | (streams[2 * i + 1] << 8);
+  streams_size_sum += streams_size[i];
+ }
+ const unsigned int segment_size = (lsh.regenerated_size + 3) / 4;
+ if (streams_size_sum > total_streams_size || 3 * segment_size > lsh.regenerated_size) {
+  WARNING_LOG("Invalid jump table (%u > %u), or too few literals for four streams (%u).\n", streams_size_sum, total_streams_size, lsh.regenerated_size);
+  return -ZSTD_CORRUPTED_DATA;
+ }
+ streams_size[3] = total_streams_size - streams_size_sum;
+ BackwardBitReader bit_readers[4] = {0};
+ unsigned char* segments[4] = {0};
+ unsigned char* segments_end[4] = {0};
+ const unsigned char* stream = streams + 6;
+ for (unsigned char i = 0; i < 4; ++i) {
+  if ((err = bit_reader_init(bit_readers + i, stream, streams_size[i])) < 0) {
+   WARNING_LOG("An error occurred while initializing the literals substream '%u'.\n", i + 1);
+   return err;
   }
-  if (workspace -> literals_cnt != lsh.regenerated_size) {
-   XCOMP_SAFE_FREE(workspace -> hf_literals);
-   WARNING_LOG("Size mismatch between literals_cnt and the expected regenerated size: %u != %u .\n", workspace -> literals_cnt, lsh.regenerated_size);
-   return -ZSTD_CORRUPTED_DATA;
+  stream += streams_size[i];
+  segments[i] = literals + i * segment_size;
+  segments_end[i] = (i == 3) ? literals + lsh.regenerated_size : segments[i] + segment_size;
+ }
+ // Decode the streams interleaved while all of them can load a whole word, as the last segment is the shortest
+ const ZSTDHfEntry* hf_literals = workspace -> hf_literals;
+ const unsigned char max_nb_bits = workspace -> max_nb_bits;
+ while (segments_end[3] - segments[3] >= 4) {
+  if ((bit_reader_reload(bit_readers) | bit_reader_reload(bit_readers + 1) | bit_reader_reload(bit_readers + 2) | bit_reader_reload(bit_readers + 3)) != BIT_READER_UNFINISHED) break;
+  for (unsigned char j = 0; j < 4; ++j) {
+   for (unsigned char i = 0; i < 4; ++i) segments[i][j] = huff_decode_symbol(bit_readers + i, hf_literals, max_nb_bits);
   }
+  for (unsigned char i = 0; i < 4; ++i) segments[i] += 4;
  }
- return err;
+ for (unsigned char i = 0; i < 4; ++i) {
+  if ((err = huff_decode_stream(bit_readers + i, segments[i], segments_end[i], workspace)) < 0) {
+   WARNING_LOG("An error occurred while decoding the literals huff encoded in the substream '%u'.\n", i + 1);
+   return err;
+  }
+ }
+ return ZSTD_NO_ERROR;
 }
 static int parse_literals_section(BitStream* compressed_bit_stream, Workspace* workspace) {
  LiteralsSectionHeader lsh = {0};
  lsh.literals_block_type = bitstream_read_bits(compressed_bit_stream, 2);
- DEBUG_LOG("literals_block_type: '%s'\n", literals_blocks_type_str[lsh.literals_block_type]);
+ TRACE_LOG("literals_block_type: '%s'\n", literals_blocks_type_str[lsh.literals_block_type]);
  unsigned char size_format = bitstream_read_bits(compressed_bit_stream, 2);
  int err = 0;
  if (lsh.literals_block_type == RAW_LITERALS_BLOCK || lsh.literals_block_type == RLE_LITERALS_BLOCK) {
   if (size_format == 0 || size_format == 2) lsh.regenerated_size = (bitstream_read_bits(compressed_bit_stream, 4) << 1) + (size_format >> 1);
   else if (size_format == 1) lsh.regenerated_size = bitstream_read_bits(compressed_bit_stream, 12);
   else lsh.regenerated_size = bitstream_read_bits(compressed_bit_stream, 20);
-  DEBUG_LOG("regenerated_size: %u\n", lsh.regenerated_size);
-  workspace -> literals_cnt = 0;
-  XCOMP_SAFE_FREE(workspace -> literals);
-  workspace -> literals = (unsigned char*) xcomp_calloc(lsh.regenerated_size, sizeof(unsigned char));
-  if (workspace -> literals == NULL) {
-   WARNING_LOG("Failed to allocate literals buffer.\n");
-   return -ZSTD_IO_ERROR;
-  }
-  if (lsh.literals_block_type == RAW_LITERALS_BLOCK) {
-   unsigned char* raw_literals_block_data = SAFE_BYTE_READ(compressed_bit_stream, sizeof(unsigned char), lsh.regenerated_size, raw_literals_block_data);
-   mem_cpy(workspace -> literals, raw_literals_block_data, lsh.regenerated_size);
-  } else {
-   unsigned char rle_literal_val = SAFE_BYTE_READ_WITH_CAST(compressed_bit_stream, sizeof(unsigned char), 1, unsigned char, rle_literal_val, 0);
-   mem_set(workspace -> literals, rle_literal_val, lsh.regenerated_size);
-  }
  } else {
   lsh.regenerated_size = bitstream_read_bits(compressed_bit_stream, ((size_format == 0 || size_format == 1) ? 10 : (size_format == 2 ? 14 : 18)));
   lsh.compressed_size = bitstream_read_bits(compressed_bit_stream, ((size_format == 0 || size_format == 1) ? 10 : (size_format == 2 ? 14 : 18)));
   lsh.streams_cnt = size_format == 0 ? 1 : 4;
-  XCOMP_SAFE_FREE(workspace -> literals);
-  workspace -> literals_cnt = 0;
-  workspace -> literals = (unsigned char*) xcomp_calloc(lsh.regenerated_size, sizeof(unsigned char));
-  if (workspace -> literals == NULL) {
-   WARNING_LOG("Failed to allocate literals buffer.\n");
-   return -ZSTD_IO_ERROR;
-  } else if ((err = decode_literals(compressed_bit_stream, workspace, lsh)) < 0) {
+ }
+ TRACE_LOG("regenerated_size: %u\n", lsh.regenerated_size);
+ if (lsh.regenerated_size > ZSTD_BLOCK_MAX_SIZE) {
+  WARNING_LOG("The literals cannot be more than the block maximum size: %u > %u.\n", lsh.regenerated_size, ZSTD_BLOCK_MAX_SIZE);
+  return -ZSTD_TOO_MANY_LITERALS;
+ }
+ if (lsh.literals_block_type == RAW_LITERALS_BLOCK) {
+  workspace -> literals = SAFE_BYTE_READ(compressed_bit_stream, sizeof(unsigned char), lsh.regenerated_size, workspace -> literals);
+ } else if (lsh.literals_block_type == RLE_LITERALS_BLOCK) {
+  unsigned char rle_literal_val = SAFE_BYTE_READ_WITH_CAST(compressed_bit_stream, sizeof(unsigned char), 1, unsigned char, rle_literal_val, 0);
+  mem_set(workspace -> literals_buffer, rle_literal_val, lsh.regenerated_size);
+  workspace -> literals = workspace -> literals_buffer;
+ } else {
+  if ((err = decode_literals(compressed_bit_stream, workspace, lsh)) < 0) {
    WARNING_LOG("An error occurred while decoding the literals.\n");
    return err;
   }
+  workspace -> literals = workspace -> literals_buffer;
  }
  workspace -> literals_cnt = lsh.regenerated_size;
  return ZSTD_NO_ERROR;
@@ -1542,115 +2508,56 @@ static int parse_literals_section(BitStream* compressed_bit_stream, Workspace* w
 // ---------------------------------------
 //  Sequence Parsing and Decoding Section
 // ---------------------------------------
-static int decode_sequences(BitStream* sequence_compressed_bit_stream, Workspace* workspace) {
- unsigned int ll_state = 0;
- unsigned int ol_state = 0;
- unsigned int ml_state = 0;
- if (workspace -> sequence_section.ll_rle == -1) ll_state = reversed_bitstream_read_bits(sequence_compressed_bit_stream, workspace -> sequence_section.ll_table_log);
- if (workspace -> sequence_section.ol_rle == -1) ol_state = reversed_bitstream_read_bits(sequence_compressed_bit_stream, workspace -> sequence_section.ol_table_log);
- if (workspace -> sequence_section.ml_rle == -1) ml_state = reversed_bitstream_read_bits(sequence_compressed_bit_stream, workspace -> sequence_section.ml_table_log);
- for (unsigned int i = 0; i < workspace -> sequence_len; ++i) {
-  unsigned int ll_code = workspace -> sequence_section.ll_rle == -1 ? (workspace -> sequence_section.ll_fse_table)[ll_state].symbol : workspace -> sequence_section.ll_rle;
-  unsigned int ml_code = workspace -> sequence_section.ml_rle == -1 ? (workspace -> sequence_section.ml_fse_table)[ml_state].symbol : workspace -> sequence_section.ml_rle;
-  unsigned int ol_code = workspace -> sequence_section.ol_rle == -1 ? (workspace -> sequence_section.ol_fse_table)[ol_state].symbol : workspace -> sequence_section.ol_rle;
-  LengthCode ll_actual_codes = *XCOMP_CAST_PTR(ll_codes[ll_code], LengthCode);
-  LengthCode ml_actual_codes = *XCOMP_CAST_PTR(ml_codes[ml_code], LengthCode);
-  if (ol_code > 31) {
-   WARNING_LOG("Offset Length code cannot be bigger than %u: %u\n", 31, ol_code);
+/// NOTE: the table is left as it is for REPEAT_MODE, and the predefined one is rebuilt only if the table was replaced since,
+///       while an RLE table is a single state that reads no bits.
+static int build_sequence_table(BitStream* compressed_bit_stream, CompressionMode mode, FSEDecodingTable* table, const short int* predefined_frequencies, unsigned char predefined_cnt, unsigned char predefined_table_log, unsigned char max_table_log, unsigned char max_symbol) {
+ int err = 0;
+ if (mode == REPEAT_MODE) {
+  if (!table -> is_valid) {
+   WARNING_LOG("No table from a previous block to repeat, the stream is corrupted.\n");
    return -ZSTD_CORRUPTED_DATA;
   }
-        unsigned int offset = reversed_bitstream_read_bits(sequence_compressed_bit_stream, ol_code) + (1U << ol_code);
-  unsigned int ml_add = reversed_bitstream_read_bits(sequence_compressed_bit_stream, ml_actual_codes.num_bits);
-  unsigned int ll_add = reversed_bitstream_read_bits(sequence_compressed_bit_stream, ll_actual_codes.num_bits);
-  if (offset == 0) {
-   WARNING_LOG("Offset cannot be 0.\n");
-   return -ZSTD_CORRUPTED_DATA;
+  return ZSTD_NO_ERROR;
+ } else if (mode == PREDEFINED_MODE && table -> is_predefined) {
+  table -> is_valid = TRUE;
+  return ZSTD_NO_ERROR;
+ }
+ table -> is_valid = FALSE;
+ table -> is_predefined = FALSE;
+ if (mode == PREDEFINED_MODE) {
+  if ((err = fse_build_table(predefined_table_log, predefined_frequencies, predefined_cnt, table -> entries)) < 0) {
+   WARNING_LOG("An error occurred while building the table for predefined.\n");
+   return err;
   }
-  (workspace -> sequences)[i] = (Sequence) {
-   .ll_value = ll_actual_codes.value + ll_add,
-   .ml_value = ml_actual_codes.value + ml_add,
-   .ol_value = offset
-  };
-  if ((i + 1) < workspace -> sequence_len) {
-   if (workspace -> sequence_section.ll_rle == -1) ll_state = (workspace -> sequence_section.ll_fse_table)[ll_state].baseline + reversed_bitstream_read_bits(&*sequence_compressed_bit_stream, (workspace -> sequence_section.ll_fse_table)[ll_state].nb_bits);
-   if (workspace -> sequence_section.ml_rle == -1) ml_state = (workspace -> sequence_section.ml_fse_table)[ml_state].baseline + reversed_bitstream_read_bits(&*sequence_compressed_bit_stream, (workspace -> sequence_section.ml_fse_table)[ml_state].nb_bits);
-   if (workspace -> sequence_section.ol_rle == -1) ol_state = (workspace -> sequence_section.ol_fse_table)[ol_state].baseline + reversed_bitstream_read_bits(&*sequence_compressed_bit_stream, (workspace -> sequence_section.ol_fse_table)[ol_state].nb_bits);
-  }
-  if (sequence_compressed_bit_stream -> error) {
-   XCOMP_SAFE_FREE(workspace -> sequences);
-   WARNING_LOG("Tried to read after the end of the stream.\n");
+  table -> table_log = predefined_table_log;
+  table -> is_predefined = TRUE;
+ } else if (mode == FSE_COMPRESSED_MODE) {
+  table -> table_log = bitstream_read_bits(compressed_bit_stream, 4) + 5;
+  if (table -> table_log > max_table_log) {
+   WARNING_LOG("Table log exceeds the maximum value of %u: %u.\n", max_table_log, table -> table_log);
    return -ZSTD_CORRUPTED_DATA;
   }
- }
- if (!IS_REVERSED_EOS(sequence_compressed_bit_stream)) {
-  XCOMP_SAFE_FREE(workspace -> sequences);
-  WARNING_LOG("Stream not empty.\n");
-  PRINT_BIT_STREAM_INFO(sequence_compressed_bit_stream);
-  return -ZSTD_CORRUPTED_DATA;
- }
- return ZSTD_NO_ERROR;
-}
-static int parse_sequence_section(BitStream* compressed_bit_stream, Workspace* workspace) {
- workspace -> sequence_len = SAFE_BYTE_READ_WITH_CAST(compressed_bit_stream, sizeof(unsigned char), 1, unsigned char, workspace -> sequence_len, 0);
- if (workspace -> sequence_len > 127) {
-  unsigned char first_byte = workspace -> sequence_len;
-  if (first_byte < 255) {
-   workspace -> sequence_len = SAFE_BYTE_READ_WITH_CAST(compressed_bit_stream, sizeof(unsigned char), 1, unsigned char, workspace -> sequence_len, 0);
-  } else {
-   workspace -> sequence_len = SAFE_BYTE_READ_WITH_CAST(compressed_bit_stream, sizeof(unsigned char), 2, unsigned short int, workspace -> sequence_len, 0);
+  short int frequencies[256] = {0};
+  unsigned short int probabilities_cnt = 0;
+  if ((err = read_probabilities(compressed_bit_stream, table -> table_log, max_symbol, frequencies, &probabilities_cnt)) < 0) {
+   WARNING_LOG("An error occurred while reading the probabilities.\n");
+   return err;
+  } else if ((err = fse_build_table(table -> table_log, frequencies, probabilities_cnt, table -> entries)) < 0) {
+   WARNING_LOG("An error occurred while building the table.\n");
+   return err;
   }
-  workspace -> sequence_len += first_byte < 255 ? ((first_byte - 128) << 8) : 0x7F00;
- }
- DEBUG_LOG("sequence_len: %u\n", workspace -> sequence_len);
- if (workspace -> sequence_len == 0) {
-  if (!IS_EOS(compressed_bit_stream)) {
-   WARNING_LOG("Expected end of stream, but the bitstream is not empty: %u bytes left.\n", compressed_bit_stream -> size - compressed_bit_stream -> byte_pos);
+ } else {
+  unsigned char rle_symbol = SAFE_BYTE_READ_WITH_CAST(compressed_bit_stream, sizeof(unsigned char), 1, unsigned char, rle_symbol, 0);
+  if (rle_symbol > max_symbol) {
+   WARNING_LOG("RLE symbol cannot be bigger than %u: %u\n", max_symbol, rle_symbol);
    return -ZSTD_CORRUPTED_DATA;
   }
-  return ZSTD_NO_ERROR;
- }
- SymbolCompressionModes symbol_compression_modes = SAFE_BYTE_READ_WITH_CAST(compressed_bit_stream, sizeof(SymbolCompressionModes), 1, SymbolCompressionModes, symbol_compression_modes, {0});
- if (symbol_compression_modes.reserved != 0) {
-  WARNING_LOG("Use of symbol compression mode reserved field.\n");
-  return -ZSTD_RESERVED_FIELD;
- }
- DEBUG_LOG("SymbolCompressionModes: (0x%X)\n", *XCOMP_CAST_PTR(&symbol_compression_modes, unsigned char));
- DEBUG_LOG(" - literals_length_mode: '%s'\n", compression_modes_str[symbol_compression_modes.literals_len_mode]);
- DEBUG_LOG(" - offset_mode: '%s'\n", compression_modes_str[symbol_compression_modes.offset_mode]);
- DEBUG_LOG(" - match_length_mode: '%s'\n", compression_modes_str[symbol_compression_modes.match_len_mode]);
- // Build the FSE table for each type from predefined distribution or build it from decoded distribution, for RLE recover the single value that compose the entire table
- // For Repeat nothing has to be done, at the moment we are not able to take track of previously used tables
- // Furthermore, for Repeat just check that it can be used, like if this is not the first block and similars
- int err = 0;
- SequenceSection* sequence_section = &(workspace -> sequence_section);
- do { switch (symbol_compression_modes.literals_len_mode) { case PREDEFINED_MODE: { if (sequence_section -> ll_fse_table != NULL) XCOMP_SAFE_FREE(sequence_section -> ll_fse_table); if ((err = fse_build_table(PRED_LL_TABLE_LOG, (short int*)ll_pred_frequencies, XCOMP_ARR_SIZE(ll_pred_frequencies), &(sequence_section -> ll_fse_table))) < 0) { WARNING_LOG("An error occurred while building the table for predefined.\n"); return err; } sequence_section -> ll_table_log = PRED_LL_TABLE_LOG; sequence_section -> ll_rle = -1; break; } case FSE_COMPRESSED_MODE: { if (sequence_section -> ll_fse_table != NULL) XCOMP_SAFE_FREE(sequence_section -> ll_fse_table); sequence_section -> ll_table_log = bitstream_read_bits(compressed_bit_stream, 4) + 5; if (sequence_section -> ll_table_log > LL_MAX_LOG) { WARNING_LOG("Table log exceeds the maximum value of %u: %u.\n", LL_MAX_LOG, sequence_section -> ll_table_log); return -ZSTD_CORRUPTED_DATA; } short int* frequencies = NULL; unsigned short int probabilities_cnt = 0; if ((err = read_probabilities(compressed_bit_stream, sequence_section -> ll_table_log, 35, &frequencies, &probabilities_cnt)) < 0) { WARNING_LOG("An error occurred while reading the probabilities for predefined.\n"); return err; } if ((err = fse_build_table(sequence_section -> ll_table_log, frequencies, probabilities_cnt, &(sequence_section -> ll_fse_table))) < 0) { XCOMP_SAFE_FREE(frequencies); WARNING_LOG("An error occurred while building the table for predefined.\n"); return err; } XCOMP_SAFE_FREE(frequencies); sequence_section -> ll_rle = -1; break; } case RLE_MODE: { sequence_section -> ll_rle = SAFE_BYTE_READ_WITH_CAST(compressed_bit_stream, sizeof(unsigned char), 1, unsigned char, sequence_section -> ll_rle, 0); break; } case REPEAT_MODE: { if (sequence_section -> ll_fse_table == NULL) { WARNING_LOG("Uninitialized " "sequence_section -> ll_fse_table" " either due to a previous IO error, or the stream is actually corrupted.\n"); return -ZSTD_CORRUPTED_DATA; } break; } } } while(FALSE);
- do { switch (symbol_compression_modes.offset_mode) { case PREDEFINED_MODE: { if (sequence_section -> ol_fse_table != NULL) XCOMP_SAFE_FREE(sequence_section -> ol_fse_table); if ((err = fse_build_table(PRED_OL_TABLE_LOG, (short int*)ol_pred_frequencies, XCOMP_ARR_SIZE(ol_pred_frequencies), &(sequence_section -> ol_fse_table))) < 0) { WARNING_LOG("An error occurred while building the table for predefined.\n"); return err; } sequence_section -> ol_table_log = PRED_OL_TABLE_LOG; sequence_section -> ol_rle = -1; break; } case FSE_COMPRESSED_MODE: { if (sequence_section -> ol_fse_table != NULL) XCOMP_SAFE_FREE(sequence_section -> ol_fse_table); sequence_section -> ol_table_log = bitstream_read_bits(compressed_bit_stream, 4) + 5; if (sequence_section -> ol_table_log > OL_MAX_LOG) { WARNING_LOG("Table log exceeds the maximum value of %u: %u.\n", OL_MAX_LOG, sequence_section -> ol_table_log); return -ZSTD_CORRUPTED_DATA; } short int* frequencies = NULL; unsigned short int probabilities_cnt = 0; if ((err = read_probabilities(compressed_bit_stream, sequence_section -> ol_table_log, 31, &frequencies, &probabilities_cnt)) < 0) { WARNING_LOG("An error occurred while reading the probabilities for predefined.\n"); return err; } if ((err = fse_build_table(sequence_section -> ol_table_log, frequencies, probabilities_cnt, &(sequence_section -> ol_fse_table))) < 0) { XCOMP_SAFE_FREE(frequencies); WARNING_LOG("An error occurred while building the table for predefined.\n"); return err; } XCOMP_SAFE_FREE(frequencies); sequence_section -> ol_rle = -1; break; } case RLE_MODE: { sequence_section -> ol_rle = SAFE_BYTE_READ_WITH_CAST(compressed_bit_stream, sizeof(unsigned char), 1, unsigned char, sequence_section -> ol_rle, 0); break; } case REPEAT_MODE: { if (sequence_section -> ol_fse_table == NULL) { WARNING_LOG("Uninitialized " "sequence_section -> ol_fse_table" " either due to a previous IO error, or the stream is actually corrupted.\n"); return -ZSTD_CORRUPTED_DATA; } break; } } } while(FALSE);
- do { switch (symbol_compression_modes.match_len_mode) { case PREDEFINED_MODE: { if (sequence_section -> ml_fse_table != NULL) XCOMP_SAFE_FREE(sequence_section -> ml_fse_table); if ((err = fse_build_table(PRED_ML_TABLE_LOG, (short int*)ml_pred_frequencies, XCOMP_ARR_SIZE(ml_pred_frequencies), &(sequence_section -> ml_fse_table))) < 0) { WARNING_LOG("An error occurred while building the table for predefined.\n"); return err; } sequence_section -> ml_table_log = PRED_ML_TABLE_LOG; sequence_section -> ml_rle = -1; break; } case FSE_COMPRESSED_MODE: { if (sequence_section -> ml_fse_table != NULL) XCOMP_SAFE_FREE(sequence_section -> ml_fse_table); sequence_section -> ml_table_log = bitstream_read_bits(compressed_bit_stream, 4) + 5; if (sequence_section -> ml_table_log > ML_MAX_LOG) { WARNING_LOG("Table log exceeds the maximum value of %u: %u.\n", ML_MAX_LOG, sequence_section -> ml_table_log); return -ZSTD_CORRUPTED_DATA; } short int* frequencies = NULL; unsigned short int probabilities_cnt = 0; if ((err = read_probabilities(compressed_bit_stream, sequence_section -> ml_table_log, 52, &frequencies, &probabilities_cnt)) < 0) { WARNING_LOG("An error occurred while reading the probabilities for predefined.\n"); return err; } if ((err = fse_build_table(sequence_section -> ml_table_log, frequencies, probabilities_cnt, &(sequence_section -> ml_fse_table))) < 0) { XCOMP_SAFE_FREE(frequencies); WARNING_LOG("An error occurred while building the table for predefined.\n"); return err; } XCOMP_SAFE_FREE(frequencies); sequence_section -> ml_rle = -1; break; } case RLE_MODE: { sequence_section -> ml_rle = SAFE_BYTE_READ_WITH_CAST(compressed_bit_stream, sizeof(unsigned char), 1, unsigned char, sequence_section -> ml_rle, 0); break; } case REPEAT_MODE: { if (sequence_section -> ml_fse_table == NULL) { WARNING_LOG("Uninitialized " "sequence_section -> ml_fse_table" " either due to a previous IO error, or the stream is actually corrupted.\n"); return -ZSTD_CORRUPTED_DATA; } break; } } } while(FALSE);
- unsigned int sequence_stream_size = compressed_bit_stream -> size - compressed_bit_stream -> byte_pos;
- unsigned char* sequence_compressed_stream = SAFE_BYTE_READ(compressed_bit_stream, sizeof(unsigned char), sequence_stream_size, sequence_compressed_stream);
- BitStream sequence_compressed_bit_stream = CREATE_REVERSED_BIT_STREAM(sequence_compressed_stream, sequence_stream_size, 0);
- do { unsigned char bit_val = reversed_bitstream_read_next_bit(&sequence_compressed_bit_stream); if (((&sequence_compressed_bit_stream) -> bit_pos == 6) && ((&sequence_compressed_bit_stream) -> byte_pos < (&sequence_compressed_bit_stream) -> size - 1)) { WARNING_LOG("Padding zeros cannot be more than 7.\n"); err = -ZSTD_CORRUPTED_DATA; break; } else if (bit_val) break; } while(TRUE);
- if (err < 0) {
-  WARNING_LOG("An error occurred while parsing the sequence section.\n");
-  return err;
- }
- // Parse the FSE Table as defined in decode_sequences_with_rle in zstd-rs, the price of few branches is feasible as at the moment we value more readability.
- // At each pass it will decode a Sequence, so we need a struct for the Sequences
- XCOMP_SAFE_FREE(workspace -> sequences);
- workspace -> sequences = (Sequence*) xcomp_calloc(workspace -> sequence_len, sizeof(Sequence));
- if (workspace -> sequences == NULL) {
-  WARNING_LOG("Failed to allocate sequences buffer.\n");
-  return -ZSTD_IO_ERROR;
- } else if ((err = decode_sequences(&sequence_compressed_bit_stream, workspace)) < 0) {
-  deallocate_sequence_section(sequence_section);
-  WARNING_LOG("An error occurred while decoding the sequences.\n");
-  return err;
+  (table -> entries)[0] = (FSETableEntry) { .symbol = rle_symbol, .nb_bits = 0, .baseline = 0 };
+  table -> table_log = 0;
  }
+ table -> is_valid = TRUE;
  return ZSTD_NO_ERROR;
 }
-// ----------------------------
-//  Sequence Execution Section
-// ----------------------------
 static unsigned int update_off_history(unsigned int* offset_history, unsigned int offset, unsigned int ll_value) {
  unsigned int actual_offset = 0;
  if (offset > 3) actual_offset = offset - 3;
@@ -1668,56 +2575,130 @@ static unsigned int update_off_history(unsigned int* offset_history, unsigned in
  }
  return actual_offset;
 }
-static int sequence_execution(Workspace* workspace) {
- if (workspace -> sequence_len == 0) {
-  mem_cpy(workspace -> frame_buffer + workspace -> frame_buffer_len, workspace -> literals, workspace -> literals_cnt);
-  workspace -> frame_buffer_len += workspace -> literals_cnt;
-  return ZSTD_NO_ERROR;
- }
- unsigned int literals_ind = 0;
- unsigned int sequence_cnt = 0;
- unsigned int original_frame_len = workspace -> frame_buffer_len;
- unsigned int* offset_history = workspace -> offset_history;
- if (offset_history == NULL) {
-  WARNING_LOG("Uninitialized offset history.\n");
-  return -ZSTD_IO_ERROR;
+/// NOTE: the literals never overlap the frame buffer, so they are copied a word at a time.
+static inline void copy_literals(unsigned char* dest, const unsigned char* literals, unsigned int length) {
+ unsigned int i = 0;
+ for (; i + 8 <= length; i += 8) xcomp_store_64(dest + i, xcomp_load_64(literals + i));
+ for (; i < length; ++i) dest[i] = literals[i];
+ return;
+}
+/// NOTE: each sequence is executed as soon as it is decoded, so that the literals and the match land in the frame buffer
+///       without storing the sequences, the bits of a sequence and of the next states never exceed the 57 bits left after a reload.
+static int decode_sequences(const unsigned char* sequences_stream, unsigned int size, unsigned int sequences_cnt, Workspace* workspace) {
+ int err = 0;
+ BackwardBitReader bit_reader = {0};
+ if ((err = bit_reader_init(&bit_reader, sequences_stream, size)) < 0) {
+  WARNING_LOG("An error occurred while initializing the sequences bitstream.\n");
+  return err;
  }
- for (unsigned int i = 0; i < workspace -> sequence_len; ++i) {
-  Sequence sequence = workspace -> sequences[i];
-  if (sequence.ll_value > 0) {
-   if (sequence.ll_value + literals_ind > workspace -> literals_cnt) {
-    WARNING_LOG("Literals length value makes index out of range (%u > %u).\n", (sequence.ll_value + literals_ind), workspace -> literals_cnt);
-    return -ZSTD_CORRUPTED_DATA;
-   }
-   mem_cpy(workspace -> frame_buffer + workspace -> frame_buffer_len, workspace -> literals + literals_ind, sequence.ll_value);
-   literals_ind += sequence.ll_value;
-   workspace -> frame_buffer_len += sequence.ll_value;
-   sequence_cnt += sequence.ll_value;
-  }
-  unsigned int offset = update_off_history(offset_history, sequence.ol_value, sequence.ll_value);
-  if (offset == 0) {
-   WARNING_LOG("Actual offset cannot be zero.\n");
+ const FSETableEntry* ll_table = workspace -> ll_table.entries;
+ const FSETableEntry* ml_table = workspace -> ml_table.entries;
+ const FSETableEntry* ol_table = workspace -> ol_table.entries;
+ unsigned int ll_state = bit_reader_read(&bit_reader, workspace -> ll_table.table_log);
+ unsigned int ol_state = bit_reader_read(&bit_reader, workspace -> ol_table.table_log);
+ unsigned int ml_state = bit_reader_read(&bit_reader, workspace -> ml_table.table_log);
+ bit_reader_reload(&bit_reader);
+ const unsigned char* literals = workspace -> literals;
+ const unsigned char* const literals_end = literals + workspace -> literals_cnt;
+ unsigned char* const frame_start = workspace -> frame_buffer;
+ unsigned char* const frame_end = frame_start + workspace -> frame_buffer_capacity;
+ unsigned char* dest = frame_start + workspace -> frame_buffer_len;
+ for (unsigned int i = 0; i < sequences_cnt; ++i) {
+  const FSETableEntry ll_entry = ll_table[ll_state];
+  const FSETableEntry ml_entry = ml_table[ml_state];
+  const FSETableEntry ol_entry = ol_table[ol_state];
+  const unsigned int offset = (1U << ol_entry.symbol) + bit_reader_read(&bit_reader, ol_entry.symbol);
+  const unsigned int ml_value = ml_codes[ml_entry.symbol][0] + bit_reader_read(&bit_reader, ml_codes[ml_entry.symbol][1]);
+  bit_reader_reload(&bit_reader);
+  const unsigned int ll_value = ll_codes[ll_entry.symbol][0] + bit_reader_read(&bit_reader, ll_codes[ll_entry.symbol][1]);
+  if ((i + 1) < sequences_cnt) {
+   ll_state = ll_entry.baseline + bit_reader_read(&bit_reader, ll_entry.nb_bits);
+   ml_state = ml_entry.baseline + bit_reader_read(&bit_reader, ml_entry.nb_bits);
+   ol_state = ol_entry.baseline + bit_reader_read(&bit_reader, ol_entry.nb_bits);
+   bit_reader_reload(&bit_reader);
+  }
+  if (ll_value > (unsigned int) (literals_end - literals)) {
+   WARNING_LOG("Literals length value makes index out of range (%u > %ld).\n", ll_value, (long int) (literals_end - literals));
+   return -ZSTD_CORRUPTED_DATA;
+  } else if (ll_value > (unsigned int) (frame_end - dest) || ml_value > (unsigned int) (frame_end - dest) - ll_value) {
+   WARNING_LOG("The sequence overflows the frame buffer (%u + %u > %ld).\n", ll_value, ml_value, (long int) (frame_end - dest));
    return -ZSTD_CORRUPTED_DATA;
   }
-  if (sequence.ml_value > 0) {
-   unsigned int current_pos = workspace -> frame_buffer_len;
-   if (((long int) current_pos - offset) < 0LL) {
-    WARNING_LOG("Offset makes negative index into literals: %ld.\n", ((long int) current_pos - offset));
-    return -ZSTD_CORRUPTED_DATA;
-   }
-   for (unsigned int i = 0; i < sequence.ml_value; ++i) (workspace -> frame_buffer)[(workspace -> frame_buffer_len)++] = (workspace -> frame_buffer)[current_pos + i - offset];
-   sequence_cnt += sequence.ml_value;
+  copy_literals(dest, literals, ll_value);
+  literals += ll_value;
+  dest += ll_value;
+  const unsigned int actual_offset = update_off_history(workspace -> offset_history, offset, ll_value);
+  if (actual_offset == 0 || actual_offset > (unsigned int) (dest - frame_start)) {
+   WARNING_LOG("Invalid offset %u, with %ld bytes decoded.\n", actual_offset, (long int) (dest - frame_start));
+   return -ZSTD_CORRUPTED_DATA;
   }
+  xcomp_copy_match(dest, actual_offset, ml_value);
+  dest += ml_value;
  }
- if (literals_ind < workspace -> literals_cnt) {
-  mem_cpy(workspace -> frame_buffer + workspace -> frame_buffer_len, workspace -> literals + literals_ind, workspace -> literals_cnt - literals_ind);
-  workspace -> frame_buffer_len += workspace -> literals_cnt - literals_ind;
-  sequence_cnt += workspace -> literals_cnt - literals_ind;
+ if (!bit_reader_is_empty(&bit_reader)) {
+  WARNING_LOG("Stream not empty.\n");
+  return -ZSTD_CORRUPTED_DATA;
  }
- if (sequence_cnt != (workspace -> frame_buffer_len - original_frame_len)) {
-  WARNING_LOG("Size mismatch between sequence_cnt: %u and the decoded len: %u\n", sequence_cnt, (workspace -> frame_buffer_len - original_frame_len));
+ // The literals left after the last sequence are appended as they are
+ if ((unsigned int) (literals_end - literals) > (unsigned int) (frame_end - dest)) {
+  WARNING_LOG("The last literals overflow the frame buffer (%ld > %ld).\n", (long int) (literals_end - literals), (long int) (frame_end - dest));
   return -ZSTD_CORRUPTED_DATA;
  }
+ copy_literals(dest, literals, literals_end - literals);
+ dest += literals_end - literals;
+ workspace -> frame_buffer_len = dest - frame_start;
+ return ZSTD_NO_ERROR;
+}
+static int parse_sequence_section(BitStream* compressed_bit_stream, Workspace* workspace) {
+ unsigned int sequences_cnt = SAFE_BYTE_READ_WITH_CAST(compressed_bit_stream, sizeof(unsigned char), 1, unsigned char, sequences_cnt, 0);
+ if (sequences_cnt > 127) {
+  unsigned char first_byte = sequences_cnt;
+  if (first_byte < 255) {
+   sequences_cnt = SAFE_BYTE_READ_WITH_CAST(compressed_bit_stream, sizeof(unsigned char), 1, unsigned char, sequences_cnt, 0);
+  } else {
+   sequences_cnt = SAFE_BYTE_READ_WITH_CAST(compressed_bit_stream, sizeof(unsigned char), 2, unsigned short int, sequences_cnt, 0);
+  }
+  sequences_cnt += first_byte < 255 ? ((first_byte - 128) << 8) : 0x7F00;
+ }
+ TRACE_LOG("sequences_cnt: %u\n", sequences_cnt);
+ if (sequences_cnt == 0) {
+  if (!IS_EOS(compressed_bit_stream)) {
+   WARNING_LOG("Expected end of stream, but the bitstream is not empty: %u bytes left.\n", compressed_bit_stream -> size - compressed_bit_stream -> byte_pos);
+   return -ZSTD_CORRUPTED_DATA;
+  } else if (workspace -> literals_cnt > workspace -> frame_buffer_capacity - workspace -> frame_buffer_len) {
+   WARNING_LOG("The literals overflow the frame buffer (%u > %u).\n", workspace -> frame_buffer_len + workspace -> literals_cnt, workspace -> frame_buffer_capacity);
+   return -ZSTD_CORRUPTED_DATA;
+  }
+  copy_literals(workspace -> frame_buffer + workspace -> frame_buffer_len, workspace -> literals, workspace -> literals_cnt);
+  workspace -> frame_buffer_len += workspace -> literals_cnt;
+  return ZSTD_NO_ERROR;
+ }
+ SymbolCompressionModes symbol_compression_modes = SAFE_BYTE_READ_WITH_CAST(compressed_bit_stream, sizeof(SymbolCompressionModes), 1, SymbolCompressionModes, symbol_compression_modes, {0});
+ if (symbol_compression_modes.reserved != 0) {
+  WARNING_LOG("Use of symbol compression mode reserved field.\n");
+  return -ZSTD_RESERVED_FIELD;
+ }
+ TRACE_LOG("SymbolCompressionModes: (0x%X)\n", *XCOMP_CAST_PTR(&symbol_compression_modes, unsigned char));
+ TRACE_LOG(" - literals_length_mode: '%s'\n", compression_modes_str[symbol_compression_modes.literals_len_mode]);
+ TRACE_LOG(" - offset_mode: '%s'\n", compression_modes_str[symbol_compression_modes.offset_mode]);
+ TRACE_LOG(" - match_length_mode: '%s'\n", compression_modes_str[symbol_compression_modes.match_len_mode]);
+ int err = 0;
+ if ((err = build_sequence_table(compressed_bit_stream, symbol_compression_modes.literals_len_mode, &(workspace -> ll_table), ll_pred_frequencies, XCOMP_ARR_SIZE(ll_pred_frequencies), PRED_LL_TABLE_LOG, LL_MAX_LOG, 35)) < 0) {
+  WARNING_LOG("An error occurred while building the literals length table.\n");
+  return err;
+ } else if ((err = build_sequence_table(compressed_bit_stream, symbol_compression_modes.offset_mode, &(workspace -> ol_table), ol_pred_frequencies, XCOMP_ARR_SIZE(ol_pred_frequencies), PRED_OL_TABLE_LOG, OL_MAX_LOG, 31)) < 0) {
+  WARNING_LOG("An error occurred while building the offset table.\n");
+  return err;
+ } else if ((err = build_sequence_table(compressed_bit_stream, symbol_compression_modes.match_len_mode, &(workspace -> ml_table), ml_pred_frequencies, XCOMP_ARR_SIZE(ml_pred_frequencies), PRED_ML_TABLE_LOG, ML_MAX_LOG, 52)) < 0) {
+  WARNING_LOG("An error occurred while building the match length table.\n");
+  return err;
+ }
+ unsigned int sequences_stream_size = compressed_bit_stream -> size - compressed_bit_stream -> byte_pos;
+ unsigned char* sequences_stream = SAFE_BYTE_READ(compressed_bit_stream, sizeof(unsigned char), sequences_stream_size, sequences_stream);
+ if ((err = decode_sequences(sequences_stream, sequences_stream_size, sequences_cnt, workspace)) < 0) {
+  WARNING_LOG("An error occurred while decoding the sequences.\n");
+  return err;
+ }
  return ZSTD_NO_ERROR;
 }
 // ----------------------------------------------
@@ -1729,72 +2710,67 @@ static int decompress_block(BitStream* compressed_bit_stream, Workspace* workspa
   WARNING_LOG("An error occurred while parsing the literals section.\n");
   return err;
  }
- // Use the Literals to decode the sequence section
+ // Use the Literals to decode and execute the sequence section
  if ((err = parse_sequence_section(compressed_bit_stream, workspace))) {
   WARNING_LOG("An error occurred while parsing the sequence section.\n");
   return err;
  }
- if ((err = sequence_execution(workspace)) < 0) {
-  WARNING_LOG("An error occurred while performing sequence execution.\n");
-  return err;
+ return ZSTD_NO_ERROR;
+}
+/// NOTE: the frame buffer grows to fit size more bytes, unless it is owned by the caller, which bounds it to its capacity.
+static int reserve_frame_buffer(Workspace* workspace, unsigned int size) {
+ if (workspace -> frame_buffer_len + size <= workspace -> frame_buffer_capacity) return ZSTD_NO_ERROR;
+ else if (workspace -> is_caller_data) {
+  WARNING_LOG("The decompressed data does not fit in the buffer of %u bytes.\n", workspace -> frame_buffer_capacity);
+  return -ZSTD_DECOMPRESSED_SIZE_MISMATCH;
+ }
+ unsigned char* frame_buffer = (unsigned char*) xcomp_realloc(workspace -> frame_buffer, (workspace -> frame_buffer_len + size) * sizeof(unsigned char));
+ if (frame_buffer == NULL) {
+  WARNING_LOG("Failed to xcomp_reallocate frame buffer.\n");
+  return -ZSTD_IO_ERROR;
  }
+ workspace -> frame_buffer = frame_buffer;
+ workspace -> frame_buffer_capacity = workspace -> frame_buffer_len + size;
  return ZSTD_NO_ERROR;
 }
 static int parse_block(BitStream* bit_stream, Workspace* workspace, unsigned int block_maximum_size) {
  BlockHeader block_header = SAFE_BYTE_READ_WITH_CAST(bit_stream, sizeof(BlockHeader), 1, BlockHeader, block_header, {0});
- DEBUG_LOG("BlockHeader: (0x%X)\n", *XCOMP_CAST_PTR(&block_header, unsigned int));
- DEBUG_LOG(" - last_block: %u\n", block_header.last_block);
- DEBUG_LOG(" - block_type: '%s'\n", block_types_str[block_header.block_type]);
- DEBUG_LOG(" - block_size: %u\n", block_header.block_size);
+ TRACE_LOG("BlockHeader: (0x%X)\n", *XCOMP_CAST_PTR(&block_header, unsigned int));
+ TRACE_LOG(" - last_block: %u\n", block_header.last_block);
+ TRACE_LOG(" - block_type: '%s'\n", block_types_str[block_header.block_type]);
+ TRACE_LOG(" - block_size: %u\n", block_header.block_size);
  if (block_header.block_type == RESERVED_TYPE) return -ZSTD_RESERVED;
+ int err = 0;
  if (block_header.block_type == RAW_BLOCK) {
-  if (workspace -> frame_buffer_len + block_header.block_size) {
-   workspace -> frame_buffer = (unsigned char*) xcomp_realloc(workspace -> frame_buffer, (workspace -> frame_buffer_len + block_header.block_size) * sizeof(unsigned char));
-   if (workspace -> frame_buffer == NULL) {
-    WARNING_LOG("Failed to xcomp_reallocate frame buffer.\n");
-    return -ZSTD_IO_ERROR;
-   }
+  if (block_header.block_size) {
+   if ((err = reserve_frame_buffer(workspace, block_header.block_size)) < 0) return err;
    unsigned char* raw_block_data = SAFE_BYTE_READ(bit_stream, sizeof(unsigned char), block_header.block_size, raw_block_data);
    mem_cpy(workspace -> frame_buffer + workspace -> frame_buffer_len, raw_block_data, block_header.block_size * sizeof(unsigned char));
    workspace -> frame_buffer_len += block_header.block_size;
   }
  } else if (block_header.block_type == RLE_BLOCK) {
-  workspace -> frame_buffer = (unsigned char*) xcomp_realloc(workspace -> frame_buffer, (workspace -> frame_buffer_len + block_header.block_size) * sizeof(unsigned char));
-  if (workspace -> frame_buffer == NULL) {
-   WARNING_LOG("Failed to xcomp_reallocate frame buffer.\n");
-   return -ZSTD_IO_ERROR;
-  }
+  if ((err = reserve_frame_buffer(workspace, block_header.block_size)) < 0) return err;
   unsigned char rle_val = SAFE_BYTE_READ_WITH_CAST(bit_stream, sizeof(unsigned char), 1, unsigned char, rle_val, 0);
   mem_set(workspace -> frame_buffer + workspace -> frame_buffer_len, rle_val, block_header.block_size * sizeof(unsigned char));
   workspace -> frame_buffer_len += block_header.block_size;
  } else {
-  workspace -> frame_buffer = (unsigned char*) xcomp_realloc(workspace -> frame_buffer, (workspace -> frame_buffer_len + block_maximum_size) * sizeof(unsigned char));
-  if (workspace -> frame_buffer == NULL) {
-   WARNING_LOG("Failed to xcomp_reallocate frame buffer.\n");
-   return -ZSTD_IO_ERROR;
-  }
+  // The caller buffer is bounded by its capacity, while the regenerated size of the block is checked as it is executed
+  if (!workspace -> is_caller_data && (err = reserve_frame_buffer(workspace, block_maximum_size)) < 0) return err;
   unsigned char* compressed_stream = SAFE_BYTE_READ(bit_stream, sizeof(unsigned char), block_header.block_size, compressed_stream);
   BitStream compressed_bit_stream = CREATE_BIT_STREAM(compressed_stream, block_header.block_size);
-  int err = 0;
   if ((err = decompress_block(&compressed_bit_stream, workspace)) < 0) {
-   XCOMP_SAFE_FREE(workspace -> frame_buffer);
    WARNING_LOG("An error occurred while decompressing the block.\n");
    return err;
   }
-  workspace -> frame_buffer = (unsigned char*) xcomp_realloc(workspace -> frame_buffer, workspace -> frame_buffer_len * sizeof(unsigned char));
-  if (workspace -> frame_buffer == NULL && workspace -> frame_buffer_len != 0) {
-   WARNING_LOG("Failed to xcomp_reallocate frame buffer.\n");
-   return -ZSTD_IO_ERROR;
-  }
  }
  return block_header.last_block; // Return the information to the frame parser
 }
-static int parse_frames(BitStream* bit_stream, unsigned char** decompressed_data, unsigned int* decompressed_data_length) {
+static int parse_frames(BitStream* bit_stream, unsigned char** decompressed_data, unsigned int* decompressed_data_length, unsigned char is_caller_data, unsigned int decompressed_data_capacity, unsigned char verify_checksum) {
  unsigned int magic = SAFE_BYTE_READ_WITH_CAST(bit_stream, sizeof(unsigned int), 1, unsigned int, magic, 0);
- DEBUG_LOG("magic: 0x%X\n", magic);
+ TRACE_LOG("magic: 0x%X\n", magic);
  if (0x184D2A50 <= magic && magic <= 0x184D2A5F) {
   unsigned int frame_len = SAFE_BYTE_READ_WITH_CAST(bit_stream, sizeof(unsigned int), 1, unsigned int, frame_len, 0);
-  DEBUG_LOG("Skipping 'skippable frame' with length %u found!\n", frame_len);
+  TRACE_LOG("Skipping 'skippable frame' with length %u found!\n", frame_len);
   unsigned char* skipped_data = SAFE_BYTE_READ(bit_stream, sizeof(unsigned char), frame_len, skipped_data);
   UNUSED_VAR(skipped_data);
   return ZSTD_NO_ERROR;
@@ -1823,7 +2799,7 @@ static int parse_frames(BitStream* bit_stream, unsigned char** decompressed_data
   return -ZSTD_UNSUPPORTED_FEATURE;
  }
  unsigned char frame_content_size_len = (fhd.frame_content_size_flag == 0 ? fhd.single_segment_flag : 1 << fhd.frame_content_size_flag);
- DEBUG_LOG("frame_content_size_len: %u\n", frame_content_size_len);
+ TRACE_LOG("frame_content_size_len: %u\n", frame_content_size_len);
  unsigned long long int frame_content_size = 0;
  if (frame_content_size_len) {
   unsigned char* frame_content_size_data = SAFE_BYTE_READ(bit_stream, frame_content_size_len, 1, frame_content_size_data);
@@ -1831,20 +2807,34 @@ static int parse_frames(BitStream* bit_stream, unsigned char** decompressed_data
   if (frame_content_size_len == 2) frame_content_size += 256;
  }
  if (fhd.single_segment_flag) window_size = frame_content_size;
- DEBUG_LOG("Frame Header:\n");
- DEBUG_LOG(" - window_size: %llu\n", window_size);
- DEBUG_LOG(" - frame_content_size: %llu\n", frame_content_size);
- // Define the workspace for this frame
- unsigned int offset_history[] = {1, 4, 8};
- Workspace workspace = {0};
- workspace.offset_history = offset_history;
+ TRACE_LOG("Frame Header:\n");
+ TRACE_LOG(" - window_size: %llu\n", window_size);
+ TRACE_LOG(" - frame_content_size: %llu\n", frame_content_size);
+ // Reset the workspace of this thread for the frame, the tables of the previous frames cannot be repeated
+ Workspace* workspace = get_zstd_workspace();
+ if (workspace == NULL) return -ZSTD_IO_ERROR;
+ workspace -> offset_history[0] = 1, workspace -> offset_history[1] = 4, workspace -> offset_history[2] = 8;
+ workspace -> frame_buffer = NULL;
+ workspace -> frame_buffer_len = 0;
+ workspace -> frame_buffer_capacity = 0;
+ workspace -> is_caller_data = FALSE;
+ workspace -> ll_table.is_valid = workspace -> ml_table.is_valid = workspace -> ol_table.is_valid = FALSE;
+ workspace -> max_nb_bits = 0;
+ workspace -> literals = NULL;
+ workspace -> literals_cnt = 0;
+ // The frame is decoded in place right after the previous frames when the buffer is owned by the caller
+ if (is_caller_data) {
+  workspace -> frame_buffer = *decompressed_data + *decompressed_data_length;
+  workspace -> frame_buffer_capacity = decompressed_data_capacity - *decompressed_data_length;
+  workspace -> is_caller_data = TRUE;
+ }
  int err = 0;
  unsigned int blocks_cnt = 0;
  do {
-  DEBUG_LOG("Parsing data block num %u\n", blocks_cnt);
+  TRACE_LOG("Parsing data block num %u\n", blocks_cnt);
   // Previous decoded data, up to a distance of Window_Size, or the beginning of the Frame, whichever is smaller. Single_Segment_Flag will be set in the latter case.
-  if ((err = parse_block(bit_stream, &workspace, MAX(window_size, (128 * 1024)))) < 0) {
-   deallocate_workspace(&workspace);
+  if ((err = parse_block(bit_stream, workspace, MAX(window_size, (128 * 1024)))) < 0) {
+   deallocate_workspace(workspace);
    WARNING_LOG("An error occurred while decoding a block.\n");
    return err;
   }
@@ -1852,30 +2842,33 @@ static int parse_frames(BitStream* bit_stream, unsigned char** decompressed_data
  } while (err != 1);
  if (fhd.content_checksum_flag) {
   unsigned int frame_checksum = SAFE_BYTE_READ_WITH_CAST(bit_stream, sizeof(unsigned int), 1, unsigned int, frame_checksum, 0);
-  DEBUG_LOG("frame checksum: 0x%X\n", frame_checksum);
-  u64 decoded_checksum = xxhash64(workspace.frame_buffer, workspace.frame_buffer_len, 0) & 0xFFFFFFFF;
+  TRACE_LOG("frame checksum: 0x%X\n", frame_checksum);
+  // The checksum is consumed even when it is not verified, as the next frame follows it
+  u64 decoded_checksum = verify_checksum ? xxhash64(workspace -> frame_buffer, workspace -> frame_buffer_len, 0) & 0xFFFFFFFF : frame_checksum;
   if (decoded_checksum != frame_checksum) {
-   DEBUG_LOG("data(%u): '%.*s'\n", workspace.frame_buffer_len, workspace.frame_buffer_len, workspace.frame_buffer);
-   deallocate_workspace(&workspace);
+   TRACE_LOG("data(%u): '%.*s'\n", workspace -> frame_buffer_len, workspace -> frame_buffer_len, workspace -> frame_buffer);
+   deallocate_workspace(workspace);
    WARNING_LOG("The checksum of the frame doesn't match with the one found at the end of the frame (0x%llX != 0x%X).\n", decoded_checksum, frame_checksum);
    return -ZSTD_CHECKSUM_FAIL;
   }
  }
- if (workspace.frame_buffer_len) {
-  *decompressed_data = (unsigned char*) xcomp_realloc(*decompressed_data, (*decompressed_data_length + workspace.frame_buffer_len) * sizeof(unsigned char));
+ if (is_caller_data) {
+  *decompressed_data_length += workspace -> frame_buffer_len;
+ } else if (workspace -> frame_buffer_len) {
+  *decompressed_data = (unsigned char*) xcomp_realloc(*decompressed_data, (*decompressed_data_length + workspace -> frame_buffer_len) * sizeof(unsigned char));
   if (*decompressed_data == NULL) {
-   deallocate_workspace(&workspace);
+   deallocate_workspace(workspace);
    WARNING_LOG("Failed to xcomp_reallocate the decompressed data buffer.\n");
    return -ZSTD_IO_ERROR;
   }
-  mem_cpy(*decompressed_data + *decompressed_data_length, workspace.frame_buffer, workspace.frame_buffer_len);
-  *decompressed_data_length += workspace.frame_buffer_len;
+  mem_cpy(*decompressed_data + *decompressed_data_length, workspace -> frame_buffer, workspace -> frame_buffer_len);
+  *decompressed_data_length += workspace -> frame_buffer_len;
  }
- deallocate_workspace(&workspace);
+ deallocate_workspace(workspace);
  return ZSTD_NO_ERROR;
 }
 /* ---------------------------------------------------------------------------------------------------------- */
-unsigned char* zstd_inflate(unsigned char* stream, unsigned int size, unsigned int* decompressed_data_length, int* zstd_err) {
+unsigned char* zstd_inflate(unsigned char* stream, unsigned int size, unsigned int* decompressed_data_length, int* zstd_err, unsigned char verify_checksum) {
  unsigned char* decompressed_data = (unsigned char*) xcomp_calloc(1, sizeof(unsigned char));
  if (decompressed_data == NULL) {
   XCOMP_SAFE_FREE(stream);
@@ -1888,8 +2881,8 @@ unsigned char* zstd_inflate(unsigned char* stream, unsigned int size, unsigned i
  unsigned long int expected_decompression_size = (*decompressed_data_length > 0) ? *decompressed_data_length : 0x1FFFFFFFF;
  *decompressed_data_length = 0;
  do {
-  DEBUG_LOG("Parsing frame num %u:\n", frames_cnt);
-  if ((*zstd_err = parse_frames(&bit_stream, &decompressed_data, decompressed_data_length))) {
+  TRACE_LOG("Parsing frame num %u:\n", frames_cnt);
+  if ((*zstd_err = parse_frames(&bit_stream, &decompressed_data, decompressed_data_length, FALSE, 0, verify_checksum))) {
    XCOMP_MULTI_FREE(stream, decompressed_data);
    return ((unsigned char*) "An error occurred while parsing the frame.\n");
   }
@@ -1903,6 +2896,21 @@ unsigned char* zstd_inflate(unsigned char* stream, unsigned int size, unsigned i
  XCOMP_SAFE_FREE(stream);
  return decompressed_data;
 }
+int zstd_inflate_into(unsigned char* dst, unsigned int dst_capacity, const unsigned char* src, unsigned int src_len, unsigned int* decompressed_data_length, unsigned char verify_checksum) {
+ int err = 0;
+ unsigned int frames_cnt = 0;
+ BitStream bit_stream = CREATE_BIT_STREAM((unsigned char*) src, src_len);
+ *decompressed_data_length = 0;
+ do {
+  TRACE_LOG("Parsing frame num %u:\n", frames_cnt);
+  if ((err = parse_frames(&bit_stream, &dst, decompressed_data_length, TRUE, dst_capacity, verify_checksum))) {
+   WARNING_LOG("An error occurred while parsing the frame.\n");
+   return err;
+  }
+  frames_cnt++;
+ } while (!IS_EOS(&bit_stream) && !bit_stream.error && *decompressed_data_length < dst_capacity);
+ return ZSTD_NO_ERROR;
+}
 /* Copyright (C) 1991-2025 Free Software Foundation, Inc.
    This file is part of the GNU C Library.
 
@@ -1957,6 +2965,17 @@ unsigned char* zstd_inflate(unsigned char* stream, unsigned int size, unsigned i
 // -----------------
 //  Constant Values 
 // -----------------
+typedef enum {
+ ZLIB_STORE_LEVEL   = 0,
+ ZLIB_DEFAULT_LEVEL = 6,
+ ZLIB_MAX_LEVEL     = 9,
+ ZLIB_HASH_BITS     = 15,
+ ZLIB_MIN_MATCH     = 3,
+ ZLIB_MAX_MATCH     = 258,
+ ZLIB_MAX_DISTANCE  = 32768,
+ ZLIB_TOO_FAR       = 4096,
+ ZLIB_SKIP_SHIFT    = 5
+} ZlibConstants;
 /* -------------------------------------------------------------------------------------------------------- */
 // -------
 //  Enums
@@ -2095,23 +3114,56 @@ typedef struct HFTree {
  unsigned short int size;
  unsigned char is_fixed;
 } HFTree;
+/// NOTE: the match finder parameters of each compression level, matching the ones of zlib,
+///       where the levels below four match greedily, and use max_lazy as the longest match whose positions are all indexed.
+typedef struct DeflateLevel {
+ unsigned short int good_length;
+ unsigned short int max_lazy;
+ unsigned short int nice_length;
+ unsigned short int max_chain;
+ unsigned char lazy;
+} DeflateLevel;
+/// NOTE: the hash heads and chains shared by all the blocks of a stream, so that the matches can reach back into the previous block,
+///       where prev is a ring over the last ZLIB_MAX_DISTANCE positions, and the positions are stored off by one, so that zero ends a chain.
+typedef struct DeflateWindow {
+ unsigned int* head;
+ unsigned int* prev;
+} DeflateWindow;
+static const DeflateLevel deflate_levels[] = {
+ { 0,   0,   0,    0, FALSE },
+ { 4,   4,   8,    4, FALSE },
+ { 4,   5,  16,    8, FALSE },
+ { 4,   6,  32,   32, FALSE },
+ { 4,   4,  16,   16, TRUE  },
+ { 8,  16,  32,   32, TRUE  },
+ { 8,  16, 128,  128, TRUE  },
+ { 8,  32, 128,  256, TRUE  },
+ { 32, 128, 258, 1024, TRUE  },
+ { 32, 258, 258, 4096, TRUE  }
+};
 /* -------------------------------------------------------------------------------------------------------- */
 // ------------------------
 //  Functions Declarations
 // ------------------------
-static int length_distance_encoding(const unsigned char* data_stream, unsigned int data_stream_size, Match** distance_encoding, unsigned int* distance_encoding_cnt);
+static void encode_match(Match* match, unsigned short int length, unsigned short int distance);
+static inline unsigned int hash_match_head(const unsigned char* data);
+static unsigned short int find_longest_match(const unsigned char* data_stream, unsigned int block_end, unsigned int pos, const DeflateWindow* window, const DeflateLevel* level, unsigned short int prev_length, unsigned short int* distance);
+static inline void insert_match_head(const unsigned char* data_stream, unsigned int data_stream_size, unsigned int pos, DeflateWindow* window);
+static int length_distance_encoding(const unsigned char* data_stream, unsigned int data_stream_size, unsigned int block_start, unsigned int block_end, unsigned char level, DeflateWindow* window, Match** distance_encoding, unsigned int* distance_encoding_cnt);
 static void update_hf_nodes(HFNode new_node, HFNode* hf_nodes, unsigned int hf_nodes_cnt);
 static int build_hf_table(HFTree* hf_tree);
-static int generate_hf_tree(unsigned short int* data_stream, unsigned int data_stream_size, HFTree* hf_tree);
+static int generate_hf_tree(unsigned short int* data_stream, unsigned int data_stream_size, unsigned char max_bits, HFTree* hf_tree);
 static int rle_encoding(RLEStream** rle_encoded, unsigned short int* rle_encoded_size, HFTree hf_literals, HFTree hf_distances);
 static int generate_hf_trees(Match* distance_encoded, unsigned int distance_encoded_size, BitStream* buffer, HFTree* hf_literals, HFTree* hf_distances);
+static inline unsigned short int reverse_hf_code(unsigned short int code, unsigned char length);
 static int hf_encode_block(HFTree hf_literals, HFTree hf_distances, Match* distance_encoding, unsigned int distance_encoding_cnt, BitStream* buffer);
 static int encode_uncompressed_block(BitStream* compressed_bit_stream, unsigned char* data_buffer, unsigned int data_buffer_len, unsigned char is_final) ;
-static int hf_compressed_block(BType method, BitStream* buffer, Match* distance_encoding, unsigned int distance_encoding_cnt, unsigned char is_final);
-static int compress_block(BitStream* compressed_bit_stream, unsigned char* data_buffer, unsigned int data_buffer_len, unsigned char is_final);
+static unsigned long long int hf_block_cost(HFTree hf_literals, HFTree hf_distances, const unsigned int* literals_freqs, const unsigned int* distances_freqs);
+static int compress_block(BitStream* compressed_bit_stream, unsigned char* data_buffer, unsigned int data_buffer_len, unsigned int block_start, unsigned int block_end, unsigned char is_final, unsigned char level, DeflateWindow* window);
 /// NOTE: the stream will be always deallocated both in case of failure and success.
 /// 	  Furthermore, the function allocates the returned stream of bytes, so that
 /// 	  once it's on the hand of the caller, it's responsible to manage that memory.
+unsigned char* zlib_deflate_level(unsigned char* data_buffer, unsigned int data_buffer_len, unsigned char level, unsigned int* compressed_data_len, int* zlib_err);
 unsigned char* zlib_deflate(unsigned char* data_buffer, unsigned int data_buffer_len, unsigned int* compressed_data_len, int* zlib_err);
 /* -------------------------------------------------------------------------------------------------------- */
 static void deallocate_hf_tree(HFTree* hf_tree) {
@@ -2119,68 +3171,111 @@ static void deallocate_hf_tree(HFTree* hf_tree) {
  XCOMP_SAFE_FREE(hf_tree -> table);
  return;
 }
-static int length_distance_encoding(const unsigned char* data_stream, unsigned int data_stream_size, Match** distance_encoding, unsigned int* distance_encoding_cnt) {
- *distance_encoding_cnt = MIN(data_stream_size, 3);
- *distance_encoding = (Match*) xcomp_realloc(*distance_encoding, *distance_encoding_cnt * sizeof(Match));
+static void encode_match(Match* match, unsigned short int length, unsigned short int distance) {
+ static const unsigned short int length_base_values[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+ static const unsigned short int dist_base_values[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+ // Past the first codes, each extra bit covers four length codes and two distance codes, hence they follow from the highest bit
+ unsigned char len_ind = length - 3;
+ if (length == ZLIB_MAX_MATCH) len_ind = 28;
+ else if (len_ind >= 8) len_ind = 4 * (floor_log2(len_ind) - 1) + ((len_ind >> (floor_log2(len_ind) - 2)) & 3);
+ unsigned char dist_ind = distance - 1;
+ if (distance > 4) dist_ind = 2 * floor_log2(distance - 1) + (((distance - 1) >> (floor_log2(distance - 1) - 1)) & 1);
+ match -> literal = 257 + len_ind;
+ match -> length_diff = length - length_base_values[len_ind];
+ match -> distance = dist_ind;
+ match -> distance_diff = distance - dist_base_values[dist_ind];
+ return;
+}
+static inline unsigned int hash_match_head(const unsigned char* data) {
+ const unsigned int value = data[0] | (data[1] << 8) | (data[2] << 16);
+ return (value * 2654435761U) >> (32 - ZLIB_HASH_BITS);
+}
+/// NOTE: the chain of the positions sharing the hash of pos is walked from the most recent one, for at most max_chain links,
+///       which are cut to a quarter once a match of good_length is already at hand, while the search stops at the first match of nice_length.
+///       The candidates may lie in the previous blocks, while the match itself never runs past block_end.
+static unsigned short int find_longest_match(const unsigned char* data_stream, unsigned int block_end, unsigned int pos, const DeflateWindow* window, const DeflateLevel* level, unsigned short int prev_length, unsigned short int* distance) {
+ if (pos + ZLIB_MIN_MATCH > block_end) return 0;
+ const unsigned short int max_length = MIN(block_end - pos, (unsigned int) ZLIB_MAX_MATCH);
+ unsigned int chain_length = (prev_length >= level -> good_length) ? (level -> max_chain >> 2) : level -> max_chain;
+ unsigned short int best_length = ZLIB_MIN_MATCH - 1;
+ for (unsigned int candidate = (window -> head)[hash_match_head(data_stream + pos)]; candidate != 0 && chain_length > 0; candidate = (window -> prev)[(candidate - 1) & (ZLIB_MAX_DISTANCE - 1)], --chain_length) {
+  const unsigned int match_pos = candidate - 1;
+  // The ring slots past the window were reused by newer positions, hence the chain ends there
+  if (match_pos >= pos || pos - match_pos > ZLIB_MAX_DISTANCE) break;
+  // The byte past the best length is the most likely to differ, hence it is checked first
+  if (data_stream[match_pos + best_length] != data_stream[pos + best_length] || data_stream[match_pos] != data_stream[pos]) continue;
+  unsigned short int length = 0;
+  while (length < max_length && data_stream[match_pos + length] == data_stream[pos + length]) ++length;
+  if (length <= best_length) continue;
+  best_length = length;
+  *distance = pos - match_pos;
+  if (length >= level -> nice_length) break;
+ }
+ // A short match far away costs more bits than the literals it replaces
+ if (best_length < ZLIB_MIN_MATCH || (best_length == ZLIB_MIN_MATCH && *distance > ZLIB_TOO_FAR)) return 0;
+ return best_length;
+}
+static inline void insert_match_head(const unsigned char* data_stream, unsigned int data_stream_size, unsigned int pos, DeflateWindow* window) {
+ if (pos + ZLIB_MIN_MATCH > data_stream_size) return;
+ const unsigned int hash = hash_match_head(data_stream + pos);
+ (window -> prev)[pos & (ZLIB_MAX_DISTANCE - 1)] = (window -> head)[hash];
+ (window -> head)[hash] = pos + 1;
+ return;
+}
+/// NOTE: the matches are found through the hash chains of the positions sharing the same first three bytes,
+///       with the lazy evaluation deferring a match whenever the next position starts a longer one, as zlib does.
+///       The greedy levels skip the search at one more position every 2^ZLIB_SKIP_SHIFT consecutive misses, while still indexing them,
+///       so that incompressible data is stepped over quickly, while a later repeat of it is still found.
+///       Only the symbols of [block_start, block_end) are emitted, while the window keeps indexing the whole stream.
+static int length_distance_encoding(const unsigned char* data_stream, unsigned int data_stream_size, unsigned int block_start, unsigned int block_end, unsigned char level, DeflateWindow* window, Match** distance_encoding, unsigned int* distance_encoding_cnt) {
+ const DeflateLevel* config = deflate_levels + MIN(level, (unsigned char) ZLIB_MAX_LEVEL);
+ *distance_encoding_cnt = 0;
+ *distance_encoding = (Match*) xcomp_calloc(block_end - block_start + 1, sizeof(Match));
  if (*distance_encoding == NULL) {
-  WARNING_LOG("Failed to xcomp_reallocate buffer for distance_encoding.\n");
+  WARNING_LOG("Failed to allocate the buffer for the distance_encoding.\n");
   return -ZLIB_IO_ERROR;
  }
- for (unsigned char i = 0; i < *distance_encoding_cnt; ++i) (*distance_encoding)[i].literal = data_stream[i];
- unsigned short int cur_len = 0;
- for (long int i = 3; i < data_stream_size; i += cur_len) {
-  unsigned short int found = 0;
-  cur_len = 3;
-  for (int j = 0; (j < i - cur_len) && (i < data_stream_size - cur_len); ++j) {
-   if (mem_n_cmp((const char*) (data_stream + i), (const char*) (data_stream + j), cur_len) == 0) {
-    cur_len++;
-    found = i - j;
-    if (cur_len == 259) break;
+ Match* matches = *distance_encoding;
+ unsigned int misses = 0;
+ unsigned int next_pos = 0;
+ unsigned short int next_length = 0;
+ unsigned short int next_distance = 0;
+ for (unsigned int i = block_start; i < block_end;) {
+  unsigned short int distance = 0;
+  unsigned short int length = 0;
+  if (next_pos == i + 1) {
+   length = next_length;
+   distance = next_distance;
+  } else length = find_longest_match(data_stream, block_end, i, window, config, 0, &distance);
+  insert_match_head(data_stream, data_stream_size, i, window);
+  if (config -> lazy && length > 0 && length < config -> max_lazy) {
+   next_distance = 0;
+   next_length = find_longest_match(data_stream, block_end, i + 1, window, config, length, &next_distance);
+   next_pos = i + 2;
+   if (next_length > length) {
+    matches[(*distance_encoding_cnt)++].literal = data_stream[i++];
     continue;
    }
   }
-  cur_len--;
-  *distance_encoding = (Match*) xcomp_realloc(*distance_encoding, sizeof(Match) * (++(*distance_encoding_cnt)));
-  if (*distance_encoding == NULL) {
-   WARNING_LOG("Failed to xcomp_reallocate buffer for distance_encoding.\n");
-   return -ZLIB_IO_ERROR;
-  }
-  (*distance_encoding)[*distance_encoding_cnt - 1] = (Match) {0};
-  if (cur_len > 2) {
-   const unsigned short int length_base_values[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
-   unsigned char len_ind = 0;
-   for (; len_ind < 29; ++len_ind) {
-    if (cur_len < length_base_values[len_ind]) {
-     --len_ind;
-     break;
-    } else if (cur_len == length_base_values[len_ind]) break;
-   }
-   (*distance_encoding)[*distance_encoding_cnt - 1].length_diff = cur_len - length_base_values[len_ind];
-   (*distance_encoding)[*distance_encoding_cnt - 1].literal = 257 + len_ind;
-   const unsigned short int dist_base_values[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
-   unsigned char dist_ind = 0;
-   for (; dist_ind < 30; ++dist_ind) {
-    if (found < dist_base_values[dist_ind]) {
-     --dist_ind;
-     break;
-    } else if (found == dist_base_values[dist_ind]) break;
+  if (length == 0) {
+   matches[(*distance_encoding_cnt)++].literal = data_stream[i++];
+   if (config -> lazy) continue;
+   for (unsigned int skip = MIN(++misses >> ZLIB_SKIP_SHIFT, block_end - i); skip > 0; --skip) {
+    insert_match_head(data_stream, data_stream_size, i, window);
+    matches[(*distance_encoding_cnt)++].literal = data_stream[i++];
    }
-   dist_ind = MIN(dist_ind, 29);
-   (*distance_encoding)[*distance_encoding_cnt - 1].distance_diff = found - dist_base_values[dist_ind];
-   (*distance_encoding)[*distance_encoding_cnt - 1].distance = dist_ind;
-  } else {
-   (*distance_encoding)[*distance_encoding_cnt - 1].literal = data_stream[i];
-   cur_len = 1;
+   continue;
+  }
+  misses = 0;
+  encode_match(matches + (*distance_encoding_cnt)++, length, distance);
+  // The fast levels skip indexing the inner positions of the long matches
+  if (config -> lazy || length <= config -> max_lazy) {
+   for (unsigned int j = i + 1; j < i + length; ++j) insert_match_head(data_stream, data_stream_size, j, window);
   }
+  i += length;
  }
  // Append the block delimiter
- *distance_encoding = (Match*) xcomp_realloc(*distance_encoding, sizeof(Match) * (++(*distance_encoding_cnt)));
- if (*distance_encoding == NULL) {
-  WARNING_LOG("Failed to xcomp_reallocate buffer for distance_encoding.\n");
-  return -ZLIB_IO_ERROR;
- }
- (*distance_encoding)[*distance_encoding_cnt - 1] = (Match) {0};
- (*distance_encoding)[*distance_encoding_cnt - 1].literal = 256;
+ matches[(*distance_encoding_cnt)++].literal = 256;
  return ZLIB_NO_ERROR;
 }
 static void update_hf_nodes(HFNode new_node, HFNode* hf_nodes, unsigned int hf_nodes_cnt) {
@@ -2210,64 +3305,74 @@ static int build_hf_table(HFTree* hf_tree) {
  return ZLIB_NO_ERROR;
 }
 // Compute Huffman code lengths from a frequency table
-static int generate_hf_tree(unsigned short int* data_stream, unsigned int data_stream_size, HFTree* hf_tree) {
+/// NOTE: when the tree grows deeper than max_bits the frequencies are halved, keeping the used symbols non-zero,
+///       and the tree is rebuilt, while a lone symbol still gets a one bit code, as deflate requires.
+static int generate_hf_tree(unsigned short int* data_stream, unsigned int data_stream_size, unsigned char max_bits, HFTree* hf_tree) {
  unsigned int frequencies[288] = {0};
  for (unsigned int i = 0; i < data_stream_size; ++i) frequencies[data_stream[i]]++;
- HFNode hf_nodes[288] = {0}; // Heap for building the tree
- unsigned short int hf_nodes_cnt = 0;
+ unsigned short int symbols_cnt = 0;
  for (unsigned short int i = 0; i < 288; ++i) {
-  if (frequencies[i]) {
-   HFNode new_node = (HFNode) { .symbol = i, .freq = frequencies[i] };
-   update_hf_nodes(new_node, hf_nodes, ++hf_nodes_cnt);
-   hf_tree -> size = MAX(hf_tree -> size, i + 1);
-  }
+  if (frequencies[i] == 0) continue;
+  hf_tree -> size = MAX(hf_tree -> size, i + 1);
+  symbols_cnt++;
  }
  if (hf_tree -> size == 0) {
   hf_tree -> table = (unsigned short int*) xcomp_calloc(MAX(hf_tree -> size, 1), sizeof(unsigned short int));
   hf_tree -> lengths = (unsigned char*) xcomp_calloc(MAX(hf_tree -> size, 1), sizeof(unsigned char));
   return ZLIB_NO_ERROR;
  }
-    // Build Huffman tree (iterative method)
- unsigned int parent_size = hf_tree -> size;
- unsigned int* parent = (unsigned int*) xcomp_calloc(parent_size, sizeof(unsigned int));
+ hf_tree -> lengths = (unsigned char*) xcomp_calloc(hf_tree -> size, sizeof(unsigned char));
+ if (hf_tree -> lengths == NULL) {
+  WARNING_LOG("Failed to allocate buffer for hf_lengths.\n");
+  return -ZLIB_IO_ERROR;
+ }
+ // A tree has at most twice the symbols as nodes
+ unsigned int* parent = (unsigned int*) xcomp_calloc(2 * hf_tree -> size, sizeof(unsigned int));
  if (parent == NULL) {
+  XCOMP_SAFE_FREE(hf_tree -> lengths);
   WARNING_LOG("Failed to allocate buffer for parent.\n");
   return -ZLIB_IO_ERROR;
  }
-    while (hf_nodes_cnt > 1) {
-        // Take two smallest nodes
-        HFNode left = hf_nodes[0];
-        HFNode right = hf_nodes[1];
-        // Remove them from heap
-        mem_move(hf_nodes, hf_nodes + 2, (hf_nodes_cnt - 2) * sizeof(HFNode));
-        hf_nodes_cnt--;
-        // Create a new merged node
-        HFNode new_node = (HFNode) { .symbol = parent_size++, .freq = left.freq + right.freq};
-  parent = (unsigned int*) xcomp_realloc(parent, sizeof(unsigned int) * parent_size);
-  if (parent == NULL) {
-   WARNING_LOG("Failed to xcomp_reallocate buffer for parent.\n");
-   return -ZLIB_IO_ERROR;
+ unsigned char max_length = 0;
+ do {
+  HFNode hf_nodes[288] = {0}; // Heap for building the tree
+  unsigned short int hf_nodes_cnt = 0;
+  for (unsigned short int i = 0; i < hf_tree -> size; ++i) {
+   if (frequencies[i] == 0) continue;
+   HFNode new_node = (HFNode) { .symbol = i, .freq = frequencies[i] };
+   update_hf_nodes(new_node, hf_nodes, ++hf_nodes_cnt);
   }
-  parent[parent_size - 1] = 0;
-        // Assign parents for tree traversal
-        parent[left.symbol] = new_node.symbol;
-        parent[right.symbol] = new_node.symbol;
-  update_hf_nodes(new_node, hf_nodes, hf_nodes_cnt);
-    }
-    // Assign bit-lengths from depths
-    hf_tree -> lengths = (unsigned char*) xcomp_calloc(hf_tree -> size, sizeof(unsigned char));
- if (hf_tree -> lengths == NULL) {
-  WARNING_LOG("Failed to allocate buffer for hf_lengths.\n");
-  return -ZLIB_IO_ERROR;
- }
- for (unsigned short int i = 0; i < hf_tree -> size; i++) {
-        unsigned int node = i;
-        while (parent[node]) {
-   ((hf_tree -> lengths)[i])++;
-            node = parent[node];
-        }
-    }
+  // Build Huffman tree (iterative method)
+  unsigned int parent_size = hf_tree -> size;
+  mem_set(parent, 0, 2 * hf_tree -> size * sizeof(unsigned int));
+  while (hf_nodes_cnt > 1) {
+   // Take two smallest nodes
+   HFNode left = hf_nodes[0];
+   HFNode right = hf_nodes[1];
+   // Remove them from heap
+   mem_move(hf_nodes, hf_nodes + 2, (hf_nodes_cnt - 2) * sizeof(HFNode));
+   hf_nodes_cnt--;
+   // Create a new merged node, and assign the parents for the tree traversal
+   HFNode new_node = (HFNode) { .symbol = parent_size++, .freq = left.freq + right.freq};
+   parent[left.symbol] = new_node.symbol;
+   parent[right.symbol] = new_node.symbol;
+   update_hf_nodes(new_node, hf_nodes, hf_nodes_cnt);
+  }
+  // Assign bit-lengths from depths
+  max_length = 0;
+  for (unsigned short int i = 0; i < hf_tree -> size; i++) {
+   (hf_tree -> lengths)[i] = 0;
+   for (unsigned int node = i; parent[node]; node = parent[node]) ((hf_tree -> lengths)[i])++;
+   max_length = MAX(max_length, (hf_tree -> lengths)[i]);
+  }
+  for (unsigned short int i = 0; max_length > max_bits && i < hf_tree -> size; ++i) {
+   if (frequencies[i]) frequencies[i] = (frequencies[i] >> 1) | 1;
+  }
+ } while (max_length > max_bits);
  XCOMP_SAFE_FREE(parent);
+ if (symbols_cnt == 1) {
+  for (unsigned short int i = 0; i < hf_tree -> size; ++i) if (frequencies[i]) (hf_tree -> lengths)[i] = 1;
+ }
  int err = 0;
  if ((err = build_hf_table(hf_tree)) < 0) {
   XCOMP_SAFE_FREE(hf_tree -> lengths);
@@ -2373,12 +3478,12 @@ static int generate_hf_trees(Match* distance_encoded, unsigned int distance_enco
  }
  // Generate the tables
  int err = 0;
- if ((err = generate_hf_tree(literals_data, distance_encoded_size, hf_literals)) < 0) {
+ if ((err = generate_hf_tree(literals_data, distance_encoded_size, 15, hf_literals)) < 0) {
   XCOMP_MULTI_FREE(literals_data, distance_data);
   WARNING_LOG("An error occurred while generating the hf_tree for literals.\n");
   return err;
  }
- if ((err = generate_hf_tree(distance_data, distance_size, hf_distances)) < 0) {
+ if ((err = generate_hf_tree(distance_data, distance_size, 15, hf_distances)) < 0) {
   deallocate_hf_tree(hf_literals);
   XCOMP_MULTI_FREE(literals_data, distance_data);
   WARNING_LOG("An error occurred while generating the hf_tree for distances.\n");
@@ -2401,7 +3506,7 @@ static int generate_hf_trees(Match* distance_encoded, unsigned int distance_enco
  }
  for (unsigned short int i = 0; i < rle_encoded_size; ++i) rle_encoded_data[i] = rle_encoded[i].value;
  HFTree hf_tree = { .size = 19 };
- if ((err = generate_hf_tree(rle_encoded_data, rle_encoded_size, &hf_tree)) < 0) {
+ if ((err = generate_hf_tree(rle_encoded_data, rle_encoded_size, 7, &hf_tree)) < 0) {
   do { HFTree* hf_trees[] = { NULL,hf_literals, hf_distances }; for (unsigned int i = 1; i < XCOMP_ARR_SIZE(hf_trees); ++i) deallocate_hf_tree(hf_trees[i]); } while (FALSE);
   XCOMP_MULTI_FREE(rle_encoded, rle_encoded_data);
   WARNING_LOG("An error occurred while generating the hf_tree for the previous hf.\n");
@@ -2429,138 +3534,191 @@ static int generate_hf_trees(Match* distance_encoded, unsigned int distance_enco
  XCOMP_SAFE_FREE(rle_encoded);
  return ZLIB_NO_ERROR;
 }
+static inline unsigned short int reverse_hf_code(unsigned short int code, unsigned char length) {
+ unsigned short int reversed_code = 0;
+ for (unsigned char i = 0; i < length; ++i, code >>= 1) reversed_code = (reversed_code << 1) | (code & 1);
+ return reversed_code;
+}
+/// NOTE: the codes are reversed once per block, rather than at each symbol, and each match is packed
+///       together with its extra bits, which fit in 15 + 5 + 15 + 13 bits, into a single write.
 static int hf_encode_block(HFTree hf_literals, HFTree hf_distances, Match* distance_encoding, unsigned int distance_encoding_cnt, BitStream* buffer) {
     const unsigned char lenghts_extra_bits[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
     const unsigned char distances_extra_bits[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+ unsigned short int literals_codes[288] = {0};
+ unsigned short int distances_codes[30] = {0};
+ for (unsigned short int i = 0; i < hf_literals.size; ++i) literals_codes[i] = reverse_hf_code((hf_literals.table)[i], (hf_literals.lengths)[i]);
+ for (unsigned short int i = 0; i < MIN(hf_distances.size, 30); ++i) distances_codes[i] = reverse_hf_code((hf_distances.table)[i], (hf_distances.lengths)[i]);
  for (unsigned int i = 0; i < distance_encoding_cnt; ++i) {
-  unsigned short int literal = distance_encoding[i].literal;
-  SAFE_REV_BIT_WRITE(buffer, (hf_literals.table)[literal], (hf_literals.lengths)[literal]);
+  const unsigned short int literal = distance_encoding[i].literal;
+  unsigned long long int bits = literals_codes[literal];
+  unsigned char bits_cnt = (hf_literals.lengths)[literal];
   if (literal > 256) {
-   unsigned char distance = distance_encoding[i].distance;
-   SAFE_BIT_WRITE(buffer, distance_encoding[i].length_diff, lenghts_extra_bits[literal - 257]);
-   SAFE_REV_BIT_WRITE(buffer, (hf_distances.table)[distance], (hf_distances.lengths)[distance]);
-   SAFE_BIT_WRITE(buffer, distance_encoding[i].distance_diff, distances_extra_bits[distance]);
+   const unsigned char distance = distance_encoding[i].distance;
+   bits |= (unsigned long long int) distance_encoding[i].length_diff << bits_cnt;
+   bits_cnt += lenghts_extra_bits[literal - 257];
+   bits |= (unsigned long long int) distances_codes[distance] << bits_cnt;
+   bits_cnt += (hf_distances.lengths)[distance];
+   bits |= (unsigned long long int) distance_encoding[i].distance_diff << bits_cnt;
+   bits_cnt += distances_extra_bits[distance];
   }
+  SAFE_BIT_WRITE(buffer, bits, bits_cnt);
  }
  return ZLIB_NO_ERROR;
 }
 static int encode_uncompressed_block(BitStream* compressed_bit_stream, unsigned char* data_buffer, unsigned int data_buffer_len, unsigned char is_final) {
  SAFE_BIT_WRITE(compressed_bit_stream, is_final, 3);
+ // LEN and NLEN are stored little-endian, followed by the data as is
  unsigned short int buffer_len = data_buffer_len & 0xFFFF;
- XCOMP_BE_CONVERT(&buffer_len, sizeof(unsigned short int));
  SAFE_BYTE_WRITE(compressed_bit_stream, sizeof(unsigned short int), 1, &buffer_len);
  buffer_len = ~buffer_len;
  SAFE_BYTE_WRITE(compressed_bit_stream, sizeof(unsigned short int), 1, &buffer_len);
- XCOMP_BE_CONVERT(data_buffer, data_buffer_len);
  SAFE_BYTE_WRITE(compressed_bit_stream, sizeof(unsigned char), data_buffer_len, data_buffer);
  return ZLIB_NO_ERROR;
 }
-static int hf_compressed_block(BType method, BitStream* buffer, Match* distance_encoding, unsigned int distance_encoding_cnt, unsigned char is_final) {
- int err = 0;
- // Calculate the Huffman Tree/Table
- SAFE_NEXT_BIT_WRITE(buffer, is_final, distance_encoding);
- SAFE_BIT_WRITE(buffer, method, 2, XCOMP_SAFE_FREE(distance_encoding));
- HFTree hf_literals = {0};
- HFTree hf_distances = {0};
- if (method == COMPRESSED_DYNAMIC_HF) {
-  if ((err = generate_hf_trees(distance_encoding, distance_encoding_cnt, buffer, &hf_literals, &hf_distances)) < 0) {
-   WARNING_LOG("An error occurred while generating hf_tables.\n");
-   return err;
-  }
- } else {
-  hf_literals.table = (unsigned short int*) fixed_hf_literals_table; hf_literals.lengths = (unsigned char*) fixed_hf_literals_lengths; hf_literals.size = 286; hf_literals.is_fixed = TRUE;;
-  hf_distances.table = (unsigned short int*) fixed_hf_distances_table; hf_distances.lengths = (unsigned char*) fixed_hf_distances_lengths; hf_distances.size = 30; hf_distances.is_fixed = TRUE;;
- }
- // Huffman encode the block, encapsulating it into a DEFLATE block (append block header, encoded data plus the encoded '256' to signal the end of the block)
- if ((err = hf_encode_block(hf_literals, hf_distances, distance_encoding, distance_encoding_cnt, buffer)) < 0) {
-  if (!hf_literals.is_fixed) do { HFTree* hf_trees[] = { NULL,&hf_literals, &hf_distances }; for (unsigned int i = 1; i < XCOMP_ARR_SIZE(hf_trees); ++i) deallocate_hf_tree(hf_trees[i]); } while (FALSE);
-  WARNING_LOG("An error occurred while encoding the block.\n");
-  return err;
- }
- if (!hf_literals.is_fixed) do { HFTree* hf_trees[] = { NULL,&hf_literals, &hf_distances }; for (unsigned int i = 1; i < XCOMP_ARR_SIZE(hf_trees); ++i) deallocate_hf_tree(hf_trees[i]); } while (FALSE);
- return ZLIB_NO_ERROR;
+static unsigned long long int hf_block_cost(HFTree hf_literals, HFTree hf_distances, const unsigned int* literals_freqs, const unsigned int* distances_freqs) {
+ unsigned long long int cost = 0;
+ for (unsigned short int i = 0; i < hf_literals.size; ++i) cost += (unsigned long long int) literals_freqs[i] * (hf_literals.lengths)[i];
+ for (unsigned short int i = 0; i < hf_distances.size; ++i) cost += (unsigned long long int) distances_freqs[i] * (hf_distances.lengths)[i];
+ return cost;
 }
-static int compress_block(BitStream* compressed_bit_stream, unsigned char* data_buffer, unsigned int data_buffer_len, unsigned char is_final) {
+/// NOTE: the bits of each encoding are computed from the symbol counts, and only the cheapest one is emitted,
+///       where the dynamic trees are built, and their header written aside, to price it, as zlib does.
+static int compress_block(BitStream* compressed_bit_stream, unsigned char* data_buffer, unsigned int data_buffer_len, unsigned int block_start, unsigned int block_end, unsigned char is_final, unsigned char level, DeflateWindow* window) {
+ const unsigned int block_len = block_end - block_start;
+ if (level == ZLIB_STORE_LEVEL) {
+  TRACE_LOG("compression_method: '%s', decompressed_size: %u\n", btypes_str[NO_COMPRESSION], block_len);
+  return encode_uncompressed_block(compressed_bit_stream, data_buffer + block_start, block_len, is_final);
+ }
  int err = 0;
  Match* distance_encoding = NULL;
  unsigned int distance_encoding_cnt = 0;
- if ((err = length_distance_encoding(data_buffer, data_buffer_len, &distance_encoding, &distance_encoding_cnt)) < 0) {
+ if ((err = length_distance_encoding(data_buffer, data_buffer_len, block_start, block_end, level, window, &distance_encoding, &distance_encoding_cnt)) < 0) {
   WARNING_LOG("An error occurred while performing the length-distance encoding.\n");
   return err;
  }
- // Static compression
- BitStream fixed_block_bit_stream = CREATE_BIT_STREAM(NULL, 0);
- if ((err = hf_compressed_block(COMPRESSED_FIXED_HF, &fixed_block_bit_stream, distance_encoding, distance_encoding_cnt, is_final)) < 0) {
-  XCOMP_SAFE_FREE(distance_encoding);
-  WARNING_LOG("An error occurred while compressing the block using FIXED_HF.\n");
-  return err;
+ const unsigned char lenghts_extra_bits[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+ const unsigned char distances_extra_bits[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+ unsigned int literals_freqs[288] = {0};
+ unsigned int distances_freqs[30] = {0};
+ unsigned long long int extra_bits = 0;
+ for (unsigned int i = 0; i < distance_encoding_cnt; ++i) {
+  literals_freqs[distance_encoding[i].literal]++;
+  if (distance_encoding[i].literal <= 256) continue;
+  distances_freqs[distance_encoding[i].distance]++;
+  extra_bits += lenghts_extra_bits[distance_encoding[i].literal - 257] + distances_extra_bits[distance_encoding[i].distance];
  }
- // Dynamic compression
- BitStream dynamic_block_bit_stream = CREATE_BIT_STREAM(NULL, 0);
- if ((err = hf_compressed_block(COMPRESSED_DYNAMIC_HF, &dynamic_block_bit_stream, distance_encoding, distance_encoding_cnt, is_final)) < 0) {
+ // With a flat histogram of the 256 literals, where no frequency reaches the sum of the two lowest ones, every literal costs eight bits
+ // in any code, hence the block is stored without building the dynamic trees, as the few matches could save at most 1/64 of it
+ if (literals_freqs[255] > 0) {
+  unsigned int lowest[2] = { 0xFFFFFFFF, 0xFFFFFFFF };
+  unsigned int highest = 0;
+  unsigned int literals_cnt = 0;
+  for (unsigned short int i = 0; i < 256; ++i) {
+   literals_cnt += literals_freqs[i];
+   highest = MAX(highest, literals_freqs[i]);
+   if (literals_freqs[i] < lowest[0]) lowest[1] = lowest[0], lowest[0] = literals_freqs[i];
+   else if (literals_freqs[i] < lowest[1]) lowest[1] = literals_freqs[i];
+  }
+  if (lowest[0] > 0 && (block_len - literals_cnt) < (block_len >> 6) && (unsigned long long int) highest < (unsigned long long int) lowest[0] + lowest[1]) {
+   XCOMP_SAFE_FREE(distance_encoding);
+   TRACE_LOG("compression_method: '%s', decompressed_size: %u\n", btypes_str[NO_COMPRESSION], block_len);
+   return encode_uncompressed_block(compressed_bit_stream, data_buffer + block_start, block_len, is_final);
+  }
+ }
+ const HFTree fixed_literals = { .lengths = (unsigned char*) fixed_hf_literals_lengths, .table = (unsigned short int*) fixed_hf_literals_table, .size = 286, .is_fixed = TRUE };
+ const HFTree fixed_distances = { .lengths = (unsigned char*) fixed_hf_distances_lengths, .table = (unsigned short int*) fixed_hf_distances_table, .size = 30, .is_fixed = TRUE };
+ const unsigned long long int fixed_cost = 3 + extra_bits + hf_block_cost(fixed_literals, fixed_distances, literals_freqs, distances_freqs);
+ // The dynamic header is written aside, as it is emitted only if the dynamic trees win
+ HFTree hf_literals = {0};
+ HFTree hf_distances = {0};
+ BitStream dynamic_header = CREATE_BIT_STREAM(NULL, 0);
+ if ((err = generate_hf_trees(distance_encoding, distance_encoding_cnt, &dynamic_header, &hf_literals, &hf_distances)) < 0) {
   XCOMP_SAFE_FREE(distance_encoding);
-  deallocate_bit_stream(&fixed_block_bit_stream);
-  WARNING_LOG("An error occurred while compressing the block using DYNAMIC_HF.\n");
+  deallocate_bit_stream(&dynamic_header);
+  WARNING_LOG("An error occurred while generating hf_tables.\n");
   return err;
  }
- XCOMP_SAFE_FREE(distance_encoding);
+ const unsigned long long int dynamic_cost = 3 + dynamic_header.byte_pos * 8ULL + dynamic_header.bit_pos + extra_bits + hf_block_cost(hf_literals, hf_distances, literals_freqs, distances_freqs);
  // Fallback no compression
- if (fixed_block_bit_stream.size > data_buffer_len + 5 && dynamic_block_bit_stream.size > data_buffer_len + 5) {
-  deallocate_bit_stream(&fixed_block_bit_stream);
-  deallocate_bit_stream(&dynamic_block_bit_stream);
-  printf("compression_method: '%s', decompressed_size: %u\n", btypes_str[NO_COMPRESSION], data_buffer_len);
-  if ((err = encode_uncompressed_block(compressed_bit_stream, data_buffer, data_buffer_len, is_final)) < 0) {
+ if (MIN(fixed_cost, dynamic_cost) > (block_len + 5) * 8ULL) {
+  do { HFTree* hf_trees[] = { NULL,&hf_literals, &hf_distances }; for (unsigned int i = 1; i < XCOMP_ARR_SIZE(hf_trees); ++i) deallocate_hf_tree(hf_trees[i]); } while (FALSE);
+  XCOMP_SAFE_FREE(distance_encoding);
+  deallocate_bit_stream(&dynamic_header);
+  TRACE_LOG("compression_method: '%s', decompressed_size: %u\n", btypes_str[NO_COMPRESSION], block_len);
+  if ((err = encode_uncompressed_block(compressed_bit_stream, data_buffer + block_start, block_len, is_final)) < 0) {
    WARNING_LOG("An error occurred while encoding the uncompressed block.\n");
    return err;
   }
   return ZLIB_NO_ERROR;
  }
- unsigned char is_fixed_better = fixed_block_bit_stream.size <= dynamic_block_bit_stream.size;
- printf("compression_method: '%s', decompressed_size: %u\n", btypes_str[is_fixed_better ? COMPRESSED_FIXED_HF : COMPRESSED_DYNAMIC_HF], data_buffer_len);
- BitStream block_bit_stream = is_fixed_better ? fixed_block_bit_stream : dynamic_block_bit_stream;
- if (is_fixed_better) deallocate_bit_stream(&dynamic_block_bit_stream);
- else deallocate_bit_stream(&fixed_block_bit_stream);
- bitstream_bit_copy(compressed_bit_stream, &block_bit_stream);
+ const unsigned char is_fixed_better = fixed_cost <= dynamic_cost;
+ TRACE_LOG("compression_method: '%s', decompressed_size: %u\n", btypes_str[is_fixed_better ? COMPRESSED_FIXED_HF : COMPRESSED_DYNAMIC_HF], block_len);
+ bitstream_write_next_bit(compressed_bit_stream, is_final);
+ bitstream_write_bits(compressed_bit_stream, is_fixed_better ? COMPRESSED_FIXED_HF : COMPRESSED_DYNAMIC_HF, 2);
+ if (!is_fixed_better) bitstream_bit_copy(compressed_bit_stream, &dynamic_header);
+ deallocate_bit_stream(&dynamic_header);
  if (compressed_bit_stream -> error) {
-  if (!is_fixed_better) deallocate_bit_stream(&dynamic_block_bit_stream);
-  else deallocate_bit_stream(&fixed_block_bit_stream);
-  WARNING_LOG("Failed to bit copy the block bitstream into the compressed bitstream.\n");
+  do { HFTree* hf_trees[] = { NULL,&hf_literals, &hf_distances }; for (unsigned int i = 1; i < XCOMP_ARR_SIZE(hf_trees); ++i) deallocate_hf_tree(hf_trees[i]); } while (FALSE);
+  XCOMP_SAFE_FREE(distance_encoding);
+  WARNING_LOG("Failed to write the block header into the compressed bitstream.\n");
   return -ZLIB_IO_ERROR;
  }
- // Deallocate the one the bit_stream actually used
- if (!is_fixed_better) deallocate_bit_stream(&dynamic_block_bit_stream);
- else deallocate_bit_stream(&fixed_block_bit_stream);
+ // Huffman encode the block, the encoded '256' closing it
+ err = hf_encode_block(is_fixed_better ? fixed_literals : hf_literals, is_fixed_better ? fixed_distances : hf_distances, distance_encoding, distance_encoding_cnt, compressed_bit_stream);
+ do { HFTree* hf_trees[] = { NULL,&hf_literals, &hf_distances }; for (unsigned int i = 1; i < XCOMP_ARR_SIZE(hf_trees); ++i) deallocate_hf_tree(hf_trees[i]); } while (FALSE);
+ XCOMP_SAFE_FREE(distance_encoding);
+ if (err < 0) {
+  WARNING_LOG("An error occurred while encoding the block.\n");
+  return err;
+ }
  return ZLIB_NO_ERROR;
 }
-unsigned char* zlib_deflate(unsigned char* data_buffer, unsigned int data_buffer_len, unsigned int* compressed_data_len, int* zlib_err) {
+/// NOTE: the level goes from ZLIB_STORE_LEVEL, which only emits stored blocks, up to ZLIB_MAX_LEVEL,
+///       trading the speed of the match finder for the compression ratio, as the zlib levels do.
+///       An empty input still emits an empty final stored block, as a deflate stream needs a final block.
+unsigned char* zlib_deflate_level(unsigned char* data_buffer, unsigned int data_buffer_len, unsigned char level, unsigned int* compressed_data_len, int* zlib_err) {
  *compressed_data_len = 0;
  BitStream compressed_bit_stream = CREATE_BIT_STREAM(NULL, 0);
  *zlib_err = -ZLIB_NO_ERROR;
- // Fragment the data in block of WINDOW_SIZE
- unsigned int buffer_offset = 0;
- unsigned int block_cnt = 0;
- while (data_buffer_len >= 0x7FFF) {
-  DEBUG_LOG("Block %u: is_final: %u, ", ++block_cnt, data_buffer_len == 0x7FFF);
-  if ((*zlib_err = compress_block(&compressed_bit_stream, data_buffer + buffer_offset, 0x7FFF, data_buffer_len == 0x7FFF)) < 0) {
+ if (data_buffer_len == 0) {
+  if ((*zlib_err = encode_uncompressed_block(&compressed_bit_stream, data_buffer, 0, TRUE)) < 0) {
    XCOMP_SAFE_FREE(data_buffer);
    deallocate_bit_stream(&compressed_bit_stream);
-   return ((unsigned char*) "An error occurred while compressing the block.\n");
+   return ((unsigned char*) "An error occurred while encoding the empty block.\n");
   }
-  data_buffer_len -= 0x7FFF;
-  buffer_offset += 0x7FFF;
+  XCOMP_SAFE_FREE(data_buffer);
+  *compressed_data_len = compressed_bit_stream.size;
+  return compressed_bit_stream.stream;
  }
- if (data_buffer_len > 0) {
-  DEBUG_LOG("Block %u: is_final: 1, ", ++block_cnt);
-  if ((*zlib_err = compress_block(&compressed_bit_stream, data_buffer + buffer_offset, data_buffer_len, TRUE)) < 0) {
-   XCOMP_SAFE_FREE(data_buffer);
+ // A single window is shared by all the blocks, so that the matches can cross their boundaries
+ DeflateWindow window = {0};
+ if (level != ZLIB_STORE_LEVEL) {
+  window.head = (unsigned int*) xcomp_calloc(1 << ZLIB_HASH_BITS, sizeof(unsigned int));
+  window.prev = (unsigned int*) xcomp_calloc(ZLIB_MAX_DISTANCE, sizeof(unsigned int));
+  if (window.head == NULL || window.prev == NULL) {
+   XCOMP_MULTI_FREE(window.head, window.prev, data_buffer);
+   *zlib_err = -ZLIB_IO_ERROR;
+   return ((unsigned char*) "Failed to allocate the deflate window.\n");
+  }
+ }
+ // Fragment the data in block of WINDOW_SIZE
+ unsigned int block_cnt = 0;
+ for (unsigned int buffer_offset = 0; buffer_offset < data_buffer_len; buffer_offset += 0x7FFF) {
+  const unsigned int block_end = MIN(data_buffer_len - buffer_offset, 0x7FFFU) + buffer_offset;
+  TRACE_LOG("Block %u: is_final: %u, ", ++block_cnt, block_end == data_buffer_len);
+  if ((*zlib_err = compress_block(&compressed_bit_stream, data_buffer, data_buffer_len, buffer_offset, block_end, block_end == data_buffer_len, level, &window)) < 0) {
+   XCOMP_MULTI_FREE(window.head, window.prev, data_buffer);
    deallocate_bit_stream(&compressed_bit_stream);
    return ((unsigned char*) "An error occurred while compressing the block.\n");
   }
  }
- XCOMP_SAFE_FREE(data_buffer);
+ XCOMP_MULTI_FREE(window.head, window.prev, data_buffer);
  *compressed_data_len = compressed_bit_stream.size;
  return compressed_bit_stream.stream;
 }
+unsigned char* zlib_deflate(unsigned char* data_buffer, unsigned int data_buffer_len, unsigned int* compressed_data_len, int* zlib_err) {
+ return zlib_deflate_level(data_buffer, data_buffer_len, ZLIB_DEFAULT_LEVEL, compressed_data_len, zlib_err);
+}
 /*
  * Copyright (C) 2025 TheProgxy <theprogxy@gmail.com>
  *
@@ -2580,259 +3738,304 @@ unsigned char* zlib_deflate(unsigned char* data_buffer, unsigned int data_buffer
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
  * Resources: deflate <https://www.ietf.org/rfc/rfc1951.txt> *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-// -------------------
-//  Macros Definition
-// -------------------
+// -----------------
+//  Constant Values
+// -----------------
+typedef enum {
+ INFLATE_LITERALS_TABLE_BITS  = 10,
+ INFLATE_DISTANCES_TABLE_BITS = 8,
+ INFLATE_PRECODE_TABLE_BITS   = 7,
+ INFLATE_FIXED_LITERALS_BITS  = 9,
+ INFLATE_FIXED_DISTANCES_BITS = 5,
+ INFLATE_MAX_CODE_LENGTH      = 15,
+ INFLATE_MAX_LITERALS         = 288,
+ INFLATE_MAX_DISTANCES        = 32,
+ INFLATE_SUBTABLE_FLAG        = 0x8000
+} InflateConstants;
 /* ---------------------------------------------------------------------------------------------------------- */
 // ---------
 //  Structs
 // ---------
-typedef struct HFTable {
-    unsigned short int** values;
-    unsigned short int* min_codes;
-    unsigned short int* max_codes;
-    unsigned char* lengths;
-    unsigned short int size;
-    unsigned char max_bit_length;
- unsigned char is_fixed_hf;
-} HFTable;
+/// NOTE: the bits are consumed from the bottom of bit_buffer, which is refilled whole bytes at a time,
+///       while the output grows geometrically up to capacity, rather than once per decoded symbol,
+///       unless it is owned by the caller (is_caller_data), in which case it can never outgrow capacity.
+typedef struct InflateStream {
+ const unsigned char* stream;
+ unsigned int size;
+ unsigned int byte_pos;
+ unsigned long long int bit_buffer;
+ unsigned char bits_cnt;
+ unsigned char* data;
+ unsigned int data_len;
+ unsigned int capacity;
+ unsigned char is_caller_data;
+} InflateStream;
 /* -------------------------------------------------------------------------------------------------------- */
 // ------------------
 //  Static Variables
 // ------------------
-// Fixed huffman literal/lengths codes
-static const unsigned short int fixed_val_ptr[] = {0, 256, 0, 280, 144};
-static const unsigned short int fixed_mins[] = {0, 0x00, 0x30, 0xC0, 0x190};
-static const unsigned short int fixed_maxs[] = {0, 0x18, 0xC0, 0xC8, 0x200};
-static const unsigned short int fixed_distance_val_ptr[] = {0, 0x00};
-static const unsigned short int fixed_distance_mins[] = {0, 0x00};
-static const unsigned short int fixed_distance_maxs[] = {0, 0x20};
+/// NOTE: each entry of a decoding table is indexed by the next table_bits of the stream, and holds the decoded
+///       symbol in the upper 16 bits and the length of its code in the lower 8 bits, while the entries of the
+///       codes longer than table_bits point to a subtable, holding its offset in the upper 16 bits, its bits in
+///       bits 8-11, and INFLATE_SUBTABLE_FLAG. Entries left to zero are not part of the code.
+// Fixed huffman literal/lengths codes, as built by build_inflate_table with INFLATE_FIXED_LITERALS_BITS
+static const unsigned int fixed_literals_table[512] = {
+  0x01000007, 0x00500008, 0x00100008, 0x01180008, 0x01100007, 0x00700008, 0x00300008, 0x00C00009,
+  0x01080007, 0x00600008, 0x00200008, 0x00A00009, 0x00000008, 0x00800008, 0x00400008, 0x00E00009,
+  0x01040007, 0x00580008, 0x00180008, 0x00900009, 0x01140007, 0x00780008, 0x00380008, 0x00D00009,
+  0x010C0007, 0x00680008, 0x00280008, 0x00B00009, 0x00080008, 0x00880008, 0x00480008, 0x00F00009,
+  0x01020007, 0x00540008, 0x00140008, 0x011C0008, 0x01120007, 0x00740008, 0x00340008, 0x00C80009,
+  0x010A0007, 0x00640008, 0x00240008, 0x00A80009, 0x00040008, 0x00840008, 0x00440008, 0x00E80009,
+  0x01060007, 0x005C0008, 0x001C0008, 0x00980009, 0x01160007, 0x007C0008, 0x003C0008, 0x00D80009,
+  0x010E0007, 0x006C0008, 0x002C0008, 0x00B80009, 0x000C0008, 0x008C0008, 0x004C0008, 0x00F80009,
+  0x01010007, 0x00520008, 0x00120008, 0x011A0008, 0x01110007, 0x00720008, 0x00320008, 0x00C40009,
+  0x01090007, 0x00620008, 0x00220008, 0x00A40009, 0x00020008, 0x00820008, 0x00420008, 0x00E40009,
+  0x01050007, 0x005A0008, 0x001A0008, 0x00940009, 0x01150007, 0x007A0008, 0x003A0008, 0x00D40009,
+  0x010D0007, 0x006A0008, 0x002A0008, 0x00B40009, 0x000A0008, 0x008A0008, 0x004A0008, 0x00F40009,
+  0x01030007, 0x00560008, 0x00160008, 0x011E0008, 0x01130007, 0x00760008, 0x00360008, 0x00CC0009,
+  0x010B0007, 0x00660008, 0x00260008, 0x00AC0009, 0x00060008, 0x00860008, 0x00460008, 0x00EC0009,
+  0x01070007, 0x005E0008, 0x001E0008, 0x009C0009, 0x01170007, 0x007E0008, 0x003E0008, 0x00DC0009,
+  0x010F0007, 0x006E0008, 0x002E0008, 0x00BC0009, 0x000E0008, 0x008E0008, 0x004E0008, 0x00FC0009,
+  0x01000007, 0x00510008, 0x00110008, 0x01190008, 0x01100007, 0x00710008, 0x00310008, 0x00C20009,
+  0x01080007, 0x00610008, 0x00210008, 0x00A20009, 0x00010008, 0x00810008, 0x00410008, 0x00E20009,
+  0x01040007, 0x00590008, 0x00190008, 0x00920009, 0x01140007, 0x00790008, 0x00390008, 0x00D20009,
+  0x010C0007, 0x00690008, 0x00290008, 0x00B20009, 0x00090008, 0x00890008, 0x00490008, 0x00F20009,
+  0x01020007, 0x00550008, 0x00150008, 0x011D0008, 0x01120007, 0x00750008, 0x00350008, 0x00CA0009,
+  0x010A0007, 0x00650008, 0x00250008, 0x00AA0009, 0x00050008, 0x00850008, 0x00450008, 0x00EA0009,
+  0x01060007, 0x005D0008, 0x001D0008, 0x009A0009, 0x01160007, 0x007D0008, 0x003D0008, 0x00DA0009,
+  0x010E0007, 0x006D0008, 0x002D0008, 0x00BA0009, 0x000D0008, 0x008D0008, 0x004D0008, 0x00FA0009,
+  0x01010007, 0x00530008, 0x00130008, 0x011B0008, 0x01110007, 0x00730008, 0x00330008, 0x00C60009,
+  0x01090007, 0x00630008, 0x00230008, 0x00A60009, 0x00030008, 0x00830008, 0x00430008, 0x00E60009,
+  0x01050007, 0x005B0008, 0x001B0008, 0x00960009, 0x01150007, 0x007B0008, 0x003B0008, 0x00D60009,
+  0x010D0007, 0x006B0008, 0x002B0008, 0x00B60009, 0x000B0008, 0x008B0008, 0x004B0008, 0x00F60009,
+  0x01030007, 0x00570008, 0x00170008, 0x011F0008, 0x01130007, 0x00770008, 0x00370008, 0x00CE0009,
+  0x010B0007, 0x00670008, 0x00270008, 0x00AE0009, 0x00070008, 0x00870008, 0x00470008, 0x00EE0009,
+  0x01070007, 0x005F0008, 0x001F0008, 0x009E0009, 0x01170007, 0x007F0008, 0x003F0008, 0x00DE0009,
+  0x010F0007, 0x006F0008, 0x002F0008, 0x00BE0009, 0x000F0008, 0x008F0008, 0x004F0008, 0x00FE0009,
+  0x01000007, 0x00500008, 0x00100008, 0x01180008, 0x01100007, 0x00700008, 0x00300008, 0x00C10009,
+  0x01080007, 0x00600008, 0x00200008, 0x00A10009, 0x00000008, 0x00800008, 0x00400008, 0x00E10009,
+  0x01040007, 0x00580008, 0x00180008, 0x00910009, 0x01140007, 0x00780008, 0x00380008, 0x00D10009,
+  0x010C0007, 0x00680008, 0x00280008, 0x00B10009, 0x00080008, 0x00880008, 0x00480008, 0x00F10009,
+  0x01020007, 0x00540008, 0x00140008, 0x011C0008, 0x01120007, 0x00740008, 0x00340008, 0x00C90009,
+  0x010A0007, 0x00640008, 0x00240008, 0x00A90009, 0x00040008, 0x00840008, 0x00440008, 0x00E90009,
+  0x01060007, 0x005C0008, 0x001C0008, 0x00990009, 0x01160007, 0x007C0008, 0x003C0008, 0x00D90009,
+  0x010E0007, 0x006C0008, 0x002C0008, 0x00B90009, 0x000C0008, 0x008C0008, 0x004C0008, 0x00F90009,
+  0x01010007, 0x00520008, 0x00120008, 0x011A0008, 0x01110007, 0x00720008, 0x00320008, 0x00C50009,
+  0x01090007, 0x00620008, 0x00220008, 0x00A50009, 0x00020008, 0x00820008, 0x00420008, 0x00E50009,
+  0x01050007, 0x005A0008, 0x001A0008, 0x00950009, 0x01150007, 0x007A0008, 0x003A0008, 0x00D50009,
+  0x010D0007, 0x006A0008, 0x002A0008, 0x00B50009, 0x000A0008, 0x008A0008, 0x004A0008, 0x00F50009,
+  0x01030007, 0x00560008, 0x00160008, 0x011E0008, 0x01130007, 0x00760008, 0x00360008, 0x00CD0009,
+  0x010B0007, 0x00660008, 0x00260008, 0x00AD0009, 0x00060008, 0x00860008, 0x00460008, 0x00ED0009,
+  0x01070007, 0x005E0008, 0x001E0008, 0x009D0009, 0x01170007, 0x007E0008, 0x003E0008, 0x00DD0009,
+  0x010F0007, 0x006E0008, 0x002E0008, 0x00BD0009, 0x000E0008, 0x008E0008, 0x004E0008, 0x00FD0009,
+  0x01000007, 0x00510008, 0x00110008, 0x01190008, 0x01100007, 0x00710008, 0x00310008, 0x00C30009,
+  0x01080007, 0x00610008, 0x00210008, 0x00A30009, 0x00010008, 0x00810008, 0x00410008, 0x00E30009,
+  0x01040007, 0x00590008, 0x00190008, 0x00930009, 0x01140007, 0x00790008, 0x00390008, 0x00D30009,
+  0x010C0007, 0x00690008, 0x00290008, 0x00B30009, 0x00090008, 0x00890008, 0x00490008, 0x00F30009,
+  0x01020007, 0x00550008, 0x00150008, 0x011D0008, 0x01120007, 0x00750008, 0x00350008, 0x00CB0009,
+  0x010A0007, 0x00650008, 0x00250008, 0x00AB0009, 0x00050008, 0x00850008, 0x00450008, 0x00EB0009,
+  0x01060007, 0x005D0008, 0x001D0008, 0x009B0009, 0x01160007, 0x007D0008, 0x003D0008, 0x00DB0009,
+  0x010E0007, 0x006D0008, 0x002D0008, 0x00BB0009, 0x000D0008, 0x008D0008, 0x004D0008, 0x00FB0009,
+  0x01010007, 0x00530008, 0x00130008, 0x011B0008, 0x01110007, 0x00730008, 0x00330008, 0x00C70009,
+  0x01090007, 0x00630008, 0x00230008, 0x00A70009, 0x00030008, 0x00830008, 0x00430008, 0x00E70009,
+  0x01050007, 0x005B0008, 0x001B0008, 0x00970009, 0x01150007, 0x007B0008, 0x003B0008, 0x00D70009,
+  0x010D0007, 0x006B0008, 0x002B0008, 0x00B70009, 0x000B0008, 0x008B0008, 0x004B0008, 0x00F70009,
+  0x01030007, 0x00570008, 0x00170008, 0x011F0008, 0x01130007, 0x00770008, 0x00370008, 0x00CF0009,
+  0x010B0007, 0x00670008, 0x00270008, 0x00AF0009, 0x00070008, 0x00870008, 0x00470008, 0x00EF0009,
+  0x01070007, 0x005F0008, 0x001F0008, 0x009F0009, 0x01170007, 0x007F0008, 0x003F0008, 0x00DF0009,
+  0x010F0007, 0x006F0008, 0x002F0008, 0x00BF0009, 0x000F0008, 0x008F0008, 0x004F0008, 0x00FF0009
+};
+// Fixed huffman distance codes, as built by build_inflate_table with INFLATE_FIXED_DISTANCES_BITS
+static const unsigned int fixed_distances_table[32] = {
+  0x00000005, 0x00100005, 0x00080005, 0x00180005, 0x00040005, 0x00140005, 0x000C0005, 0x001C0005,
+  0x00020005, 0x00120005, 0x000A0005, 0x001A0005, 0x00060005, 0x00160005, 0x000E0005, 0x001E0005,
+  0x00010005, 0x00110005, 0x00090005, 0x00190005, 0x00050005, 0x00150005, 0x000D0005, 0x001D0005,
+  0x00030005, 0x00130005, 0x000B0005, 0x001B0005, 0x00070005, 0x00170005, 0x000F0005, 0x001F0005
+};
+static const unsigned short int length_base_values[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const unsigned char length_extra_bits[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const unsigned short int distance_base_values[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const unsigned char distance_extra_bits[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
 /* ---------------------------------------------------------------------------------------------------------- */
 // ------------------------
 //  Functions Declarations
 // ------------------------
-static void deallocate_hf_table(HFTable* hf);
-static int generate_codes(HFTable* hf);
-static int decode_hf(BitStream* bit_stream, unsigned short int code, HFTable hf);
-static int decode_lengths(BitStream* bit_stream, HFTable decoder_hf, HFTable* literals_hf, HFTable* distance_hf);
-static int copy_data(unsigned char** dest, unsigned int* index, unsigned short int length, unsigned short int distance);
-static int get_length(BitStream* bit_stream, unsigned short int value);
-static int get_distance(BitStream* bit_stream, unsigned short int value);
-static int read_uncompressed_data(BitStream* bit_stream, unsigned char** decompressed_data, unsigned int* decompressed_data_length);
-static int decode_dynamic_huffman_tables(BitStream* bit_stream, HFTable* literals_hf, HFTable* distance_hf);
+static inline void inflate_refill(InflateStream* inflate_stream);
+static inline int inflate_read_bits(InflateStream* inflate_stream, unsigned char n_bits);
+static inline int inflate_decode_symbol(InflateStream* inflate_stream, const unsigned int* table, unsigned char table_bits);
+static int inflate_reserve(InflateStream* inflate_stream, unsigned int size);
+static int build_inflate_table(const unsigned char* lengths, unsigned short int symbols_cnt, unsigned char table_bits, unsigned int** table);
+static int read_uncompressed_data(InflateStream* inflate_stream);
+static int decode_dynamic_huffman_tables(InflateStream* inflate_stream, unsigned int** literals_table, unsigned int** distances_table);
+static int decode_compressed_block(BType compression_method, InflateStream* inflate_stream);
+static int inflate_blocks(InflateStream* inflate_stream);
 /// NOTE: the stream will be always deallocated both in case of failure and success.
 /// 	  Furthermore, the function allocates the returned stream of bytes, so that
 /// 	  once it's on the hand of the caller, it's responsible to manage that memory.
 unsigned char* zlib_inflate(unsigned char* stream, unsigned int size, unsigned int* decompressed_data_length, int* zlib_err);
+/// NOTE: unlike zlib_inflate, neither buffer is allocated nor deallocated, the data is decoded straight into dst,
+///       failing with -ZLIB_INVALID_LENGTH if it does not fit in dst_capacity bytes.
+int zlib_inflate_into(unsigned char* dst, unsigned int dst_capacity, const unsigned char* src, unsigned int src_len, unsigned int* decompressed_data_length);
 /* ---------------------------------------------------------------------------------------------------------- */
-static void deallocate_hf_table(HFTable* hf) {
- if (hf -> is_fixed_hf) return;
- for (unsigned char i = 1; i <= hf -> max_bit_length; ++i) XCOMP_SAFE_FREE((hf -> values)[i]);
-    XCOMP_SAFE_FREE(hf -> values);
-    XCOMP_SAFE_FREE(hf -> min_codes);
-    XCOMP_SAFE_FREE(hf -> max_codes);
-    XCOMP_SAFE_FREE(hf -> lengths);
-    hf -> max_bit_length = 0;
-    hf -> size = 0;
-    return;
-}
-static int generate_codes(HFTable* hf) {
- if (hf -> max_bit_length == 0) {
-  hf -> max_bit_length = 0; do { for (unsigned short int i = 0; i < (hf -> size); ++i) { (hf -> max_bit_length) = ((hf -> max_bit_length) < (hf -> lengths)[i]) ? (hf -> lengths)[i] : (hf -> max_bit_length); } } while (FALSE);
- }
- unsigned char bl_count[16] = {0};
- for (unsigned short int i = 0; i < hf -> size; ++i) bl_count[(hf -> lengths)[i]]++;
- bl_count[0] = 0;
-    hf -> values = (unsigned short int**) xcomp_calloc(hf -> max_bit_length + 1, sizeof(unsigned short int*));
-    if (hf -> values == NULL) {
-  WARNING_LOG("Failed to allocate buffer for hf -> values.\n");
-  return -ZLIB_IO_ERROR;
+/// NOTE: while at least 8 bytes are left, they are loaded at once and only the whole bytes that fit are accounted,
+///       the bits loaded past bits_cnt are the same that the next refill would load, so they can be left in place.
+static inline void inflate_refill(InflateStream* inflate_stream) {
+ if (inflate_stream -> byte_pos + 8 <= inflate_stream -> size) {
+  const unsigned char* bytes = inflate_stream -> stream + inflate_stream -> byte_pos;
+  unsigned long long int word = 0;
+  for (unsigned char i = 0; i < 8; ++i) word |= (unsigned long long int) bytes[i] << (i * 8);
+  inflate_stream -> bit_buffer |= word << inflate_stream -> bits_cnt;
+  inflate_stream -> byte_pos += (63 - inflate_stream -> bits_cnt) >> 3;
+  inflate_stream -> bits_cnt |= 56;
+  return;
  }
- for (unsigned char i = 1; i <= hf -> max_bit_length; ++i) {
-        (hf -> values)[i] = (unsigned short int*) xcomp_calloc(bl_count[i], sizeof(unsigned short int));
-  if ((hf -> values)[i] == NULL) {
-   WARNING_LOG("Failed to allocate buffer for hf -> values[%u].\n", i);
-   return -ZLIB_IO_ERROR;
-  }
+ while (inflate_stream -> bits_cnt < 56 && inflate_stream -> byte_pos < inflate_stream -> size) {
+  inflate_stream -> bit_buffer |= (unsigned long long int) (inflate_stream -> stream)[(inflate_stream -> byte_pos)++] << inflate_stream -> bits_cnt;
+  inflate_stream -> bits_cnt += 8;
  }
- // Find the minimum and maximum code values for each bit_length 
-    hf -> min_codes = (unsigned short int*) xcomp_calloc(hf -> max_bit_length + 1, sizeof(unsigned short int));
-    if (hf -> min_codes == NULL) {
-  WARNING_LOG("Failed to allocate buffer for hf -> min_codes.\n");
-  return -ZLIB_IO_ERROR;
+ return;
+}
+static inline int inflate_read_bits(InflateStream* inflate_stream, unsigned char n_bits) {
+ if (n_bits > inflate_stream -> bits_cnt) {
+  WARNING_LOG("Unexpected end of stream while reading %u bits.\n", n_bits);
+  return -ZLIB_CORRUPTED_DATA;
  }
- hf -> max_codes = (unsigned short int*) xcomp_calloc(hf -> max_bit_length + 1, sizeof(unsigned short int));
-    if (hf -> max_codes == NULL) {
-  WARNING_LOG("Failed to allocate buffer for hf -> max_codes.\n");
-  return -ZLIB_IO_ERROR;
+ const int bits = inflate_stream -> bit_buffer & ((1ULL << n_bits) - 1);
+ inflate_stream -> bit_buffer >>= n_bits;
+ inflate_stream -> bits_cnt -= n_bits;
+ return bits;
+}
+/// NOTE: a single lookup in the primary table decodes the codes up to table_bits long, the longer ones take a second
+///       lookup in their subtable, hence the caller should refill the bit buffer before decoding.
+static inline int inflate_decode_symbol(InflateStream* inflate_stream, const unsigned int* table, unsigned char table_bits) {
+ unsigned int entry = table[inflate_stream -> bit_buffer & ((1ULL << table_bits) - 1)];
+ if (entry & INFLATE_SUBTABLE_FLAG) {
+  if (table_bits > inflate_stream -> bits_cnt) {
+   WARNING_LOG("Unexpected end of stream while decoding a symbol.\n");
+   return -ZLIB_CORRUPTED_DATA;
+  }
+  inflate_stream -> bit_buffer >>= table_bits;
+  inflate_stream -> bits_cnt -= table_bits;
+  entry = table[(entry >> 16) + (inflate_stream -> bit_buffer & ((1ULL << ((entry >> 8) & 0xF)) - 1))];
  }
-    for (unsigned char bits = 1; bits <= hf -> max_bit_length; ++bits) {
-        (hf -> min_codes)[bits] = ((hf -> min_codes)[bits - 1] + bl_count[bits - 1]) << 1;
-        (hf -> max_codes)[bits] = (hf -> min_codes)[bits];
-    }
- // Compute the code for each entry, and updating the max_code each time accordingly.
-    // In this way we sort of allocate a code for each entry in order (as lexicographical order is required), as we already know the base for each bit_length (min_code).
- unsigned char* values_index = (unsigned char*) xcomp_calloc(hf -> max_bit_length + 1, sizeof(unsigned char));
-    if (values_index == NULL) {
-  WARNING_LOG("Failed to allocate buffer for values_index.\n");
-  return -ZLIB_IO_ERROR;
+ const unsigned char code_length = entry & 0xFF;
+ if (code_length == 0) {
+  WARNING_LOG("Invalid huffman code.\n");
+  return -ZLIB_INVALID_DECODED_VALUE;
+ } else if (code_length > inflate_stream -> bits_cnt) {
+  WARNING_LOG("Unexpected end of stream while decoding a symbol.\n");
+  return -ZLIB_CORRUPTED_DATA;
  }
- for (unsigned short int i = 0; i < hf -> size; ++i) {
-        if ((hf -> lengths)[i] != 0) {
-            unsigned char value_bit_len = (hf -> lengths)[i];
-            ((hf -> max_codes)[value_bit_len])++;
-            (hf -> values)[value_bit_len][values_index[value_bit_len]++] = i;
-  }
-    }
-    XCOMP_SAFE_FREE(values_index);
-    return ZLIB_NO_ERROR;
-}
-static int decode_hf(BitStream* bit_stream, unsigned short int code, HFTable hf) {
- if (hf.is_fixed_hf) {
-  // Read the first n common first bits, if bit_length is 4 means that is the literals hf so the base is 6 common bits, otherwise is 4 for distance hf
-  for (unsigned char i = 0; i < (hf.max_bit_length == 4 ? 6 : 4); ++i) {
-   unsigned char next_bit = SAFE_NEXT_BIT_READ(bit_stream, next_bit);
-   code = (code << 1) + next_bit;
-  }
- }
- for (unsigned char i = 1; i <= hf.max_bit_length; ++i) {
-  // Check if the code is inside this bit_length group, by checking if it's less than the maximum code for this bit_length.
-  if (hf.max_codes[i] > code) {
-   // Return the corresponding decoded value from the hf tree, subtracting the min code for this bit length to get the offset of the entry.
-   return (hf.is_fixed_hf) ? (code - hf.min_codes[i] + hf.values[0][i]) : hf.values[i][code - hf.min_codes[i]];
-        }
-  // If the code does not match, then add a bit and check with the next bit_length
-        // If the hf used is the literals fixed one, then we need to do the following as the 8 bit-length group is divided in two sub-groups (0 - 143) and (280 - 287), preventing it to read the next_bit and skip the length
-        if (i != 2 || hf.is_fixed_hf != 2) {
-   unsigned char next_bit = SAFE_NEXT_BIT_READ(bit_stream, next_bit);
-   code = (code << 1) + next_bit;
-  }
-        if (bit_stream -> error) break;
-    }
- // Return max value to signal error during operation.
-    return -ZLIB_INVALID_DECODED_VALUE;
+ inflate_stream -> bit_buffer >>= code_length;
+ inflate_stream -> bits_cnt -= code_length;
+ return entry >> 16;
 }
-static int decode_lengths(BitStream* bit_stream, HFTable decoder_hf, HFTable* literals_hf, HFTable* distance_hf) {
-    literals_hf -> lengths = (unsigned char*) xcomp_calloc(literals_hf -> size, sizeof(unsigned char));
- if (literals_hf -> lengths == NULL) {
-  WARNING_LOG("Failed to allocate buffer for literals_hf -> lengths.\n");
-  return -ZLIB_IO_ERROR;
+static int inflate_reserve(InflateStream* inflate_stream, unsigned int size) {
+ if (inflate_stream -> data_len + size <= inflate_stream -> capacity) return ZLIB_NO_ERROR;
+ else if (inflate_stream -> is_caller_data) {
+  WARNING_LOG("The decompressed data does not fit in the buffer of %u bytes.\n", inflate_stream -> capacity);
+  return -ZLIB_INVALID_LENGTH;
  }
- distance_hf -> lengths = (unsigned char*) xcomp_calloc(distance_hf -> size, sizeof(unsigned char));
-    if (distance_hf -> lengths == NULL) {
-  XCOMP_SAFE_FREE(literals_hf -> lengths);
-  WARNING_LOG("Failed to allocate buffer for distance_hf -> lengths.\n");
+ unsigned int capacity = MAX(inflate_stream -> data_len + size, MAX(inflate_stream -> capacity * 2, 4096));
+ unsigned char* data = (unsigned char*) xcomp_realloc(inflate_stream -> data, sizeof(unsigned char) * capacity);
+ if (data == NULL) {
+  WARNING_LOG("Failed to xcomp_reallocate buffer for decompressed data.\n");
   return -ZLIB_IO_ERROR;
  }
- unsigned short int index = 0;
-    while (index < (literals_hf -> size + distance_hf -> size)) {
-  unsigned short int code = SAFE_NEXT_BIT_READ(bit_stream, code);
-        int value = decode_hf(bit_stream, code, decoder_hf);
-  if (value < 0) {
-   XCOMP_MULTI_FREE(literals_hf -> lengths, distance_hf -> lengths);
-   WARNING_LOG("Corrupted encoded lengths.\n");
-   return value;
-  }
-  // NOTE: the operation index - literals_hf -> size, is required to normalize the index, as the values are read sequentially
-        if (value < 16) {
-   // 0 - 15: Represent code lengths of 0 - 15.
-   // Hence, we first fill the literals and then the distances (look block order below)
-            if (index < literals_hf -> size) {
-    (literals_hf -> lengths)[index] = value;
-    literals_hf -> max_bit_length = MAX(literals_hf -> max_bit_length, value);
-   } else {
-    (distance_hf -> lengths)[index - literals_hf -> size] = value;
-    distance_hf -> max_bit_length = MAX(distance_hf -> max_bit_length, value);
-   }
-   index++;
-        } else if (value == 16) {
-   // 16: Copy the previous code length 3 - 6 times.
-   // Determine how many times to repeat
-   unsigned char count = SAFE_BITS_READ(bit_stream, count, 2);
-            count += 3;
-   // Fill the literals and then the distances (look block order below)
-            unsigned char value = (index < literals_hf -> size) ? (literals_hf -> lengths)[index - 1] : (distance_hf -> lengths)[index - literals_hf -> size - 1];
-            for (unsigned char i = 0; i < count; ++i, ++index) {
-                if (index < literals_hf -> size) (literals_hf -> lengths)[index] = value;
-                else (distance_hf -> lengths)[index - literals_hf -> size] = value;
-            }
-        } else if (value == 17) {
-   // 17: Repeat a code length of 0 for 3 - 10 times. (3 bits of length).
-   unsigned char count = SAFE_BITS_READ(bit_stream, count, 3);
-            count += 3;
-   for (unsigned char i = 0; i < count; ++i, ++index) {
-                if (index < literals_hf -> size) (literals_hf -> lengths)[index] = 0;
-                else (distance_hf -> lengths)[index - literals_hf -> size] = 0;
-            }
-        } else if (value == 18) {
-   // 18: Repeat a code length of 0 for 11 - 138 times (7 bits of length).
-   unsigned char count = SAFE_BITS_READ(bit_stream, count, 7);
-            count += 11;
-   for (unsigned char i = 0; i < count; ++i, ++index) {
-                if (index < literals_hf -> size) (literals_hf -> lengths)[index] = 0;
-                else (distance_hf -> lengths)[index - literals_hf -> size] = 0;
-            }
-        } else {
-   WARNING_LOG("Invalid value decoded: %u must be less than 19.\n", value); return -ZLIB_CORRUPTED_DATA;
-  }
-    }
-    return ZLIB_NO_ERROR;
+ inflate_stream -> data = data;
+ inflate_stream -> capacity = capacity;
+ return ZLIB_NO_ERROR;
 }
-/// Move backwards distance bytes in the output stream, and copy length bytes from this position to the output stream
-static int copy_data(unsigned char** dest, unsigned int* index, unsigned short int length, unsigned short int distance) {
-    *dest = (unsigned char*) xcomp_realloc(*dest, sizeof(unsigned char) * ((*index) + length));
- if (*dest == NULL) {
-  WARNING_LOG("Failed to xcomp_reallocate buffer for dest.\n");
+/// NOTE: the codes are assigned in canonical order, and as deflate packs them starting from their most significant
+///       bit, both the table indexes and the subtables indexes are bit reversed. Over-subscribed codes are rejected,
+///       while the holes of incomplete codes are left to zero, so that decoding them fails.
+static int build_inflate_table(const unsigned char* lengths, unsigned short int symbols_cnt, unsigned char table_bits, unsigned int** table) {
+ unsigned short int bl_count[INFLATE_MAX_CODE_LENGTH + 1] = {0};
+ for (unsigned short int i = 0; i < symbols_cnt; ++i) bl_count[lengths[i]]++;
+ bl_count[0] = 0;
+ int left = 1;
+ for (unsigned char bits = 1; bits <= INFLATE_MAX_CODE_LENGTH; ++bits) {
+  left = (left << 1) - bl_count[bits];
+  if (left < 0) {
+   WARNING_LOG("Over-subscribed huffman code lengths.\n");
+   return -ZLIB_CORRUPTED_DATA;
+  }
+ }
+ unsigned short int next_code[INFLATE_MAX_CODE_LENGTH + 1] = {0};
+ for (unsigned char bits = 1; bits <= INFLATE_MAX_CODE_LENGTH; ++bits) next_code[bits] = (next_code[bits - 1] + bl_count[bits - 1]) << 1;
+ unsigned short int codes[INFLATE_MAX_LITERALS] = {0};
+ for (unsigned short int i = 0; i < symbols_cnt; ++i) if (lengths[i]) codes[i] = next_code[lengths[i]]++;
+ // Each subtable is sized by the longest code sharing its prefix
+ unsigned char subtable_bits[1 << INFLATE_LITERALS_TABLE_BITS] = {0};
+ for (unsigned short int i = 0; i < symbols_cnt; ++i) {
+  if (lengths[i] <= table_bits) continue;
+  const unsigned short int prefix = codes[i] >> (lengths[i] - table_bits);
+  subtable_bits[prefix] = MAX(subtable_bits[prefix], lengths[i] - table_bits);
+ }
+ unsigned int table_size = 1U << table_bits;
+ for (unsigned short int prefix = 0; prefix < (1U << table_bits); ++prefix) if (subtable_bits[prefix]) table_size += 1U << subtable_bits[prefix];
+ *table = (unsigned int*) xcomp_calloc(table_size, sizeof(unsigned int));
+ if (*table == NULL) {
+  WARNING_LOG("Failed to allocate buffer for the decoding table.\n");
   return -ZLIB_IO_ERROR;
  }
- if ((long int) *index - distance < 0) {
-  WARNING_LOG("Invalid distance, which makes buffer pointer negative: %d, (index: %u, distance: %u)\n", *index - distance, *index, distance);
-  return -ZLIB_CORRUPTED_DATA;
+ unsigned int subtable_offset = 1U << table_bits;
+ for (unsigned short int prefix = 0; prefix < (1U << table_bits); ++prefix) {
+  if (subtable_bits[prefix] == 0) continue;
+  unsigned short int reversed_prefix = 0;
+  for (unsigned char bit = 0; bit < table_bits; ++bit) reversed_prefix |= ((prefix >> bit) & 1) << (table_bits - 1 - bit);
+  (*table)[reversed_prefix] = (subtable_offset << 16) | INFLATE_SUBTABLE_FLAG | (subtable_bits[prefix] << 8) | table_bits;
+  subtable_offset += 1U << subtable_bits[prefix];
+ }
+ for (unsigned short int i = 0; i < symbols_cnt; ++i) {
+  if (lengths[i] == 0) continue;
+  unsigned int* entries = *table;
+  unsigned char code_length = lengths[i];
+  unsigned char entries_bits = table_bits;
+  unsigned short int code = codes[i];
+  if (code_length > table_bits) {
+   const unsigned short int prefix = code >> (code_length - table_bits);
+   unsigned short int reversed_prefix = 0;
+   for (unsigned char bit = 0; bit < table_bits; ++bit) reversed_prefix |= ((prefix >> bit) & 1) << (table_bits - 1 - bit);
+   entries += (*table)[reversed_prefix] >> 16;
+   entries_bits = subtable_bits[prefix];
+   code_length -= table_bits;
+   code &= (1U << code_length) - 1;
+  }
+  unsigned short int reversed_code = 0;
+  for (unsigned char bit = 0; bit < code_length; ++bit) reversed_code |= ((code >> bit) & 1) << (code_length - 1 - bit);
+  for (unsigned int j = reversed_code; j < (1U << entries_bits); j += 1U << code_length) entries[j] = ((unsigned int) i << 16) | code_length;
  }
- mem_cpy(*dest + *index, *dest + *index - distance, sizeof(unsigned char) * length);
- (*index) += length;
  return ZLIB_NO_ERROR;
 }
-/// Get length from table defined in the specification.
-static int get_length(BitStream* bit_stream, unsigned short int value) {
-    const unsigned short int base_values[] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
-    const unsigned char extra_bits[] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
-    unsigned short int length = base_values[value - 257]; // 257 is the base value of the table, so it's used to normalize the value.
- unsigned char extra = SAFE_BITS_READ(bit_stream, extra, extra_bits[value - 257]); // Some of the entries require to read additional bits.
-    return (length + extra);
-}
-/// Similarly, as above, we perform an analog lookup operation.
-static int get_distance(BitStream* bit_stream, unsigned short int value) {
-    const unsigned short int base_values[] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
-    const unsigned char extra_bits[] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
-    unsigned short int distance = base_values[value]; // The distance values start from 0 in the table.
-    unsigned short int extra = SAFE_BITS_READ(bit_stream, extra, extra_bits[value]); // Similarly some entries require additional bits to be read.
-    return (distance + extra);
-}
-static int read_uncompressed_data(BitStream* bit_stream, unsigned char** decompressed_data, unsigned int* decompressed_data_length) {
-    // Read the length and its one-complement, and check if there's corruption
- skip_to_next_byte(bit_stream);
- unsigned short int length = SAFE_BYTE_READ_WITH_CAST(bit_stream, sizeof(unsigned short int), 1, unsigned short int, length, 0);
- unsigned short int length_c = SAFE_BYTE_READ_WITH_CAST(bit_stream, sizeof(unsigned short int), 1, unsigned short int, length_c, 0);
- XCOMP_BE_CONVERT(&length, sizeof(unsigned short int));
-    XCOMP_BE_CONVERT(&length_c, sizeof(unsigned short int));
+static int read_uncompressed_data(InflateStream* inflate_stream) {
+ // Drop the bits up to the byte boundary, and give back the whole bytes still held by the bit buffer
+ inflate_stream -> byte_pos -= inflate_stream -> bits_cnt >> 3;
+ inflate_stream -> bit_buffer = 0;
+ inflate_stream -> bits_cnt = 0;
+ // Read the length and its one-complement, and check if there's corruption
+ if (inflate_stream -> byte_pos + 4 > inflate_stream -> size) {
+  WARNING_LOG("Unexpected end of stream while reading the uncompressed block header.\n");
+  return -ZLIB_CORRUPTED_DATA;
+ }
+ const unsigned char* header = inflate_stream -> stream + inflate_stream -> byte_pos;
+ unsigned short int length = header[0] | (header[1] << 8);
+ unsigned short int length_c = header[2] | (header[3] << 8);
+ inflate_stream -> byte_pos += 4;
  unsigned short int check = ((length ^ length_c) + 1) & 0xFFFF;
-    if (check) {
+ if (check) {
   WARNING_LOG("Invalid checksum: ((0x%X ^ 0x%X) + 1 = 0x%X) which is not equal to 0.\n", length, length_c, check);
   return -ZLIB_INVALID_LEN_CHECKSUM;
- } else if (length + bit_stream -> byte_pos > bit_stream -> size) {
+ } else if (length + inflate_stream -> byte_pos > inflate_stream -> size) {
   WARNING_LOG("Invalid length: %u would make bitstream pointer read out of bound.\n", length);
-  PRINT_BIT_STREAM_INFO(bit_stream);
   return -ZLIB_CORRUPTED_DATA;
  }
  // Read length bytes from the stream
-    *decompressed_data = (unsigned char*) xcomp_realloc(*decompressed_data, sizeof(unsigned char) * (*decompressed_data_length + length));
- if (mem_cpy(*decompressed_data + *decompressed_data_length, bitstream_read_bytes(bit_stream, sizeof(unsigned char), length), sizeof(unsigned char) * length) == NULL) {
-  WARNING_LOG("Failed to xcomp_reallocate buffer for decompressed data.\n");
-  return -ZLIB_IO_ERROR;
- }
- XCOMP_BE_CONVERT(*decompressed_data + *decompressed_data_length, length);
-    *decompressed_data_length += length;
+ int err = 0;
+ if ((err = inflate_reserve(inflate_stream, length)) < 0) return err;
+ mem_cpy(inflate_stream -> data + inflate_stream -> data_len, inflate_stream -> stream + inflate_stream -> byte_pos, sizeof(unsigned char) * length);
+ inflate_stream -> data_len += length;
+ inflate_stream -> byte_pos += length;
  return ZLIB_NO_ERROR;
 }
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * 
@@ -2861,174 +4064,195 @@ static int read_uncompressed_data(BitStream* bit_stream, unsigned char** decompr
  * The literal/length symbol 256 (end of data), encoded using the literal/length Huffman code
  * 
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-static int decode_dynamic_huffman_tables(BitStream* bit_stream, HFTable* literals_hf, HFTable* distance_hf) {
- HFTable decoder_hf = (HFTable) {0}; // Huffman Tree used for decoding the Literals and Distances Huffman Trees
- literals_hf -> size = SAFE_BITS_READ(bit_stream, literals_hf -> size, 5);
-    literals_hf -> size += 257;
- distance_hf -> size = SAFE_BITS_READ(bit_stream, distance_hf -> size, 5);
-    distance_hf -> size += 1;
- decoder_hf.size = SAFE_BITS_READ(bit_stream, decoder_hf.size, 4);
-    decoder_hf.size += 4;
-    // Retrieve the length to build the huffman tree to decode the other two huffman trees (Literals and Distance)
-    const unsigned char order_of_code_lengths[] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
-    decoder_hf.lengths = (unsigned char*) xcomp_calloc(19, sizeof(unsigned char));
- if (decoder_hf.lengths == NULL) {
-  WARNING_LOG("Failed to allocate buffer for decoder_hf lengths.\n");
-  return -ZLIB_IO_ERROR;
- }
- // Retrieve the length of each code, using the array to match the fixed order of the codes. Furthermore, each one of the length is 3-bit long.
-    for (unsigned char i = 0; i < decoder_hf.size; ++i) {
-  (decoder_hf.lengths)[order_of_code_lengths[i]] = SAFE_BITS_READ(bit_stream, (decoder_hf.lengths)[order_of_code_lengths[i]], 3);
+static int decode_dynamic_huffman_tables(InflateStream* inflate_stream, unsigned int** literals_table, unsigned int** distances_table) {
+ inflate_refill(inflate_stream);
+ const int literals_cnt = inflate_read_bits(inflate_stream, 5) + 257;
+ const int distances_cnt = inflate_read_bits(inflate_stream, 5) + 1;
+ const int code_lengths_cnt = inflate_read_bits(inflate_stream, 4) + 4;
+ if (literals_cnt < 257 || distances_cnt < 1 || code_lengths_cnt < 4) return -ZLIB_CORRUPTED_DATA;
+ else if (literals_cnt > 286 || distances_cnt > 30) {
+  WARNING_LOG("Invalid amount of codes: %d literals and %d distances.\n", literals_cnt, distances_cnt);
+  return -ZLIB_CORRUPTED_DATA;
  }
- decoder_hf.size = 19; // The real size of the lengths is 19 as the amount allocated, value used for allocation
- // Build the huffman tree from the lengths
-    int err = 0;
-    if ((err = generate_codes(&decoder_hf)) < 0) {
-  deallocate_hf_table(&decoder_hf);
-  WARNING_LOG("An error occurred while generating the codes for the decoder_hf table.\n");
-  return err;
+ // Retrieve the length to build the huffman table to decode the other two huffman tables (Literals and Distance)
+ // Each one of the length is 3-bit long, and they are stored following a fixed order
+ const unsigned char order_of_code_lengths[] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+ unsigned char code_lengths[19] = {0};
+ for (unsigned char i = 0; i < code_lengths_cnt; ++i) {
+  inflate_refill(inflate_stream);
+  const int length = inflate_read_bits(inflate_stream, 3);
+  if (length < 0) return length;
+  code_lengths[order_of_code_lengths[i]] = length;
  }
- // Decode the bit_lengths for both the Huffman Trees
- if ((err = decode_lengths(bit_stream, decoder_hf, literals_hf, distance_hf)) < 0) {
-  deallocate_hf_table(&decoder_hf);
-  WARNING_LOG("An error occurred while decoding the lengths.\n");
+ int err = 0;
+ unsigned int* precode_table = NULL;
+ if ((err = build_inflate_table(code_lengths, 19, INFLATE_PRECODE_TABLE_BITS, &precode_table)) < 0) {
+  WARNING_LOG("An error occurred while building the code lengths table.\n");
   return err;
  }
-    deallocate_hf_table(&decoder_hf);
- // Again this values are required to be set as they are used for the allocation
-    if (literals_hf -> size < 286) {
-  literals_hf -> lengths = xcomp_realloc(literals_hf -> lengths, sizeof(unsigned char) * 286);
-  if (literals_hf -> lengths == NULL) {
-   XCOMP_SAFE_FREE(distance_hf -> lengths);
-   WARNING_LOG("Failed to xcomp_reallocate the buffer for literals_hf -> lenghts.\n");
-   return -ZLIB_IO_ERROR;
+ // Decode the bit lengths of both the tables, as a single sequence, as the repeats can cross from one to the other
+ unsigned char lengths[INFLATE_MAX_LITERALS + INFLATE_MAX_DISTANCES] = {0};
+ unsigned short int index = 0;
+ while (index < literals_cnt + distances_cnt) {
+  inflate_refill(inflate_stream);
+  const int value = inflate_decode_symbol(inflate_stream, precode_table, INFLATE_PRECODE_TABLE_BITS);
+  if (value < 0) {
+   XCOMP_SAFE_FREE(precode_table);
+   WARNING_LOG("Corrupted encoded lengths.\n");
+   return value;
   }
-  mem_set(literals_hf -> lengths + literals_hf -> size, 0, sizeof(unsigned char) * (286 - literals_hf -> size));
-  literals_hf -> size = 286;
- }
- if (distance_hf -> size < 30) {
-  distance_hf -> lengths = xcomp_realloc(distance_hf -> lengths, sizeof(unsigned char) * 30);
-  if (distance_hf -> lengths == NULL) {
-   XCOMP_SAFE_FREE(literals_hf -> lengths);
-   WARNING_LOG("Failed to xcomp_reallocate the buffer for distance_hf -> lenghts.\n");
-   return -ZLIB_IO_ERROR;
+  if (value < 16) {
+   // 0 - 15: Represent code lengths of 0 - 15.
+   lengths[index++] = value;
+   continue;
+  }
+  // 16: Copy the previous code length 3 - 6 times (2 bits of length).
+  // 17: Repeat a code length of 0 for 3 - 10 times (3 bits of length).
+  // 18: Repeat a code length of 0 for 11 - 138 times (7 bits of length).
+  const unsigned char repeated_length = (value == 16 && index > 0) ? lengths[index - 1] : 0;
+  const int count = (value == 16) ? inflate_read_bits(inflate_stream, 2) + 3 : (value == 17) ? inflate_read_bits(inflate_stream, 3) + 3 : inflate_read_bits(inflate_stream, 7) + 11;
+  if ((value == 16 && index == 0) || count < 3 || index + count > literals_cnt + distances_cnt) {
+   XCOMP_SAFE_FREE(precode_table);
+   WARNING_LOG("Invalid repeat of the code lengths at %u.\n", index);
+   return -ZLIB_CORRUPTED_DATA;
   }
-  mem_set(distance_hf -> lengths + distance_hf -> size, 0, sizeof(unsigned char) * (30 - distance_hf -> size));
-  distance_hf -> size = 30;
+  for (int i = 0; i < count; ++i) lengths[index++] = repeated_length;
  }
-    if ((err = generate_codes(literals_hf)) < 0) {
-  XCOMP_SAFE_FREE(distance_hf -> lengths);
-  deallocate_hf_table(literals_hf);
-  WARNING_LOG("An error occurred while generating the codes for the literals_hf table.\n");
+ XCOMP_SAFE_FREE(precode_table);
+ if ((err = build_inflate_table(lengths, literals_cnt, INFLATE_LITERALS_TABLE_BITS, literals_table)) < 0) {
+  WARNING_LOG("An error occurred while building the literals table.\n");
   return err;
  }
- XCOMP_SAFE_FREE(literals_hf -> lengths);
- if ((err = generate_codes(distance_hf)) < 0) {
-  do { deallocate_hf_table(literals_hf); deallocate_hf_table(distance_hf); } while (FALSE);
-  WARNING_LOG("An error occurred while generating the codes for the distance_hf table.\n");
+ if ((err = build_inflate_table(lengths + literals_cnt, distances_cnt, INFLATE_DISTANCES_TABLE_BITS, distances_table)) < 0) {
+  XCOMP_SAFE_FREE(*literals_table);
+  WARNING_LOG("An error occurred while building the distances table.\n");
   return err;
  }
- XCOMP_SAFE_FREE(distance_hf -> lengths);
-    return ZLIB_NO_ERROR;
+ return ZLIB_NO_ERROR;
 }
-static int decode_compressed_block(BType compression_method, BitStream* bit_stream, unsigned char** decompressed_data, unsigned int* decompressed_data_length) {
+static int decode_compressed_block(BType compression_method, InflateStream* inflate_stream) {
  int err = 0;
- HFTable literals_hf = (HFTable) {0};
- HFTable distance_hf = (HFTable) {0};
- if (compression_method == COMPRESSED_FIXED_HF) {
-  unsigned short int* literals_val_ptr = (unsigned short int*) fixed_val_ptr; (literals_hf) = (HFTable) { .values = &literals_val_ptr, .min_codes = (unsigned short int*) fixed_mins, .max_codes = (unsigned short int*) fixed_maxs, .size = 286, .max_bit_length = 4, .is_fixed_hf = 2 };
-  unsigned short int* distance_val_ptr = (unsigned short int*) fixed_distance_val_ptr; (distance_hf) = (HFTable) { .values = &distance_val_ptr, .min_codes = (unsigned short int*) fixed_distance_mins, .max_codes = (unsigned short int*) fixed_distance_maxs, .size = 30, .max_bit_length = 1, .is_fixed_hf = TRUE };
- } else if ((err = decode_dynamic_huffman_tables(bit_stream, &literals_hf, &distance_hf))) {
-  WARNING_LOG("An error occurred during dynamic HF table decoding.\n");
-  return err;
+ unsigned int* literals_table = (unsigned int*) fixed_literals_table;
+ unsigned int* distances_table = (unsigned int*) fixed_distances_table;
+ unsigned char literals_bits = INFLATE_FIXED_LITERALS_BITS;
+ unsigned char distances_bits = INFLATE_FIXED_DISTANCES_BITS;
+ if (compression_method == COMPRESSED_DYNAMIC_HF) {
+  if ((err = decode_dynamic_huffman_tables(inflate_stream, &literals_table, &distances_table)) < 0) {
+   WARNING_LOG("An error occurred during dynamic HF table decoding.\n");
+   return err;
+  }
+  literals_bits = INFLATE_LITERALS_TABLE_BITS;
+  distances_bits = INFLATE_DISTANCES_TABLE_BITS;
  }
- // Decode compressed data block
- unsigned short int code = 0;
- int decoded_value = 0;
- int decoded_distance = 0;
- while (!bit_stream -> error) {
-  code = bitstream_read_next_bit(bit_stream);
-  if ((bit_stream) -> error) { do { deallocate_hf_table((&literals_hf)); deallocate_hf_table((&distance_hf)); } while (FALSE); return -ZLIB_IO_ERROR; };
-  // Decode the literal/length value
-  if ((decoded_value = decode_hf(bit_stream, code, literals_hf)) < 0) {
-   do { deallocate_hf_table(&literals_hf); deallocate_hf_table(&distance_hf); } while (FALSE);
+ // Decode compressed data block, a single refill covers the longest length and distance pair (48 bits)
+ while (TRUE) {
+  inflate_refill(inflate_stream);
+  const int decoded_value = inflate_decode_symbol(inflate_stream, literals_table, literals_bits);
+  if (decoded_value < 0) {
+   err = decoded_value;
    WARNING_LOG("An error occurred while decoding the code.\n");
-   return decoded_value;
+   break;
   }
   if (decoded_value < 256) {
    // If literal/length value < 256: copy value (literal/length byte) to output stream
-   *decompressed_data = (unsigned char*) xcomp_realloc(*decompressed_data, sizeof(unsigned char) * (*decompressed_data_length + 1));
-   if (*decompressed_data == NULL) {
-    do { deallocate_hf_table(&literals_hf); deallocate_hf_table(&distance_hf); } while (FALSE);
-    WARNING_LOG("Failed to xcomp_reallocate buffer for decompressed data.\n");
-    return -ZLIB_IO_ERROR;
-   }
-   (*decompressed_data)[*decompressed_data_length] = decoded_value;
-   (*decompressed_data_length)++;
+   if ((err = inflate_reserve(inflate_stream, 1)) < 0) break;
+   (inflate_stream -> data)[(inflate_stream -> data_len)++] = decoded_value;
+   continue;
   } else if (decoded_value == 256) {
    break;
-  } else {
-   unsigned short int length = get_length(bit_stream, decoded_value);
-   int distance_code = bitstream_read_next_bit(bit_stream);
-   if ((bit_stream) -> error) { do { deallocate_hf_table((&literals_hf)); deallocate_hf_table((&distance_hf)); } while (FALSE); return -ZLIB_IO_ERROR; };
-   // Decode the distance value
-   if ((decoded_distance = decode_hf(bit_stream, distance_code, distance_hf)) < 0) {
-    do { deallocate_hf_table(&literals_hf); deallocate_hf_table(&distance_hf); } while (FALSE);
-    WARNING_LOG("An error occurred while decoding the code.\n");
-    return decoded_value;
-   }
-   // Move backwards distance bytes in the output stream, and copy length bytes from this position to the output stream
-   unsigned short int distance = get_distance(bit_stream, decoded_distance);
-   if ((err = copy_data(decompressed_data, decompressed_data_length, length, distance)) < 0) {
-    do { deallocate_hf_table(&literals_hf); deallocate_hf_table(&distance_hf); } while (FALSE);
-    WARNING_LOG("An error occurred while copying data from the decoded data.\n");
+  } else if (decoded_value > 285) {
+   err = -ZLIB_INVALID_DECODED_VALUE;
+   WARNING_LOG("Invalid length code: %d.\n", decoded_value);
+   break;
+  }
+  // Get the length and the distance from the tables defined in the specification, some of the entries require to read additional bits.
+  const int length_extra = inflate_read_bits(inflate_stream, length_extra_bits[decoded_value - 257]);
+  const int decoded_distance = inflate_decode_symbol(inflate_stream, distances_table, distances_bits);
+  if (length_extra < 0 || decoded_distance < 0) {
+   err = (length_extra < 0) ? length_extra : decoded_distance;
+   WARNING_LOG("An error occurred while decoding the code.\n");
+   break;
+  } else if (decoded_distance > 29) {
+   err = -ZLIB_INVALID_DECODED_VALUE;
+   WARNING_LOG("Invalid distance code: %d.\n", decoded_distance);
+   break;
+  }
+  const int distance_extra = inflate_read_bits(inflate_stream, distance_extra_bits[decoded_distance]);
+  if (distance_extra < 0) {
+   err = distance_extra;
+   break;
+  }
+  const unsigned short int length = length_base_values[decoded_value - 257] + length_extra;
+  const unsigned short int distance = distance_base_values[decoded_distance] + distance_extra;
+  // Move backwards distance bytes in the output stream, and copy length bytes from this position to the output stream
+  if (distance > inflate_stream -> data_len) {
+   err = -ZLIB_CORRUPTED_DATA;
+   WARNING_LOG("Invalid distance, which makes buffer pointer negative: (index: %u, distance: %u)\n", inflate_stream -> data_len, distance);
+   break;
+  }
+  if ((err = inflate_reserve(inflate_stream, length)) < 0) break;
+  xcomp_copy_match(inflate_stream -> data + inflate_stream -> data_len, distance, length);
+  inflate_stream -> data_len += length;
+ }
+ if (compression_method == COMPRESSED_DYNAMIC_HF) XCOMP_MULTI_FREE(literals_table, distances_table);
+ return err;
+}
+static int inflate_blocks(InflateStream* inflate_stream) {
+ int err = 0;
+ unsigned char final = 0;
+ unsigned int block_cnt = 0;
+ unsigned int old_decompressed_size = 0;
+ while (!final) {
+  // Read header bits
+  inflate_refill(inflate_stream);
+  const int header = inflate_read_bits(inflate_stream, 3);
+  if (header < 0) {
+   WARNING_LOG("An error occurred while reading from the bitstream.\n");
+   return -ZLIB_IO_ERROR;
+  }
+  final = header & 1;
+  BType compression_method = header >> 1;
+  block_cnt++;
+  TRACE_LOG("Block %u: is_final: %u, compression_method: '%s', ", block_cnt, final, btypes_str[compression_method]);
+  if (compression_method == NO_COMPRESSION) {
+   if ((err = read_uncompressed_data(inflate_stream)) < 0) {
+    WARNING_LOG("Corrupted uncompressed block.\n");
     return err;
    }
+  } else if (compression_method == RESERVED) {
+   WARNING_LOG("Invalid compression type.\n");
+   return -ZLIB_INVALID_COMPRESSION_TYPE;
+  } else if ((err = decode_compressed_block(compression_method, inflate_stream)) < 0) {
+   // Decode compressed data block
+   WARNING_LOG("An error occurred while decompressing the block.\n");
+   return err;
   }
+  TRACE_LOG("decompressed_size: %u\n", inflate_stream -> data_len - old_decompressed_size);
+  old_decompressed_size = inflate_stream -> data_len;
  }
- do { deallocate_hf_table(&literals_hf); deallocate_hf_table(&distance_hf); } while (FALSE);
  return ZLIB_NO_ERROR;
 }
 unsigned char* zlib_inflate(unsigned char* stream, unsigned int size, unsigned int* decompressed_data_length, int* zlib_err) {
-    // Initialize decompressed data
-    unsigned char* decompressed_data = (unsigned char*) xcomp_calloc(1, sizeof(unsigned char));
-    if (decompressed_data == NULL) {
+ *decompressed_data_length = 0;
+ InflateStream inflate_stream = { .stream = stream, .size = size };
+ // Initialize decompressed data, expecting the usual deflate ratio so that few reallocations are needed
+ if ((*zlib_err = inflate_reserve(&inflate_stream, MAX(MIN(size, 0x1000000) * 4, 1))) < 0) {
   XCOMP_SAFE_FREE(stream);
-  *zlib_err = -ZLIB_IO_ERROR;
   return ((unsigned char*) "Failed to allocate buffer for decompressed_data.\n");
  }
- BitStream bit_stream = CREATE_BIT_STREAM(stream, size);
- *decompressed_data_length = 0;
-    unsigned char final = 0;
- BType compression_method = 0;
- unsigned int block_cnt = 0;
- unsigned int old_decompressed_size = 0;
- while (!final) {
-  // Read header bits
-  do { final = bitstream_read_next_bit(&bit_stream); if ((&bit_stream) -> error) { (*zlib_err) = -ZLIB_IO_ERROR; return ((unsigned char*) "An error occurred while reading from the bitstream.\n"); } compression_method = bitstream_read_bits((&bit_stream), 2); if ((&bit_stream) -> error) { (*zlib_err) = -ZLIB_IO_ERROR; return ((unsigned char*) "An error occurred while reading from the bitstream.\n"); } } while (FALSE);
-  block_cnt++;
-  DEBUG_LOG("Block %u: is_final: %u, compression_method: '%s', ", block_cnt, final, btypes_str[compression_method]);
-        if (compression_method == NO_COMPRESSION) {
-   if ((*zlib_err = read_uncompressed_data(&bit_stream, &decompressed_data, decompressed_data_length)) < 0) {
-    XCOMP_MULTI_FREE(stream, decompressed_data);
-    return ((unsigned char*) "corrupted compressed block\n");
-            }
-            continue;
-        } else if (compression_method == RESERVED) {
-   XCOMP_MULTI_FREE(stream, decompressed_data);
-            return ((unsigned char*) "invalid compression type\n");
-        }
-        // Decode compressed data block
-  if ((*zlib_err = decode_compressed_block(compression_method, &bit_stream, &decompressed_data, decompressed_data_length)) < 0) {
-   XCOMP_MULTI_FREE(stream, decompressed_data);
-   return ((unsigned char*) "An error occurred while decompressing the block.\n");
-  }
-  printf("decompressed_size: %u\n", *decompressed_data_length - old_decompressed_size);
-  old_decompressed_size = *decompressed_data_length;
+ if ((*zlib_err = inflate_blocks(&inflate_stream)) < 0) {
+  XCOMP_MULTI_FREE(stream, inflate_stream.data);
+  return ((unsigned char*) "An error occurred while decompressing the stream.\n");
  }
- *zlib_err = ZLIB_NO_ERROR;
+ *decompressed_data_length = inflate_stream.data_len;
  XCOMP_SAFE_FREE(stream);
-    return decompressed_data;
+ return inflate_stream.data;
+}
+int zlib_inflate_into(unsigned char* dst, unsigned int dst_capacity, const unsigned char* src, unsigned int src_len, unsigned int* decompressed_data_length) {
+ InflateStream inflate_stream = { .stream = src, .size = src_len, .data = dst, .capacity = dst_capacity, .is_caller_data = TRUE };
+ int err = inflate_blocks(&inflate_stream);
+ *decompressed_data_length = inflate_stream.data_len;
+ return err;
 }
 
 #endif /* _XCOMP_H_ */
@@ -126,7 +126,7 @@ static int get_n_sector_at(const unsigned int at, const unsigned int cnt, void*
 	int err = 0;
 	u64 offset = at * SECTOR_SIZE;
 	u64 size = cnt * SECTOR_SIZE;
-	if ((err = qread(data, sizeof(u8), size, offset, default_qcow_ctx)) < 0) {
+	if ((err = qread(data, sizeof(u8), size, offset, &default_qcow_ctx)) < 0) {
 		WARNING_LOG("Failed to read %llu bytes at LBA 0x%llX, ret: %d - '%s'\n", size, offset, err, qcow_errors_str[-err]);
 		return err;
 	}
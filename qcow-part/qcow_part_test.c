@@ -20,7 +20,7 @@
 #include "qcow_part.h"
 
 int main(void) {
-	if (init_default_qcow("../Arch-Linux-x86_64-basic.qcow2")) {
+	if (init_default_qcow_mmap("../Arch-Linux-x86_64-basic.qcow2")) {
 		WARNING_LOG("Failed to init qcow_part.\n");
 		return 1;
 	}
@@ -213,6 +213,7 @@ typedef struct {
 	qfs_btrfs_chunks* chunks;
 	u64 chunks_cnt;
 	u64 node_size;
+	bool dump;
 } qfs_btrfs_t;
 
 typedef struct PACKED_STRUCT {
@@ -1269,8 +1270,112 @@ static inline u64 btrfs_lba_to_physical_lba(const qfs_btrfs_t* qfs_btrfs, u64 bt
 
 static int parse_btree(qfs_btrfs_t* qfs_btrfs, const btrfs_superblock_t superblock, const char* btree_name, const u64 btree_lba, const guid_t fs_uuid, const u8 level);
 
+static bool is_known_btrfs_item_type(const u8 item_type) {
+	switch (item_type) {
+		case BTRFS_INODE_ITEM_KEY:
+		case BTRFS_INODE_REF_KEY:
+		case BTRFS_XATTR_ITEM_KEY:
+		case BTRFS_DIR_ITEM_KEY:
+		case BTRFS_DIR_INDEX_KEY:
+		case BTRFS_EXTENT_DATA_ITEM_KEY:
+		case BTRFS_CSUM_ITEM_KEY:
+		case BTRFS_ROOT_ITEM_KEY:
+		case BTRFS_ROOT_BACKREF_KEY:
+		case BTRFS_ROOT_REF_KEY:
+		case BTRFS_EXTENT_ITEM_KEY:
+		case BTRFS_METADATA_ITEM_KEY:
+		case BTRFS_BLOCK_GROUP_KEY:
+		case BTRFS_FREE_SPACE_INFO_KEY:
+		case BTRFS_FREE_SPACE_EXTENT_KEY:
+		case BTRFS_FREE_SPACE_BITMAP_KEY:
+		case BTRFS_DEV_EXTENT_KEY:
+		case BTRFS_DEV_ITEM_KEY:
+		case BTRFS_CHUNK_ITEM_KEY:
+		case BTRFS_DEV_STATS_KEY:
+		case BTRFS_UUID_KEY:
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/// NOTE: Only called while dumping the filesystem (see qfs_dump_btrfs), so that parsing the trees does not print anything.
+static void dump_btrfs_leaf_item(const btrfs_node_header_t* header, const btrfs_leaf_node_t* leaf_node) {
+	const btrfs_key_t key = leaf_node -> key;
+	const u8* item = QCOW_CAST_PTR(header, u8) + sizeof(btrfs_node_header_t) + leaf_node -> offset;
+	if (key.item_type == BTRFS_DEV_ITEM_KEY) {
+		print_dev_item(QCOW_CAST_PTR(item, btrfs_dev_item_t));
+	} else if (key.item_type == BTRFS_CHUNK_ITEM_KEY) {
+		print_btrfs_chunk_item(QCOW_CAST_PTR(item, btrfs_chunk_item_t), "");
+	} else if (key.item_type == BTRFS_ROOT_ITEM_KEY) {
+		printf("Obj ID: %lld\n", key.obj_id);
+		print_btrfs_root_item(QCOW_CAST_PTR(item, btrfs_root_item_t));
+	} else if (key.item_type == BTRFS_INODE_REF_KEY) {
+		print_btrfs_inode_ref(QCOW_CAST_PTR(item, btrfs_inode_ref_t));
+	} else if (key.item_type == BTRFS_DIR_ITEM_KEY || key.item_type == BTRFS_DIR_INDEX_KEY) {
+		print_btrfs_dir_item(QCOW_CAST_PTR(item, btrfs_dir_item_t), leaf_node -> size);
+	} else if (key.item_type == BTRFS_XATTR_ITEM_KEY) {
+		printf(" -- XAttr Item --\n");
+		print_btrfs_dir_item(QCOW_CAST_PTR(item, btrfs_dir_item_t), leaf_node -> size);
+		printf("--------------------------------\n");
+	} else if (key.item_type == BTRFS_ROOT_REF_KEY || key.item_type == BTRFS_ROOT_BACKREF_KEY) {
+		print_btrfs_root_ref(QCOW_CAST_PTR(item, btrfs_root_ref_t));
+	} else if (key.item_type == BTRFS_INODE_ITEM_KEY) {
+		printf(" -- Inode Item --\n");
+		print_btrfs_inode_item(QCOW_CAST_PTR(item, btrfs_inode_item_t), "    ");
+		printf("--------------------------------\n");
+	} else if (key.item_type == BTRFS_EXTENT_DATA_ITEM_KEY) {
+		const btrfs_extent_data_t* extent_data = QCOW_CAST_PTR(item, btrfs_extent_data_t);
+		print_btrfs_extent_data(extent_data, "    ");
+		if (extent_data -> type != INLINE) {
+			const btrfs_extended_extent_data_t* extended_extent_data = QCOW_CAST_PTR(QCOW_CAST_PTR(extent_data, u8) + sizeof(btrfs_extent_data_t), btrfs_extended_extent_data_t);
+			print_btrfs_extended_extent_data(extended_extent_data, "    ");
+		}
+	} else if (key.item_type == BTRFS_EXTENT_ITEM_KEY) {
+		print_btrfs_extent_item(QCOW_CAST_PTR(item, btrfs_extent_item_t), "    ", leaf_node -> size);
+	} else if (key.item_type == BTRFS_METADATA_ITEM_KEY) {
+		printf(" -- Metadata Item --\n");
+		print_btrfs_extent_item(QCOW_CAST_PTR(item, btrfs_extent_item_t), "    ", leaf_node -> size);
+		printf("--------------------------------\n");
+	} else if (key.item_type == BTRFS_BLOCK_GROUP_KEY) {
+		print_btrfs_block_group_item(QCOW_CAST_PTR(item, btrfs_block_group_item_t), "    ");
+	} else if (key.item_type == BTRFS_DEV_EXTENT_KEY) {
+		print_btrfs_dev_extent(QCOW_CAST_PTR(item, btrfs_dev_extent_t), "    ");
+	} else if (key.item_type == BTRFS_DEV_STATS_KEY) {
+		print_btrfs_dev_stats(QCOW_CAST_PTR(item, u64), "    ", leaf_node -> size);
+	} else if (key.item_type == BTRFS_CSUM_ITEM_KEY) {
+		printf("-- CSum Item --\n");
+		const u32* csums = QCOW_CAST_PTR(item, u32);
+		for (u64 i = 0, j = 0; i < leaf_node -> size; ++j, i += sizeof(u32)) {
+			printf("  -> csum %llu: 0x%X\n", j, csums[j]);
+		}
+		printf("--------------------------------\n");
+	} else if (key.item_type == BTRFS_UUID_KEY) {
+		printf("-- UUID Item --\n");
+		printf("  -> uuid: ");
+		print_guid(item);
+		printf("\n");
+		printf("--------------------------------\n");
+	} else if (key.item_type == BTRFS_FREE_SPACE_INFO_KEY) {
+		print_btrfs_free_space_info(&key, QCOW_CAST_PTR(item, btrfs_free_space_info_t), "    ");
+	} else if (key.item_type == BTRFS_FREE_SPACE_BITMAP_KEY) {
+		print_btrfs_free_space_bitmap(&key, item, "    ", leaf_node -> size);
+	} else if (key.item_type == BTRFS_FREE_SPACE_EXTENT_KEY) {
+		printf(" -- Free Space Extent --\n");
+		printf("  -> size: %llX\n", key.offset);
+		printf("  -> offset: %llX\n", key.obj_id);
+		printf("--------------------------------\n");
+	} else {
+		print_btrfs_key(&key, "    ");
+		printf("      -> offset: 0x%X\n", leaf_node -> offset);
+		printf("      -> size:   %u\n", leaf_node -> size);
+	}
+
+	return;
+}
+
 static int parse_node_header(qfs_btrfs_t* qfs_btrfs, const btrfs_superblock_t superblock, const btrfs_node_header_t* header, const u32 sector_size) {
-	print_btrfs_node_header(header);
+	if (qfs_btrfs -> dump) print_btrfs_node_header(header);
 	
 	if (header -> level == 0) {
 		const btrfs_leaf_node_t* leaf_nodes = QCOW_CAST_PTR(QCOW_CAST_PTR(header, u8) + sizeof(btrfs_node_header_t), btrfs_leaf_node_t);
@@ -1278,20 +1383,17 @@ static int parse_node_header(qfs_btrfs_t* qfs_btrfs, const btrfs_superblock_t su
 		int err = 0;
 		for (u64 i = 0; i < header -> items_cnt; ++i) {
 			const btrfs_key_t key = (leaf_nodes + i) -> key;
-			if (key.item_type == BTRFS_DEV_ITEM_KEY) {
-				// TODO: Validate dev item
-				print_dev_item(QCOW_CAST_PTR(QCOW_CAST_PTR(header, u8) + sizeof(btrfs_node_header_t) + (leaf_nodes + i) -> offset, btrfs_dev_item_t));
-			} else if (key.item_type == BTRFS_CHUNK_ITEM_KEY) {
+			if (qfs_btrfs -> dump) dump_btrfs_leaf_item(header, leaf_nodes + i);
+
+			if (key.item_type == BTRFS_CHUNK_ITEM_KEY) {
 				const btrfs_chunk_item_t* chunk_item = QCOW_CAST_PTR(QCOW_CAST_PTR(header, u8) + sizeof(btrfs_node_header_t) + (leaf_nodes + i) -> offset, btrfs_chunk_item_t);
-				print_btrfs_chunk_item(chunk_item, "");
 				if ((err = extend_chunk_mapping(qfs_btrfs, &key, chunk_item, sector_size)) < 0) {
 					WARNING_LOG("Failed to extend the chunk mapping.\n");
 					return err;
 				}
 			} else if (key.item_type == BTRFS_ROOT_ITEM_KEY) {
-				printf("Obj ID: %lld\n", key.obj_id);
 				const btrfs_root_item_t* root_item = QCOW_CAST_PTR(QCOW_CAST_PTR(header, u8) + sizeof(btrfs_node_header_t) + (leaf_nodes + i) -> offset, btrfs_root_item_t);
-				print_btrfs_root_item(root_item);
+				UNUSED_VAR(root_item);
 				if (key.obj_id == BTRFS_FS_TREE_OBJECTID) {
 					DEBUG_LOG("Found FS Root Tree.\n");
 					/* err = parse_btree(qfs_btrfs, superblock, "fs", root_item -> bytenr, NULL, root_item -> level); */
@@ -1322,79 +1424,8 @@ static int parse_node_header(qfs_btrfs_t* qfs_btrfs, const btrfs_superblock_t su
 					WARNING_LOG("Failed to perform parsing of tree.\n");
 					return err;
 				}
-			} else if (key.item_type == BTRFS_INODE_REF_KEY) {
-				const btrfs_inode_ref_t* inode_ref = QCOW_CAST_PTR(QCOW_CAST_PTR(header, u8) + sizeof(btrfs_node_header_t) + (leaf_nodes + i) -> offset, btrfs_inode_ref_t);
-				print_btrfs_inode_ref(inode_ref);
-			} else if (key.item_type == BTRFS_DIR_ITEM_KEY || key.item_type == BTRFS_DIR_INDEX_KEY) {
-				const btrfs_dir_item_t* dir_item = QCOW_CAST_PTR(QCOW_CAST_PTR(header, u8) + sizeof(btrfs_node_header_t) + (leaf_nodes + i) -> offset, btrfs_dir_item_t);
-				print_btrfs_dir_item(dir_item, (leaf_nodes + i) -> size);
-			} else if (key.item_type == BTRFS_XATTR_ITEM_KEY) {
-				printf(" -- XAttr Item --\n");
-				const btrfs_dir_item_t* dir_item = QCOW_CAST_PTR(QCOW_CAST_PTR(header, u8) + sizeof(btrfs_node_header_t) + (leaf_nodes + i) -> offset, btrfs_dir_item_t);
-				print_btrfs_dir_item(dir_item, (leaf_nodes + i) -> size);
-				printf("--------------------------------\n");
-			} else if (key.item_type == BTRFS_ROOT_REF_KEY || key.item_type == BTRFS_ROOT_BACKREF_KEY) {
-				const btrfs_root_ref_t* root_ref = QCOW_CAST_PTR(QCOW_CAST_PTR(header, u8) + sizeof(btrfs_node_header_t) + (leaf_nodes + i) -> offset, btrfs_root_ref_t);
-				print_btrfs_root_ref(root_ref);
-			} else if (key.item_type == BTRFS_INODE_ITEM_KEY) {
-				const btrfs_inode_item_t* inode_item = QCOW_CAST_PTR(QCOW_CAST_PTR(header, u8) + sizeof(btrfs_node_header_t) + (leaf_nodes + i) -> offset, btrfs_inode_item_t);
-				printf(" -- Inode Item --\n");
-				print_btrfs_inode_item(inode_item, "    ");
-				printf("--------------------------------\n");
-			} else if (key.item_type == BTRFS_EXTENT_DATA_ITEM_KEY) {
-				const btrfs_extent_data_t* extent_data = QCOW_CAST_PTR(QCOW_CAST_PTR(header, u8) + sizeof(btrfs_node_header_t) + (leaf_nodes + i) -> offset, btrfs_extent_data_t);
-				print_btrfs_extent_data(extent_data, "    ");
-				if (extent_data -> type != INLINE) {
-					const btrfs_extended_extent_data_t* extended_extent_data = QCOW_CAST_PTR(QCOW_CAST_PTR(extent_data, u8) + sizeof(btrfs_extent_data_t), btrfs_extended_extent_data_t);
-					print_btrfs_extended_extent_data(extended_extent_data, "    ");
-				}
-			} else if (key.item_type == BTRFS_EXTENT_ITEM_KEY) {
-				const btrfs_extent_item_t* extent_item = QCOW_CAST_PTR(QCOW_CAST_PTR(header, u8) + sizeof(btrfs_node_header_t) + (leaf_nodes + i) -> offset, btrfs_extent_item_t);
-				print_btrfs_extent_item(extent_item, "    ", (leaf_nodes + i) -> size);
-			} else if (key.item_type == BTRFS_METADATA_ITEM_KEY) {
-				printf(" -- Metadata Item --\n");
-				const btrfs_extent_item_t* extent_item = QCOW_CAST_PTR(QCOW_CAST_PTR(header, u8) + sizeof(btrfs_node_header_t) + (leaf_nodes + i) -> offset, btrfs_extent_item_t);
-				print_btrfs_extent_item(extent_item, "    ", (leaf_nodes + i) -> size);
-				printf("--------------------------------\n");
-			} else if (key.item_type == BTRFS_BLOCK_GROUP_KEY) {
-				const btrfs_block_group_item_t* block_group_item = QCOW_CAST_PTR(QCOW_CAST_PTR(header, u8) + sizeof(btrfs_node_header_t) + (leaf_nodes + i) -> offset, btrfs_block_group_item_t);
-				print_btrfs_block_group_item(block_group_item, "    ");
-			} else if (key.item_type == BTRFS_DEV_EXTENT_KEY) {
-				const btrfs_dev_extent_t* dev_extent = QCOW_CAST_PTR(QCOW_CAST_PTR(header, u8) + sizeof(btrfs_node_header_t) + (leaf_nodes + i) -> offset, btrfs_dev_extent_t);
-				print_btrfs_dev_extent(dev_extent, "    ");
-			} else if (key.item_type == BTRFS_DEV_STATS_KEY) {
-				const u64* dev_stats = QCOW_CAST_PTR(QCOW_CAST_PTR(header, u8) + sizeof(btrfs_node_header_t) + (leaf_nodes + i) -> offset, u64);
-				print_btrfs_dev_stats(dev_stats, "    ", (leaf_nodes + i) -> size);
-			} else if (key.item_type == BTRFS_CSUM_ITEM_KEY) {
-				printf("-- CSum Item --\n");
-				const u32* csums = QCOW_CAST_PTR(QCOW_CAST_PTR(header, u8) + sizeof(btrfs_node_header_t) + (leaf_nodes + i) -> offset, u32);
-				for (u64 i = 0, j = 0; i < (leaf_nodes + i) -> size; ++j, i += sizeof(u32)) {
-					printf("  -> csum %llu: 0x%X\n", j, csums[j]);
-				}
-				printf("--------------------------------\n");
-			} else if (key.item_type == BTRFS_UUID_KEY) {
-				printf("-- UUID Item --\n");
-				const u8* uuid = QCOW_CAST_PTR(QCOW_CAST_PTR(header, u8) + sizeof(btrfs_node_header_t) + (leaf_nodes + i) -> offset, u8);
-				printf("  -> uuid: ");
-			   	print_guid(uuid);
-				printf("\n");
-				printf("--------------------------------\n");
-			} else if (key.item_type == BTRFS_FREE_SPACE_INFO_KEY) {
-				const btrfs_free_space_info_t* free_space_info = QCOW_CAST_PTR(QCOW_CAST_PTR(header, u8) + sizeof(btrfs_node_header_t) + (leaf_nodes + i) -> offset, btrfs_free_space_info_t);
-				print_btrfs_free_space_info(&key, free_space_info, "    ");
-			} else if (key.item_type == BTRFS_FREE_SPACE_BITMAP_KEY) {
-				const u8* free_space_info = QCOW_CAST_PTR(header, u8) + sizeof(btrfs_node_header_t) + (leaf_nodes + i) -> offset;
-				print_btrfs_free_space_bitmap(&key, free_space_info, "    ", (leaf_nodes + i) -> size);
-			} else if (key.item_type == BTRFS_FREE_SPACE_EXTENT_KEY) {
-				printf(" -- Free Space Extent --\n");
-				printf("  -> size: %llX\n", key.offset);
-				printf("  -> offset: %llX\n", key.obj_id);
-				printf("--------------------------------\n");
-			} else {
-				DEBUG_LOG("  -> leaf_node %llu:\n", i);
-				print_btrfs_key(&key, "    ");
-				printf("      -> offset: 0x%X\n", (leaf_nodes + i) -> offset);
-				printf("      -> size:   %u\n", (leaf_nodes + i) -> size);
+			} else if (!is_known_btrfs_item_type(key.item_type)) {
+				WARNING_LOG("Unknown item type 0x%X in leaf_node %llu.\n", key.item_type, i);
 				return -QCOW_UNKNOWN_ITEM_TYPE;
 			}
 		}
@@ -1476,7 +1507,7 @@ static int parse_superblock(qfs_btrfs_t* qfs_btrfs) {
 		return err;
 	}
 
-	print_btrfs_superblock(&superblock);
+	if (qfs_btrfs -> dump) print_btrfs_superblock(&superblock);
 	
 	if ((err = parse_btree(qfs_btrfs, superblock, "chunk", superblock.chunk_tree_root_lba, superblock.fs_uuid, superblock.chunk_root_level)) < 0) {
 		WARNING_LOG("Failed to parse the chunk root.\n");
@@ -1488,8 +1519,7 @@ static int parse_superblock(qfs_btrfs_t* qfs_btrfs) {
 		return err;
 	}
 
-	TODO("Implement me!");
-	return -QCOW_TODO;
+	return QCOW_NO_ERROR;
 }
 
 static int parse_btrfs_fs(qfs_btrfs_t* qfs_btrfs) {
@@ -378,7 +378,7 @@ static int fetch_next_cluster(qfs_fat_t* qfs_fat, u32* cluster_n, const bool upd
 	if (update_cluster_ref) {
 		*cluster_n = (qfs_fat -> fat_tables)[0][*cluster_n] & 0x0FFFFFFF;
 		if (*cluster_n >= FAT_END_OF_CHAIN) {
-			DEBUG_LOG("Reached end of chain of the FAT table.\n");
+			TRACE_LOG("Reached end of chain of the FAT table.\n");
 			return -QCOW_FILE_NOT_FOUND;
 		}
 
@@ -410,13 +410,13 @@ static int iterate_fat_dir(fat_dir_entry_t* fat_entry, char name[FAT_MAX_NAME],
 		*fat_entry = ((fat_dir_entry_t*) qfs_fat -> lru_cluster)[i];
 		
 		if ((fat_entry -> name)[0] == FAT_EMPTY_DIR) {
-			DEBUG_LOG("Found first empty dir, and therefore the end of this directory's content.\n");
+			TRACE_LOG("Found first empty dir, and therefore the end of this directory's content.\n");
 			return -QCOW_END_OF_DIRECTORY;
 		} else if ((fat_entry -> name)[0] == FAT_DIR_DELETED) {
-			DEBUG_LOG("This directory/file has been deleted.\n");
+			TRACE_LOG("This directory/file has been deleted.\n");
 			continue;
 		} else if (fat_entry -> attr & FAT_ATTR_LFN) {
-			DEBUG_LOG("entry has LFN attr.\n");
+			TRACE_LOG("entry has LFN attr.\n");
 			if ((err = update_lfn_entry_name(fat_entry, name, &name_size, &lfn_entry_checksum)) < 0) {
 				WARNING_LOG("Failed to read the lfn entry.\n");
 				return err;
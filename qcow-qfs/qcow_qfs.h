@@ -205,6 +205,7 @@ int qfs_write(qfs_file_t* file, const void* buf, const int size);
 int qfs_seek(qfs_t* qfs, qfs_file_t* file, const u64 off, const int whence);
 u64 qfs_tell(qfs_file_t* file);
 int qfs_readdir(qfs_t* qfs, qfs_dir_t* dir, qfs_dirent_t* ent);
+int qfs_dump_btrfs(const partition_t partition);
 
 // Exposed API Functions
 int qfs_mount(const partition_t partition, qfs_t* qfs) {
@@ -488,5 +489,18 @@ int qfs_readdir(qfs_t* qfs, qfs_dir_t* dir, qfs_dirent_t* ent) {
 	return QCOW_NO_ERROR;
 }
 
+/// NOTE: Prints the superblock and every node and leaf item of the chunk and root trees of the BTRFS
+/// partition, as mounting it stays silent and only walks the trees to build the chunk mapping.
+/// The dump only parses the superblock and its trees, hence it succeeds even though mounting is not implemented yet.
+int qfs_dump_btrfs(const partition_t partition) {
+	qfs_btrfs_t qfs_btrfs = {0};
+	qfs_btrfs.start_lba = partition.start_lba;
+	qfs_btrfs.dump = TRUE;
+	int err = 0;
+	if ((err = parse_superblock(&qfs_btrfs)) < 0) WARNING_LOG("Failed to parse the superblock.\n");
+	deallocate_qfs_btrfs(&qfs_btrfs);
+	return err;
+}
+
 #endif //_QCOW_QFS_H_
 
@@ -170,7 +170,7 @@ int main(void) {
 
 	/* if (init_default_qcow("../Arch_Linux.qcow2")) { */
 	/* if (init_default_qcow("../Arch-Linux-x86_64-basic.qcow2")) { */
-	if (init_default_qcow("../Arch-Linux-x86_64-basic-20260101.476437.qcow2")) {
+	if (init_default_qcow_mmap("../Arch-Linux-x86_64-basic-20260101.476437.qcow2")) {
 		WARNING_LOG("Failed to init qcow_part.\n");
 		return 1;
 	}